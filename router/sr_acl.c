@@ -0,0 +1,513 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_acl.c
+ *
+ * Description:
+ *
+ * ACL parsing and the tuple space classifier, see sr_acl.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "sr_if.h"
+#include "sr_router.h"
+#include "sr_protocol.h"
+#include "sr_stats.h"
+#include "sr_pkt.h"
+#include "sr_acl.h"
+
+/* Read a decimal number of at most max from s, leaving *end after it.
+ * Returns -1 if s doesn't start with a digit or the number is too big. */
+static int sr_acl_parse_num(const char* s, char** end, unsigned long max,
+                            unsigned long* v)
+{
+    if(*s < '0' || *s > '9')
+    { return -1; }
+    *v = strtoul(s, end, 10);
+    return *v > max ? -1 : 0;
+}
+
+static int sr_acl_parse_prefix(const char* s, uint32_t* addr, uint32_t* mask)
+{
+    char buf[32];
+    char* slash;
+    char* end;
+    struct in_addr in;
+    unsigned long len = 32;
+
+    if(strcmp(s, "any") == 0)
+    {
+        *addr = *mask = 0;
+        return 0;
+    }
+
+    strncpy(buf, s, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = 0;
+    if((slash = strchr(buf, '/')) != 0)
+    {
+        *slash = 0;
+        if(sr_acl_parse_num(slash + 1, &end, 32, &len) != 0 || *end)
+        { return -1; }
+    }
+    if(inet_aton(buf, &in) == 0)
+    { return -1; }
+
+    *mask = len ? htonl(0xffffffffU << (32 - len)) : 0;
+    *addr = in.s_addr & *mask;
+    return 0;
+} /* -- sr_acl_parse_prefix -- */
+
+static int sr_acl_parse_proto(const char* s, int* proto)
+{
+    char* end;
+    unsigned long v;
+
+    if(strcmp(s, "any") == 0)
+    { *proto = SR_ACL_ANY; }
+    else if(strcmp(s, "icmp") == 0)
+    { *proto = ip_protocol_icmp; }
+    else if(strcmp(s, "tcp") == 0)
+    { *proto = ip_protocol_tcp; }
+    else if(strcmp(s, "udp") == 0)
+    { *proto = ip_protocol_udp; }
+    else
+    {
+        if(sr_acl_parse_num(s, &end, 255, &v) != 0 || *end)
+        { return -1; }
+        *proto = (int)v;
+    }
+    return 0;
+} /* -- sr_acl_parse_proto -- */
+
+static int sr_acl_parse_ports(const char* s, uint16_t* lo, uint16_t* hi)
+{
+    char* end;
+    unsigned long a, b;
+
+    if(strcmp(s, "any") == 0)
+    {
+        *lo = 0;
+        *hi = 65535;
+        return 0;
+    }
+    if(sr_acl_parse_num(s, &end, 65535, &a) != 0)
+    { return -1; }
+    b = a;
+    if(*end == '-' && sr_acl_parse_num(end + 1, &end, 65535, &b) != 0)
+    { return -1; }
+    if(*end || a > b)
+    { return -1; }
+    *lo = (uint16_t)a;
+    *hi = (uint16_t)b;
+    return 0;
+} /* -- sr_acl_parse_ports -- */
+
+static int sr_acl_any_ports(const struct sr_acl_rule* r)
+{
+    return r->sport_lo == 0 && r->sport_hi == 65535 &&
+           r->dport_lo == 0 && r->dport_hi == 65535;
+}
+
+static unsigned int sr_acl_hash(uint32_t src, uint32_t dst, int proto,
+                                int ifindex, unsigned int tuple)
+{
+    uint32_t h;
+
+    h = src * 0x9e3779b1U;
+    h ^= dst * 0x85ebca77U;
+    h ^= (((uint32_t)tuple << 16) ^ ((uint32_t)(proto + 1) << 8) ^
+          (uint32_t)(ifindex + 1)) * 0xc2b2ae3dU;
+    return h ^ (h >> 15);
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_acl_probe(..)
+ * Scope:  Local
+ *
+ * Find the entry for a key, or with 'insert' claim a free slot for it.
+ *
+ *---------------------------------------------------------------------*/
+
+static struct sr_acl_entry* sr_acl_probe(struct sr_acl* acl, uint32_t src,
+        uint32_t dst, int proto, int ifindex, unsigned int tuple, int insert)
+{
+    unsigned int i = sr_acl_hash(src, dst, proto, ifindex, tuple) & acl->mask;
+    struct sr_acl_entry* e;
+
+    for(;; i = (i + 1) & acl->mask)
+    {
+        e = &acl->slots[i];
+        if(e->tuple == 0)
+        {
+            if(!insert)
+            { return 0; }
+            e->src = src;
+            e->dst = dst;
+            e->proto = proto;
+            e->ifindex = ifindex;
+            e->tuple = tuple;
+            return e;
+        }
+        if(e->tuple == tuple && e->src == src && e->dst == dst &&
+           e->proto == proto && e->ifindex == ifindex)
+        { return e; }
+    }
+} /* -- sr_acl_probe -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_acl_compile(..)
+ * Scope:  Local
+ *
+ * Group the rules into tuples and build the hash table and rule chains.
+ * Tuples are created in order of their first rule, which is exactly the
+ * order the search wants them in.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_acl_compile(struct sr_acl* acl)
+{
+    struct sr_acl_rule* r;
+    struct sr_acl_tuple* t;
+    struct sr_acl_entry* e;
+    struct sr_acl_entry** where;
+    unsigned int i, j, size, next;
+
+    where = (struct sr_acl_entry**)malloc((acl->nrules + 1) *
+                                          sizeof(struct sr_acl_entry*));
+    acl->tuples = (struct sr_acl_tuple*)calloc(acl->nrules + 1,
+                                               sizeof(struct sr_acl_tuple));
+    acl->chain = (unsigned int*)malloc((acl->nrules + 1) * sizeof(unsigned int));
+    for(size = 16; size < 2 * acl->nrules; size <<= 1);
+    acl->slots = (struct sr_acl_entry*)calloc(size, sizeof(struct sr_acl_entry));
+    acl->mask = size - 1;
+    if(!where || !acl->tuples || !acl->chain || !acl->slots)
+    {
+        free(where);
+        return -1;
+    }
+
+    for(i = 0; i < acl->nrules; i++)
+    {
+        r = &acl->rules[i];
+        for(j = 0; j < acl->ntuples; j++)
+        {
+            t = &acl->tuples[j];
+            if(t->src_mask == r->src_mask && t->dst_mask == r->dst_mask &&
+               t->any_proto == (r->proto == SR_ACL_ANY) &&
+               t->any_iface == (r->ifindex == SR_ACL_ANY))
+            { break; }
+        }
+        if(j == acl->ntuples)
+        {
+            t = &acl->tuples[acl->ntuples++];
+            t->src_mask = r->src_mask;
+            t->dst_mask = r->dst_mask;
+            t->any_proto = (r->proto == SR_ACL_ANY);
+            t->any_iface = (r->ifindex == SR_ACL_ANY);
+            t->best = i;
+        }
+
+        where[i] = sr_acl_probe(acl, r->src, r->dst, r->proto, r->ifindex,
+                                j + 1, 1);
+        where[i]->count++;
+    }
+
+    /* -- lay the chains out back to back, each in rule order -- */
+    for(next = 0, i = 0; i < size; i++)
+    {
+        e = &acl->slots[i];
+        e->first = next;
+        next += e->count;
+        e->count = 0;
+    }
+    for(i = 0; i < acl->nrules; i++)
+    {
+        e = where[i];
+        acl->chain[e->first + e->count++] = i;
+    }
+
+    free(where);
+    return 0;
+} /* -- sr_acl_compile -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_acl_load(..)
+ * Scope:  Global
+ *
+ * Parse an ACL file; sr_acl_attach(..) compiles it once the interfaces
+ * are known.  Returns 0 on any error.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_acl* sr_acl_load(struct sr_instance* sr, const char* filename)
+{
+    FILE* fp;
+    char line[BUFSIZ];
+    char action[16], src[32], dst[32], proto[16], sport[16], dport[16];
+    char iface[sr_IFACE_NAMELEN + 1];
+    struct sr_acl* acl;
+    struct sr_acl_rule* r;
+    unsigned int cap = 0, lineno = 0;
+    int n;
+
+    /* -- REQUIRES -- */
+    assert(sr);
+    assert(filename);
+
+    if((fp = fopen(filename, "r")) == 0)
+    {
+        perror("fopen(..):sr_acl_load");
+        return 0;
+    }
+    acl = (struct sr_acl*)calloc(1, sizeof(struct sr_acl));
+    assert(acl);
+
+    while(fgets(line, BUFSIZ, fp) != 0)
+    {
+        lineno++;
+        strcpy(proto, "any");
+        strcpy(sport, "any");
+        strcpy(dport, "any");
+        strcpy(iface, "any");
+        n = sscanf(line, "%15s %31s %31s %15s %15s %15s %32s",
+                   action, src, dst, proto, sport, dport, iface);
+        if(n <= 0 || action[0] == '#')
+        { continue; }
+
+        if(acl->nrules == cap)
+        {
+            cap = cap ? cap * 2 : 64;
+            acl->rules = (struct sr_acl_rule*)realloc(acl->rules,
+                    cap * sizeof(struct sr_acl_rule));
+            assert(acl->rules);
+        }
+        r = &acl->rules[acl->nrules];
+        memset(r, 0, sizeof(*r));
+        r->line = lineno;
+        r->ifindex = SR_ACL_ANY;
+
+        if(strcmp(action, "permit") == 0)
+        { r->action = SR_ACL_PERMIT; }
+        else if(strcmp(action, "deny") == 0)
+        { r->action = SR_ACL_DENY; }
+        else
+        { n = 0; }
+
+        if(n < 3 ||
+           sr_acl_parse_prefix(src, &r->src, &r->src_mask) != 0 ||
+           sr_acl_parse_prefix(dst, &r->dst, &r->dst_mask) != 0 ||
+           sr_acl_parse_proto(proto, &r->proto) != 0 ||
+           sr_acl_parse_ports(sport, &r->sport_lo, &r->sport_hi) != 0 ||
+           sr_acl_parse_ports(dport, &r->dport_lo, &r->dport_hi) != 0 ||
+           (!sr_acl_any_ports(r) && r->proto != ip_protocol_tcp &&
+            r->proto != ip_protocol_udp))
+        {
+            fprintf(stderr, "%s:%u: expected 'permit|deny src dst "
+                    "[proto [sport [dport [iface]]]]'\n", filename, lineno);
+            goto fail;
+        }
+
+        if(strcmp(iface, "any") != 0)
+        {
+            if(strlen(iface) >= sr_IFACE_NAMELEN)
+            {
+                fprintf(stderr, "%s:%u: interface name too long\n",
+                        filename, lineno);
+                goto fail;
+            }
+            strcpy(r->iface, iface);
+        }
+        acl->nrules++;
+    } /* -- while -- */
+
+    fclose(fp);
+    strncpy(acl->filename, filename, sizeof(acl->filename) - 1);
+    return acl;
+
+fail:
+    fclose(fp);
+    sr_acl_destroy(acl);
+    return 0;
+} /* -- sr_acl_load -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_acl_attach(..)
+ * Scope:  Global
+ *
+ * Look up the interfaces the rules name and compile the classifier.
+ * Called once the interface list is complete.  Returns 0, or -1 after
+ * saying what's wrong.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_acl_attach(struct sr_acl* acl, struct sr_instance* sr)
+{
+    struct sr_acl_rule* r;
+    struct sr_if* ifp;
+    unsigned int i;
+
+    /* -- REQUIRES -- */
+    assert(acl);
+    assert(sr);
+
+    if(acl->slots)
+    { return 0; }
+
+    for(i = 0; i < acl->nrules; i++)
+    {
+        r = &acl->rules[i];
+        if(r->iface[0] == 0)
+        { continue; }
+        if((ifp = sr_get_interface(sr, r->iface)) == 0)
+        {
+            fprintf(stderr, "%s:%u: unknown interface %s\n",
+                    acl->filename, r->line, r->iface);
+            return -1;
+        }
+        r->ifindex = (int)ifp->ifindex;
+    }
+
+    if(sr_acl_compile(acl) != 0)
+    {
+        fprintf(stderr, "%s: out of memory compiling ACL\n", acl->filename);
+        free(acl->tuples);
+        free(acl->slots);
+        free(acl->chain);
+        acl->tuples = 0;
+        acl->slots = 0;
+        acl->chain = 0;
+        acl->ntuples = 0;
+        return -1;
+    }
+
+    printf("Loaded %u ACL rules in %u tuples from %s\n",
+           acl->nrules, acl->ntuples, acl->filename);
+    return 0;
+} /* -- sr_acl_attach -- */
+
+void sr_acl_destroy(struct sr_acl* acl)
+{
+    if(acl == 0)
+    { return; }
+    free(acl->rules);
+    free(acl->tuples);
+    free(acl->slots);
+    free(acl->chain);
+    free(acl);
+} /* -- sr_acl_destroy -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_acl_check(..)
+ * Scope:  Global
+ *
+ * Classify a validated IP frame described by pkt and count the hit.
+ * Ports are only known for tcp/udp first fragments; everything else only
+ * matches rules whose ports are "any".
+ *
+ *---------------------------------------------------------------------*/
+
+enum sr_acl_action sr_acl_check(struct sr_acl* acl,
+        uint8_t* packet /* lent */,
+        const struct sr_pkt* pkt)
+{
+    sr_ip_hdr_t* ip_hdr = (sr_ip_hdr_t*)(packet + pkt->l3);
+    uint8_t* l4 = packet + pkt->l4;
+    int sport = -1, dport = -1;
+    struct sr_acl_tuple* t;
+    struct sr_acl_entry* e;
+    struct sr_acl_rule* r;
+    unsigned int i, k, match = acl->nrules;
+
+    if((pkt->proto == ip_protocol_tcp || pkt->proto == ip_protocol_udp) &&
+       !(pkt->flags & SR_PKT_LATER) && pkt->len >= pkt->l4 + 4u)
+    {
+        sport = l4[0] << 8 | l4[1];
+        dport = l4[2] << 8 | l4[3];
+    }
+
+    for(i = 0; i < acl->ntuples; i++)
+    {
+        t = &acl->tuples[i];
+        if(t->best >= match)
+        { break; }
+
+        e = sr_acl_probe(acl, ip_hdr->ip_src & t->src_mask,
+                ip_hdr->ip_dst & t->dst_mask,
+                t->any_proto ? SR_ACL_ANY : pkt->proto,
+                t->any_iface ? SR_ACL_ANY : (int)pkt->ifindex, i + 1, 0);
+        if(e == 0)
+        { continue; }
+
+        for(k = 0; k < e->count && acl->chain[e->first + k] < match; k++)
+        {
+            r = &acl->rules[acl->chain[e->first + k]];
+            if(sr_acl_any_ports(r) ||
+               (sport >= r->sport_lo && sport <= r->sport_hi &&
+                dport >= r->dport_lo && dport <= r->dport_hi))
+            {
+                match = acl->chain[e->first + k];
+                break;
+            }
+        }
+    }
+
+    if(match == acl->nrules)
+    {
+        acl->permitted++;
+        return SR_ACL_PERMIT;
+    }
+
+    r = &acl->rules[match];
+    r->hits++;
+    if(r->action == SR_ACL_DENY)
+    { acl->denied++; }
+    else
+    { acl->permitted++; }
+    return r->action;
+} /* -- sr_acl_check -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_acl_stats(..)
+ * Scope:  Local
+ *
+ * Totals, and hits for every rule that has any, keyed by file line.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_acl_stats(struct sr_stats_writer* w, void* arg)
+{
+    struct sr_instance* sr = (struct sr_instance*)arg;
+    struct sr_acl* acl = sr->acl;
+    char key[32];
+    unsigned int i;
+
+    if(acl == 0)
+    { return; }
+
+    sr_stats_put_u64(w, "rules", acl->nrules);
+    sr_stats_put_u64(w, "tuples", acl->ntuples);
+    sr_stats_put_u64(w, "permitted", acl->permitted);
+    sr_stats_put_u64(w, "denied", acl->denied);
+
+    sr_stats_open(w, "hits");
+    for(i = 0; i < acl->nrules; i++)
+    {
+        if(acl->rules[i].hits)
+        {
+            sprintf(key, "line_%u", acl->rules[i].line);
+            sr_stats_put_u64(w, key, acl->rules[i].hits);
+        }
+    }
+    sr_stats_close(w);
+} /* -- sr_acl_stats -- */
+
+void sr_acl_init(struct sr_instance* sr)
+{
+    sr_stats_register("acl", sr_acl_stats, sr);
+} /* -- sr_acl_init -- */
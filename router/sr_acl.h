@@ -0,0 +1,103 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_acl.h
+ *
+ * Description:
+ *
+ * Access control lists for IP traffic, read from a file next to rtable
+ * (sr -a <file>, "acl" by default if it exists).  One rule per line,
+ * first match wins, and a datagram no rule matches is permitted:
+ *
+ *   # action  src            dst            proto  sport   dport     iface
+ *   deny      10.0.1.0/24    any            tcp    any     22        eth3
+ *   deny      any            107.21.0.0/16  udp    any     1-1023    any
+ *   permit    any            any            any    any     any       any
+ *
+ * Ports are "any", a port, or an inclusive range, and only apply to tcp
+ * and udp.  iface is the interface the datagram arrived on.
+ *
+ * Rules are compiled for tuple space search: rules with the same source
+ * and destination prefix lengths and the same use of the proto/iface
+ * wildcards form a tuple, and each tuple is one exact-match probe into a
+ * shared hash table whose entries list that key's rules in priority
+ * order (port ranges are checked there).  Tuples are visited in order of
+ * their best rule and the search stops as soon as no remaining tuple can
+ * beat the match already found, so the cost follows the number of
+ * distinct tuples rather than the number of rules.
+ *
+ * A live router only learns its interfaces from VNSHWINFO, after the
+ * file is read, so rules keep interface names until sr_acl_attach(..)
+ * looks them up and compiles the classifier; until then nothing is
+ * denied, and no datagram arrives before it anyway.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_ACL_H
+#define SR_ACL_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+#include "sr_if.h"
+
+#define SR_ACL_ANY  (-1)
+
+enum sr_acl_action {
+    SR_ACL_PERMIT,
+    SR_ACL_DENY
+};
+
+struct sr_instance;
+struct sr_pkt;
+
+struct sr_acl_rule {
+    uint32_t src, src_mask;     /* network byte order */
+    uint32_t dst, dst_mask;
+    int      proto;             /* or SR_ACL_ANY */
+    int      ifindex;           /* or SR_ACL_ANY, from iface */
+    char     iface[sr_IFACE_NAMELEN];   /* "" for any */
+    uint16_t sport_lo, sport_hi;
+    uint16_t dport_lo, dport_hi;
+    enum sr_acl_action action;
+    unsigned int line;          /* in the file, for reporting */
+    uint64_t hits;
+};
+
+struct sr_acl_tuple {
+    uint32_t src_mask, dst_mask;
+    int any_proto, any_iface;
+    unsigned int best;          /* first rule in this tuple */
+};
+
+struct sr_acl_entry {
+    uint32_t src, dst;          /* masked */
+    int      proto, ifindex;    /* SR_ACL_ANY when the tuple wildcards them */
+    unsigned int tuple;         /* 0 marks a free slot, else index + 1 */
+    unsigned int first, count;  /* this key's rules in chain[] */
+};
+
+struct sr_acl {
+    struct sr_acl_rule*  rules;
+    unsigned int         nrules;
+    struct sr_acl_tuple* tuples;
+    unsigned int         ntuples;
+    struct sr_acl_entry* slots;
+    unsigned int         mask;  /* slots - 1, power of two */
+    unsigned int*        chain;
+    char filename[64];          /* for reporting */
+    uint64_t permitted;
+    uint64_t denied;
+};
+
+void sr_acl_init(struct sr_instance* sr);
+struct sr_acl* sr_acl_load(struct sr_instance* sr, const char* filename);
+int  sr_acl_attach(struct sr_acl* acl, struct sr_instance* sr);
+void sr_acl_destroy(struct sr_acl* acl);
+enum sr_acl_action sr_acl_check(struct sr_acl* acl, uint8_t* packet,
+                                const struct sr_pkt* pkt);
+
+#endif /* -- SR_ACL_H -- */
@@ -10,14 +10,63 @@
 #include "sr_router.h"
 #include "sr_if.h"
 #include "sr_protocol.h"
+#include "sr_stats.h"
+#include "sr_icmp.h"
+#include "sr_rtcache.h"
+#include "sr_cpu.h"
+
+/* Sends the ARP request for req if it is due.  A request that has been
+   sent SR_ARPREQ_TRIES times is left for sr_arpcache_sweepreqs() to give
+   up on.  The caller holds the cache lock. */
+void sr_arpcache_handle_arpreq(struct sr_instance *sr, struct sr_arpreq *req) {
+    time_t now = time(NULL);
+
+    if (req->times_sent > 0 && difftime(now, req->sent) < 1.0)
+        return;
+    if (req->times_sent >= SR_ARPREQ_TRIES)
+        return;
+
+    sr_send_arp_request(sr, req);
+    req->sent = now;
+    req->times_sent++;
+}
 
 /* 
   This function gets called every second. For each request sent out, we keep
   checking whether we should resend an request or destroy the arp request.
   See the comments in the header file for an idea of what it should look like.
+
+  Requests that have run out of tries are taken off the queue first and
+  answered with host unreachable after the walk: sending those errors
+  queues packets of its own and may change the queue under us.
 */
 void sr_arpcache_sweepreqs(struct sr_instance *sr) { 
-    /* Fill this in */
+    struct sr_arpreq *req, *next, **prev, *dead = NULL;
+    struct sr_packet *pkt;
+    time_t now = time(NULL);
+
+    prev = &(sr->cache.requests);
+    for (req = sr->cache.requests; req != NULL; req = next) {
+        next = req->next;
+        if (req->times_sent >= SR_ARPREQ_TRIES &&
+            difftime(now, req->sent) >= 1.0) {
+            *prev = next;
+            req->next = dead;
+            dead = req;
+            continue;
+        }
+        sr_arpcache_handle_arpreq(sr, req);
+        prev = &(req->next);
+    }
+
+    for (req = dead; req != NULL; req = next) {
+        next = req->next;
+        for (pkt = req->packets; pkt; pkt = pkt->next) {
+            sr_stats_drop(sr_get_interface(sr, pkt->iface), SR_DROP_ARP_TIMEOUT);
+            sr_icmp_send_error(sr, pkt->buf, pkt->len, SR_ICMP_HOST_UNREACH);
+        }
+        sr_arpreq_destroy(&(sr->cache), req);
+    }
 }
 
 /* You should not need to touch the rest of this code. */
@@ -77,17 +126,21 @@ struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
         cache->requests = req;
     }
     
-    /* Add the packet to the list of packets for this request */
+    /* Add the packet to the end of the list of packets for this request,
+       so they go out in the order they arrived */
     if (packet && packet_len && iface) {
         struct sr_packet *new_pkt = (struct sr_packet *)malloc(sizeof(struct sr_packet));
+        struct sr_packet **tail = &(req->packets);
         
         new_pkt->buf = (uint8_t *)malloc(packet_len);
         memcpy(new_pkt->buf, packet, packet_len);
         new_pkt->len = packet_len;
 		new_pkt->iface = (char *)malloc(sr_IFACE_NAMELEN);
         strncpy(new_pkt->iface, iface, sr_IFACE_NAMELEN);
-        new_pkt->next = req->packets;
-        req->packets = new_pkt;
+        new_pkt->next = NULL;
+        while (*tail)
+            tail = &((*tail)->next);
+        *tail = new_pkt;
     }
     
     pthread_mutex_unlock(&(cache->lock));
@@ -133,6 +186,7 @@ struct sr_arpreq *sr_arpcache_insert(struct sr_arpcache *cache,
         cache->entries[i].ip = ip;
         cache->entries[i].added = time(NULL);
         cache->entries[i].valid = 1;
+        sr_rtc_invalidate();
     }
     
     pthread_mutex_unlock(&(cache->lock));
@@ -222,6 +276,8 @@ int sr_arpcache_destroy(struct sr_arpcache *cache) {
 void *sr_arpcache_timeout(void *sr_ptr) {
     struct sr_instance *sr = sr_ptr;
     struct sr_arpcache *cache = &(sr->cache);
+
+    sr_cpu_bind(SR_CPU_TIMER);
     
     while (1) {
         sleep(1.0);
@@ -234,6 +290,7 @@ void *sr_arpcache_timeout(void *sr_ptr) {
         for (i = 0; i < SR_ARPCACHE_SZ; i++) {
             if ((cache->entries[i].valid) && (difftime(curtime,cache->entries[i].added) > SR_ARPCACHE_TO)) {
                 cache->entries[i].valid = 0;
+                sr_rtc_invalidate();
             }
         }
         
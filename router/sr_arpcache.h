@@ -73,6 +73,9 @@
 
 #define SR_ARPCACHE_SZ    100  
 #define SR_ARPCACHE_TO    15.0
+#define SR_ARPREQ_TRIES   5
+
+struct sr_instance;
 
 struct sr_packet {
     uint8_t *buf;               /* A raw Ethernet frame, presumably with the dest MAC empty */
@@ -143,6 +146,16 @@ void sr_arpcache_dump(struct sr_arpcache *cache);
    a destructor, and a cleanup thread times out cache entries every 15
    seconds. */
 
+/* Sends the ARP request for req if a second has passed since the last one.
+   A request already sent SR_ARPREQ_TRIES times is left for
+   sr_arpcache_sweepreqs() to give up on.  Call with the cache lock held. */
+void sr_arpcache_handle_arpreq(struct sr_instance *sr, struct sr_arpreq *req);
+
+/* Called every second by the cleanup thread to retry outstanding requests.
+   Gives up on those sent SR_ARPREQ_TRIES times, sending ICMP host
+   unreachable for every packet waiting on them. */
+void sr_arpcache_sweepreqs(struct sr_instance *sr);
+
 int   sr_arpcache_init(struct sr_arpcache *cache);
 int   sr_arpcache_destroy(struct sr_arpcache *cache);
 void *sr_arpcache_timeout(void *cache_ptr);
@@ -0,0 +1,453 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_cksum.c
+ *
+ * Description:
+ *
+ * Internet checksum kernels and their runtime selection, see sr_cksum.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SR_CKSUM_X86
+#include <immintrin.h>
+#endif
+
+#include "sr_stats.h"
+#include "sr_cksum.h"
+
+#define SR_CKSUM_CHECK_LEN   2048    /* every length up to this ... */
+#define SR_CKSUM_CHECK_ALIGN 8       /* ... at every offset below this */
+#define SR_CKSUM_CHECK_MAX   65536   /* plus all-ones buffers up to this */
+#define SR_CKSUM_SEED        0x2545f491
+
+struct sr_cksum_kernel {
+    const char* name;
+    sr_cksum_fn fn;
+    int (*supported)(void);
+};
+
+static uint16_t sr_cksum_generic(const void* data, int len);
+
+sr_cksum_fn sr_cksum_sum = sr_cksum_generic;
+static const char* sr_cksum_active = "generic";
+
+static __inline__ uint16_t sr_cksum_fold64(uint64_t s)
+{
+    while(s >> 16)
+    { s = (s & 0xffff) + (s >> 16); }
+    return (uint16_t)s;
+}
+
+/* The last < 4 bytes, padded with a zero byte if len is odd */
+static __inline__ uint64_t sr_cksum_tail(const uint8_t* p, int len)
+{
+    uint64_t s = 0;
+    uint16_t w;
+
+    while(len >= 4)
+    {
+        uint32_t d;
+        memcpy(&d, p, 4);
+        s += d;
+        p += 4;
+        len -= 4;
+    }
+    if(len >= 2)
+    {
+        memcpy(&w, p, 2);
+        s += w;
+        p += 2;
+        len -= 2;
+    }
+    if(len)
+    {
+        w = 0;
+        memcpy(&w, p, 1);
+        s += w;
+    }
+    return s;
+} /* -- sr_cksum_tail -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_cksum_ref(..)
+ * Scope:  Global
+ *
+ * The original byte-pair loop, kept as the reference the other kernels
+ * are checked against.
+ *
+ *---------------------------------------------------------------------*/
+
+uint16_t sr_cksum_ref(const void* data, int len)
+{
+    const uint8_t* p = data;
+    uint32_t sum = 0;
+
+    for(; len >= 2; p += 2, len -= 2)
+    { sum += p[0] << 8 | p[1]; }
+    if(len > 0)
+    { sum += p[0] << 8; }
+    while(sum > 0xffff)
+    { sum = (sum >> 16) + (sum & 0xffff); }
+
+    /* big endian words back to memory order */
+    return ntohs((uint16_t)sum);
+} /* -- sr_cksum_ref -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_cksum_generic(..)
+ * Scope:  Local
+ *
+ * 32 bit words into two 64 bit accumulators.  Carries pile up in the
+ * high half and are folded once at the end, which is equivalent because
+ * 2^16 == 1 mod 0xffff.
+ *
+ *---------------------------------------------------------------------*/
+
+static uint16_t sr_cksum_generic(const void* data, int len)
+{
+    const uint8_t* p = data;
+    uint64_t s0 = 0, s1 = 0;
+    uint32_t w[4];
+
+    while(len >= 16)
+    {
+        memcpy(w, p, 16);
+        s0 += w[0];
+        s1 += w[1];
+        s0 += w[2];
+        s1 += w[3];
+        p += 16;
+        len -= 16;
+    }
+    return sr_cksum_fold64(s0 + s1 + sr_cksum_tail(p, len));
+} /* -- sr_cksum_generic -- */
+
+static int sr_cksum_always(void)
+{
+    return 1;
+}
+
+#ifdef SR_CKSUM_X86
+
+/*---------------------------------------------------------------------
+ * Method: sr_cksum_sse2(..) / sr_cksum_avx2(..)
+ * Scope:  Local
+ *
+ * Same scheme as the generic kernel, but a vector register of 32 bit
+ * words is widened into 64 bit lanes (interleaving with zero) and added
+ * 16 or 64 bytes per iteration.
+ *
+ *---------------------------------------------------------------------*/
+
+__attribute__ ((target ("sse2")))
+static uint16_t sr_cksum_sse2(const void* data, int len)
+{
+    const uint8_t* p = data;
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc0 = zero, acc1 = zero;
+    __m128i v;
+    uint64_t lanes[2];
+
+    while(len >= 16)
+    {
+        v = _mm_loadu_si128((const __m128i*)p);
+        acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(v, zero));
+        acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(v, zero));
+        p += 16;
+        len -= 16;
+    }
+    _mm_storeu_si128((__m128i*)lanes, _mm_add_epi64(acc0, acc1));
+    return sr_cksum_fold64(lanes[0] + lanes[1] + sr_cksum_tail(p, len));
+} /* -- sr_cksum_sse2 -- */
+
+__attribute__ ((target ("avx2")))
+static uint16_t sr_cksum_avx2(const void* data, int len)
+{
+    const uint8_t* p = data;
+    __m256i zero = _mm256_setzero_si256();
+    __m256i acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero;
+    __m256i v0, v1;
+    uint64_t lanes[4];
+
+    while(len >= 64)
+    {
+        v0 = _mm256_loadu_si256((const __m256i*)p);
+        v1 = _mm256_loadu_si256((const __m256i*)(p + 32));
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v0, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v0, zero));
+        acc2 = _mm256_add_epi64(acc2, _mm256_unpacklo_epi32(v1, zero));
+        acc3 = _mm256_add_epi64(acc3, _mm256_unpackhi_epi32(v1, zero));
+        p += 64;
+        len -= 64;
+    }
+    if(len >= 32)
+    {
+        v0 = _mm256_loadu_si256((const __m256i*)p);
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v0, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v0, zero));
+        p += 32;
+        len -= 32;
+    }
+    acc0 = _mm256_add_epi64(_mm256_add_epi64(acc0, acc1),
+                            _mm256_add_epi64(acc2, acc3));
+    _mm256_storeu_si256((__m256i*)lanes, acc0);
+    return sr_cksum_fold64(lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+                           sr_cksum_tail(p, len));
+} /* -- sr_cksum_avx2 -- */
+
+static int sr_cksum_has_sse2(void)
+{
+    return __builtin_cpu_supports("sse2");
+}
+
+static int sr_cksum_has_avx2(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+#endif /* SR_CKSUM_X86 */
+
+/* widest first */
+static const struct sr_cksum_kernel sr_cksum_kernels[] = {
+#ifdef SR_CKSUM_X86
+    { "avx2",    sr_cksum_avx2,    sr_cksum_has_avx2 },
+    { "sse2",    sr_cksum_sse2,    sr_cksum_has_sse2 },
+#endif
+    { "generic", sr_cksum_generic, sr_cksum_always },
+    { "ref",     sr_cksum_ref,     sr_cksum_always }
+};
+
+#define SR_CKSUM_NKERNELS \
+    ((int)(sizeof(sr_cksum_kernels) / sizeof(sr_cksum_kernels[0])))
+
+/* Sums of the pseudo-random test data, in network order, by start and
+   length: the short tails and every SIMD block size, misaligned */
+static const struct {
+    int off;
+    int len;
+    uint16_t sum;
+} sr_cksum_answers[] = {
+    { 0,    0, 0x0000 },
+    { 0,    1, 0x7300 },
+    { 1,    2, 0x6ee1 },
+    { 3,    3, 0xa750 },
+    { 0,   20, 0x7713 },
+    { 1,   31, 0x2d78 },
+    { 2,   32, 0x0a8b },
+    { 3,   33, 0x2516 },
+    { 0,   63, 0x113b },
+    { 5,   64, 0xe978 },
+    { 7,   65, 0x650f },
+    { 1,  127, 0xa5ab },
+    { 0,  128, 0x1ea6 },
+    { 6,  129, 0x4970 },
+    { 3, 1500, 0x4f80 },
+    { 1, 2047, 0xe4ca }
+};
+
+#define SR_CKSUM_NANSWERS \
+    ((int)(sizeof(sr_cksum_answers) / sizeof(sr_cksum_answers[0])))
+
+/* The test data: SR_CKSUM_CHECK_LEN + SR_CKSUM_CHECK_ALIGN bytes */
+static void sr_cksum_fill(uint8_t* buf)
+{
+    uint32_t seed = SR_CKSUM_SEED;
+    int i;
+
+    for(i = 0; i < SR_CKSUM_CHECK_LEN + SR_CKSUM_CHECK_ALIGN; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        buf[i] = (uint8_t)(seed >> 16);
+    }
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_cksum_known(..)
+ * Scope:  Local
+ *
+ * The quick test at start: the example of RFC 1071, the answers above
+ * and the two largest all-ones buffers, which carry the most.  Returns
+ * 0 if k gets them all right.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_cksum_known(const struct sr_cksum_kernel* k, uint8_t* buf)
+{
+    static const uint8_t rfc1071[8] = {
+        0x00, 0x01, 0xf2, 0x03, 0xf4, 0xf5, 0xf6, 0xf7
+    };
+    uint16_t got;
+    int i;
+
+    if((got = ntohs(k->fn(rfc1071, sizeof(rfc1071)))) != 0xddf2)
+    {
+        fprintf(stderr, "cksum: %s kernel gets RFC 1071 wrong (%04x), "
+                "not using it\n", k->name, got);
+        return -1;
+    }
+
+    sr_cksum_fill(buf);
+    for(i = 0; i < SR_CKSUM_NANSWERS; i++)
+    {
+        got = ntohs(k->fn(buf + sr_cksum_answers[i].off, sr_cksum_answers[i].len));
+        if(got != sr_cksum_answers[i].sum)
+        {
+            fprintf(stderr, "cksum: %s kernel gets a wrong sum (len %d, "
+                    "offset %d: %04x != %04x), not using it\n", k->name,
+                    sr_cksum_answers[i].len, sr_cksum_answers[i].off, got,
+                    sr_cksum_answers[i].sum);
+            return -1;
+        }
+    }
+
+    memset(buf, 0xff, SR_CKSUM_CHECK_MAX + SR_CKSUM_CHECK_ALIGN);
+    if(ntohs(k->fn(buf + 1, SR_CKSUM_CHECK_MAX - 1)) != 0xff00 ||
+       ntohs(k->fn(buf + 1, SR_CKSUM_CHECK_MAX)) != 0xffff)
+    {
+        fprintf(stderr, "cksum: %s kernel gets carries wrong, not using it\n",
+                k->name);
+        return -1;
+    }
+    return 0;
+} /* -- sr_cksum_known -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_cksum_check(..)
+ * Scope:  Local
+ *
+ * Differential test of fn against the reference: pseudo-random data at
+ * every length up to SR_CKSUM_CHECK_LEN and every start offset below
+ * SR_CKSUM_CHECK_ALIGN, then all-ones buffers, which produce the most
+ * carries, up to SR_CKSUM_CHECK_MAX bytes.  Returns 0 if they agree.
+ * Too slow for every start, sr_cksum_test() runs it.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_cksum_check(const struct sr_cksum_kernel* k, uint8_t* buf)
+{
+    int len, off;
+    uint16_t want, got;
+
+    sr_cksum_fill(buf);
+    for(off = 0; off < SR_CKSUM_CHECK_ALIGN; off++)
+    {
+        for(len = 0; len <= SR_CKSUM_CHECK_LEN; len++)
+        {
+            want = sr_cksum_ref(buf + off, len);
+            got = k->fn(buf + off, len);
+            if(want != got)
+            {
+                fprintf(stderr, "cksum: %s kernel disagrees with reference "
+                        "(len %d, offset %d: %04x != %04x)\n",
+                        k->name, len, off, got, want);
+                return -1;
+            }
+        }
+    }
+
+    memset(buf, 0xff, SR_CKSUM_CHECK_MAX + SR_CKSUM_CHECK_ALIGN);
+    for(len = SR_CKSUM_CHECK_MAX - 67; len <= SR_CKSUM_CHECK_MAX; len++)
+    {
+        if(sr_cksum_ref(buf + 1, len) != k->fn(buf + 1, len))
+        {
+            fprintf(stderr, "cksum: %s kernel disagrees with reference "
+                    "on carries (len %d)\n", k->name, len);
+            return -1;
+        }
+    }
+    return 0;
+} /* -- sr_cksum_check -- */
+
+static void sr_cksum_stats(struct sr_stats_writer* w, void* arg)
+{
+    sr_stats_put_str(w, "kernel", sr_cksum_active);
+} /* -- sr_cksum_stats -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_cksum_init(..)
+ * Scope:  Global
+ *
+ * Select the widest supported kernel that passes sr_cksum_known().
+ * Call before any other thread can be checksumming.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_cksum_init(void)
+{
+    uint8_t* buf;
+    int i;
+
+    buf = (uint8_t*)malloc(SR_CKSUM_CHECK_MAX + SR_CKSUM_CHECK_ALIGN);
+    if(buf == 0)
+    {
+        perror("malloc");
+        return;
+    }
+
+#ifdef SR_CKSUM_X86
+    __builtin_cpu_init();
+#endif
+
+    for(i = 0; i < SR_CKSUM_NKERNELS; i++)
+    {
+        if(sr_cksum_kernels[i].supported() &&
+           sr_cksum_known(&sr_cksum_kernels[i], buf) == 0)
+        {
+            sr_cksum_sum = sr_cksum_kernels[i].fn;
+            sr_cksum_active = sr_cksum_kernels[i].name;
+            break;
+        }
+    }
+    free(buf);
+
+    sr_stats_register("cksum", sr_cksum_stats, 0);
+} /* -- sr_cksum_init -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_cksum_test(..)
+ * Scope:  Global
+ *
+ * Run sr_cksum_check() on every kernel the CPU supports, for the tests
+ * (make check).  Returns the number of kernels that disagree.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_cksum_test(void)
+{
+    uint8_t* buf;
+    int i, bad = 0;
+
+    buf = (uint8_t*)malloc(SR_CKSUM_CHECK_MAX + SR_CKSUM_CHECK_ALIGN);
+    if(buf == 0)
+    {
+        perror("malloc");
+        return 1;
+    }
+
+#ifdef SR_CKSUM_X86
+    __builtin_cpu_init();
+#endif
+
+    for(i = 0; i < SR_CKSUM_NKERNELS; i++)
+    {
+        if(!sr_cksum_kernels[i].supported())
+        { continue; }
+        if(sr_cksum_known(&sr_cksum_kernels[i], buf) != 0 ||
+           sr_cksum_check(&sr_cksum_kernels[i], buf) != 0)
+        { bad++; }
+        else
+        { printf("cksum: %s kernel agrees with reference\n", sr_cksum_kernels[i].name); }
+    }
+    free(buf);
+    return bad;
+} /* -- sr_cksum_test -- */
+
+const char* sr_cksum_name(void)
+{
+    return sr_cksum_active;
+} /* -- sr_cksum_name -- */
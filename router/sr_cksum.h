@@ -0,0 +1,41 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_cksum.h
+ *
+ * Description:
+ *
+ * Internet checksum kernels behind cksum() and cksum_partial().  Every
+ * kernel returns the folded one's complement sum of the buffer read as
+ * 16 bit words in memory order; since that sum doesn't depend on byte
+ * order, callers only byte swap the final 16 bits.
+ *
+ * The kernels are the byte-pair reference loop, a portable one that
+ * adds 32 bit words into 64 bit accumulators, and SSE2/AVX2 versions on
+ * x86.  sr_cksum_init() picks the widest one the CPU supports that gets
+ * a set of known answers right, a kernel that doesn't is never used.
+ * sr_cksum_test() compares every kernel with the reference over every
+ * length and alignment in a test buffer; make check runs it.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_CKSUM_H
+#define SR_CKSUM_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+typedef uint16_t (*sr_cksum_fn)(const void* data, int len);
+
+/* active kernel, the portable one until sr_cksum_init() runs */
+extern sr_cksum_fn sr_cksum_sum;
+
+uint16_t sr_cksum_ref(const void* data, int len);
+void sr_cksum_init(void);
+int sr_cksum_test(void);
+const char* sr_cksum_name(void);
+
+#endif /* -- SR_CKSUM_H -- */
@@ -0,0 +1,247 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_cpu.c
+ *
+ * Description:
+ *
+ * Thread placement, see sr_cpu.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/syscall.h>
+
+#include "sr_stats.h"
+#include "sr_cpu.h"
+
+static const char* sr_cpu_names[SR_CPU_ROLES] = {
+    "rx", "tx", "timer", "control", "stats", "export"
+};
+
+static cpu_set_t sr_cpu_sets[SR_CPU_ROLES];
+static int sr_cpu_given[SR_CPU_ROLES];
+static cpu_set_t sr_cpu_rest;           /* for roles not given */
+static int sr_cpu_pinned = 0;           /* -A was given */
+static pid_t sr_cpu_tid[SR_CPU_ROLES];  /* last thread bound to each role */
+
+/* Parse "n" or "n-m" into set; returns 0 or -1 */
+static int sr_cpu_parse_list(const char* s, cpu_set_t* set)
+{
+    char* end;
+    long lo, hi, i;
+
+    lo = strtol(s, &end, 10);
+    hi = lo;
+    if(end != s && *end == '-')
+    { hi = strtol(end + 1, &end, 10); }
+    if(end == s || *end || lo < 0 || hi < lo || hi >= CPU_SETSIZE)
+    { return -1; }
+
+    CPU_ZERO(set);
+    for(i = lo; i <= hi; i++)
+    { CPU_SET(i, set); }
+    return 0;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_cpu_parse(..)
+ * Scope:  Global
+ *
+ * Take thread placement from sr -A, role=cpus pairs separated by commas.
+ * Every CPU given has to be one the process may run on.  Returns 0, or
+ * -1 after saying what's wrong.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_cpu_parse(const char* spec)
+{
+    cpu_set_t allowed, set;
+    char buf[256];
+    char* item;
+    char* save;
+    char* eq;
+    int role, i;
+
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    {
+        perror("sched_getaffinity");
+        return -1;
+    }
+    strncpy(buf, spec, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = 0;
+
+    for(item = strtok_r(buf, ",", &save); item; item = strtok_r(0, ",", &save))
+    {
+        if((eq = strchr(item, '=')) == 0)
+        {
+            fprintf(stderr, "CPU placement: expected role=cpus, not %s\n", item);
+            return -1;
+        }
+        *eq = 0;
+        for(role = 0; role < SR_CPU_ROLES; role++)
+        {
+            if(strcmp(item, sr_cpu_names[role]) == 0)
+            { break; }
+        }
+        if(role == SR_CPU_ROLES)
+        {
+            fprintf(stderr, "CPU placement: no thread role %s\n", item);
+            return -1;
+        }
+        if(sr_cpu_parse_list(eq + 1, &set) != 0)
+        {
+            fprintf(stderr, "CPU placement: bad CPUs %s for %s\n", eq + 1, item);
+            return -1;
+        }
+        for(i = 0; i < CPU_SETSIZE; i++)
+        {
+            if(CPU_ISSET(i, &set) && !CPU_ISSET(i, &allowed))
+            {
+                fprintf(stderr, "CPU placement: can't run %s on CPU %d\n",
+                        item, i);
+                return -1;
+            }
+        }
+        sr_cpu_sets[role] = set;
+        sr_cpu_given[role] = 1;
+    }
+
+    /* -- the rest keep off the forwarding CPUs, if that leaves any -- */
+    sr_cpu_rest = allowed;
+    if(sr_cpu_given[SR_CPU_RX])
+    {
+        for(i = 0; i < CPU_SETSIZE; i++)
+        {
+            if(CPU_ISSET(i, &sr_cpu_sets[SR_CPU_RX]))
+            { CPU_CLR(i, &sr_cpu_rest); }
+        }
+        if(CPU_COUNT(&sr_cpu_rest) == 0)
+        { sr_cpu_rest = allowed; }
+    }
+    sr_cpu_pinned = 1;
+    return 0;
+} /* -- sr_cpu_parse -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_cpu_bind(..)
+ * Scope:  Global
+ *
+ * Put the calling thread where its role goes, and name it after the
+ * role for top and perf (sr-tx, ...).  Threads the caller starts later inherit the
+ * placement until they bind themselves.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_cpu_bind(enum sr_cpu_role role)
+{
+    const cpu_set_t* set;
+    char name[16];
+    int err;
+
+    /* -- the main thread's name is the process's, leave it be -- */
+    sr_cpu_tid[role] = (pid_t)syscall(SYS_gettid);
+    if(sr_cpu_tid[role] != getpid())
+    {
+        snprintf(name, sizeof(name), "sr-%s", sr_cpu_names[role]);
+        pthread_setname_np(pthread_self(), name);
+    }
+
+    if(!sr_cpu_pinned)
+    { return; }
+    set = sr_cpu_given[role] ? &sr_cpu_sets[role] : &sr_cpu_rest;
+    if((err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), set)))
+    {
+        fprintf(stderr, "Can't place the %s thread: %s\n", sr_cpu_names[role],
+                strerror(err));
+    }
+} /* -- sr_cpu_bind -- */
+
+/* Make threads started with attr run where role goes, without binding */
+void sr_cpu_attr(enum sr_cpu_role role, pthread_attr_t* attr)
+{
+    if(!sr_cpu_pinned)
+    { return; }
+    pthread_attr_setaffinity_np(attr, sizeof(cpu_set_t), sr_cpu_given[role] ?
+                                &sr_cpu_sets[role] : &sr_cpu_rest);
+} /* -- sr_cpu_attr -- */
+
+/* set as a list of CPUs and ranges, "0-1,3" */
+static void sr_cpu_format(const cpu_set_t* set, char* buf, size_t len)
+{
+    size_t off = 0;
+    int i, j;
+
+    buf[0] = 0;
+    for(i = 0; i < CPU_SETSIZE && off < len; i = j)
+    {
+        if(!CPU_ISSET(i, set))
+        {
+            j = i + 1;
+            continue;
+        }
+        for(j = i + 1; j < CPU_SETSIZE && CPU_ISSET(j, set); j++);
+        off += snprintf(buf + off, len - off, j - 1 > i ? "%s%d-%d" : "%s%d",
+                        off ? "," : "", i, j - 1);
+    }
+}
+
+/* The CPU thread tid last ran on, field 39 of its stat, or -1 */
+static int sr_cpu_last(pid_t tid)
+{
+    char path[64], line[1024];
+    char* p;
+    FILE* fp;
+    int field, cpu = -1;
+
+    snprintf(path, sizeof(path), "/proc/self/task/%d/stat", (int)tid);
+    if((fp = fopen(path, "r")) == 0)
+    { return -1; }
+    if(fgets(line, sizeof(line), fp) && (p = strrchr(line, ')')))
+    {
+        /* -- the name can hold anything, count from after it -- */
+        for(field = 2; p && field < 39; field++)
+        { p = strchr(p + 1, ' '); }
+        if(p)
+        { cpu = atoi(p + 1); }
+    }
+    fclose(fp);
+    return cpu;
+}
+
+static void sr_cpu_stats(struct sr_stats_writer* w, void* arg)
+{
+    char buf[256];
+    int role, cpu;
+
+    (void)arg;
+    for(role = 0; role < SR_CPU_ROLES; role++)
+    {
+        sr_stats_open(w, sr_cpu_names[role]);
+        if(!sr_cpu_pinned)
+        { strcpy(buf, "any"); }
+        else
+        {
+            sr_cpu_format(sr_cpu_given[role] ? &sr_cpu_sets[role] : &sr_cpu_rest,
+                          buf, sizeof(buf));
+        }
+        sr_stats_put_str(w, "cpus", buf);
+        if(sr_cpu_tid[role])
+        {
+            sr_stats_put_u64(w, "tid", sr_cpu_tid[role]);
+            if((cpu = sr_cpu_last(sr_cpu_tid[role])) >= 0)
+            { sr_stats_put_u64(w, "last_cpu", cpu); }
+        }
+        sr_stats_close(w);
+    }
+} /* -- sr_cpu_stats -- */
+
+void sr_cpu_init(struct sr_instance* sr)
+{
+    sr_stats_register("cpu", sr_cpu_stats, sr);
+} /* -- sr_cpu_init -- */
@@ -0,0 +1,57 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_cpu.h
+ *
+ * Description:
+ *
+ * Which CPUs each of the router's threads may run on.  Every thread has a
+ * role and calls sr_cpu_bind(..) with it before it does anything else:
+ *
+ *   rx        the main thread, which reads, forwards and answers packets
+ *   tx        the egress scheduler (sr -q / -P)
+ *   timer     the ARP cache sweep
+ *   control   routing table reloads; the threads that parse a table are
+ *             started where control goes, see sr_cpu_attr(..)
+ *   stats     the stats socket server (sr -k)
+ *   export    the flow exporter (sr -F)
+ *
+ * Placement is given with sr -A as role=cpus pairs, e.g.
+ *
+ *   sr -A rx=2,tx=3,timer=0,control=0-1
+ *
+ * where cpus is one CPU or a range.  Roles that aren't named run on the
+ * CPUs the process started with less those given to rx, so nothing else
+ * competes with forwarding for its core and the forwarding thread keeps
+ * its cache.  Without -A nothing is pinned.
+ *
+ * Threads bind before they allocate, and Linux places memory on the NUMA
+ * node of the CPU that first touches it, so each thread's own tables
+ * (its route cache, its stats slot) and whatever rx fills in (the routing
+ * table, loaded by the main thread, NAT and connection tables) end up
+ * local to where they're used.  The "cpu" stats section shows each
+ * role's CPUs and the CPU its thread last ran on.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_CPU_H
+#define SR_CPU_H
+
+#include <pthread.h>
+
+enum sr_cpu_role {
+    SR_CPU_RX,
+    SR_CPU_TX,
+    SR_CPU_TIMER,
+    SR_CPU_CONTROL,
+    SR_CPU_STATS,
+    SR_CPU_EXPORT,
+    SR_CPU_ROLES
+};
+
+struct sr_instance;
+
+int  sr_cpu_parse(const char* spec);
+void sr_cpu_bind(enum sr_cpu_role role);
+void sr_cpu_attr(enum sr_cpu_role role, pthread_attr_t* attr);
+void sr_cpu_init(struct sr_instance* sr);
+
+#endif /* -- SR_CPU_H -- */
@@ -0,0 +1,592 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_ct.c
+ *
+ * Description:
+ *
+ * Connection tracking and the return-traffic policy, see sr_ct.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include "sr_if.h"
+#include "sr_router.h"
+#include "sr_protocol.h"
+#include "sr_stats.h"
+#include "sr_epoch.h"
+#include "sr_huge.h"
+#include "sr_pkt.h"
+#include "sr_ct.h"
+
+#define SR_CT_ORIG   0          /* directions */
+#define SR_CT_REPLY  1
+
+#define SR_CT_FLOW   0          /* what sr_ct_parse found */
+#define SR_CT_ERROR  1          /* ICMP error, the tuple is what it quotes */
+#define SR_CT_OTHER  2          /* nothing we track */
+
+#define SR_TCP_FIN 0x01
+#define SR_TCP_SYN 0x02
+#define SR_TCP_RST 0x04
+#define SR_TCP_ACK 0x10
+
+#define SR_ICMP_PARAM_PROBLEM 12
+
+struct sr_ct_tuple {
+    uint32_t src, dst;
+    uint16_t sport, dport;
+    uint8_t  proto;
+    uint8_t  tcp_flags;
+    uint8_t  icmp_type;
+};
+
+/* idle timeouts by state, seconds */
+static const uint32_t sr_ct_timeouts[SR_CT_STATE_MAX] = {
+    120,        /* SYN_SENT */
+    60,         /* SYN_RECV */
+    7440,       /* ESTABLISHED, RFC 5382 */
+    120,        /* FIN_WAIT */
+    120,        /* TIME_WAIT */
+    10,         /* CLOSE */
+    30,         /* UDP_UNREPLIED */
+    180,        /* UDP_REPLIED */
+    30          /* ICMP */
+};
+
+static uint32_t sr_ct_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)ts.tv_sec;
+}
+
+/* The same for both directions: endpoints are put in order first */
+static uint32_t sr_ct_hash(const struct sr_ct_tuple* t)
+{
+    uint32_t a = t->src, b = t->dst, ports, h;
+
+    if(a > b || (a == b && t->sport > t->dport))
+    {
+        a = t->dst;
+        b = t->src;
+        ports = (uint32_t)t->dport << 16 | t->sport;
+    }
+    else
+    { ports = (uint32_t)t->sport << 16 | t->dport; }
+
+    h = a * 0x9e3779b1U;
+    h ^= h >> 16;
+    h += b * 0x85ebca77U;
+    h ^= h >> 13;
+    h += ports * 0xc2b2ae3dU;
+    h ^= h >> 16;
+    h += t->proto * 0x27d4eb2fU;
+    return h ^ (h >> 15);
+}
+
+static struct sr_ct_shard* sr_ct_shard_of(struct sr_ct* ct, uint32_t h)
+{
+    return &ct->shards[(h >> 24) % SR_CT_SHARDS];
+}
+
+static int sr_ct_parse(uint8_t* ip, unsigned int avail, struct sr_ct_tuple* t,
+                       int quoted);
+
+/*---------------------------------------------------------------------
+ * Method: sr_ct_parse_l4(..)
+ * Scope:  Local
+ *
+ * Fill in the tuple of the IP datagram with header ip_hdr, whose
+ * transport header at l4 has l4len bytes there.  For an ICMP error the
+ * tuple is the one of the datagram it quotes; quoted headers only need
+ * to reach the ports.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_ct_parse_l4(sr_ip_hdr_t* ip_hdr, uint8_t* l4, unsigned int l4len,
+                          struct sr_ct_tuple* t, int quoted)
+{
+    t->src = ip_hdr->ip_src;
+    t->dst = ip_hdr->ip_dst;
+    t->proto = ip_hdr->ip_p;
+    t->tcp_flags = 0;
+    t->icmp_type = 0;
+
+    switch(ip_hdr->ip_p)
+    {
+        case ip_protocol_tcp:
+            if(l4len < (quoted ? 4 : 20))
+            { return SR_CT_OTHER; }
+            memcpy(&t->sport, l4, 2);
+            memcpy(&t->dport, l4 + 2, 2);
+            if(!quoted)
+            { t->tcp_flags = l4[13]; }
+            return SR_CT_FLOW;
+
+        case ip_protocol_udp:
+            if(l4len < (quoted ? 4 : 8))
+            { return SR_CT_OTHER; }
+            memcpy(&t->sport, l4, 2);
+            memcpy(&t->dport, l4 + 2, 2);
+            return SR_CT_FLOW;
+
+        case ip_protocol_icmp:
+            if(l4len < 8)
+            { return SR_CT_OTHER; }
+            t->icmp_type = l4[0];
+            if(l4[0] == icmp_type_echo_request || l4[0] == icmp_type_echo_reply)
+            {
+                memcpy(&t->sport, l4 + 4, 2);
+                t->dport = t->sport;
+                return SR_CT_FLOW;
+            }
+            if(!quoted && (l4[0] == icmp_type_dest_unreachable ||
+                           l4[0] == icmp_type_time_exceeded ||
+                           l4[0] == SR_ICMP_PARAM_PROBLEM) &&
+               sr_ct_parse(l4 + 8, l4len - 8, t, 1) == SR_CT_FLOW)
+            { return SR_CT_ERROR; }
+            return SR_CT_OTHER;
+    }
+    return SR_CT_OTHER;
+} /* -- sr_ct_parse_l4 -- */
+
+/* The same for the (quoted) IP datagram at ip, avail bytes of it there */
+static int sr_ct_parse(uint8_t* ip, unsigned int avail, struct sr_ct_tuple* t,
+                       int quoted)
+{
+    sr_ip_hdr_t* ip_hdr = (sr_ip_hdr_t*)ip;
+    unsigned int hl;
+
+    if(avail < sizeof(sr_ip_hdr_t) || ip_hdr->ip_v != 4)
+    { return SR_CT_OTHER; }
+    hl = ip_hdr->ip_hl * 4;
+    if(hl < sizeof(sr_ip_hdr_t) || avail < hl ||
+       (ntohs(ip_hdr->ip_off) & IP_OFFMASK))
+    { return SR_CT_OTHER; }
+    return sr_ct_parse_l4(ip_hdr, ip + hl, avail - hl, t, quoted);
+} /* -- sr_ct_parse -- */
+
+/* Lock-free, call inside an epoch */
+static struct sr_ct_conn* sr_ct_find(struct sr_ct* ct, struct sr_ct_shard* s,
+        uint32_t h, const struct sr_ct_tuple* t, int* dir)
+{
+    struct sr_ct_conn* c;
+
+    for(c = __atomic_load_n(&s->buckets[h & ct->mask], __ATOMIC_ACQUIRE); c;
+        c = __atomic_load_n(&c->next, __ATOMIC_ACQUIRE))
+    {
+        if(c->hash != h || c->proto != t->proto)
+        { continue; }
+        if(c->src == t->src && c->dst == t->dst &&
+           c->sport == t->sport && c->dport == t->dport)
+        {
+            *dir = SR_CT_ORIG;
+            return c;
+        }
+        if(c->src == t->dst && c->dst == t->src &&
+           c->sport == t->dport && c->dport == t->sport)
+        {
+            *dir = SR_CT_REPLY;
+            return c;
+        }
+    }
+    return 0;
+} /* -- sr_ct_find -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_ct_update(..)
+ * Scope:  Local
+ *
+ * Advance a connection's state for a datagram going in direction dir and
+ * push its expiry out.  Runs without the shard lock, so fields are only
+ * written with atomic stores; two datagrams of one connection racing each
+ * other can at worst lose a transition the next datagram makes again.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_ct_update(struct sr_ct_conn* c, int dir, uint8_t flags,
+                         uint32_t now)
+{
+    uint8_t state = __atomic_load_n(&c->state, __ATOMIC_RELAXED);
+    uint8_t fin;
+
+    switch(c->proto)
+    {
+        case ip_protocol_tcp:
+            if(flags & SR_TCP_RST)
+            {
+                state = SR_CT_TCP_CLOSE;
+                break;
+            }
+            if((flags & (SR_TCP_SYN | SR_TCP_ACK)) == SR_TCP_SYN &&
+               dir == SR_CT_ORIG &&
+               (state == SR_CT_TCP_TIME_WAIT || state == SR_CT_TCP_CLOSE))
+            {
+                state = SR_CT_TCP_SYN_SENT;
+                __atomic_store_n(&c->fin, 0, __ATOMIC_RELAXED);
+            }
+            else if((flags & (SR_TCP_SYN | SR_TCP_ACK)) == (SR_TCP_SYN | SR_TCP_ACK) &&
+                    dir == SR_CT_REPLY && state == SR_CT_TCP_SYN_SENT)
+            { state = SR_CT_TCP_SYN_RECV; }
+            else if((flags & (SR_TCP_SYN | SR_TCP_ACK)) == SR_TCP_ACK &&
+                    dir == SR_CT_ORIG && state == SR_CT_TCP_SYN_RECV)
+            { state = SR_CT_TCP_ESTABLISHED; }
+
+            if(flags & SR_TCP_FIN)
+            {
+                fin = __atomic_or_fetch(&c->fin, 1 << dir, __ATOMIC_RELAXED);
+                if(fin == 3)
+                { state = SR_CT_TCP_TIME_WAIT; }
+                else if(state <= SR_CT_TCP_ESTABLISHED)
+                { state = SR_CT_TCP_FIN_WAIT; }
+            }
+            break;
+
+        case ip_protocol_udp:
+            if(dir == SR_CT_REPLY)
+            { state = SR_CT_UDP_REPLIED; }
+            break;
+    }
+
+    __atomic_store_n(&c->state, state, __ATOMIC_RELAXED);
+    __atomic_store_n(&c->expires, now + sr_ct_timeouts[state], __ATOMIC_RELAXED);
+} /* -- sr_ct_update -- */
+
+/* Put c on its shard's wheel at its expiry, or as far out as it goes */
+static void sr_ct_file(struct sr_ct_shard* s, struct sr_ct_conn* c, uint32_t now)
+{
+    uint32_t t = __atomic_load_n(&c->expires, __ATOMIC_RELAXED);
+
+    if((int32_t)(t - now) <= 0)
+    { t = now + 1; }
+    else if(t - now >= SR_CT_WHEEL)
+    { t = now + SR_CT_WHEEL - 1; }
+
+    c->wnext = s->wheel[t % SR_CT_WHEEL];
+    s->wheel[t % SR_CT_WHEEL] = c;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_ct_add(..)
+ * Scope:  Local
+ *
+ * Start tracking a connection whose first datagram is t.  Another thread
+ * may have added it since the lock-free lookup missed, so look again
+ * under the lock.  Returns -1 if the table is full.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_ct_add(struct sr_ct* ct, struct sr_ct_shard* s, uint32_t h,
+                     const struct sr_ct_tuple* t, uint32_t now)
+{
+    struct sr_ct_conn* c;
+    struct sr_ct_conn* old;
+    int dir;
+
+    if(__sync_add_and_fetch(&ct->count, 1) > ct->max ||
+       (c = (struct sr_ct_conn*)malloc(sizeof(struct sr_ct_conn))) == 0)
+    {
+        __sync_fetch_and_sub(&ct->count, 1);
+        __sync_fetch_and_add(&ct->full, 1);
+        return -1;
+    }
+
+    memset(c, 0, sizeof(*c));
+    c->hash = h;
+    c->src = t->src;
+    c->dst = t->dst;
+    c->sport = t->sport;
+    c->dport = t->dport;
+    c->proto = t->proto;
+    switch(t->proto)
+    {
+        case ip_protocol_tcp:
+            c->state = (t->tcp_flags & (SR_TCP_SYN | SR_TCP_ACK)) == SR_TCP_SYN ?
+                       SR_CT_TCP_SYN_SENT : SR_CT_TCP_ESTABLISHED;
+            break;
+        case ip_protocol_udp:
+            c->state = SR_CT_UDP_UNREPLIED;
+            break;
+        default:
+            c->state = SR_CT_ICMP;
+    }
+    sr_ct_update(c, SR_CT_ORIG, t->tcp_flags, now);
+
+    pthread_mutex_lock(&s->lock);
+    if((old = sr_ct_find(ct, s, h, t, &dir)))
+    {
+        sr_ct_update(old, dir, t->tcp_flags, now);
+        pthread_mutex_unlock(&s->lock);
+        free(c);
+        __sync_fetch_and_sub(&ct->count, 1);
+        return 0;
+    }
+    c->next = s->buckets[h & ct->mask];
+    __atomic_store_n(&s->buckets[h & ct->mask], c, __ATOMIC_RELEASE);
+    sr_ct_file(s, c, now);
+    pthread_mutex_unlock(&s->lock);
+
+    __sync_fetch_and_add(&ct->created, 1);
+    return 0;
+} /* -- sr_ct_add -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_ct_advance(..)
+ * Scope:  Local
+ *
+ * Advance one shard's wheel to now, with its lock held.  Connections
+ * used since they were filed go back on the wheel; the rest are unlinked,
+ * which readers still walking the chain don't notice since the unlinked
+ * entry keeps its next pointer, and freed through the epoch.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_ct_advance(struct sr_ct* ct, struct sr_ct_shard* s, uint32_t now)
+{
+    struct sr_ct_conn* head;
+    struct sr_ct_conn* c;
+    struct sr_ct_conn** pp;
+
+    if(now - s->tick > SR_CT_WHEEL)
+    { s->tick = now - SR_CT_WHEEL; }
+
+    while(s->tick != now)
+    {
+        s->tick++;
+        head = s->wheel[s->tick % SR_CT_WHEEL];
+        s->wheel[s->tick % SR_CT_WHEEL] = 0;
+
+        while(head)
+        {
+            c = head;
+            head = c->wnext;
+            if((int32_t)(__atomic_load_n(&c->expires, __ATOMIC_RELAXED) - now) > 0)
+            {
+                sr_ct_file(s, c, now);
+                continue;
+            }
+
+            for(pp = &s->buckets[c->hash & ct->mask]; *pp != c; pp = &(*pp)->next);
+            __atomic_store_n(pp, c->next, __ATOMIC_RELEASE);
+            sr_epoch_retire(c, free);
+            __sync_fetch_and_sub(&ct->count, 1);
+            __sync_fetch_and_add(&ct->expired, 1);
+        }
+    }
+} /* -- sr_ct_advance -- */
+
+/* Once a second, whichever thread notices first sweeps every shard */
+static void sr_ct_sweep(struct sr_ct* ct, uint32_t now)
+{
+    uint32_t last = __atomic_load_n(&ct->tick, __ATOMIC_RELAXED);
+    int i;
+
+    if(last == now || !__sync_bool_compare_and_swap(&ct->tick, last, now))
+    { return; }
+
+    for(i = 0; i < SR_CT_SHARDS; i++)
+    {
+        pthread_mutex_lock(&ct->shards[i].lock);
+        sr_ct_advance(ct, &ct->shards[i], now);
+        pthread_mutex_unlock(&ct->shards[i].lock);
+    }
+    sr_epoch_reclaim();
+} /* -- sr_ct_sweep -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_ct_track(..)
+ * Scope:  Global
+ *
+ * Account a whole datagram about to be forwarded, described by pkt.
+ * Returns 0 to forward it, -1 if the policy of iface refuses it or a new
+ * connection doesn't fit in the table.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_ct_track(struct sr_ct* ct,
+        uint8_t* packet /* lent */,
+        const struct sr_pkt* pkt)
+{
+    struct sr_ct_tuple t;
+    struct sr_ct_shard* s;
+    struct sr_ct_conn* c;
+    uint32_t now, h;
+    int kind, dir, outside;
+
+    now = sr_ct_now();
+    sr_ct_sweep(ct, now);
+
+    outside = pkt->ifindex < 64 && ((ct->reply_only >> pkt->ifindex) & 1);
+    kind = (pkt->flags & SR_PKT_LATER) ? SR_CT_OTHER :
+           sr_ct_parse_l4((sr_ip_hdr_t*)(packet + pkt->l3), packet + pkt->l4,
+                          pkt->len - pkt->l4, &t, 0);
+    if(kind == SR_CT_OTHER)
+    {
+        if(outside)
+        {
+            __sync_fetch_and_add(&ct->blocked, 1);
+            return -1;
+        }
+        return 0;
+    }
+
+    h = sr_ct_hash(&t);
+    s = sr_ct_shard_of(ct, h);
+
+    sr_epoch_enter();
+    c = sr_ct_find(ct, s, h, &t, &dir);
+    if(c && kind == SR_CT_FLOW)
+    {
+        /* -- echo requests only go the way the first one went -- */
+        if(t.proto == ip_protocol_icmp &&
+           (t.icmp_type == icmp_type_echo_request) != (dir == SR_CT_ORIG))
+        { c = 0; }
+        else
+        { sr_ct_update(c, dir, t.tcp_flags, now); }
+    }
+    sr_epoch_exit();
+
+    if(c)
+    {
+        if(kind == SR_CT_ERROR)
+        { __sync_fetch_and_add(&ct->related, 1); }
+        return 0;
+    }
+    if(outside)
+    {
+        __sync_fetch_and_add(&ct->blocked, 1);
+        return -1;
+    }
+
+    /* -- only the first datagram of a connection starts one -- */
+    if(kind == SR_CT_ERROR ||
+       (t.proto == ip_protocol_icmp && t.icmp_type != icmp_type_echo_request))
+    { return 0; }
+    return sr_ct_add(ct, s, h, &t, now);
+} /* -- sr_ct_track -- */
+
+static void sr_ct_stats(struct sr_stats_writer* w, void* arg)
+{
+    struct sr_instance* sr = (struct sr_instance*)arg;
+    struct sr_ct* ct = sr->ct;
+    struct sr_if* iface;
+    char names[128];
+    size_t n = 0;
+
+    if(ct == 0)
+    { return; }
+
+    names[0] = 0;
+    for(iface = sr->if_list; iface; iface = iface->next)
+    {
+        if(iface->ifindex < 64 && ((ct->reply_only >> iface->ifindex) & 1) &&
+           n + strlen(iface->name) + 2 < sizeof(names))
+        { n += sprintf(names + n, "%s%s", n ? "," : "", iface->name); }
+    }
+
+    sr_stats_put_str(w, "reply_only", names);
+    sr_stats_put_u64(w, "connections", ct->count);
+    sr_stats_put_u64(w, "max_connections", ct->max);
+    sr_stats_put_u64(w, "created", ct->created);
+    sr_stats_put_u64(w, "expired", ct->expired);
+    sr_stats_put_u64(w, "blocked", ct->blocked);
+    sr_stats_put_u64(w, "related", ct->related);
+    sr_stats_put_u64(w, "table_full", ct->full);
+} /* -- sr_ct_stats -- */
+
+void sr_ct_init(struct sr_instance* sr)
+{
+    sr_stats_register("conntrack", sr_ct_stats, sr);
+} /* -- sr_ct_init -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_ct_create(..)
+ * Scope:  Global
+ *
+ * A tracker for up to max connections, with no interface restricted yet.
+ * Returns 0 if memory is short.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_ct* sr_ct_create(uint32_t max)
+{
+    struct sr_ct* ct;
+    uint32_t size, now;
+    int i;
+
+    if(max == 0 || max > (1U << 30))
+    {
+        fprintf(stderr, "conntrack: bad connection limit %u\n", max);
+        return 0;
+    }
+
+    /* -- about one connection per bucket when full -- */
+    for(size = 16; size < max / SR_CT_SHARDS; size <<= 1);
+
+    if(posix_memalign((void**)&ct, SR_CACHELINE, sizeof(struct sr_ct)) != 0)
+    { return 0; }
+    memset(ct, 0, sizeof(struct sr_ct));
+
+    now = sr_ct_now();
+    for(i = 0; i < SR_CT_SHARDS; i++)
+    {
+        pthread_mutex_init(&ct->shards[i].lock, 0);
+        ct->shards[i].tick = now;
+        ct->shards[i].buckets = (struct sr_ct_conn**)
+            sr_huge_alloc("conntrack", size * sizeof(struct sr_ct_conn*));
+        if(ct->shards[i].buckets == 0)
+        {
+            fprintf(stderr, "conntrack: can't allocate %u buckets\n", size);
+            while(i >= 0)
+            { sr_huge_free(ct->shards[i--].buckets); }
+            free(ct);
+            return 0;
+        }
+    }
+    ct->mask = size - 1;
+    ct->max = max;
+    ct->tick = now;
+    return ct;
+} /* -- sr_ct_create -- */
+
+/* Only let return traffic in on the interface called name, once attached */
+int sr_ct_reply_only(struct sr_ct* ct, const char* name)
+{
+    /* -- REQUIRES -- */
+    assert(ct);
+    assert(name);
+
+    if(name[0] == 0 || strlen(name) >= sr_IFACE_NAMELEN ||
+       ct->nreply == SR_CT_REPLY_MAX)
+    {
+        fprintf(stderr, "conntrack: bad interface %s\n", name);
+        return -1;
+    }
+    strcpy(ct->reply_names[ct->nreply++], name);
+    return 0;
+} /* -- sr_ct_reply_only -- */
+
+/* Look up the return-only interfaces, once the interface list is complete */
+int sr_ct_attach(struct sr_ct* ct, struct sr_instance* sr)
+{
+    struct sr_if* iface;
+    unsigned int i;
+
+    for(i = 0; i < ct->nreply; i++)
+    {
+        if((iface = sr_get_interface(sr, ct->reply_names[i])) == 0 ||
+           iface->ifindex >= 64)
+        {
+            fprintf(stderr, "conntrack: no interface %s\n", ct->reply_names[i]);
+            return -1;
+        }
+        ct->reply_only |= (uint64_t)1 << iface->ifindex;
+        printf("conntrack: only return traffic in on %s\n", iface->name);
+    }
+    return 0;
+} /* -- sr_ct_attach -- */
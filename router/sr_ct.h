@@ -0,0 +1,109 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_ct.h
+ *
+ * Description:
+ *
+ * Connection tracking for forwarded traffic, turned on with
+ * sr -f <iface>[,<iface>..][:max].  TCP connections follow the usual
+ * handshake and teardown states, UDP pseudo-flows are unreplied or
+ * replied, and ICMP echo is tracked by identifier; each state has its
+ * own idle timeout.
+ *
+ * The listed interfaces only let in return traffic: a datagram arriving
+ * on one of them is forwarded if it belongs to a connection opened from
+ * elsewhere, or is an ICMP error about one, and dropped otherwise.  The
+ * names are looked up by sr_ct_attach(..) once the interface list is
+ * known, after VNSHWINFO on a live router.
+ *
+ * Connections live in SR_CT_SHARDS shards, picked by a hash that is the
+ * same for both directions.  Lookups take no lock: chains are read inside
+ * an epoch (sr_epoch.h) and established flows only update their state and
+ * expiry with atomic stores.  Inserts and expiry take the shard's lock,
+ * and unlinked connections are freed through the epoch once no reader can
+ * still be looking at them.  Each shard has a one-second timer wheel;
+ * refreshing a connection doesn't touch it, the wheel re-files the entry
+ * when its slot comes up.  NAT sees datagrams after this, so connections
+ * are in terms of inside addresses.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_CT_H
+#define SR_CT_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+#include <pthread.h>
+
+#include "sr_stats.h"
+#include "sr_if.h"
+
+#define SR_CT_SHARDS       16
+#define SR_CT_DEFAULT_MAX  (1 << 18)   /* connections */
+#define SR_CT_WHEEL        512         /* slots, one second each */
+#define SR_CT_REPLY_MAX    16          /* return-only interfaces */
+
+enum sr_ct_state {
+    SR_CT_TCP_SYN_SENT,
+    SR_CT_TCP_SYN_RECV,
+    SR_CT_TCP_ESTABLISHED,
+    SR_CT_TCP_FIN_WAIT,         /* one side closed */
+    SR_CT_TCP_TIME_WAIT,        /* both sides closed */
+    SR_CT_TCP_CLOSE,            /* reset */
+    SR_CT_UDP_UNREPLIED,
+    SR_CT_UDP_REPLIED,
+    SR_CT_ICMP,
+    SR_CT_STATE_MAX
+};
+
+struct sr_instance;
+struct sr_pkt;
+
+struct sr_ct_conn {
+    struct sr_ct_conn* next;    /* hash chain, read without the lock */
+    uint32_t hash;
+    uint32_t src, dst;          /* original direction, network byte order */
+    uint16_t sport, dport;      /* ICMP echo: the identifier, twice */
+    uint8_t  proto;
+    uint8_t  state;             /* enum sr_ct_state */
+    uint8_t  fin;               /* directions that sent a FIN */
+    uint32_t expires;           /* seconds */
+    struct sr_ct_conn* wnext;   /* timer wheel, under the lock */
+};
+
+struct sr_ct_shard {
+    pthread_mutex_t lock;
+    struct sr_ct_conn** buckets;
+    struct sr_ct_conn* wheel[SR_CT_WHEEL];
+    uint32_t tick;
+} __attribute__ ((aligned (SR_CACHELINE)));
+
+struct sr_ct {
+    struct sr_ct_shard shards[SR_CT_SHARDS];
+    uint32_t mask;              /* buckets per shard - 1 */
+    uint32_t max;
+    uint32_t count;
+    uint32_t tick;              /* last sweep */
+    uint64_t reply_only;        /* bit per ifindex, set by sr_ct_attach */
+    char reply_names[SR_CT_REPLY_MAX][sr_IFACE_NAMELEN];
+    unsigned int nreply;
+
+    uint64_t created;
+    uint64_t expired;
+    uint64_t blocked;
+    uint64_t related;
+    uint64_t full;
+};
+
+void sr_ct_init(struct sr_instance* sr);
+struct sr_ct* sr_ct_create(uint32_t max);
+int sr_ct_reply_only(struct sr_ct* ct, const char* iface);
+int sr_ct_attach(struct sr_ct* ct, struct sr_instance* sr);
+int sr_ct_track(struct sr_ct* ct, uint8_t* packet, const struct sr_pkt* pkt);
+
+#endif /* -- SR_CT_H -- */
@@ -2,6 +2,7 @@
 #include <sys/types.h>
 
 #include <stdio.h>
+#include <string.h>
 #include "sr_dumper.h"
 
 static void
@@ -69,3 +70,115 @@ sr_dump_close(FILE *fp)
   fclose(fp);
 }
 
+
+static uint32_t
+sf_swap32(uint32_t v)
+{
+        return ((v & 0xff) << 24) | ((v & 0xff00) << 8) |
+               ((v >> 8) & 0xff00) | (v >> 24);
+}
+
+/*
+ * Open 'fname' for reading and validate the file header.
+ */
+int
+sr_dump_read_open(struct sr_dump_reader *r, const char *fname)
+{
+        struct pcap_file_header hdr;
+
+        memset(r, 0, sizeof(*r));
+
+        if (fname[0] == '-' && fname[1] == '\0')
+                r->fp = stdin;
+        else if ((r->fp = fopen(fname, "r")) == NULL) {
+                fprintf(stderr, "sr_dump_read_open: can't open %s\n", fname);
+                return (-1);
+        }
+
+        if (fread(&hdr, sizeof(hdr), 1, r->fp) != 1) {
+                fprintf(stderr, "sr_dump_read_open: %s: short file header\n",
+                    fname);
+                sr_dump_read_close(r);
+                return (-1);
+        }
+
+        switch (hdr.magic) {
+        case TCPDUMP_MAGIC:
+                break;
+        case TCPDUMP_MAGIC_NSEC:
+                r->nsec = 1;
+                break;
+        default:
+                if (sf_swap32(hdr.magic) == TCPDUMP_MAGIC)
+                        r->swapped = 1;
+                else if (sf_swap32(hdr.magic) == TCPDUMP_MAGIC_NSEC)
+                        r->swapped = r->nsec = 1;
+                else {
+                        fprintf(stderr, "sr_dump_read_open: %s: bad magic "
+                            "0x%08x\n", fname, hdr.magic);
+                        sr_dump_read_close(r);
+                        return (-1);
+                }
+        }
+
+        r->snaplen  = r->swapped ? sf_swap32(hdr.snaplen) : hdr.snaplen;
+        r->linktype = r->swapped ? sf_swap32(hdr.linktype) : hdr.linktype;
+
+        if (r->linktype != LINKTYPE_ETHERNET) {
+                fprintf(stderr, "sr_dump_read_open: %s: unsupported link "
+                    "type %u\n", fname, r->linktype);
+                sr_dump_read_close(r);
+                return (-1);
+        }
+
+        return (0);
+}
+
+/*
+ * Read the next packet.  Bytes beyond 'buflen' are skipped so that h->caplen
+ * never exceeds what is actually in 'buf'.
+ */
+int
+sr_dump_read(struct sr_dump_reader *r, struct pcap_pkthdr *h,
+             unsigned char *buf, unsigned int buflen)
+{
+        struct pcap_sf_pkthdr sf_hdr;
+        uint32_t caplen, keep;
+
+        if (fread(&sf_hdr, sizeof(sf_hdr), 1, r->fp) != 1)
+                return (feof(r->fp) ? 0 : -1);
+
+        if (r->swapped) {
+                sf_hdr.ts.tv_sec  = sf_swap32(sf_hdr.ts.tv_sec);
+                sf_hdr.ts.tv_usec = sf_swap32(sf_hdr.ts.tv_usec);
+                sf_hdr.caplen     = sf_swap32(sf_hdr.caplen);
+                sf_hdr.len        = sf_swap32(sf_hdr.len);
+        }
+
+        caplen = sf_hdr.caplen;
+        if (caplen > 0x40000) {
+                fprintf(stderr, "sr_dump_read: bogus caplen %u\n", caplen);
+                return (-1);
+        }
+
+        keep = min(caplen, buflen);
+        if (keep && fread(buf, keep, 1, r->fp) != 1)
+                return (-1);
+        if (caplen > keep && fseek(r->fp, caplen - keep, SEEK_CUR) != 0)
+                return (-1);
+
+        h->ts.tv_sec  = sf_hdr.ts.tv_sec;
+        h->ts.tv_usec = r->nsec ? sf_hdr.ts.tv_usec / 1000 : sf_hdr.ts.tv_usec;
+        h->caplen     = keep;
+        h->len        = sf_hdr.len;
+
+        return (1);
+}
+
+void
+sr_dump_read_close(struct sr_dump_reader *r)
+{
+        if (r->fp && r->fp != stdin)
+                fclose(r->fp);
+        r->fp = NULL;
+}
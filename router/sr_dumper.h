@@ -3,6 +3,8 @@
  * format as well as a set of operations for logging.
  */
 
+#ifndef SR_DUMPER_H
+#define SR_DUMPER_H
 
 #ifdef _LINUX_
 #include <stdint.h>
@@ -12,6 +14,7 @@
 #include <inttypes.h>
 #endif /* _DARWIN_ */
 
+#include <stdio.h>
 #include <sys/time.h>
 
 #define PCAP_VERSION_MAJOR 2
@@ -20,6 +23,7 @@
 #define PCAP_PROTO_LEN 2
 
 #define TCPDUMP_MAGIC 0xa1b2c3d4
+#define TCPDUMP_MAGIC_NSEC 0xa1b23c4d
 
 #define LINKTYPE_ETHERNET 1
 
@@ -77,3 +81,34 @@ void sr_dump(FILE *fp, const struct pcap_pkthdr *h, const unsigned char *sp);
  * Close the file
  */
 void sr_dump_close(FILE *fp);
+
+/*
+ * State for reading a dump file back.  Captures written on a host of the
+ * other byte order, or with nanosecond timestamps, are converted on the fly.
+ */
+struct sr_dump_reader {
+    FILE* fp;
+    int swapped;           /* file byte order differs from ours */
+    int nsec;              /* timestamps are in nanoseconds */
+    uint32_t snaplen;
+    uint32_t linktype;
+};
+
+/**
+ * Open a dump file for reading and check its header.  Returns 0 on success.
+ */
+int sr_dump_read_open(struct sr_dump_reader *r, const char *fname);
+
+/**
+ * Read the next packet into buf (at most buflen bytes are kept).  Returns 1
+ * when a packet was read, 0 at end of file and -1 on a malformed file.
+ */
+int sr_dump_read(struct sr_dump_reader *r, struct pcap_pkthdr *h,
+                 unsigned char *buf, unsigned int buflen);
+
+/**
+ * Close a dump file opened for reading
+ */
+void sr_dump_read_close(struct sr_dump_reader *r);
+
+#endif /* SR_DUMPER_H */
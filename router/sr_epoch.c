@@ -0,0 +1,160 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_epoch.c
+ *
+ * Description:
+ *
+ * Epoch based reclamation, see sr_epoch.h.
+ *
+ * Every thread that enters gets a record on a list that only grows.  A
+ * record holds the global epoch the thread saw when it entered, or 0 while
+ * it's outside.  Retiring stamps the object with the current epoch and
+ * bumps it, so any reader that could still hold the object shows an epoch
+ * no newer than the stamp; once no record does, the object can go.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "sr_stats.h"
+#include "sr_epoch.h"
+
+struct sr_epoch_rec {
+    uint64_t epoch;             /* 0 when outside */
+    unsigned int nest;
+    struct sr_epoch_rec* next;
+} __attribute__ ((aligned (SR_CACHELINE)));
+
+struct sr_epoch_obj {
+    void* obj;
+    sr_epoch_free_fn fn;
+    uint64_t epoch;
+    struct sr_epoch_obj* next;
+};
+
+static uint64_t sr_epoch_global = 1;
+static struct sr_epoch_rec* sr_epoch_recs = 0;
+static __thread struct sr_epoch_rec* sr_epoch_self = 0;
+
+/* -- retired objects, oldest first -- */
+static struct sr_epoch_obj* sr_epoch_head = 0;
+static struct sr_epoch_obj** sr_epoch_tail = &sr_epoch_head;
+static pthread_mutex_t sr_epoch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct sr_epoch_rec* sr_epoch_register(void)
+{
+    struct sr_epoch_rec* r;
+
+    if(posix_memalign((void**)&r, SR_CACHELINE, sizeof(*r)) != 0)
+    { abort(); }
+    r->epoch = 0;
+    r->nest = 0;
+    do
+    { r->next = sr_epoch_recs; }
+    while(!__sync_bool_compare_and_swap(&sr_epoch_recs, r->next, r));
+
+    sr_epoch_self = r;
+    return r;
+}
+
+void sr_epoch_enter(void)
+{
+    struct sr_epoch_rec* r = sr_epoch_self;
+
+    if(r == 0)
+    { r = sr_epoch_register(); }
+    if(r->nest++ == 0)
+    {
+        __atomic_store_n(&r->epoch, __atomic_load_n(&sr_epoch_global,
+                         __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+        /* -- the epoch must be visible before we read anything shared -- */
+        __sync_synchronize();
+    }
+} /* -- sr_epoch_enter -- */
+
+void sr_epoch_exit(void)
+{
+    struct sr_epoch_rec* r = sr_epoch_self;
+
+    if(--r->nest == 0)
+    { __atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE); }
+} /* -- sr_epoch_exit -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_epoch_retire(..)
+ * Scope:  Global
+ *
+ * Destroy obj with fn once no reader can still see it.  obj must already
+ * be unreachable for new readers.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_epoch_retire(void* obj, sr_epoch_free_fn fn)
+{
+    struct sr_epoch_obj* o;
+
+    if((o = (struct sr_epoch_obj*)malloc(sizeof(*o))) == 0)
+    { abort(); }
+    o->obj = obj;
+    o->fn = fn;
+    o->next = 0;
+
+    pthread_mutex_lock(&sr_epoch_lock);
+    o->epoch = __sync_fetch_and_add(&sr_epoch_global, 1);
+    *sr_epoch_tail = o;
+    sr_epoch_tail = &o->next;
+    pthread_mutex_unlock(&sr_epoch_lock);
+} /* -- sr_epoch_retire -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_epoch_reclaim(..)
+ * Scope:  Global
+ *
+ * Destroy every retired object no reader can still hold.  Returns how
+ * many went.  Safe from inside an epoch, though whatever was retired
+ * after the caller entered has to wait for a later call.
+ *
+ *---------------------------------------------------------------------*/
+
+unsigned int sr_epoch_reclaim(void)
+{
+    struct sr_epoch_rec* r;
+    struct sr_epoch_obj* done;
+    struct sr_epoch_obj** last;
+    struct sr_epoch_obj* o;
+    uint64_t oldest, e;
+    unsigned int n = 0;
+
+    if(sr_epoch_head == 0)
+    { return 0; }
+
+    /* -- pairs with the fence in sr_epoch_enter -- */
+    __sync_synchronize();
+    oldest = __atomic_load_n(&sr_epoch_global, __ATOMIC_RELAXED);
+    for(r = __atomic_load_n(&sr_epoch_recs, __ATOMIC_ACQUIRE); r; r = r->next)
+    {
+        e = __atomic_load_n(&r->epoch, __ATOMIC_ACQUIRE);
+        if(e && e < oldest)
+        { oldest = e; }
+    }
+
+    /* -- the list is in retire order, so what can go is a prefix -- */
+    pthread_mutex_lock(&sr_epoch_lock);
+    done = sr_epoch_head;
+    for(last = &done; *last && (*last)->epoch < oldest; last = &(*last)->next);
+    sr_epoch_head = *last;
+    *last = 0;
+    if(sr_epoch_head == 0)
+    { sr_epoch_tail = &sr_epoch_head; }
+    pthread_mutex_unlock(&sr_epoch_lock);
+
+    while(done)
+    {
+        o = done;
+        done = done->next;
+        o->fn(o->obj);
+        free(o);
+        n++;
+    }
+    return n;
+} /* -- sr_epoch_reclaim -- */
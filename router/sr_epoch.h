@@ -0,0 +1,35 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_epoch.h
+ *
+ * Description:
+ *
+ * Epoch based reclamation for tables that are read without locks.
+ *
+ * A reader brackets its lookups with sr_epoch_enter()/sr_epoch_exit().
+ * A writer unlinks an object under whatever lock it uses and hands it to
+ * sr_epoch_retire(); the object is destroyed by a later sr_epoch_reclaim()
+ * once every reader that was inside when it was retired has left.
+ * Entering and leaving are a store and a fence on the thread's own record,
+ * and nesting is allowed.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_EPOCH_H
+#define SR_EPOCH_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+typedef void (*sr_epoch_free_fn)(void* obj);
+
+void sr_epoch_enter(void);
+void sr_epoch_exit(void);
+void sr_epoch_retire(void* obj, sr_epoch_free_fn fn);
+unsigned int sr_epoch_reclaim(void);
+
+#endif /* -- SR_EPOCH_H -- */
@@ -0,0 +1,989 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_fib.c
+ *
+ * Description:
+ *
+ * Binary trie for longest prefix match with lock-free readers, see
+ * sr_fib.h.  Prefixes are in host byte order here.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+
+#include "sr_router.h"
+#include "sr_rt.h"
+#include "sr_epoch.h"
+#include "sr_fib.h"
+#include "sr_rtcache.h"
+#include "sr_huge.h"
+
+/* -- trie nodes are carved from SR_HUGE_PAGE slabs shared by every fib;
+      freed ones wait for reuse on a list linked through child[0] -- */
+static pthread_mutex_t sr_fib_slab_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sr_fib_node* sr_fib_spare = 0;
+static struct sr_fib_node* sr_fib_slab = 0;
+static size_t sr_fib_slab_left = 0;
+
+static struct sr_fib_node* sr_fib_node_new(struct sr_fib* fib)
+{
+    struct sr_fib_node* n;
+
+    pthread_mutex_lock(&sr_fib_slab_lock);
+    if((n = sr_fib_spare))
+    { sr_fib_spare = n->child[0]; }
+    else
+    {
+        if(sr_fib_slab_left == 0)
+        {
+            sr_fib_slab = (struct sr_fib_node*)sr_huge_alloc("fib_nodes",
+                                                             SR_HUGE_PAGE);
+            assert(sr_fib_slab);
+            sr_fib_slab_left = SR_HUGE_PAGE / sizeof(struct sr_fib_node);
+        }
+        n = sr_fib_slab++;
+        sr_fib_slab_left--;
+    }
+    pthread_mutex_unlock(&sr_fib_slab_lock);
+
+    memset(n, 0, sizeof(struct sr_fib_node));
+    fib->nnodes++;
+    return n;
+}
+
+/* Put back the nodes first .. last, linked through child[0] */
+static void sr_fib_node_put(struct sr_fib_node* first, struct sr_fib_node* last)
+{
+    pthread_mutex_lock(&sr_fib_slab_lock);
+    last->child[0] = sr_fib_spare;
+    sr_fib_spare = first;
+    pthread_mutex_unlock(&sr_fib_slab_lock);
+}
+
+static void sr_fib_node_free(void* n)
+{
+    sr_fib_node_put((struct sr_fib_node*)n, (struct sr_fib_node*)n);
+}
+
+struct sr_fib* sr_fib_create(void)
+{
+    struct sr_fib* fib;
+
+    fib = (struct sr_fib*)calloc(1, sizeof(struct sr_fib));
+    assert(fib);
+    pthread_mutex_init(&fib->lock, 0);
+    fib->root = sr_fib_node_new(fib);
+    fib->l1 = (struct sr_fib_l1*)sr_huge_alloc("fib_l1", SR_FIB_L1_SIZE *
+                                               sizeof(struct sr_fib_l1));
+    assert(fib->l1);
+    return fib;
+} /* -- sr_fib_create -- */
+
+/* Chain up the subtrie at n for sr_fib_node_put(..), children first */
+static void sr_fib_free_nodes(struct sr_fib_node* n, struct sr_fib_node** first,
+                              struct sr_fib_node** last)
+{
+    if(n == 0)
+    { return; }
+    sr_fib_free_nodes(n->child[0], first, last);
+    sr_fib_free_nodes(n->child[1], first, last);
+    if(*first == 0)
+    { *last = n; }
+    n->child[0] = *first;
+    *first = n;
+}
+
+/* Free a fib no reader can see any more, routes and all */
+void sr_fib_destroy(void* arg)
+{
+    struct sr_fib* fib = (struct sr_fib*)arg;
+    struct sr_fib_node* first = 0;
+    struct sr_fib_node* last = 0;
+    struct sr_rt* rt;
+
+    if(fib->image)
+    { munmap(fib->image, fib->image_len); }
+    else
+    {
+        sr_fib_free_nodes(fib->root, &first, &last);
+        sr_fib_node_put(first, last);
+        while((rt = fib->routes))
+        {
+            fib->routes = rt->next;
+            free(rt->group);
+            free(rt);
+        }
+    }
+    sr_huge_free(fib->l1);
+    pthread_mutex_destroy(&fib->lock);
+    free(fib);
+} /* -- sr_fib_destroy -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_find(..)
+ * Scope:  Global
+ *
+ * The node of prefix/len, with the fib's lock held.  With create set,
+ * missing nodes on the way are added; each is linked only once it's
+ * complete, so readers never see a half made node.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_fib_node* sr_fib_find(struct sr_fib* fib, uint32_t prefix,
+                                unsigned int len, int create)
+{
+    struct sr_fib_node* n = fib->root;
+    struct sr_fib_node* next;
+    unsigned int i, bit;
+
+    for(i = 0; i < len; i++)
+    {
+        bit = (prefix >> (31 - i)) & 1;
+        if((next = n->child[bit]) == 0)
+        {
+            if(!create)
+            { return 0; }
+            next = sr_fib_node_new(fib);
+            __atomic_store_n(&n->child[bit], next, __ATOMIC_RELEASE);
+            if(i + 1 == SR_FIB_L1_BITS)
+            {
+                __atomic_store_n(&fib->l1[prefix >> (32 - SR_FIB_L1_BITS)].node,
+                                 next, __ATOMIC_RELEASE);
+            }
+        }
+        n = next;
+    }
+    return n;
+} /* -- sr_fib_find -- */
+
+void sr_fib_cursor_init(struct sr_fib* fib, struct sr_fib_cursor* c)
+{
+    c->path[0] = fib->root;
+    c->prefix = 0;
+    c->len = 0;
+} /* -- sr_fib_cursor_init -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_find_next(..)
+ * Scope:  Global
+ *
+ * sr_fib_find(..) with create set, for a fib being built from prefixes
+ * in ascending order with nothing deleted in between.  The walk starts
+ * where the path of the last prefix parts from this one, so a sorted
+ * table is built in one pass touching each node about once.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_fib_node* sr_fib_find_next(struct sr_fib* fib, struct sr_fib_cursor* c,
+                                     uint32_t prefix, unsigned int len)
+{
+    struct sr_fib_node* n;
+    struct sr_fib_node* next;
+    uint32_t diff = prefix ^ c->prefix;
+    unsigned int i, bit, same;
+
+    same = diff ? (unsigned int)__builtin_clz(diff) : 32;
+    if(same > c->len)
+    { same = c->len; }
+    if(same > len)
+    { same = len; }
+
+    n = c->path[same];
+    for(i = same; i < len; i++)
+    {
+        bit = (prefix >> (31 - i)) & 1;
+        if((next = n->child[bit]) == 0)
+        {
+            next = sr_fib_node_new(fib);
+            __atomic_store_n(&n->child[bit], next, __ATOMIC_RELEASE);
+            if(i + 1 == SR_FIB_L1_BITS)
+            {
+                __atomic_store_n(&fib->l1[prefix >> (32 - SR_FIB_L1_BITS)].node,
+                                 next, __ATOMIC_RELEASE);
+            }
+        }
+        c->path[i + 1] = n = next;
+    }
+    c->prefix = prefix;
+    c->len = len;
+    return n;
+} /* -- sr_fib_find_next -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_set_rt(..)
+ * Scope:  Global
+ *
+ * Make rt (or nothing) the route of node, the node of prefix/len, with
+ * the fib's lock held.  For a prefix no longer than the first level, the
+ * entries it covers that had the old route as their longest match, or a
+ * shorter one than this, take rt; on removal they fall back to the next
+ * shorter prefix on the path.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_fib_set_rt(struct sr_fib* fib, struct sr_fib_node* node,
+                   uint32_t prefix, unsigned int len, struct sr_rt* rt)
+{
+    struct sr_rt* old = node->rt;
+    struct sr_rt* to = rt;
+    struct sr_rt* cur;
+    struct sr_fib_node* n;
+    uint32_t i, first, count;
+
+    __atomic_store_n(&node->rt, rt, __ATOMIC_RELEASE);
+    if(len > SR_FIB_L1_BITS || old == rt)
+    { return; }
+
+    if(to == 0)
+    {
+        /* -- the longest match of prefix/len - 1 and shorter -- */
+        for(n = fib->root, i = 0; i < len; i++)
+        {
+            if(n->rt)
+            { to = n->rt; }
+            n = n->child[(prefix >> (31 - i)) & 1];
+        }
+    }
+
+    count = 1u << (SR_FIB_L1_BITS - len);
+    first = (prefix >> (32 - SR_FIB_L1_BITS)) & ~(count - 1);
+    for(i = first; i < first + count; i++)
+    {
+        cur = fib->l1[i].rt;
+        if(old ? cur == old :
+           (cur == 0 ||
+            (unsigned int)__builtin_popcount(cur->mask.s_addr) < len))
+        { __atomic_store_n(&fib->l1[i].rt, to, __ATOMIC_RELEASE); }
+    }
+} /* -- sr_fib_set_rt -- */
+
+/* Fill in the first level for the subtrie at n, of prefix/depth */
+static void sr_fib_l1_fill(struct sr_fib* fib, const struct sr_fib_node* n,
+                           uint32_t prefix, unsigned int depth,
+                           struct sr_rt* best)
+{
+    uint32_t i, first;
+    int bit;
+
+    if(n && n->rt)
+    { best = n->rt; }
+    if(n == 0 || depth == SR_FIB_L1_BITS)
+    {
+        first = prefix >> (32 - SR_FIB_L1_BITS);
+        for(i = 0; i < (1u << (SR_FIB_L1_BITS - depth)); i++)
+        {
+            fib->l1[first + i].node = (struct sr_fib_node*)n;
+            fib->l1[first + i].rt = best;
+        }
+        return;
+    }
+    for(bit = 0; bit < 2; bit++)
+    {
+        sr_fib_l1_fill(fib, n->child[bit],
+                       prefix | ((uint32_t)bit << (31 - depth)), depth + 1, best);
+    }
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_prune(..)
+ * Scope:  Global
+ *
+ * After prefix/len lost its route, unlink the nodes at the end of its
+ * path that no longer lead to any route, with the fib's lock held.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_fib_prune(struct sr_fib* fib, uint32_t prefix, unsigned int len)
+{
+    struct sr_fib_node* path[33];
+    struct sr_fib_node* n;
+    unsigned int i;
+
+    path[0] = fib->root;
+    for(i = 0; i < len && path[i]; i++)
+    { path[i + 1] = path[i]->child[(prefix >> (31 - i)) & 1]; }
+    if(i < len || path[len] == 0)
+    { return; }
+
+    for(i = len; i > 0; i--)
+    {
+        n = path[i];
+        if(n->rt || n->child[0] || n->child[1])
+        { break; }
+        __atomic_store_n(&path[i - 1]->child[(prefix >> (32 - i)) & 1], 0,
+                         __ATOMIC_RELEASE);
+        if(i == SR_FIB_L1_BITS)
+        {
+            __atomic_store_n(&fib->l1[prefix >> (32 - SR_FIB_L1_BITS)].node, 0,
+                             __ATOMIC_RELEASE);
+        }
+        sr_epoch_retire(n, sr_fib_node_free);
+        fib->nnodes--;
+    }
+} /* -- sr_fib_prune -- */
+
+/* The plain walk from the root, what the first level must agree with */
+static struct sr_rt* sr_fib_lookup_trie(struct sr_fib* fib, uint32_t ip_nbo)
+{
+    uint32_t ip = ntohl(ip_nbo);
+    struct sr_fib_node* n = fib->root;
+    struct sr_rt* best;
+    struct sr_rt* rt;
+    int i;
+
+    best = __atomic_load_n(&n->rt, __ATOMIC_ACQUIRE);
+    for(i = 31; i >= 0; i--)
+    {
+        if((n = __atomic_load_n(&n->child[(ip >> i) & 1], __ATOMIC_ACQUIRE)) == 0)
+        { break; }
+        if((rt = __atomic_load_n(&n->rt, __ATOMIC_ACQUIRE)))
+        { best = rt; }
+    }
+    return best;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_lookup(..)
+ * Scope:  Global
+ *
+ * Longest prefix match, from inside an epoch.  Returns the first entry
+ * of the matching prefix or 0.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_rt* sr_fib_lookup(struct sr_fib* fib, uint32_t ip_nbo)
+{
+    uint32_t ip = ntohl(ip_nbo);
+    struct sr_fib_l1* e = &fib->l1[ip >> (32 - SR_FIB_L1_BITS)];
+    struct sr_fib_node* n;
+    struct sr_rt* best;
+    struct sr_rt* rt;
+    int i;
+
+    n = __atomic_load_n(&e->node, __ATOMIC_ACQUIRE);
+    best = __atomic_load_n(&e->rt, __ATOMIC_ACQUIRE);
+    for(i = 31 - SR_FIB_L1_BITS; n && i >= 0; i--)
+    {
+        if((n = __atomic_load_n(&n->child[(ip >> i) & 1], __ATOMIC_ACQUIRE)) == 0)
+        { break; }
+        if((rt = __atomic_load_n(&n->rt, __ATOMIC_ACQUIRE)))
+        { best = rt; }
+    }
+    return best;
+} /* -- sr_fib_lookup -- */
+
+/* First level for n addresses, one at a time */
+static void sr_fib_l1_scalar(const struct sr_fib_l1* l1, const uint32_t* ip_nbo,
+                             uint32_t* ip, struct sr_fib_node** node,
+                             struct sr_rt** best, unsigned int n)
+{
+    const struct sr_fib_l1* e;
+    unsigned int k;
+
+    for(k = 0; k < n; k++)
+    {
+        ip[k] = ntohl(ip_nbo[k]);
+        e = &l1[ip[k] >> (32 - SR_FIB_L1_BITS)];
+        node[k] = __atomic_load_n(&e->node, __ATOMIC_ACQUIRE);
+        best[k] = __atomic_load_n(&e->rt, __ATOMIC_ACQUIRE);
+    }
+}
+
+#if defined(__x86_64__) && defined(__LP64__)
+#define SR_FIB_HAVE_AVX2 1
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_l1_avx2(..)
+ * Scope:  Local
+ *
+ * First level for eight addresses per step: swap them to host order,
+ * take the top bits as an index and gather both words of the entries.
+ * Each gathered word is one aligned load, and x86 doesn't reorder loads,
+ * so this reads what the acquire loads of the scalar version would.
+ *
+ *---------------------------------------------------------------------*/
+
+__attribute__((target("avx2")))
+static void sr_fib_l1_avx2(const struct sr_fib_l1* l1, const uint32_t* ip_nbo,
+                           uint32_t* ip, struct sr_fib_node** node,
+                           struct sr_rt** best, unsigned int n)
+{
+    const long long* words = (const long long*)l1;
+    __m256i swap, h, idx;
+    __m128i lo, hi;
+    unsigned int k;
+
+    swap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                            3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    for(k = 0; k + 8 <= n; k += 8)
+    {
+        h = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(ip_nbo + k)),
+                                swap);
+        _mm256_storeu_si256((__m256i*)(ip + k), h);
+
+        /* -- entries are two words, so index in words is twice the entry -- */
+        idx = _mm256_slli_epi32(_mm256_srli_epi32(h, 32 - SR_FIB_L1_BITS), 1);
+        lo = _mm256_castsi256_si128(idx);
+        hi = _mm256_extracti128_si256(idx, 1);
+        _mm256_storeu_si256((__m256i*)(node + k),
+                            _mm256_i32gather_epi64(words, lo, 8));
+        _mm256_storeu_si256((__m256i*)(node + k + 4),
+                            _mm256_i32gather_epi64(words, hi, 8));
+        _mm256_storeu_si256((__m256i*)(best + k),
+                            _mm256_i32gather_epi64(words + 1, lo, 8));
+        _mm256_storeu_si256((__m256i*)(best + k + 4),
+                            _mm256_i32gather_epi64(words + 1, hi, 8));
+    }
+    sr_fib_l1_scalar(l1, ip_nbo + k, ip + k, node + k, best + k, n - k);
+} /* -- sr_fib_l1_avx2 -- */
+#endif
+
+/* Whether to gather the first level with AVX2, asked once */
+static int sr_fib_simd(void)
+{
+#ifdef SR_FIB_HAVE_AVX2
+    static int have = -1;
+
+    if(have < 0)
+    {
+        __builtin_cpu_init();
+        have = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    return have;
+#else
+    return 0;
+#endif
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_batch(..)
+ * Scope:  Local
+ *
+ * Up to SR_FIB_BATCH lookups.  After the first level the walks go down
+ * together, one level across all of them per step, so the loads of the
+ * different walks are independent and their misses overlap.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_fib_batch(struct sr_fib* fib, const uint32_t* ip_nbo,
+                         struct sr_rt** best, unsigned int n, int simd)
+{
+    struct sr_fib_node* node[SR_FIB_BATCH];
+    uint32_t ip[SR_FIB_BATCH];
+    struct sr_rt* rt;
+    unsigned int k, live;
+    int i;
+
+#ifdef SR_FIB_HAVE_AVX2
+    if(simd)
+    { sr_fib_l1_avx2(fib->l1, ip_nbo, ip, node, best, n); }
+    else
+#endif
+    { sr_fib_l1_scalar(fib->l1, ip_nbo, ip, node, best, n); }
+
+    for(i = 31 - SR_FIB_L1_BITS, live = n; live && i >= 0; i--)
+    {
+        for(k = 0, live = 0; k < n; k++)
+        {
+            if(node[k] == 0)
+            { continue; }
+            node[k] = __atomic_load_n(&node[k]->child[(ip[k] >> i) & 1],
+                                      __ATOMIC_ACQUIRE);
+            if(node[k])
+            {
+                live++;
+                if((rt = __atomic_load_n(&node[k]->rt, __ATOMIC_ACQUIRE)))
+                { best[k] = rt; }
+            }
+        }
+    }
+} /* -- sr_fib_batch -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_lookup_batch(..)
+ * Scope:  Global
+ *
+ * sr_fib_lookup(..) for each of n addresses (network byte order), from
+ * inside an epoch: rt[i] is the match of ip_nbo[i] or 0.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_fib_lookup_batch(struct sr_fib* fib, const uint32_t* ip_nbo,
+                         struct sr_rt** rt, unsigned int n)
+{
+    int simd = sr_fib_simd();
+    unsigned int k;
+
+    for(k = 0; k < n; k += SR_FIB_BATCH)
+    {
+        sr_fib_batch(fib, ip_nbo + k, rt + k,
+                     n - k < SR_FIB_BATCH ? n - k : SR_FIB_BATCH, simd);
+    }
+} /* -- sr_fib_lookup_batch -- */
+
+/* Compare every way of looking up a batch of addresses with the walk */
+static unsigned int sr_fib_check_batch(struct sr_fib* fib, const uint32_t* ip_nbo,
+                                       unsigned int n, unsigned int bad)
+{
+    struct sr_rt* scalar[SR_FIB_BATCH];
+    struct sr_rt* simd[SR_FIB_BATCH];
+    struct sr_rt* want;
+    uint32_t ip;
+    unsigned int k;
+
+    sr_fib_batch(fib, ip_nbo, scalar, n, 0);
+    sr_fib_batch(fib, ip_nbo, simd, n, sr_fib_simd());
+    for(k = 0; k < n; k++)
+    {
+        want = sr_fib_lookup_trie(fib, ip_nbo[k]);
+        if(scalar[k] == want && simd[k] == want &&
+           sr_fib_lookup(fib, ip_nbo[k]) == want)
+        { continue; }
+        if(bad++ < 10)
+        {
+            ip = ntohl(ip_nbo[k]);
+            fprintf(stderr, "Route lookups disagree on %u.%u.%u.%u\n",
+                    ip >> 24, (ip >> 16) & 0xff, (ip >> 8) & 0xff, ip & 0xff);
+        }
+    }
+    return bad;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_check(..)
+ * Scope:  Global
+ *
+ * Check the first level and the batched lookups, scalar and AVX2, against
+ * a plain walk of the trie: for samples random addresses, and the first
+ * and last address of up to samples of the routes.  fib must not be
+ * changing.  Returns the number of addresses they disagree on.  Used by
+ * the tests (make check), not when loading.
+ *
+ *---------------------------------------------------------------------*/
+
+unsigned int sr_fib_check(struct sr_fib* fib, unsigned int samples)
+{
+    uint32_t ip[SR_FIB_BATCH];
+    uint32_t x = 2463534242u;
+    uint32_t prefix, host;
+    unsigned int i, n = 0, bad = 0, stride;
+    struct sr_rt* rt;
+
+    for(i = 0; i < samples; i++)
+    {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        ip[n++] = x;
+        if(n == SR_FIB_BATCH)
+        {
+            bad = sr_fib_check_batch(fib, ip, n, bad);
+            n = 0;
+        }
+    }
+
+    stride = fib->nroutes / (samples ? samples : 1) + 1;
+    for(i = 0, rt = fib->routes; rt; rt = rt->next, i++)
+    {
+        if(i % stride)
+        { continue; }
+        prefix = rt->dest.s_addr & rt->mask.s_addr;
+        host = ~rt->mask.s_addr;
+        ip[n++] = prefix;
+        ip[n++] = prefix | host;
+        if(n + 2 > SR_FIB_BATCH)
+        {
+            bad = sr_fib_check_batch(fib, ip, n, bad);
+            n = 0;
+        }
+    }
+    if(n)
+    { bad = sr_fib_check_batch(fib, ip, n, bad); }
+    return bad;
+} /* -- sr_fib_check -- */
+
+/* Make fib the routing table and free the old one after a grace period */
+void sr_fib_swap(struct sr_instance* sr, struct sr_fib* fib)
+{
+    struct sr_fib* old;
+
+    old = __atomic_exchange_n(&sr->fib, fib, __ATOMIC_ACQ_REL);
+    sr_rtc_invalidate();
+    if(old)
+    { sr_epoch_retire(old, sr_fib_destroy); }
+    sr_epoch_reclaim();
+} /* -- sr_fib_swap -- */
+
+/* -- where each entry of the fib being saved goes in the image -- */
+struct sr_fib_slot {
+    const struct sr_rt* rt;
+    uintptr_t at;
+};
+
+struct sr_fib_saving {
+    struct sr_fib_slot* slots;  /* by rt */
+    unsigned int nroutes;
+    struct sr_fib_node* nodes;
+    uintptr_t nodes_at;
+    unsigned int nnodes;
+};
+
+static int sr_fib_slot_cmp(const void* a, const void* b)
+{
+    uintptr_t x = (uintptr_t)((const struct sr_fib_slot*)a)->rt;
+    uintptr_t y = (uintptr_t)((const struct sr_fib_slot*)b)->rt;
+
+    return x < y ? -1 : x > y;
+}
+
+static uintptr_t sr_fib_rt_at(struct sr_fib_saving* s, const struct sr_rt* rt)
+{
+    struct sr_fib_slot key;
+    struct sr_fib_slot* slot;
+
+    key.rt = rt;
+    slot = (struct sr_fib_slot*)bsearch(&key, s->slots, s->nroutes,
+                                        sizeof(key), sr_fib_slot_cmp);
+    assert(slot);
+    return slot->at;
+}
+
+/* Copy the subtrie at n, parents before children; returns n's address */
+static uintptr_t sr_fib_put_node(struct sr_fib_saving* s,
+                                 const struct sr_fib_node* n)
+{
+    struct sr_fib_node* o = &s->nodes[s->nnodes];
+    uintptr_t at = s->nodes_at + s->nnodes * sizeof(struct sr_fib_node);
+    int i;
+
+    s->nnodes++;
+    o->rt = n->rt ? (struct sr_rt*)sr_fib_rt_at(s, n->rt) : 0;
+    for(i = 0; i < 2; i++)
+    {
+        if(n->child[i])
+        { o->child[i] = (struct sr_fib_node*)sr_fib_put_node(s, n->child[i]); }
+    }
+    return at;
+}
+
+#define SR_FIB_ALIGN(x)  (((x) + 63) & ~(size_t)63)
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_save(..)
+ * Scope:  Global
+ *
+ * Write fib as an image for sr_fib_map(..), compiled from the text table
+ * src describes, if any.  The file is replaced in one rename, so a
+ * running router never maps half of one.  fib must not be changing.
+ * Returns 0 or -1.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_fib_save(struct sr_fib* fib, const char* path, const struct stat* src)
+{
+    struct sr_fib_saving s;
+    struct sr_fib_image* img;
+    struct sr_rt* rt;
+    struct sr_rt* routes;
+    struct sr_rt_group* groups;
+    size_t nodes_off, routes_off, groups_off, size;
+    uintptr_t base = SR_FIB_IMAGE_BASE;
+    unsigned int i, m, ngroups = 0;
+    char tmp[1024];
+    uint8_t* buf;
+    FILE* fp;
+    int ret = 0;
+
+    for(rt = fib->routes; rt; rt = rt->next)
+    {
+        if(rt->group)
+        { ngroups++; }
+    }
+    nodes_off = SR_FIB_ALIGN(sizeof(struct sr_fib_image));
+    routes_off = SR_FIB_ALIGN(nodes_off + fib->nnodes * sizeof(struct sr_fib_node));
+    groups_off = SR_FIB_ALIGN(routes_off + fib->nroutes * sizeof(struct sr_rt));
+    size = groups_off + ngroups * sizeof(struct sr_rt_group);
+
+    if((buf = (uint8_t*)calloc(1, size)) == 0 ||
+       (s.slots = (struct sr_fib_slot*)malloc((fib->nroutes + 1) *
+                                              sizeof(struct sr_fib_slot))) == 0)
+    {
+        free(buf);
+        return -1;
+    }
+    img = (struct sr_fib_image*)buf;
+    routes = (struct sr_rt*)(buf + routes_off);
+    groups = (struct sr_rt_group*)(buf + groups_off);
+
+    for(i = 0, rt = fib->routes; rt; rt = rt->next, i++)
+    {
+        s.slots[i].rt = rt;
+        s.slots[i].at = base + routes_off + i * sizeof(struct sr_rt);
+    }
+    s.nroutes = i;
+    qsort(s.slots, s.nroutes, sizeof(struct sr_fib_slot), sr_fib_slot_cmp);
+    s.nodes = (struct sr_fib_node*)(buf + nodes_off);
+    s.nodes_at = base + nodes_off;
+    s.nnodes = 0;
+
+    /* -- entries in list order, each group after its head's -- */
+    for(i = 0, ngroups = 0, rt = fib->routes; rt; rt = rt->next, i++)
+    {
+        routes[i] = *rt;
+        routes[i].prev = i ? (struct sr_rt*)(base + routes_off +
+                                             (i - 1) * sizeof(struct sr_rt)) : 0;
+        routes[i].next = rt->next ? (struct sr_rt*)(base + routes_off +
+                                             (i + 1) * sizeof(struct sr_rt)) : 0;
+        if(rt->group)
+        {
+            groups[ngroups] = *rt->group;
+            for(m = 0; m < rt->group->n; m++)
+            {
+                groups[ngroups].members[m] =
+                    (struct sr_rt*)sr_fib_rt_at(&s, rt->group->members[m]);
+            }
+            routes[i].group = (struct sr_rt_group*)(base + groups_off +
+                                     ngroups * sizeof(struct sr_rt_group));
+            ngroups++;
+        }
+    }
+
+    memcpy(img->magic, SR_FIB_IMAGE_MAGIC, sizeof(img->magic));
+    img->version = SR_FIB_IMAGE_VERSION;
+    img->ptr_size = sizeof(void*);
+    img->node_size = sizeof(struct sr_fib_node);
+    img->rt_size = sizeof(struct sr_rt);
+    img->group_size = sizeof(struct sr_rt_group);
+    img->nroutes = fib->nroutes;
+    img->nprefixes = fib->nprefixes;
+    img->ngroups = ngroups;
+    img->base = base;
+    img->size = size;
+    img->root = sr_fib_put_node(&s, fib->root);
+    img->nnodes = s.nnodes;
+    img->routes = fib->routes ? base + routes_off : 0;
+    img->tail = fib->routes ? base + routes_off +
+                              (fib->nroutes - 1) * sizeof(struct sr_rt) : 0;
+    if(src)
+    {
+        img->src_size = src->st_size;
+        img->src_mtime_sec = src->st_mtim.tv_sec;
+        img->src_mtime_nsec = src->st_mtim.tv_nsec;
+    }
+    free(s.slots);
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if((fp = fopen(tmp, "w")) == 0 ||
+       fwrite(buf, 1, size, fp) != size)
+    { ret = -1; }
+    if(fp && fclose(fp) != 0)
+    { ret = -1; }
+    if(ret == 0 && rename(tmp, path) != 0)
+    { ret = -1; }
+    if(ret != 0)
+    {
+        perror(path);
+        unlink(tmp);
+    }
+    free(buf);
+    return ret;
+} /* -- sr_fib_save -- */
+
+/* Index of the n-th of count objects of size bytes at start that p
+   points to, or -1 if it points anywhere else */
+static int64_t sr_fib_image_index(uintptr_t p, uintptr_t start,
+                                  uint64_t count, size_t size)
+{
+    if(p < start || (p - start) % size || (p - start) / size >= count)
+    { return -1; }
+    return (int64_t)((p - start) / size);
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_image_check(..)
+ * Scope:  Local
+ *
+ * Check that the counts in a mapped image add up to its size and that
+ * every pointer in it lands on an object of the right kind inside it:
+ * children after their parents, so the trie has no cycles, the route
+ * list in order and group members and buckets in range.  Returns 0 if
+ * the image can be used as is.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_fib_image_check(const struct sr_fib_image* img, uint64_t size)
+{
+    const struct sr_fib_node* nodes;
+    const struct sr_rt* routes;
+    const struct sr_rt_group* groups;
+    uintptr_t nodes_at, routes_at, groups_at;
+    uint64_t nodes_off, routes_off, groups_off, i;
+    unsigned int c, m;
+    int64_t k;
+
+    nodes_off = SR_FIB_ALIGN(sizeof(struct sr_fib_image));
+    routes_off = SR_FIB_ALIGN(nodes_off + (uint64_t)img->nnodes *
+                              sizeof(struct sr_fib_node));
+    groups_off = SR_FIB_ALIGN(routes_off + (uint64_t)img->nroutes *
+                              sizeof(struct sr_rt));
+    if(img->size != size ||
+       groups_off + (uint64_t)img->ngroups * sizeof(struct sr_rt_group) != size)
+    { return -1; }
+
+    nodes_at = img->base + nodes_off;
+    routes_at = img->base + routes_off;
+    groups_at = img->base + groups_off;
+    if(img->nnodes == 0 || img->root != nodes_at ||
+       img->routes != (img->nroutes ? routes_at : 0) ||
+       img->tail != (img->nroutes ? routes_at + (img->nroutes - 1) *
+                                    sizeof(struct sr_rt) : 0))
+    { return -1; }
+
+    nodes = (const struct sr_fib_node*)nodes_at;
+    for(i = 0; i < img->nnodes; i++)
+    {
+        for(c = 0; c < 2; c++)
+        {
+            if(nodes[i].child[c] &&
+               (k = sr_fib_image_index((uintptr_t)nodes[i].child[c], nodes_at,
+                                       img->nnodes, sizeof(struct sr_fib_node)))
+               <= (int64_t)i)
+            { return -1; }
+        }
+        if(nodes[i].rt &&
+           sr_fib_image_index((uintptr_t)nodes[i].rt, routes_at, img->nroutes,
+                              sizeof(struct sr_rt)) < 0)
+        { return -1; }
+    }
+
+    routes = (const struct sr_rt*)routes_at;
+    for(i = 0; i < img->nroutes; i++)
+    {
+        if((uintptr_t)routes[i].next != (i + 1 < img->nroutes ?
+                                         (uintptr_t)&routes[i + 1] : 0) ||
+           (uintptr_t)routes[i].prev != (i ? (uintptr_t)&routes[i - 1] : 0))
+        { return -1; }
+        if(routes[i].group &&
+           sr_fib_image_index((uintptr_t)routes[i].group, groups_at,
+                              img->ngroups, sizeof(struct sr_rt_group)) < 0)
+        { return -1; }
+    }
+
+    groups = (const struct sr_rt_group*)groups_at;
+    for(i = 0; i < img->ngroups; i++)
+    {
+        if(groups[i].n == 0 || groups[i].n > SR_RT_GROUP_MAX)
+        { return -1; }
+        for(m = 0; m < groups[i].n; m++)
+        {
+            if(sr_fib_image_index((uintptr_t)groups[i].members[m], routes_at,
+                                  img->nroutes, sizeof(struct sr_rt)) < 0)
+            { return -1; }
+        }
+        for(m = 0; m < SR_RT_GROUP_BUCKETS; m++)
+        {
+            if(groups[i].buckets[m] >= groups[i].n)
+            { return -1; }
+        }
+    }
+    return 0;
+} /* -- sr_fib_image_check -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_map(..)
+ * Scope:  Global
+ *
+ * Map an image written by sr_fib_save(..) and check it.  If src is given
+ * the image must have been compiled from a text table of that size and
+ * mtime.  Returns 0 if there is no usable image at path.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_fib* sr_fib_map(const char* path, const struct stat* src)
+{
+    const struct sr_fib_image* img;
+    struct sr_fib* fib;
+    struct stat st;
+    void* base;
+    int fd;
+
+    if((fd = open(path, O_RDONLY)) < 0)
+    { return 0; }
+    if(fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(struct sr_fib_image))
+    {
+        close(fd);
+        return 0;
+    }
+    base = mmap((void*)SR_FIB_IMAGE_BASE, st.st_size, PROT_READ, MAP_PRIVATE,
+                fd, 0);
+    close(fd);
+    if(base == MAP_FAILED)
+    { return 0; }
+
+    img = (const struct sr_fib_image*)base;
+    if(base != (void*)SR_FIB_IMAGE_BASE)
+    {
+        fprintf(stderr, "Not using routing table image %s, its address is taken\n",
+                path);
+        munmap(base, st.st_size);
+        return 0;
+    }
+    if(memcmp(img->magic, SR_FIB_IMAGE_MAGIC, sizeof(img->magic)) != 0 ||
+       img->version != SR_FIB_IMAGE_VERSION ||
+       img->ptr_size != sizeof(void*) ||
+       img->node_size != sizeof(struct sr_fib_node) ||
+       img->rt_size != sizeof(struct sr_rt) ||
+       img->group_size != sizeof(struct sr_rt_group) ||
+       img->base != SR_FIB_IMAGE_BASE)
+    {
+        fprintf(stderr, "Not using routing table image %s, it was written by "
+                "another version\n", path);
+        munmap(base, st.st_size);
+        return 0;
+    }
+    if(src && (img->src_size != (uint64_t)src->st_size ||
+               img->src_mtime_sec != (int64_t)src->st_mtim.tv_sec ||
+               img->src_mtime_nsec != (int64_t)src->st_mtim.tv_nsec))
+    {
+        fprintf(stderr, "Not using routing table image %s, the table has "
+                "changed since it was compiled\n", path);
+        munmap(base, st.st_size);
+        return 0;
+    }
+    if(sr_fib_image_check(img, st.st_size) != 0)
+    {
+        fprintf(stderr, "Not using routing table image %s, it is damaged\n",
+                path);
+        munmap(base, st.st_size);
+        return 0;
+    }
+
+    fib = (struct sr_fib*)calloc(1, sizeof(struct sr_fib));
+    assert(fib);
+    pthread_mutex_init(&fib->lock, 0);
+    fib->root = (struct sr_fib_node*)(uintptr_t)img->root;
+    fib->routes = (struct sr_rt*)(uintptr_t)img->routes;
+    fib->tail = (struct sr_rt*)(uintptr_t)img->tail;
+    fib->nroutes = img->nroutes;
+    fib->nprefixes = img->nprefixes;
+    fib->nnodes = img->nnodes;
+    fib->image = base;
+    fib->image_len = st.st_size;
+    fib->l1 = (struct sr_fib_l1*)sr_huge_alloc("fib_l1", SR_FIB_L1_SIZE *
+                                               sizeof(struct sr_fib_l1));
+    assert(fib->l1);
+    sr_fib_l1_fill(fib, fib->root, 0, 0, 0);
+    return fib;
+} /* -- sr_fib_map -- */
@@ -0,0 +1,144 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_fib.h
+ *
+ * Description:
+ *
+ * The lookup structure behind sr_rt_lookup(..): a binary trie with one
+ * level per prefix bit.  A node holds the route of its prefix (the first
+ * entry, which carries the equal-cost group) if there is one.
+ *
+ * Readers walk the trie without locks from inside an epoch (sr_epoch.h)
+ * and must stay inside it while they use the route they got.  Writers
+ * serialize on the fib's lock: new nodes are filled in before they're
+ * linked, routes are published with one pointer store, and whatever is
+ * unlinked is freed through the epoch.  Adding or deleting a prefix only
+ * touches the nodes on its path, so it costs time in proportion to the
+ * prefix length whatever the size of the table.  Nodes are carved from
+ * 2 MB slabs shared by every fib, hugepage-backed with sr -G (sr_huge.h),
+ * and freed nodes are kept for the next ones rather than given back.
+ *
+ * A flat first-level table in front of the trie holds, for each value of
+ * the top SR_FIB_L1_BITS address bits, the longest match no longer than
+ * that and the trie node at that depth, so lookups start 16 levels down.
+ * Writers keep it in step with the trie: publishing a route of length
+ * len rewrites up to 2^(16 - len) entries.  sr_fib_lookup_batch(..)
+ * resolves a burst of addresses at once: the first level with AVX2
+ * gathers where the CPU has them, then the rest of the walk a level at a
+ * time across the burst, so the lookups' cache misses overlap instead of
+ * queueing behind each other.
+ *
+ * A whole fib can be replaced with sr_fib_swap(..), which retires the old
+ * one the same way.
+ *
+ * sr_fib_save(..) writes a fib out as an image that sr_fib_map(..) maps
+ * read-only and uses as is, with no parsing or allocation per route.  The
+ * pointers in the image are laid out for SR_FIB_IMAGE_BASE, so it only
+ * works where it can be mapped at that address, and only for a build with
+ * the same structure layout; otherwise sr_fib_map(..) fails and the
+ * caller reads the text table instead.  The image records the size and
+ * mtime (to the nanosecond) of the text table it came from, and is stale
+ * once they change.  Every pointer in it is checked against the layout
+ * before the fib is used, so a truncated or damaged image is refused
+ * rather than followed.  A mapped fib can't be changed in
+ * place, a writer copies it into an ordinary one first.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_FIB_H
+#define SR_FIB_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+#include <pthread.h>
+#include <stddef.h>
+
+#define SR_FIB_L1_BITS        16
+#define SR_FIB_L1_SIZE        (1 << SR_FIB_L1_BITS)
+#define SR_FIB_BATCH          16       /* addresses walked together */
+
+#define SR_FIB_IMAGE_MAGIC    "SRFIB\r\n"
+#define SR_FIB_IMAGE_VERSION  2
+#define SR_FIB_IMAGE_BASE     ((uintptr_t)1 << (sizeof(void*) == 8 ? 45 : 30))
+
+struct sr_instance;
+struct sr_rt;
+struct stat;
+
+/* -- image header, at SR_FIB_IMAGE_BASE; addresses are already mapped -- */
+struct sr_fib_image {
+    char     magic[8];
+    uint32_t version;
+    uint32_t ptr_size;          /* layout of the build that wrote it */
+    uint32_t node_size;
+    uint32_t rt_size;
+    uint32_t group_size;
+    uint32_t nroutes;
+    uint32_t nprefixes;
+    uint32_t nnodes;
+    uint32_t ngroups;
+    uint32_t pad;
+    uint64_t base;
+    uint64_t size;              /* of the file */
+    uint64_t root;
+    uint64_t routes;
+    uint64_t tail;
+    uint64_t src_size;          /* the text table it was compiled from */
+    int64_t  src_mtime_sec;
+    int64_t  src_mtime_nsec;
+};
+
+struct sr_fib_node {
+    struct sr_fib_node* child[2];
+    struct sr_rt* rt;
+};
+
+struct sr_fib_l1 {
+    struct sr_fib_node* node;   /* at depth SR_FIB_L1_BITS, or 0 */
+    struct sr_rt* rt;           /* longest match of at most that length */
+};
+
+struct sr_fib {
+    pthread_mutex_t lock;       /* writers */
+    struct sr_fib_node* root;   /* the /0 node, always there */
+    struct sr_fib_l1* l1;       /* SR_FIB_L1_SIZE entries */
+    struct sr_rt* routes;       /* every entry, in the order added */
+    struct sr_rt* tail;
+    unsigned int nroutes;
+    unsigned int nprefixes;
+    unsigned int nnodes;
+    void* image;                /* mapped image the above live in, or 0 */
+    size_t image_len;
+};
+
+/* -- for adding prefixes in sorted order, see sr_fib_find_next(..) -- */
+struct sr_fib_cursor {
+    struct sr_fib_node* path[33];
+    uint32_t prefix;
+    unsigned int len;
+};
+
+struct sr_fib* sr_fib_create(void);
+void sr_fib_destroy(void* fib);
+struct sr_fib_node* sr_fib_find(struct sr_fib* fib, uint32_t prefix,
+                                unsigned int len, int create);
+void sr_fib_cursor_init(struct sr_fib* fib, struct sr_fib_cursor* c);
+struct sr_fib_node* sr_fib_find_next(struct sr_fib* fib, struct sr_fib_cursor* c,
+                                     uint32_t prefix, unsigned int len);
+void sr_fib_set_rt(struct sr_fib* fib, struct sr_fib_node* node,
+                   uint32_t prefix, unsigned int len, struct sr_rt* rt);
+void sr_fib_prune(struct sr_fib* fib, uint32_t prefix, unsigned int len);
+struct sr_rt* sr_fib_lookup(struct sr_fib* fib, uint32_t ip_nbo);
+void sr_fib_lookup_batch(struct sr_fib* fib, const uint32_t* ip_nbo,
+                         struct sr_rt** rt, unsigned int n);
+unsigned int sr_fib_check(struct sr_fib* fib, unsigned int samples);
+void sr_fib_swap(struct sr_instance* sr, struct sr_fib* fib);
+int sr_fib_save(struct sr_fib* fib, const char* path, const struct stat* src);
+struct sr_fib* sr_fib_map(const char* path, const struct stat* src);
+
+#endif /* -- SR_FIB_H -- */
@@ -0,0 +1,648 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_flow.c
+ *
+ * Description:
+ *
+ * Flow accounting and IPFIX export, see sr_flow.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "sr_if.h"
+#include "sr_rt.h"
+#include "sr_router.h"
+#include "sr_protocol.h"
+#include "sr_stats.h"
+#include "sr_huge.h"
+#include "sr_cpu.h"
+#include "sr_pkt.h"
+#include "sr_flow.h"
+
+#define SR_TCP_FIN 0x01
+#define SR_TCP_RST 0x04
+
+#define SR_IPFIX_VERSION      10
+#define SR_IPFIX_TEMPLATE_SET 2
+#define SR_IPFIX_TEMPLATE_ID  256
+#define SR_IPFIX_DOMAIN       1
+#define SR_IPFIX_PORT         4739
+
+#define SR_FLOW_SWEEP_SETS    128      /* swept per lock hold */
+#define SR_FLOW_SWEEP_MAX     (SR_FLOW_SWEEP_SETS * SR_FLOW_WAYS)
+
+/* -- the one template: information element and length -- */
+static const uint16_t sr_flow_template[][2] = {
+    {   8, 4 },     /* sourceIPv4Address */
+    {  12, 4 },     /* destinationIPv4Address */
+    {   7, 2 },     /* sourceTransportPort */
+    {  11, 2 },     /* destinationTransportPort, ICMP type and code */
+    {   4, 1 },     /* protocolIdentifier */
+    {   6, 1 },     /* tcpControlBits */
+    {  10, 4 },     /* ingressInterface */
+    {  14, 4 },     /* egressInterface */
+    {   2, 8 },     /* packetDeltaCount */
+    {   1, 8 },     /* octetDeltaCount */
+    { 152, 8 },     /* flowStartMilliseconds */
+    { 153, 8 },     /* flowEndMilliseconds */
+    { 136, 1 },     /* flowEndReason */
+    {  34, 4 }      /* samplingInterval */
+};
+
+#define SR_FLOW_FIELDS  (sizeof(sr_flow_template) / sizeof(sr_flow_template[0]))
+#define SR_FLOW_RECORD  59              /* bytes, the lengths above */
+#define SR_FLOW_HEAD    (16 + 8 + 4 * SR_FLOW_FIELDS + 4)
+
+static const char* sr_flow_reasons[SR_FLOW_END_RESOURCES + 1] = {
+    0, "idle", "active", "end_detected", "forced", "lack_of_resources"
+};
+
+static __thread struct sr_flow_cache* sr_flow_mine = 0;
+
+static uint64_t sr_flow_now(void)
+{
+    struct timespec ts;
+
+#ifdef CLOCK_REALTIME_COARSE
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_REALTIME, &ts);
+#endif
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint32_t sr_flow_hash(const struct sr_flow_entry* k)
+{
+    uint32_t h;
+
+    h = k->src * 0x9e3779b1U;
+    h ^= h >> 16;
+    h += k->dst * 0x85ebca77U;
+    h ^= h >> 13;
+    h += ((uint32_t)k->sport << 16 | k->dport) * 0xc2b2ae3dU;
+    h ^= h >> 16;
+    h += (k->proto | (uint32_t)k->in << 8) * 0x27d4eb2fU;
+    return h ^ (h >> 15);
+}
+
+static __inline__ int sr_flow_same(const struct sr_flow_entry* e,
+                                   const struct sr_flow_entry* k)
+{
+    return e->src == k->src && e->dst == k->dst && e->sport == k->sport &&
+           e->dport == k->dport && e->proto == k->proto && e->in == k->in;
+}
+
+/* This thread's cache, made on its first datagram */
+static struct sr_flow_cache* sr_flow_cache_new(struct sr_flow* flow)
+{
+    struct sr_flow_cache* c;
+
+    if((c = (struct sr_flow_cache*)calloc(1, sizeof(struct sr_flow_cache))) == 0)
+    { return 0; }
+    c->sets = (struct sr_flow_set*)sr_huge_alloc("flow_cache",
+                  SR_FLOW_SETS * sizeof(struct sr_flow_set));
+    if(c->sets == 0)
+    {
+        free(c);
+        return 0;
+    }
+    pthread_mutex_init(&c->lock, 0);
+
+    pthread_mutex_lock(&flow->lock);
+    c->next = flow->caches;
+    flow->caches = c;
+    pthread_mutex_unlock(&flow->lock);
+
+    sr_flow_mine = c;
+    return c;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_flow_account(..)
+ * Scope:  Global
+ *
+ * Count a datagram (described by pkt, already reassembled if it was)
+ * about to be forwarded along rt.  Fragments past the first count
+ * without ports.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_flow_account(struct sr_flow* flow,
+        const uint8_t* packet /* lent */,
+        const struct sr_pkt* pkt,
+        struct sr_rt* rt)
+{
+    const sr_ip_hdr_t* ip_hdr = (const sr_ip_hdr_t*)(packet + pkt->l3);
+    const uint8_t* l4 = packet + pkt->l4;
+    struct sr_flow_cache* c = sr_flow_mine;
+    struct sr_flow_entry k;
+    struct sr_flow_entry* e = 0;
+    struct sr_flow_entry* victim;
+    struct sr_flow_set* set;
+    struct sr_if* out;
+    uint8_t tcp_flags = 0;
+    uint64_t now;
+    int w;
+
+    if(__atomic_load_n(&flow->stop, __ATOMIC_RELAXED))
+    { return; }
+    if(c == 0 && (c = sr_flow_cache_new(flow)) == 0)
+    { return; }
+    if(flow->sample > 1 && ++c->skip < flow->sample)
+    { return; }
+    c->skip = 0;
+
+    k.src = ip_hdr->ip_src;
+    k.dst = ip_hdr->ip_dst;
+    k.sport = k.dport = 0;
+    k.proto = pkt->proto;
+    k.in = (uint16_t)(pkt->ifindex + 1);   /* IPFIX: 0 is unknown */
+    if(!(pkt->flags & SR_PKT_LATER))
+    {
+        switch(pkt->proto)
+        {
+            case ip_protocol_tcp:
+                if(pkt->len >= pkt->l4 + 14u)
+                { tcp_flags = l4[13]; }
+                /* -- fall through -- */
+            case ip_protocol_udp:
+                if(pkt->len >= pkt->l4 + 4u)
+                {
+                    k.sport = (uint16_t)(l4[0] << 8 | l4[1]);
+                    k.dport = (uint16_t)(l4[2] << 8 | l4[3]);
+                }
+                break;
+            case ip_protocol_icmp:
+                if(pkt->len >= pkt->l4 + 2u)
+                { k.dport = (uint16_t)(l4[0] << 8 | l4[1]); }
+                break;
+        }
+    }
+
+    set = &c->sets[sr_flow_hash(&k) & (SR_FLOW_SETS - 1)];
+    now = sr_flow_now();
+
+    pthread_mutex_lock(&c->lock);
+    for(w = 0; w < SR_FLOW_WAYS; w++)
+    {
+        if(set->way[w].packets && sr_flow_same(&set->way[w], &k))
+        {
+            e = &set->way[w];
+            break;
+        }
+    }
+
+    if(e == 0)
+    {
+        /* -- an empty way, else the one idle longest -- */
+        victim = &set->way[0];
+        for(w = 0; w < SR_FLOW_WAYS && victim->packets; w++)
+        {
+            if(set->way[w].packets == 0 || set->way[w].last < victim->last)
+            { victim = &set->way[w]; }
+        }
+        if(victim->packets)
+        {
+            __sync_fetch_and_add(&flow->evicted, 1);
+            if(c->npending < SR_FLOW_PENDING)
+            {
+                victim->reason = SR_FLOW_END_RESOURCES;
+                c->pending[c->npending++] = *victim;
+                /* -- churning, don't wait for the next sweep -- */
+                if(c->npending == SR_FLOW_PENDING / 2)
+                { pthread_cond_signal(&flow->wake); }
+            }
+            else
+            { __sync_fetch_and_add(&flow->lost, 1); }
+        }
+        else
+        { c->active++; }
+
+        e = victim;
+        *e = k;
+        out = sr_get_interface(flow->sr, rt->interface);
+        e->out = out ? (uint16_t)(out->ifindex + 1) : 0;
+        e->tcp_flags = 0;
+        e->reason = 0;
+        e->packets = 0;
+        e->bytes = 0;
+        e->first = now;
+        __sync_fetch_and_add(&flow->created, 1);
+    }
+
+    e->packets++;
+    e->bytes += pkt->len - pkt->l3;
+    e->tcp_flags |= tcp_flags;
+    e->last = now;
+    pthread_mutex_unlock(&c->lock);
+} /* -- sr_flow_account -- */
+
+static void sr_flow_put16(uint8_t* p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void sr_flow_put32(uint8_t* p, uint32_t v)
+{
+    sr_flow_put16(p, v >> 16);
+    sr_flow_put16(p + 2, v);
+}
+
+static void sr_flow_put64(uint8_t* p, uint64_t v)
+{
+    sr_flow_put32(p, (uint32_t)(v >> 32));
+    sr_flow_put32(p + 4, (uint32_t)v);
+}
+
+/* Send the message being built, if it has any records */
+static void sr_flow_flush(struct sr_flow* flow)
+{
+    uint8_t* m = flow->msg;
+    int ok;
+
+    if(flow->msg_records == 0)
+    { return; }
+
+    sr_flow_put16(m + 2, (uint16_t)flow->msg_len);
+    sr_flow_put32(m + 4, (uint32_t)(sr_flow_now() / 1000));
+    sr_flow_put32(m + 8, flow->sequence);
+    sr_flow_put16(m + SR_FLOW_HEAD - 2,
+                  (uint16_t)(flow->msg_len - (SR_FLOW_HEAD - 4)));
+
+    if(flow->fp)
+    { ok = fwrite(m, flow->msg_len, 1, flow->fp) == 1; }
+    else
+    { ok = send(flow->sock, m, flow->msg_len, 0) == (ssize_t)flow->msg_len; }
+
+    if(ok)
+    {
+        flow->messages++;
+        flow->exported += flow->msg_records;
+    }
+    else if(flow->export_errors++ == 0)
+    { perror("flow export"); }
+
+    flow->sequence += flow->msg_records;
+    flow->msg_len = 0;
+    flow->msg_records = 0;
+}
+
+/* Add e to the message being built, sending it first if it's full */
+static void sr_flow_export(struct sr_flow* flow, const struct sr_flow_entry* e)
+{
+    uint8_t* p;
+    unsigned int i;
+
+    if(flow->msg_len + SR_FLOW_RECORD > SR_FLOW_MSG_MAX)
+    { sr_flow_flush(flow); }
+
+    if(flow->msg_len == 0)
+    {
+        /* -- header, the template set, then the data set's header -- */
+        p = flow->msg;
+        memset(p, 0, SR_FLOW_HEAD);
+        sr_flow_put16(p, SR_IPFIX_VERSION);
+        sr_flow_put32(p + 12, SR_IPFIX_DOMAIN);
+        p += 16;
+        sr_flow_put16(p, SR_IPFIX_TEMPLATE_SET);
+        sr_flow_put16(p + 2, 8 + 4 * SR_FLOW_FIELDS);
+        sr_flow_put16(p + 4, SR_IPFIX_TEMPLATE_ID);
+        sr_flow_put16(p + 6, SR_FLOW_FIELDS);
+        p += 8;
+        for(i = 0; i < SR_FLOW_FIELDS; i++, p += 4)
+        {
+            sr_flow_put16(p, sr_flow_template[i][0]);
+            sr_flow_put16(p + 2, sr_flow_template[i][1]);
+        }
+        sr_flow_put16(p, SR_IPFIX_TEMPLATE_ID);
+        flow->msg_len = SR_FLOW_HEAD;
+    }
+
+    p = flow->msg + flow->msg_len;
+    memcpy(p, &e->src, 4);
+    memcpy(p + 4, &e->dst, 4);
+    sr_flow_put16(p + 8, e->sport);
+    sr_flow_put16(p + 10, e->dport);
+    p[12] = e->proto;
+    p[13] = e->tcp_flags;
+    sr_flow_put32(p + 14, e->in);
+    sr_flow_put32(p + 18, e->out);
+    sr_flow_put64(p + 22, e->packets);
+    sr_flow_put64(p + 30, e->bytes);
+    sr_flow_put64(p + 38, e->first);
+    sr_flow_put64(p + 46, e->last);
+    p[54] = e->reason;
+    sr_flow_put32(p + 55, flow->sample);
+
+    flow->msg_len += SR_FLOW_RECORD;
+    flow->msg_records++;
+    flow->ended[e->reason]++;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_flow_sweep(..)
+ * Scope:  Local
+ *
+ * Export what cache c pushed out and the flows in it that are done as
+ * of now, or all of them with force.  The cache is locked a slice of
+ * sets at a time, and records are encoded after it's let go.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_flow_sweep(struct sr_flow* flow, struct sr_flow_cache* c,
+                         uint64_t now, int force)
+{
+    static struct sr_flow_entry done[SR_FLOW_SWEEP_MAX > SR_FLOW_PENDING ?
+                                     SR_FLOW_SWEEP_MAX : SR_FLOW_PENDING];
+    struct sr_flow_entry* e;
+    unsigned int i, n, s, w;
+    uint8_t reason;
+
+    pthread_mutex_lock(&c->lock);
+    n = c->npending;
+    memcpy(done, c->pending, n * sizeof(struct sr_flow_entry));
+    c->npending = 0;
+    pthread_mutex_unlock(&c->lock);
+    for(i = 0; i < n; i++)
+    { sr_flow_export(flow, &done[i]); }
+
+    for(s = 0; s < SR_FLOW_SETS; s += SR_FLOW_SWEEP_SETS)
+    {
+        n = 0;
+        pthread_mutex_lock(&c->lock);
+        for(i = s; i < s + SR_FLOW_SWEEP_SETS; i++)
+        {
+            for(w = 0; w < SR_FLOW_WAYS; w++)
+            {
+                e = &c->sets[i].way[w];
+                if(e->packets == 0)
+                { continue; }
+
+                if(e->tcp_flags & (SR_TCP_FIN | SR_TCP_RST))
+                { reason = SR_FLOW_END_DETECTED; }
+                else if(now >= e->last + flow->idle_ms)
+                { reason = SR_FLOW_END_IDLE; }
+                else if(now >= e->first + flow->active_ms)
+                { reason = SR_FLOW_END_ACTIVE; }
+                else if(force)
+                { reason = SR_FLOW_END_FORCED; }
+                else
+                { continue; }
+
+                e->reason = reason;
+                done[n++] = *e;
+                e->packets = 0;
+                c->active--;
+            }
+        }
+        pthread_mutex_unlock(&c->lock);
+
+        for(i = 0; i < n; i++)
+        { sr_flow_export(flow, &done[i]); }
+    }
+} /* -- sr_flow_sweep -- */
+
+static void sr_flow_sweep_all(struct sr_flow* flow, int force)
+{
+    struct sr_flow_cache* c;
+    uint64_t now = sr_flow_now();
+
+    pthread_mutex_lock(&flow->lock);
+    c = flow->caches;
+    pthread_mutex_unlock(&flow->lock);
+
+    /* -- caches are only ever added at the head -- */
+    for(; c; c = c->next)
+    { sr_flow_sweep(flow, c, now, force); }
+    sr_flow_flush(flow);
+    if(flow->fp)
+    { fflush(flow->fp); }
+}
+
+/* The exporter: sweep every second until told to stop */
+static void* sr_flow_run(void* arg)
+{
+    struct sr_flow* flow = (struct sr_flow*)arg;
+    struct timespec ts;
+
+    sr_cpu_bind(SR_CPU_EXPORT);
+
+    pthread_mutex_lock(&flow->lock);
+    while(!flow->stop)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_sec++;
+        pthread_cond_timedwait(&flow->wake, &flow->lock, &ts);
+        if(flow->stop)
+        { break; }
+        pthread_mutex_unlock(&flow->lock);
+        sr_flow_sweep_all(flow, 0);
+        pthread_mutex_lock(&flow->lock);
+    }
+    pthread_mutex_unlock(&flow->lock);
+    return 0;
+} /* -- sr_flow_run -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_flow_drain(..)
+ * Scope:  Global
+ *
+ * Stop the exporter and export every flow still in a cache, then close
+ * the file or socket.  Nothing is counted after this.  Used when the
+ * router stops; calling it again does nothing.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_flow_drain(struct sr_flow* flow)
+{
+    pthread_mutex_lock(&flow->lock);
+    if(flow->stop)
+    {
+        pthread_mutex_unlock(&flow->lock);
+        return;
+    }
+    __atomic_store_n(&flow->stop, 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&flow->wake);
+    pthread_mutex_unlock(&flow->lock);
+
+    pthread_join(flow->thread, 0);
+    sr_flow_sweep_all(flow, 1);
+
+    if(flow->fp)
+    { fclose(flow->fp); }
+    else
+    { close(flow->sock); }
+    flow->fp = 0;
+    flow->sock = -1;
+} /* -- sr_flow_drain -- */
+
+static void sr_flow_stats(struct sr_stats_writer* w, void* arg)
+{
+    struct sr_instance* sr = (struct sr_instance*)arg;
+    struct sr_flow* flow = sr->flow;
+    struct sr_flow_cache* c;
+    unsigned int caches = 0, active = 0, i;
+
+    if(flow == 0)
+    { return; }
+
+    pthread_mutex_lock(&flow->lock);
+    for(c = flow->caches; c; c = c->next)
+    {
+        caches++;
+        active += c->active;
+    }
+    pthread_mutex_unlock(&flow->lock);
+
+    sr_stats_put_u64(w, "sample", flow->sample);
+    sr_stats_put_u64(w, "active_timeout_s", flow->active_ms / 1000);
+    sr_stats_put_u64(w, "idle_timeout_s", flow->idle_ms / 1000);
+    sr_stats_put_u64(w, "caches", caches);
+    sr_stats_put_u64(w, "active", active);
+    sr_stats_put_u64(w, "created", flow->created);
+    sr_stats_put_u64(w, "evicted", flow->evicted);
+    sr_stats_put_u64(w, "lost", flow->lost);
+    sr_stats_put_u64(w, "exported", flow->exported);
+    sr_stats_put_u64(w, "messages", flow->messages);
+    sr_stats_put_u64(w, "export_errors", flow->export_errors);
+    sr_stats_open(w, "ended");
+    for(i = 1; i <= SR_FLOW_END_RESOURCES; i++)
+    { sr_stats_put_u64(w, sr_flow_reasons[i], flow->ended[i]); }
+    sr_stats_close(w);
+} /* -- sr_flow_stats -- */
+
+/* Register the stats section and start the exporter if accounting */
+void sr_flow_init(struct sr_instance* sr)
+{
+    sr_stats_register("flows", sr_flow_stats, sr);
+
+    if(sr->flow &&
+       pthread_create(&sr->flow->thread, &(sr->attr), sr_flow_run, sr->flow) != 0)
+    {
+        perror("pthread_create(..):sr_flow.c::sr_flow_init");
+        exit(1);
+    }
+} /* -- sr_flow_init -- */
+
+/* Open target, a.b.c.d:port for a collector or else a file */
+static int sr_flow_open(struct sr_flow* flow, const char* target)
+{
+    struct sockaddr_in sin;
+    char host[32];
+    const char* colon = strrchr(target, ':');
+    char* end;
+    long port = 0;
+
+    memset(&sin, 0, sizeof(sin));
+    if(colon && colon - target < (long)sizeof(host))
+    {
+        memcpy(host, target, colon - target);
+        host[colon - target] = 0;
+        port = strtol(colon + 1, &end, 10);
+        if(*end || port <= 0 || port > 65535 || inet_aton(host, &sin.sin_addr) == 0)
+        { port = 0; }
+    }
+
+    if(port == 0)
+    {
+        if((flow->fp = fopen(target, "ab")) == 0)
+        {
+            perror(target);
+            return -1;
+        }
+        return 0;
+    }
+
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons((uint16_t)port);
+    if((flow->sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+       connect(flow->sock, (struct sockaddr*)&sin, sizeof(sin)) != 0)
+    {
+        perror("flow export: collector");
+        return -1;
+    }
+    return 0;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_flow_create(..)
+ * Scope:  Global
+ *
+ * Flow accounting for sr -F <target>[,active=s][,idle=s][,sample=N].
+ * spec is cut up.  Returns 0 after saying what's wrong.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_flow* sr_flow_create(struct sr_instance* sr, char* spec)
+{
+    struct sr_flow* flow;
+    pthread_condattr_t attr;
+    char* opt;
+    char* save;
+    char* end;
+    long v;
+
+    /* -- REQUIRES -- */
+    assert(sr);
+    assert(spec);
+
+    if((flow = (struct sr_flow*)calloc(1, sizeof(struct sr_flow))) == 0)
+    { return 0; }
+    flow->sr = sr;
+    flow->sock = -1;
+    flow->active_ms = SR_FLOW_ACTIVE_TIMEOUT * 1000;
+    flow->idle_ms = SR_FLOW_IDLE_TIMEOUT * 1000;
+    flow->sample = 1;
+
+    strtok_r(spec, ",", &save);
+    for(opt = strtok_r(0, ",", &save); opt; opt = strtok_r(0, ",", &save))
+    {
+        end = strchr(opt, '=');
+        v = end ? strtol(end + 1, &end, 10) : 0;
+        if(end == 0 || *end || v <= 0)
+        {
+            fprintf(stderr, "flow export: bad option %s\n", opt);
+            free(flow);
+            return 0;
+        }
+        if(strncmp(opt, "active=", 7) == 0)
+        { flow->active_ms = (unsigned int)v * 1000; }
+        else if(strncmp(opt, "idle=", 5) == 0)
+        { flow->idle_ms = (unsigned int)v * 1000; }
+        else if(strncmp(opt, "sample=", 7) == 0)
+        { flow->sample = (unsigned int)v; }
+        else
+        {
+            fprintf(stderr, "flow export: no option %s\n", opt);
+            free(flow);
+            return 0;
+        }
+    }
+
+    if(sr_flow_open(flow, spec) != 0)
+    {
+        if(flow->sock >= 0)
+        { close(flow->sock); }
+        free(flow);
+        return 0;
+    }
+
+    pthread_mutex_init(&flow->lock, 0);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&flow->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    return flow;
+} /* -- sr_flow_create -- */
@@ -0,0 +1,130 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_flow.h
+ *
+ * Description:
+ *
+ * Flow accounting for forwarded datagrams, exported in IPFIX (RFC 7011),
+ * turned on with
+ *
+ *   sr -F <file | a.b.c.d:port>[,active=s][,idle=s][,sample=N]
+ *
+ * A file gets the messages one after another, the IPFIX file format of
+ * RFC 5655; an address gets one UDP datagram per message, a collector's
+ * usual port is 4739.  Every message carries the template first, so a
+ * collector that starts late or drops a datagram never waits for it.
+ *
+ * Each forwarding thread counts into its own cache, SR_FLOW_SETS sets of
+ * SR_FLOW_WAYS flows keyed on addresses, ports, protocol and ingress
+ * interface, so a datagram costs one set probe under a lock nobody else
+ * holds except the exporter, briefly, once a second.  With sample=N only
+ * every Nth datagram is counted and records say so (samplingInterval).
+ * A new flow that finds its set full pushes out the one idle longest.
+ * Datagrams are counted as they leave, after NAT has rewritten them.
+ *
+ * The exporter thread sweeps the caches every second, sooner when flows
+ * are being pushed out faster than that.  A flow goes out
+ * when it has been idle for the idle timeout (default 15 s), has been
+ * running for the active timeout (default 60 s; the next datagram starts
+ * a new record), or has seen a TCP FIN or RST.  Whatever is left is
+ * exported when the router stops.  The "flows" stats section counts
+ * flows and what became of them.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_FLOW_H
+#define SR_FLOW_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+#include <stdio.h>
+#include <pthread.h>
+
+#define SR_FLOW_SETS            4096   /* per thread, power of two */
+#define SR_FLOW_WAYS            4
+#define SR_FLOW_PENDING         512    /* pushed out, waiting for export */
+#define SR_FLOW_ACTIVE_TIMEOUT  60     /* seconds */
+#define SR_FLOW_IDLE_TIMEOUT    15
+#define SR_FLOW_MSG_MAX         1400   /* bytes, fits an ethernet MTU */
+
+/* flowEndReason */
+#define SR_FLOW_END_IDLE        1
+#define SR_FLOW_END_ACTIVE      2
+#define SR_FLOW_END_DETECTED    3      /* TCP FIN or RST */
+#define SR_FLOW_END_FORCED      4      /* router stopped */
+#define SR_FLOW_END_RESOURCES   5      /* pushed out of a full set */
+
+struct sr_instance;
+struct sr_pkt;
+struct sr_rt;
+
+struct sr_flow_entry {
+    uint32_t src;               /* key, network order */
+    uint32_t dst;
+    uint16_t sport;
+    uint16_t dport;
+    uint8_t  proto;
+    uint8_t  tcp_flags;         /* all seen, or'ed */
+    uint16_t in;                /* ifindex + 1, key */
+    uint16_t out;
+    uint8_t  reason;            /* once exported */
+    uint32_t packets;           /* 0: slot empty */
+    uint64_t bytes;             /* IP */
+    uint64_t first;             /* ms since the epoch */
+    uint64_t last;
+};
+
+struct sr_flow_set {
+    struct sr_flow_entry way[SR_FLOW_WAYS];
+};
+
+struct sr_flow_cache {
+    pthread_mutex_t lock;
+    struct sr_flow_set* sets;
+    struct sr_flow_entry pending[SR_FLOW_PENDING];
+    unsigned int npending;
+    unsigned int skip;          /* datagrams since the last sampled */
+    unsigned int active;
+    struct sr_flow_cache* next;
+};
+
+struct sr_flow {
+    struct sr_instance* sr;
+    pthread_mutex_t lock;       /* caches, stop */
+    pthread_cond_t wake;
+    struct sr_flow_cache* caches;
+    unsigned int active_ms;
+    unsigned int idle_ms;
+    unsigned int sample;
+    int stop;
+    pthread_t thread;
+
+    /* -- export, exporter thread (or whoever drains) only -- */
+    FILE* fp;
+    int sock;
+    uint8_t msg[SR_FLOW_MSG_MAX];
+    unsigned int msg_len;
+    unsigned int msg_records;
+    uint32_t sequence;          /* data records sent so far */
+
+    uint64_t created;
+    uint64_t evicted;
+    uint64_t exported;
+    uint64_t messages;
+    uint64_t export_errors;
+    uint64_t lost;              /* pending was full */
+    uint64_t ended[SR_FLOW_END_RESOURCES + 1];
+};
+
+void sr_flow_init(struct sr_instance* sr);
+struct sr_flow* sr_flow_create(struct sr_instance* sr, char* spec);
+void sr_flow_account(struct sr_flow* flow, const uint8_t* packet,
+                     const struct sr_pkt* pkt, struct sr_rt* rt);
+void sr_flow_drain(struct sr_flow* flow);
+
+#endif /* -- SR_FLOW_H -- */
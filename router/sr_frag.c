@@ -0,0 +1,537 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_frag.c
+ *
+ * Description:
+ *
+ * IP fragmentation and bounded-memory reassembly, see sr_frag.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include "sr_if.h"
+#include "sr_rt.h"
+#include "sr_router.h"
+#include "sr_protocol.h"
+#include "sr_utils.h"
+#include "sr_stats.h"
+#include "sr_icmp.h"
+#include "sr_pkt.h"
+#include "sr_frag.h"
+
+#define SR_IP_MAX_HL       60
+#define SR_REASM_HEADROOM  (sizeof(sr_ethernet_hdr_t) + SR_IP_MAX_HL)
+#define SR_REASM_CHUNK     512     /* buffers grow in multiples of this */
+
+struct sr_reasm {
+    uint32_t src;
+    uint32_t dst;
+    uint16_t id;
+    uint8_t  proto;
+    uint8_t  have_last;
+    unsigned int hl;            /* of the first fragment, 0 until it's seen */
+    unsigned int total;         /* payload length, once the last is seen */
+    unsigned int end;           /* highest payload byte received, + 1 */
+    unsigned int cap;           /* payload bytes buf has room for */
+    unsigned int blocks;        /* 8 byte blocks received */
+    uint8_t* buf;               /* SR_REASM_HEADROOM + cap */
+    uint8_t* map;               /* one bit per block */
+    uint32_t expires;           /* wheel tick */
+    struct sr_reasm* next;      /* hash chain */
+    struct sr_reasm* wnext;     /* wheel slot */
+    struct sr_reasm* wprev;
+};
+
+static struct sr_reasm* sr_reasm_table[SR_REASM_BUCKETS];
+static struct sr_reasm* sr_reasm_wheel[SR_REASM_WHEEL];
+static uint32_t sr_reasm_tick = 0;
+static size_t sr_reasm_mem = 0;
+static unsigned int sr_reasm_entries = 0;
+
+static uint64_t sr_frag_datagrams = 0;
+static uint64_t sr_frag_fragments = 0;
+static uint64_t sr_reasm_fragments = 0;
+static uint64_t sr_reasm_done = 0;
+static uint64_t sr_reasm_timeouts = 0;
+static uint64_t sr_reasm_evicted = 0;
+static uint64_t sr_reasm_invalid = 0;
+
+/*---------------------------------------------------------------------
+ * Fragmentation
+ *---------------------------------------------------------------------*/
+
+static void sr_frag_out(struct sr_instance* sr, uint8_t* frame,
+                        unsigned int len, struct sr_rt* rt, const char* iface)
+{
+    sr_frag_fragments++;
+    if(rt)
+    { sr_send_ip_packet(sr, frame, len, rt); }
+    else
+    { sr_send_packet(sr, frame, len, iface); }
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_frag_send(..)
+ * Scope:  Global
+ *
+ * Send the datagram in frame as fragments of at most mtu bytes, either
+ * along route rt or, if rt is 0, straight out of iface with the frame's
+ * Ethernet header.  Only options with the copied flag are repeated after
+ * the first fragment (RFC 791).  frame is overwritten.  Returns the
+ * number of fragments sent, or -1 if the MTU can't carry the header.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_frag_send(struct sr_instance* sr,
+        uint8_t* frame /* lent, clobbered */,
+        unsigned int len,
+        unsigned int mtu,
+        struct sr_rt* rt,
+        const char* iface)
+{
+    sr_ip_hdr_t* ip_hdr = (sr_ip_hdr_t*)(frame + sizeof(sr_ethernet_hdr_t));
+    uint8_t* opt = (uint8_t*)ip_hdr;
+    uint8_t e_hdr[sizeof(sr_ethernet_hdr_t)];
+    uint8_t h2[SR_IP_MAX_HL];
+    sr_ip_hdr_t* f_hdr;
+    uint8_t* f;
+    unsigned int hl, hl2, payload, step, off, n, i, olen;
+    uint16_t flags, base, mf;
+    int count = 0;
+
+    /* REQUIRES */
+    assert(sr);
+    assert(frame);
+    assert(rt || iface);
+
+    hl = ip_hdr->ip_hl * 4;
+    payload = len - sizeof(sr_ethernet_hdr_t) - hl;
+    if(mtu < hl + 8)
+    { return -1; }
+
+    flags = ntohs(ip_hdr->ip_off);
+    base = flags & IP_OFFMASK;
+    mf = flags & IP_MF;
+
+    memcpy(e_hdr, frame, sizeof(e_hdr));
+
+    /* -- header for the later fragments: copied options only -- */
+    memcpy(h2, ip_hdr, sizeof(sr_ip_hdr_t));
+    hl2 = sizeof(sr_ip_hdr_t);
+    for(i = sizeof(sr_ip_hdr_t); i < hl && opt[i] != 0; i += olen)
+    {
+        if(opt[i] == 1)
+        {
+            olen = 1;
+            continue;
+        }
+        if(i + 1 >= hl || (olen = opt[i + 1]) < 2 || i + olen > hl)
+        { break; }
+        if(opt[i] & 0x80)
+        {
+            memcpy(h2 + hl2, opt + i, olen);
+            hl2 += olen;
+        }
+    }
+    while(hl2 % 4)
+    { h2[hl2++] = 0; }
+    ((sr_ip_hdr_t*)h2)->ip_hl = hl2 / 4;
+
+    /* -- the first fragment is the front of frame as it is -- */
+    n = (mtu - hl) & ~7U;
+    ip_hdr->ip_len = htons(hl + n);
+    ip_hdr->ip_off = htons(IP_MF | base);
+    ip_hdr->ip_sum = 0;
+    ip_hdr->ip_sum = cksum(ip_hdr, hl);
+    sr_frag_out(sr, frame, sizeof(sr_ethernet_hdr_t) + hl + n, rt, iface);
+    count++;
+
+    /* -- the rest get their headers written over the tail of the one before -- */
+    step = (mtu - hl2) & ~7U;
+    for(off = n; off < payload; off += n)
+    {
+        n = payload - off < step ? payload - off : step;
+        f = frame + sizeof(sr_ethernet_hdr_t) + hl + off -
+            hl2 - sizeof(sr_ethernet_hdr_t);
+        memcpy(f, e_hdr, sizeof(e_hdr));
+        memcpy(f + sizeof(sr_ethernet_hdr_t), h2, hl2);
+
+        f_hdr = (sr_ip_hdr_t*)(f + sizeof(sr_ethernet_hdr_t));
+        f_hdr->ip_len = htons(hl2 + n);
+        f_hdr->ip_off = htons((base + off / 8) |
+                              (off + n < payload ? IP_MF : mf));
+        f_hdr->ip_sum = 0;
+        f_hdr->ip_sum = cksum(f_hdr, hl2);
+        sr_frag_out(sr, f, sizeof(sr_ethernet_hdr_t) + hl2 + n, rt, iface);
+        count++;
+    }
+
+    sr_frag_datagrams++;
+    return count;
+} /* -- sr_frag_send -- */
+
+/*---------------------------------------------------------------------
+ * Reassembly
+ *---------------------------------------------------------------------*/
+
+static uint32_t sr_reasm_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)ts.tv_sec;
+}
+
+static size_t sr_reasm_size(unsigned int cap)
+{
+    return sizeof(struct sr_reasm) + SR_REASM_HEADROOM + cap + cap / 64;
+}
+
+static unsigned int sr_reasm_hash(uint32_t src, uint32_t dst, uint16_t id,
+                                  uint8_t proto)
+{
+    uint32_t h = src ^ dst ^ ((uint32_t)id << 16 | proto);
+
+    return ((h * 2654435761U) >> 16) % SR_REASM_BUCKETS;
+}
+
+static void sr_reasm_wheel_unlink(struct sr_reasm* e)
+{
+    if(e->wprev)
+    { e->wprev->wnext = e->wnext; }
+    else
+    { sr_reasm_wheel[e->expires % SR_REASM_WHEEL] = e->wnext; }
+    if(e->wnext)
+    { e->wnext->wprev = e->wprev; }
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_reasm_unlink(..)
+ * Scope:  Local
+ *
+ * Take e out of the table and the wheel and stop charging for it.  The
+ * buffer is left alone so a completed datagram can be handed out.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_reasm_unlink(struct sr_reasm* e)
+{
+    struct sr_reasm** pp;
+
+    pp = &sr_reasm_table[sr_reasm_hash(e->src, e->dst, e->id, e->proto)];
+    while(*pp != e)
+    { pp = &(*pp)->next; }
+    *pp = e->next;
+
+    sr_reasm_wheel_unlink(e);
+
+    sr_reasm_mem -= sr_reasm_size(e->cap);
+    sr_reasm_entries--;
+} /* -- sr_reasm_unlink -- */
+
+static void sr_reasm_destroy(struct sr_reasm* e)
+{
+    sr_reasm_unlink(e);
+    free(e->buf);
+    free(e->map);
+    free(e);
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_reasm_expire(..)
+ * Scope:  Local
+ *
+ * Advance the wheel to 'now' and drop everything that timed out.  If the
+ * first fragment made it, its sender gets a reassembly time exceeded.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_reasm_expire(struct sr_instance* sr, uint32_t now)
+{
+    struct sr_reasm* e;
+    struct sr_reasm* next;
+
+    if(now - sr_reasm_tick > SR_REASM_WHEEL)
+    { sr_reasm_tick = now - SR_REASM_WHEEL; }
+
+    while(sr_reasm_tick != now)
+    {
+        sr_reasm_tick++;
+        for(e = sr_reasm_wheel[sr_reasm_tick % SR_REASM_WHEEL]; e; e = next)
+        {
+            next = e->wnext;
+            if((int32_t)(e->expires - now) > 0)
+            { continue; }
+
+            if(e->hl && e->cap >= 8)
+            {
+                sr_icmp_send_error(sr,
+                        e->buf + SR_REASM_HEADROOM - e->hl - sizeof(sr_ethernet_hdr_t),
+                        sizeof(sr_ethernet_hdr_t) + e->hl + 8,
+                        SR_ICMP_REASM_TIMEOUT);
+            }
+            sr_reasm_timeouts++;
+            sr_stats_drop(0, SR_DROP_REASM);
+            sr_reasm_destroy(e);
+        }
+    }
+} /* -- sr_reasm_expire -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_reasm_reserve(..)
+ * Scope:  Local
+ *
+ * Make room for 'need' more bytes under SR_REASM_MEM_MAX by evicting the
+ * entries that would time out soonest, never 'keep'.  Returns 0 if the
+ * bytes now fit.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_reasm_reserve(size_t need, struct sr_reasm* keep)
+{
+    struct sr_reasm* e;
+    struct sr_reasm* next;
+    unsigned int i;
+
+    for(i = 1; i <= SR_REASM_WHEEL && sr_reasm_mem + need > SR_REASM_MEM_MAX; i++)
+    {
+        e = sr_reasm_wheel[(sr_reasm_tick + i) % SR_REASM_WHEEL];
+        for(; e && sr_reasm_mem + need > SR_REASM_MEM_MAX; e = next)
+        {
+            next = e->wnext;
+            if(e == keep)
+            { continue; }
+            sr_reasm_evicted++;
+            sr_stats_drop(0, SR_DROP_REASM);
+            sr_reasm_destroy(e);
+        }
+    }
+    return sr_reasm_mem + need > SR_REASM_MEM_MAX ? -1 : 0;
+} /* -- sr_reasm_reserve -- */
+
+static int sr_reasm_grow(struct sr_reasm* e, unsigned int end)
+{
+    unsigned int cap = (end + SR_REASM_CHUNK - 1) & ~(SR_REASM_CHUNK - 1);
+    size_t delta = sr_reasm_size(cap) - sr_reasm_size(e->cap);
+    uint8_t* buf;
+    uint8_t* map;
+
+    if(sr_reasm_reserve(delta, e) != 0)
+    { return -1; }
+    if((buf = (uint8_t*)realloc(e->buf, SR_REASM_HEADROOM + cap)) == 0)
+    { return -1; }
+    e->buf = buf;
+    if((map = (uint8_t*)realloc(e->map, cap / 64)) == 0)
+    { return -1; }
+    memset(map + e->cap / 64, 0, (cap - e->cap) / 64);
+    e->map = map;
+
+    sr_reasm_mem += delta;
+    e->cap = cap;
+    return 0;
+} /* -- sr_reasm_grow -- */
+
+static struct sr_reasm* sr_reasm_find(struct sr_ip_hdr* ip_hdr, uint32_t now)
+{
+    unsigned int h = sr_reasm_hash(ip_hdr->ip_src, ip_hdr->ip_dst,
+                                   ip_hdr->ip_id, ip_hdr->ip_p);
+    struct sr_reasm* e;
+    struct sr_reasm** slot;
+
+    for(e = sr_reasm_table[h]; e; e = e->next)
+    {
+        if(e->src == ip_hdr->ip_src && e->dst == ip_hdr->ip_dst &&
+           e->id == ip_hdr->ip_id && e->proto == ip_hdr->ip_p)
+        { return e; }
+    }
+
+    if(sr_reasm_reserve(sr_reasm_size(0), 0) != 0 ||
+       (e = (struct sr_reasm*)calloc(1, sizeof(struct sr_reasm))) == 0)
+    { return 0; }
+    if((e->buf = (uint8_t*)malloc(SR_REASM_HEADROOM)) == 0)
+    {
+        free(e);
+        return 0;
+    }
+
+    e->src = ip_hdr->ip_src;
+    e->dst = ip_hdr->ip_dst;
+    e->id = ip_hdr->ip_id;
+    e->proto = ip_hdr->ip_p;
+    e->expires = now + SR_REASM_TIMEOUT;
+
+    e->next = sr_reasm_table[h];
+    sr_reasm_table[h] = e;
+
+    slot = &sr_reasm_wheel[e->expires % SR_REASM_WHEEL];
+    e->wnext = *slot;
+    if(*slot)
+    { (*slot)->wprev = e; }
+    *slot = e;
+
+    sr_reasm_mem += sr_reasm_size(0);
+    sr_reasm_entries++;
+    return e;
+} /* -- sr_reasm_find -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_reasm_input(..)
+ * Scope:  Global
+ *
+ * Add the fragment in packet, described by pkt.  If
+ * that completes its datagram, the whole frame is returned with a fresh
+ * IP header and its length in out_len; the caller owns it until
+ * sr_reasm_release(..) and must not change its IP header length.
+ * Otherwise returns 0.  Receive thread only.
+ *
+ *---------------------------------------------------------------------*/
+
+uint8_t* sr_reasm_input(struct sr_instance* sr,
+        uint8_t* packet /* lent */,
+        const struct sr_pkt* pkt,
+        unsigned int* out_len)
+{
+    sr_ip_hdr_t* ip_hdr = (sr_ip_hdr_t*)(packet + pkt->l3);
+    struct sr_if* iface = pkt->iface;
+    unsigned int hl = pkt->l4 - pkt->l3;
+    unsigned int n = pkt->len - pkt->l4;
+    unsigned int off = (ntohs(ip_hdr->ip_off) & IP_OFFMASK) * 8;
+    int more = (ntohs(ip_hdr->ip_off) & IP_MF) != 0;
+    uint32_t now = sr_reasm_now();
+    struct sr_reasm* e;
+    uint8_t* frame;
+    unsigned int b;
+
+    /* REQUIRES */
+    assert(sr);
+    assert(packet);
+    assert(out_len);
+
+    sr_reasm_fragments++;
+    sr_reasm_expire(sr, now);
+
+    /* -- all but the last fragment carry whole blocks; nothing may end
+     *    past the largest datagram (ping of death) -- */
+    if((more && (n == 0 || n % 8)) || hl + off + n > IP_MAXPACKET)
+    {
+        sr_reasm_invalid++;
+        sr_stats_drop(iface, SR_DROP_REASM);
+        return 0;
+    }
+
+    if((e = sr_reasm_find(ip_hdr, now)) == 0)
+    {
+        sr_stats_drop(iface, SR_DROP_REASM);
+        return 0;
+    }
+
+    /* -- the datagram's end, once known, must agree with every fragment -- */
+    if((!more && e->have_last && e->total != off + n) ||
+       (!more && e->end > off + n) ||
+       (e->have_last && off + n > e->total))
+    {
+        sr_reasm_invalid++;
+        sr_stats_drop(iface, SR_DROP_REASM);
+        sr_reasm_destroy(e);
+        return 0;
+    }
+
+    if(off + n > e->cap && sr_reasm_grow(e, off + n) != 0)
+    {
+        sr_stats_drop(iface, SR_DROP_REASM);
+        sr_reasm_destroy(e);
+        return 0;
+    }
+
+    memcpy(e->buf + SR_REASM_HEADROOM + off, (uint8_t*)ip_hdr + hl, n);
+    for(b = off / 8; b < (off + n + 7) / 8; b++)
+    {
+        if(!(e->map[b / 8] & (1 << (b % 8))))
+        {
+            e->map[b / 8] |= 1 << (b % 8);
+            e->blocks++;
+        }
+    }
+
+    if(off + n > e->end)
+    { e->end = off + n; }
+    if(off == 0)
+    {
+        e->hl = hl;
+        memcpy(e->buf + SR_REASM_HEADROOM - hl, ip_hdr, hl);
+        memcpy(e->buf + SR_REASM_HEADROOM - hl - sizeof(sr_ethernet_hdr_t),
+               packet, sizeof(sr_ethernet_hdr_t));
+    }
+    if(!more)
+    {
+        e->have_last = 1;
+        e->total = off + n;
+    }
+
+    if(!e->hl || !e->have_last || e->blocks != (e->total + 7) / 8)
+    { return 0; }
+
+    sr_reasm_unlink(e);
+    frame = e->buf + SR_REASM_HEADROOM - e->hl - sizeof(sr_ethernet_hdr_t);
+    free(e->map);
+
+    if(e->hl + e->total > IP_MAXPACKET)
+    {
+        sr_reasm_invalid++;
+        sr_stats_drop(iface, SR_DROP_REASM);
+        free(e->buf);
+        free(e);
+        return 0;
+    }
+
+    ip_hdr = (sr_ip_hdr_t*)(frame + sizeof(sr_ethernet_hdr_t));
+    ip_hdr->ip_len = htons(e->hl + e->total);
+    ip_hdr->ip_off = htons(ntohs(ip_hdr->ip_off) & IP_DF);
+    ip_hdr->ip_sum = 0;
+    ip_hdr->ip_sum = cksum(ip_hdr, e->hl);
+
+    *out_len = sizeof(sr_ethernet_hdr_t) + e->hl + e->total;
+    free(e);
+    sr_reasm_done++;
+    return frame;
+} /* -- sr_reasm_input -- */
+
+void sr_reasm_release(uint8_t* frame)
+{
+    sr_ip_hdr_t* ip_hdr = (sr_ip_hdr_t*)(frame + sizeof(sr_ethernet_hdr_t));
+
+    free(frame + sizeof(sr_ethernet_hdr_t) + ip_hdr->ip_hl * 4 -
+         SR_REASM_HEADROOM);
+} /* -- sr_reasm_release -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_frag_stats(..)
+ * Scope:  Local
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_frag_stats(struct sr_stats_writer* w, void* arg)
+{
+    sr_stats_put_u64(w, "fragmented", sr_frag_datagrams);
+    sr_stats_put_u64(w, "fragments_sent", sr_frag_fragments);
+
+    sr_stats_open(w, "reassembly");
+    sr_stats_put_u64(w, "fragments", sr_reasm_fragments);
+    sr_stats_put_u64(w, "reassembled", sr_reasm_done);
+    sr_stats_put_u64(w, "timeouts", sr_reasm_timeouts);
+    sr_stats_put_u64(w, "evicted", sr_reasm_evicted);
+    sr_stats_put_u64(w, "invalid", sr_reasm_invalid);
+    sr_stats_put_u64(w, "pending", sr_reasm_entries);
+    sr_stats_put_u64(w, "mem_bytes", sr_reasm_mem);
+    sr_stats_close(w);
+} /* -- sr_frag_stats -- */
+
+void sr_frag_init(void)
+{
+    sr_reasm_tick = sr_reasm_now();
+    sr_stats_register("frag", sr_frag_stats, 0);
+} /* -- sr_frag_init -- */
@@ -0,0 +1,54 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_frag.h
+ *
+ * Description:
+ *
+ * IP fragmentation on the way out and reassembly of datagrams addressed
+ * to the router.
+ *
+ * Fragmentation works in the caller's frame: each fragment's Ethernet and
+ * IP headers are written just in front of its slice of the payload, on
+ * top of bytes that already went out with the previous fragment, so
+ * nothing is allocated or copied besides the headers.
+ *
+ * Reassembly keeps one entry per (src, dst, id, protocol) in a hash table.
+ * Payload is collected straight into a buffer with room for the headers in
+ * front, and an 8-byte-block bitmap tracks what has arrived, so overlaps
+ * and duplicates cost nothing.  All buffers together are capped at
+ * SR_REASM_MEM_MAX; when a new fragment doesn't fit, the entries closest
+ * to timing out are evicted first.  Timeouts sit on a one-second timer
+ * wheel that is advanced by the receive thread as fragments arrive, so
+ * the table needs no lock but must only be used from that thread.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_FRAG_H
+#define SR_FRAG_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+#define SR_REASM_BUCKETS   256
+#define SR_REASM_WHEEL     64          /* slots, one second each */
+#define SR_REASM_TIMEOUT   30          /* seconds, < SR_REASM_WHEEL */
+#define SR_REASM_MEM_MAX   (4 * 1024 * 1024)
+
+struct sr_instance;
+struct sr_rt;
+struct sr_pkt;
+
+void sr_frag_init(void);
+
+int sr_frag_send(struct sr_instance* sr, uint8_t* frame, unsigned int len,
+                 unsigned int mtu, struct sr_rt* rt, const char* iface);
+
+uint8_t* sr_reasm_input(struct sr_instance* sr, uint8_t* packet,
+                        const struct sr_pkt* pkt, unsigned int* out_len);
+void sr_reasm_release(uint8_t* frame);
+
+#endif /* -- SR_FRAG_H -- */
@@ -0,0 +1,329 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_huge.c
+ *
+ * Description:
+ *
+ * Hugepage-backed regions for large tables, see sr_huge.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+#include <sys/mman.h>
+
+#include "sr_stats.h"
+#include "sr_huge.h"
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+struct sr_huge_region {
+    const char* name;
+    void* addr;
+    size_t size;                /* asked for */
+    size_t len;                 /* mapped */
+    enum sr_huge_mode how;      /* what it got */
+    struct sr_huge_region* next;
+};
+
+/* -- a mapping from /proc/self/smaps with some of it on hugepages -- */
+struct sr_huge_vma {
+    unsigned long start;
+    unsigned long end;
+    unsigned long huge;         /* bytes */
+};
+
+typedef void (*sr_huge_each_fn)(const char* name, unsigned int nregions,
+                                size_t bytes, size_t huge, void* arg);
+
+static enum sr_huge_mode sr_huge_mode = SR_HUGE_OFF;
+static pthread_mutex_t sr_huge_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sr_huge_region* sr_huge_regions = 0;
+static int sr_huge_no_explicit = 0;
+static int sr_huge_no_thp = 0;
+
+static const char* sr_huge_mode_name(enum sr_huge_mode mode)
+{
+    switch(mode)
+    {
+        case SR_HUGE_THP:      return "thp";
+        case SR_HUGE_EXPLICIT: return "explicit";
+        default:               return "off";
+    }
+}
+
+/* Choose the mode from its name; returns 0 or -1 if there's no such mode */
+int sr_huge_set_mode(const char* mode)
+{
+    if(strcmp(mode, "off") == 0)
+    { sr_huge_mode = SR_HUGE_OFF; }
+    else if(strcmp(mode, "thp") == 0)
+    { sr_huge_mode = SR_HUGE_THP; }
+    else if(strcmp(mode, "explicit") == 0)
+    { sr_huge_mode = SR_HUGE_EXPLICIT; }
+    else
+    { return -1; }
+    return 0;
+} /* -- sr_huge_set_mode -- */
+
+/* len bytes of anonymous memory starting on a hugepage boundary */
+static void* sr_huge_map_aligned(size_t len)
+{
+    uint8_t* p;
+    uint8_t* at;
+
+    p = (uint8_t*)mmap(0, len + SR_HUGE_PAGE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(p == MAP_FAILED)
+    { return MAP_FAILED; }
+    at = (uint8_t*)(((uintptr_t)p + SR_HUGE_PAGE - 1) & ~(SR_HUGE_PAGE - 1));
+    if(at > p)
+    { munmap(p, at - p); }
+    munmap(at + len, p + SR_HUGE_PAGE - at);
+    return at;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_huge_alloc(..)
+ * Scope:  Global
+ *
+ * size zeroed bytes, page aligned, on hugepages if the mode asks for
+ * them and the kernel has them, else on ordinary pages.  name groups the
+ * region with others of its kind in the stats.  Returns 0 only when
+ * there's no memory at all.
+ *
+ *---------------------------------------------------------------------*/
+
+void* sr_huge_alloc(const char* name, size_t size)
+{
+    struct sr_huge_region* r;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    void* p = MAP_FAILED;
+
+    if((r = (struct sr_huge_region*)calloc(1, sizeof(struct sr_huge_region))) == 0)
+    { return 0; }
+    r->name = name;
+    r->size = size;
+    r->len = (size + page - 1) & ~(page - 1);
+    r->how = SR_HUGE_OFF;
+
+    if(sr_huge_mode != SR_HUGE_OFF && size >= SR_HUGE_MIN)
+    {
+        r->len = (size + SR_HUGE_PAGE - 1) & ~(SR_HUGE_PAGE - 1);
+#ifdef MAP_HUGETLB
+        if(sr_huge_mode == SR_HUGE_EXPLICIT)
+        {
+            p = mmap(0, r->len, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if(p != MAP_FAILED)
+            { r->how = SR_HUGE_EXPLICIT; }
+            else if(__sync_lock_test_and_set(&sr_huge_no_explicit, 1) == 0)
+            {
+                fprintf(stderr, "hugepages: no explicit hugepages for %s, "
+                        "using transparent ones\n", name);
+            }
+        }
+#endif
+#ifdef MADV_HUGEPAGE
+        if(p == MAP_FAILED && (p = sr_huge_map_aligned(r->len)) != MAP_FAILED)
+        {
+            if(madvise(p, r->len, MADV_HUGEPAGE) == 0)
+            { r->how = SR_HUGE_THP; }
+            else if(__sync_lock_test_and_set(&sr_huge_no_thp, 1) == 0)
+            {
+                fprintf(stderr, "hugepages: no transparent hugepages for %s, "
+                        "using ordinary pages\n", name);
+            }
+        }
+#endif
+    }
+    if(p == MAP_FAILED &&
+       (p = mmap(0, r->len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                 -1, 0)) == MAP_FAILED)
+    {
+        free(r);
+        return 0;
+    }
+    r->addr = p;
+
+    pthread_mutex_lock(&sr_huge_lock);
+    r->next = sr_huge_regions;
+    sr_huge_regions = r;
+    pthread_mutex_unlock(&sr_huge_lock);
+    return p;
+} /* -- sr_huge_alloc -- */
+
+/* Give back a region from sr_huge_alloc(..) */
+void sr_huge_free(void* p)
+{
+    struct sr_huge_region** at;
+    struct sr_huge_region* r = 0;
+
+    if(p == 0)
+    { return; }
+    pthread_mutex_lock(&sr_huge_lock);
+    for(at = &sr_huge_regions; *at; at = &(*at)->next)
+    {
+        if((*at)->addr == p)
+        {
+            r = *at;
+            *at = r->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sr_huge_lock);
+
+    assert(r);
+    munmap(r->addr, r->len);
+    free(r);
+} /* -- sr_huge_free -- */
+
+/* The mappings with transparent hugepages in them; *n of them, free after */
+static struct sr_huge_vma* sr_huge_smaps(unsigned int* n)
+{
+    struct sr_huge_vma* vmas = 0;
+    struct sr_huge_vma* more;
+    unsigned int max = 0;
+    unsigned long start, end, lo, hi, kb;
+    char line[512];
+    FILE* fp;
+
+    *n = 0;
+    if((fp = fopen("/proc/self/smaps", "r")) == 0)
+    { return 0; }
+    start = end = 0;
+    while(fgets(line, sizeof(line), fp))
+    {
+        if(sscanf(line, "%lx-%lx ", &lo, &hi) == 2)
+        {
+            start = lo;
+            end = hi;
+            continue;
+        }
+        if(sscanf(line, "AnonHugePages: %lu kB", &kb) != 1 || kb == 0)
+        { continue; }
+        if(*n == max)
+        {
+            max = max ? 2 * max : 64;
+            if((more = (struct sr_huge_vma*)realloc(vmas, max * sizeof(*vmas))) == 0)
+            { break; }
+            vmas = more;
+        }
+        vmas[*n].start = start;
+        vmas[*n].end = end;
+        vmas[*n].huge = kb << 10;
+        (*n)++;
+    }
+    fclose(fp);
+    return vmas;
+}
+
+/* How much of r is on hugepages, as far as the kernel says */
+static size_t sr_huge_backed(const struct sr_huge_region* r,
+                             const struct sr_huge_vma* vmas, unsigned int n)
+{
+    unsigned long start = (unsigned long)r->addr;
+    unsigned long end = start + r->len;
+    unsigned long lo, hi;
+    size_t huge = 0;
+    unsigned int i;
+
+    if(r->how == SR_HUGE_EXPLICIT)
+    { return r->len; }
+    if(r->how != SR_HUGE_THP)
+    { return 0; }
+
+    /* -- neighbouring regions can share a mapping; count at most the overlap -- */
+    for(i = 0; i < n; i++)
+    {
+        lo = vmas[i].start > start ? vmas[i].start : start;
+        hi = vmas[i].end < end ? vmas[i].end : end;
+        if(lo < hi)
+        { huge += vmas[i].huge < hi - lo ? vmas[i].huge : hi - lo; }
+    }
+    return huge;
+}
+
+/* Call fn once per region name with the totals for that name */
+static void sr_huge_each(sr_huge_each_fn fn, void* arg)
+{
+    struct sr_huge_region* r;
+    struct sr_huge_region* s;
+    struct sr_huge_vma* vmas;
+    unsigned int n, nregions;
+    size_t bytes, huge;
+
+    vmas = sr_huge_smaps(&n);
+    pthread_mutex_lock(&sr_huge_lock);
+    for(r = sr_huge_regions; r; r = r->next)
+    {
+        for(s = sr_huge_regions; s != r && strcmp(s->name, r->name); s = s->next);
+        if(s != r)
+        { continue; }
+
+        nregions = 0;
+        bytes = huge = 0;
+        for(; s; s = s->next)
+        {
+            if(strcmp(s->name, r->name) == 0)
+            {
+                nregions++;
+                bytes += s->len;
+                huge += sr_huge_backed(s, vmas, n);
+            }
+        }
+        fn(r->name, nregions, bytes, huge, arg);
+    }
+    pthread_mutex_unlock(&sr_huge_lock);
+    free(vmas);
+}
+
+static void sr_huge_put(const char* name, unsigned int nregions,
+                        size_t bytes, size_t huge, void* arg)
+{
+    struct sr_stats_writer* w = (struct sr_stats_writer*)arg;
+
+    sr_stats_open(w, name);
+    sr_stats_put_u64(w, "regions", nregions);
+    sr_stats_put_u64(w, "bytes", bytes);
+    sr_stats_put_u64(w, "hugepage_bytes", huge);
+    sr_stats_close(w);
+}
+
+static void sr_huge_stats(struct sr_stats_writer* w, void* arg)
+{
+    (void)arg;
+    sr_stats_put_str(w, "mode", sr_huge_mode_name(sr_huge_mode));
+    sr_huge_each(sr_huge_put, w);
+} /* -- sr_huge_stats -- */
+
+static void sr_huge_print(const char* name, unsigned int nregions,
+                          size_t bytes, size_t huge, void* arg)
+{
+    (void)arg;
+    printf("hugepages: %s, %u region%s, %lu of %lu kB on hugepages\n", name,
+           nregions, nregions == 1 ? "" : "s", (unsigned long)(huge >> 10),
+           (unsigned long)(bytes >> 10));
+}
+
+/* Register the stats, and say where the regions so far ended up */
+void sr_huge_init(struct sr_instance* sr)
+{
+    sr_stats_register("hugepages", sr_huge_stats, sr);
+    if(sr_huge_mode != SR_HUGE_OFF)
+    { sr_huge_each(sr_huge_print, 0); }
+} /* -- sr_huge_init -- */
@@ -0,0 +1,50 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_huge.h
+ *
+ * Description:
+ *
+ * Allocation of large tables on 2 MB pages.  Lookups in the route trie,
+ * its first-level table and the connection and NAT hash tables land on
+ * random addresses, and once a table is more than a few MB most of them
+ * miss the TLB as well as the cache.  With hugepages one TLB entry covers
+ * 512 times as much.
+ *
+ * The mode is chosen once at startup (sr -G):
+ *
+ *   off        ordinary pages, the default
+ *   thp        transparent hugepages: the regions are advised with
+ *              MADV_HUGEPAGE and the kernel backs them when it can
+ *   explicit   hugetlbfs pages from the reserved pool (vm.nr_hugepages),
+ *              falling back to transparent ones when the pool is empty
+ *
+ * Regions smaller than SR_HUGE_MIN always use ordinary pages; larger ones
+ * are rounded up to a multiple of SR_HUGE_PAGE.  When hugepages can't be
+ * had the region is allocated anyway on ordinary pages, so the mode never
+ * makes an allocation fail.  The "hugepages" stats section shows, per
+ * region name, how much was asked for and how much of it the kernel
+ * actually put on hugepages.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_HUGE_H
+#define SR_HUGE_H
+
+#include <stddef.h>
+
+#define SR_HUGE_PAGE  (2UL << 20)
+#define SR_HUGE_MIN   (1UL << 20)  /* smaller regions aren't worth a page */
+
+enum sr_huge_mode {
+    SR_HUGE_OFF,
+    SR_HUGE_THP,
+    SR_HUGE_EXPLICIT
+};
+
+struct sr_instance;
+
+int   sr_huge_set_mode(const char* mode);
+void* sr_huge_alloc(const char* name, size_t size);
+void  sr_huge_free(void* p);
+void  sr_huge_init(struct sr_instance* sr);
+
+#endif /* -- SR_HUGE_H -- */
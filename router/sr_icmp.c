@@ -0,0 +1,392 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_icmp.c
+ *
+ * Description:
+ *
+ * Template based, rate limited ICMP errors.  See sr_icmp.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "sr_if.h"
+#include "sr_rt.h"
+#include "sr_router.h"
+#include "sr_protocol.h"
+#include "sr_utils.h"
+#include "sr_stats.h"
+#include "sr_latency.h"
+#include "sr_icmp.h"
+#include "sr_frag.h"
+#include "sr_epoch.h"
+#include "sr_pkt.h"
+
+#define SR_ICMP_FRAME_LEN (sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + \
+                           sizeof(sr_icmp_t3_hdr_t))
+
+struct sr_icmp_template {
+    uint8_t  frame[SR_ICMP_FRAME_LEN];
+    uint32_t ip_sum;            /* unfolded sum of the constant IP fields */
+    uint32_t icmp_sum;          /* ... and of the constant ICMP fields */
+};
+
+/* Token bucket kept as the time at which it will next be full (GCRA): a
+   packet conforms if that time is no more than 'tolerance' ahead of now. */
+struct sr_icmp_bucket {
+    uint64_t tat;
+    uint32_t prefix;
+};
+
+struct sr_icmp_rate {
+    uint64_t interval;          /* ns per token */
+    uint64_t tolerance;         /* burst, in ns */
+};
+
+static const struct {
+    const char* name;
+    uint8_t type;
+    uint8_t code;
+} sr_icmp_kinds[SR_ICMP_KIND_MAX] = {
+    { "time_exceeded",    icmp_type_time_exceeded,    icmp_code_ttl_exceeded },
+    { "net_unreachable",  icmp_type_dest_unreachable, icmp_code_net_unreachable },
+    { "host_unreachable", icmp_type_dest_unreachable, icmp_code_host_unreachable },
+    { "port_unreachable", icmp_type_dest_unreachable, icmp_code_port_unreachable },
+    { "frag_needed",      icmp_type_dest_unreachable, icmp_code_frag_needed },
+    { "reasm_timeout",    icmp_type_time_exceeded,    icmp_code_reasm_exceeded },
+};
+
+static struct sr_icmp_template sr_icmp_templates[SR_ICMP_KIND_MAX];
+
+static pthread_mutex_t sr_icmp_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sr_icmp_rate sr_icmp_kind_rate;
+static struct sr_icmp_rate sr_icmp_prefix_rate;
+static struct sr_icmp_bucket sr_icmp_kind_buckets[SR_ICMP_KIND_MAX];
+static struct sr_icmp_bucket sr_icmp_prefix_buckets[SR_ICMP_PREFIX_SLOTS];
+static uint16_t sr_icmp_ip_id = 0;
+static int sr_icmp_rate_configured = 0;
+
+static uint64_t sr_icmp_sent[SR_ICMP_KIND_MAX];
+static uint64_t sr_icmp_suppressed_rate[SR_ICMP_KIND_MAX];
+static uint64_t sr_icmp_suppressed_prefix[SR_ICMP_KIND_MAX];
+
+static void sr_icmp_rate_set(struct sr_icmp_rate* r, unsigned int pps,
+                             unsigned int burst)
+{
+    r->interval = pps ? 1000000000ULL / pps : 0;
+    r->tolerance = r->interval * (burst ? burst - 1 : 0);
+}
+
+static int sr_icmp_take(struct sr_icmp_bucket* b, struct sr_icmp_rate* r,
+                        uint64_t now)
+{
+    if(b->tat > now + r->tolerance)
+    { return 0; }
+    b->tat = (b->tat > now ? b->tat : now) + r->interval;
+    return 1;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_icmp_allow(..)
+ * Scope:  Local
+ *
+ * Charge one error of kind 'kind' to be sent to 'dst' (network byte
+ * order) against both buckets.  Returns the IP id to use, or -1 if the
+ * error must be suppressed.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_icmp_allow(enum sr_icmp_kind kind, uint32_t dst)
+{
+    struct sr_icmp_bucket* pb;
+    struct timespec ts;
+    uint64_t now;
+    uint32_t prefix = ntohl(dst) & 0xffffff00;
+    int id;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+    pthread_mutex_lock(&sr_icmp_lock);
+
+    /* -- direct mapped; a new prefix takes the slot over with a full bucket -- */
+    pb = &sr_icmp_prefix_buckets[(((prefix >> 8) * 2654435761U) >> 16) %
+                                 SR_ICMP_PREFIX_SLOTS];
+    if(pb->prefix != prefix)
+    {
+        pb->prefix = prefix;
+        pb->tat = 0;
+    }
+
+    if(!sr_icmp_take(pb, &sr_icmp_prefix_rate, now))
+    {
+        sr_icmp_suppressed_prefix[kind]++;
+        id = -1;
+    }
+    else if(!sr_icmp_take(&sr_icmp_kind_buckets[kind], &sr_icmp_kind_rate, now))
+    {
+        sr_icmp_suppressed_rate[kind]++;
+        id = -1;
+    }
+    else
+    {
+        sr_icmp_sent[kind]++;
+        id = ++sr_icmp_ip_id;
+    }
+
+    pthread_mutex_unlock(&sr_icmp_lock);
+
+    return id;
+} /* -- sr_icmp_allow -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_icmp_send(..)
+ * Scope:  Local
+ *
+ * Send an ICMP error of the given kind back to the source of packet (a
+ * full ethernet frame).  Errors are never sent about ICMP errors or about
+ * non-initial fragments.  next_mtu goes into the header of frag needed
+ * errors and must be 0 for the others.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_icmp_send(struct sr_instance* sr,
+        uint8_t* packet /* lent */,
+        unsigned int len,
+        enum sr_icmp_kind kind,
+        uint16_t next_mtu)
+{
+    struct sr_icmp_template* t = &sr_icmp_templates[kind];
+    sr_ip_hdr_t* orig = (sr_ip_hdr_t*)(packet + sizeof(sr_ethernet_hdr_t));
+    sr_icmp_hdr_t* orig_icmp;
+    unsigned int orig_len;
+    uint8_t frame[SR_ICMP_FRAME_LEN];
+    sr_ip_hdr_t* ip_hdr = (sr_ip_hdr_t*)(frame + sizeof(sr_ethernet_hdr_t));
+    sr_icmp_t3_hdr_t* icmp_hdr =
+        (sr_icmp_t3_hdr_t*)(frame + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
+    struct sr_rt* rt;
+    struct sr_if* out;
+    uint32_t sum, src, dst;
+    int id;
+
+    /* REQUIRES */
+    assert(sr);
+    assert(packet);
+    assert(kind < SR_ICMP_KIND_MAX);
+
+    if(ntohs(orig->ip_off) & IP_OFFMASK)
+    { return; }
+
+    orig_len = len - sizeof(sr_ethernet_hdr_t);
+    if(orig->ip_p == ip_protocol_icmp && orig_len >= orig->ip_hl * 4 + 1)
+    {
+        orig_icmp = (sr_icmp_hdr_t*)((uint8_t*)orig + orig->ip_hl * 4);
+        if(orig_icmp->icmp_type != icmp_type_echo_request &&
+           orig_icmp->icmp_type != icmp_type_echo_reply)
+        { return; }
+    }
+
+    /* -- the ARP thread sends errors too, outside any epoch; find the
+     *    way back before charging the error to the rate limits -- */
+    sr_epoch_enter();
+    if((rt = sr_rt_lookup(sr, orig->ip_src)) == 0 ||
+       (out = sr_get_interface(sr, rt->interface)) == 0 ||
+       (id = sr_icmp_allow(kind, orig->ip_src)) < 0)
+    {
+        sr_epoch_exit();
+        return;
+    }
+
+    memcpy(frame, t->frame, SR_ICMP_FRAME_LEN);
+
+    src = ntohl(out->ip);
+    dst = ntohl(orig->ip_src);
+    ip_hdr->ip_id  = htons((uint16_t)id);
+    ip_hdr->ip_src = out->ip;
+    ip_hdr->ip_dst = orig->ip_src;
+    sum = t->ip_sum + (uint16_t)id + (src >> 16) + (src & 0xffff) +
+          (dst >> 16) + (dst & 0xffff);
+    ip_hdr->ip_sum = cksum_fold(sum);
+
+    icmp_hdr->next_mtu = htons(next_mtu);
+    memcpy(icmp_hdr->data, orig,
+           orig_len < ICMP_DATA_SIZE ? orig_len : ICMP_DATA_SIZE);
+    icmp_hdr->icmp_sum = cksum_fold(cksum_partial(icmp_hdr->data,
+                ICMP_DATA_SIZE, t->icmp_sum + next_mtu));
+
+    SR_STATS_INC(SR_STAT_ICMP_TX);
+    sr_latency_set_outcome(SR_LAT_ICMP);
+    sr_send_ip_packet(sr, frame, SR_ICMP_FRAME_LEN, rt);
+    sr_epoch_exit();
+} /* -- sr_icmp_send -- */
+
+void sr_icmp_send_error(struct sr_instance* sr,
+        uint8_t* packet /* lent */,
+        unsigned int len,
+        enum sr_icmp_kind kind)
+{
+    sr_icmp_send(sr, packet, len, kind, 0);
+} /* -- sr_icmp_send_error -- */
+
+/* Destination unreachable, fragmentation needed, with the MTU of the next
+   hop (RFC 1191) */
+void sr_icmp_send_frag_needed(struct sr_instance* sr,
+        uint8_t* packet /* lent */,
+        unsigned int len,
+        unsigned int mtu)
+{
+    sr_icmp_send(sr, packet, len, SR_ICMP_FRAG_NEEDED, (uint16_t)mtu);
+} /* -- sr_icmp_send_frag_needed -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_icmp_echo_reply(..)
+ * Scope:  Global
+ *
+ * Answer the echo request in packet, described by pkt, by rewriting it in
+ * place and sending it back out of the interface it came in on, to the
+ * MAC it came from.
+ * Nothing is allocated and the payload is never summed: swapping the
+ * addresses leaves the IP checksum unchanged, and the TTL and type
+ * changes are folded into the existing checksums.  A request that
+ * arrived with a bad ICMP checksum therefore leaves with a bad one.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_icmp_echo_reply(struct sr_instance* sr,
+        uint8_t* packet /* lent, modified */,
+        const struct sr_pkt* pkt)
+{
+    sr_ethernet_hdr_t* e_hdr = (sr_ethernet_hdr_t*)packet;
+    sr_ip_hdr_t* ip_hdr = (sr_ip_hdr_t*)(packet + pkt->l3);
+    sr_icmp_hdr_t* icmp_hdr = (sr_icmp_hdr_t*)(packet + pkt->l4);
+    struct sr_if* iface = pkt->iface;
+    unsigned int len = pkt->len;
+    uint16_t old, new;
+    uint32_t addr;
+
+    /* REQUIRES */
+    assert(sr);
+    assert(iface);
+
+    memcpy(e_hdr->ether_dhost, e_hdr->ether_shost, ETHER_ADDR_LEN);
+    memcpy(e_hdr->ether_shost, iface->addr, ETHER_ADDR_LEN);
+
+    addr = ip_hdr->ip_src;
+    ip_hdr->ip_src = ip_hdr->ip_dst;
+    ip_hdr->ip_dst = addr;
+
+    /* -- TTL shares a word with the protocol -- */
+    memcpy(&old, &ip_hdr->ip_ttl, sizeof(old));
+    ip_hdr->ip_ttl = INIT_TTL;
+    memcpy(&new, &ip_hdr->ip_ttl, sizeof(new));
+    ip_hdr->ip_sum = cksum_update16(ip_hdr->ip_sum, old, new);
+
+    memcpy(&old, icmp_hdr, sizeof(old));
+    icmp_hdr->icmp_type = icmp_type_echo_reply;
+    icmp_hdr->icmp_code = 0;
+    memcpy(&new, icmp_hdr, sizeof(new));
+    icmp_hdr->icmp_sum = cksum_update16(icmp_hdr->icmp_sum, old, new);
+
+    SR_STATS_INC(SR_STAT_ICMP_TX);
+    sr_latency_set_outcome(SR_LAT_ICMP);
+    if(len - pkt->l3 > iface->mtu)
+    { sr_frag_send(sr, packet, len, iface->mtu, 0, iface->name); }
+    else
+    { sr_send_packet(sr, packet, len, iface->name); }
+} /* -- sr_icmp_echo_reply -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_icmp_stats(..)
+ * Scope:  Local
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_icmp_stats(struct sr_stats_writer* w, void* arg)
+{
+    int k;
+
+    pthread_mutex_lock(&sr_icmp_lock);
+    for(k = 0; k < SR_ICMP_KIND_MAX; k++)
+    {
+        sr_stats_open(w, sr_icmp_kinds[k].name);
+        sr_stats_put_u64(w, "sent", sr_icmp_sent[k]);
+        sr_stats_put_u64(w, "suppressed_rate", sr_icmp_suppressed_rate[k]);
+        sr_stats_put_u64(w, "suppressed_prefix", sr_icmp_suppressed_prefix[k]);
+        sr_stats_close(w);
+    }
+    pthread_mutex_unlock(&sr_icmp_lock);
+} /* -- sr_icmp_stats -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_icmp_set_rate(..)
+ * Scope:  Global
+ *
+ * Errors per second allowed per kind and per destination /24, with a
+ * burst of a tenth of a second.  0 means unlimited.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_icmp_set_rate(unsigned int per_kind, unsigned int per_prefix)
+{
+    pthread_mutex_lock(&sr_icmp_lock);
+    sr_icmp_rate_set(&sr_icmp_kind_rate, per_kind, per_kind / 10 + 1);
+    sr_icmp_rate_set(&sr_icmp_prefix_rate, per_prefix, per_prefix / 10 + 1);
+    sr_icmp_rate_configured = 1;
+    pthread_mutex_unlock(&sr_icmp_lock);
+} /* -- sr_icmp_set_rate -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_icmp_init(..)
+ * Scope:  Global
+ *
+ * Build one template per kind.  Fields that change per packet (id,
+ * addresses, checksums, quoted data) are left zero so they don't
+ * contribute to the precomputed sums.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_icmp_init(void)
+{
+    struct sr_icmp_template* t;
+    sr_ethernet_hdr_t* e_hdr;
+    sr_ip_hdr_t* ip_hdr;
+    sr_icmp_t3_hdr_t* icmp_hdr;
+    int k;
+
+    for(k = 0; k < SR_ICMP_KIND_MAX; k++)
+    {
+        t = &sr_icmp_templates[k];
+        memset(t, 0, sizeof(*t));
+
+        e_hdr = (sr_ethernet_hdr_t*)t->frame;
+        ip_hdr = (sr_ip_hdr_t*)(t->frame + sizeof(sr_ethernet_hdr_t));
+        icmp_hdr = (sr_icmp_t3_hdr_t*)((uint8_t*)ip_hdr + sizeof(sr_ip_hdr_t));
+
+        e_hdr->ether_type = htons(ethertype_ip);
+
+        ip_hdr->ip_v   = 4;
+        ip_hdr->ip_hl  = sizeof(sr_ip_hdr_t) / 4;
+        ip_hdr->ip_len = htons(sizeof(sr_ip_hdr_t) + sizeof(sr_icmp_t3_hdr_t));
+        ip_hdr->ip_ttl = INIT_TTL;
+        ip_hdr->ip_p   = ip_protocol_icmp;
+
+        icmp_hdr->icmp_type = sr_icmp_kinds[k].type;
+        icmp_hdr->icmp_code = sr_icmp_kinds[k].code;
+
+        t->ip_sum = cksum_partial(ip_hdr, sizeof(sr_ip_hdr_t), 0);
+        t->icmp_sum = cksum_partial(icmp_hdr,
+                sizeof(sr_icmp_t3_hdr_t) - ICMP_DATA_SIZE, 0);
+    }
+
+    if(!sr_icmp_rate_configured)
+    {
+        sr_icmp_rate_set(&sr_icmp_kind_rate, SR_ICMP_RATE, SR_ICMP_BURST);
+        sr_icmp_rate_set(&sr_icmp_prefix_rate, SR_ICMP_PREFIX_RATE,
+                         SR_ICMP_PREFIX_BURST);
+    }
+
+    sr_stats_register("icmp", sr_icmp_stats, 0);
+} /* -- sr_icmp_init -- */
@@ -0,0 +1,62 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_icmp.h
+ *
+ * Description:
+ *
+ * ICMP error generation.  Each error kind has a preformatted
+ * Ethernet+IP+ICMP frame whose constant fields are already summed, so
+ * sending an error only copies the template, fills in the addresses and
+ * the quoted datagram, and finishes both checksums from the partial sums.
+ *
+ * Errors are rate limited by two token buckets: one per kind, and one per
+ * /24 of the address the error would be sent to.  Anything over either
+ * limit is counted as suppressed in the "icmp" stats section, so a TTL
+ * expiry flood or a scan of a dead subnet costs a counter increment.
+ *
+ * Echo requests are turned around in the receive buffer instead: addresses
+ * swapped, type and TTL rewritten, and both checksums adjusted for just the
+ * words that changed.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_ICMP_H
+#define SR_ICMP_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+#define SR_ICMP_RATE          1000  /* errors/s per kind */
+#define SR_ICMP_BURST         100
+#define SR_ICMP_PREFIX_RATE   100   /* errors/s per destination /24 */
+#define SR_ICMP_PREFIX_BURST  10
+#define SR_ICMP_PREFIX_SLOTS  1024
+
+struct sr_instance;
+struct sr_if;
+struct sr_pkt;
+
+enum sr_icmp_kind {
+    SR_ICMP_TIME_EXCEEDED,
+    SR_ICMP_NET_UNREACH,
+    SR_ICMP_HOST_UNREACH,
+    SR_ICMP_PORT_UNREACH,
+    SR_ICMP_FRAG_NEEDED,        /* use sr_icmp_send_frag_needed(..) */
+    SR_ICMP_REASM_TIMEOUT,
+    SR_ICMP_KIND_MAX
+};
+
+void sr_icmp_init(void);
+void sr_icmp_set_rate(unsigned int per_kind, unsigned int per_prefix);
+void sr_icmp_send_error(struct sr_instance* sr, uint8_t* packet,
+                        unsigned int len, enum sr_icmp_kind kind);
+void sr_icmp_send_frag_needed(struct sr_instance* sr, uint8_t* packet,
+                              unsigned int len, unsigned int mtu);
+void sr_icmp_echo_reply(struct sr_instance* sr, uint8_t* packet,
+                        const struct sr_pkt* pkt);
+
+#endif /* -- SR_ICMP_H -- */
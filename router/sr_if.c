@@ -54,6 +54,154 @@ struct sr_if* sr_get_interface(struct sr_instance* sr, const char* name)
     return 0;
 } /* -- sr_get_interface -- */
 
+/* All 32 bits mixed: hosts on one subnet differ only in the top bytes of
+ * a network order address */
+static __inline__ uint32_t sr_local_hash(uint32_t seed, uint32_t ip_nbo)
+{
+    uint32_t h = ip_nbo ^ seed;
+
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    return h ^ (h >> 16);
+}
+
+/*--------------------------------------------------------------------- 
+ * Method: sr_get_interface_by_ip
+ * Scope: Global
+ *
+ * Return the interface that owns the IP address ip_nbo (network byte
+ * order) or 0 if the address isn't one of ours.  Receive thread only
+ * once sr_local_build() has run.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_if* sr_get_interface_by_ip(struct sr_instance* sr, uint32_t ip_nbo)
+{
+    struct sr_if* if_walker = 0;
+    struct sr_local* local;
+    uint32_t i;
+
+    /* -- REQUIRES -- */
+    assert(sr);
+
+    if((local = sr->local) != 0)
+    {
+        for(i = sr_local_hash(local->seed, ip_nbo) & local->mask;
+            local->slots[i].iface; i = (i + 1) & local->mask)
+        {
+            if(local->slots[i].ip == ip_nbo)
+            { return local->slots[i].iface; }
+        }
+        return 0;
+    }
+
+    /* -- interfaces are still being added -- */
+    for(if_walker = sr->if_list; if_walker; if_walker = if_walker->next)
+    {
+        if(if_walker->ip == ip_nbo)
+        { return if_walker; }
+    }
+
+    return 0;
+} /* -- sr_get_interface_by_ip -- */
+
+/* Fill slots (mask + 1 of them, zeroed) with seed; returns the longest
+ * probe sequence a lookup for one of our addresses will take */
+static unsigned int sr_local_fill(struct sr_instance* sr,
+                                  struct sr_local_slot* slots,
+                                  uint32_t mask, uint32_t seed)
+{
+    struct sr_if* if_walker;
+    unsigned int probes, max_probes = 0;
+    uint32_t i;
+
+    for(if_walker = sr->if_list; if_walker; if_walker = if_walker->next)
+    {
+        if(if_walker->ip == 0)
+        { continue; }
+
+        /* -- an address on two interfaces belongs to the first -- */
+        probes = 1;
+        for(i = sr_local_hash(seed, if_walker->ip) & mask;
+            slots[i].iface && slots[i].ip != if_walker->ip; i = (i + 1) & mask)
+        { probes++; }
+        if(slots[i].iface)
+        { continue; }
+
+        slots[i].ip = if_walker->ip;
+        slots[i].iface = if_walker;
+        if(probes > max_probes)
+        { max_probes = probes; }
+    }
+    return max_probes;
+}
+
+/*--------------------------------------------------------------------- 
+ * Method: sr_local_build(..)
+ * Scope: Global
+ *
+ * (Re)build the set of our own addresses from the interface list, once
+ * all interfaces are known.  Until then sr_get_interface_by_ip() walks
+ * the list.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_local_build(struct sr_instance* sr)
+{
+    struct sr_local* local;
+    struct sr_local_slot* trial;
+    struct sr_local_slot* tmp;
+    struct sr_if* if_walker;
+    unsigned int count = 0, probes, k;
+    uint32_t size = 8, seed;
+
+    /* -- REQUIRES -- */
+    assert(sr);
+
+    for(if_walker = sr->if_list; if_walker; if_walker = if_walker->next)
+    {
+        if(if_walker->ip)
+        { count++; }
+    }
+    while(size < 4 * count)
+    { size *= 2; }
+
+    local = (struct sr_local*)calloc(1, sizeof(struct sr_local));
+    trial = (struct sr_local_slot*)calloc(size, sizeof(struct sr_local_slot));
+    assert(local && trial);
+    local->slots = (struct sr_local_slot*)calloc(size, sizeof(struct sr_local_slot));
+    assert(local->slots);
+    local->mask = size - 1;
+    local->count = count;
+    local->max_probes = ~0U;
+
+    /* -- keep the seed that leaves the fewest probes, stop at a perfect one -- */
+    for(k = 0; k < SR_LOCAL_SEEDS && local->max_probes > 1; k++)
+    {
+        seed = k * 0x9e3779b9U;
+        memset(trial, 0, size * sizeof(struct sr_local_slot));
+        probes = sr_local_fill(sr, trial, local->mask, seed);
+        if(probes < local->max_probes)
+        {
+            tmp = local->slots;
+            local->slots = trial;
+            trial = tmp;
+            local->seed = seed;
+            local->max_probes = probes;
+        }
+    }
+    free(trial);
+
+    if(sr->local)
+    {
+        free(sr->local->slots);
+        free(sr->local);
+    }
+    sr->local = local;
+} /* -- sr_local_build -- */
+
 /*--------------------------------------------------------------------- 
  * Method: sr_add_interface(..)
  * Scope: Global
@@ -73,9 +221,10 @@ void sr_add_interface(struct sr_instance* sr, const char* name)
     /* -- empty list special case -- */
     if(sr->if_list == 0)
     {
-        sr->if_list = (struct sr_if*)malloc(sizeof(struct sr_if));
+        sr->if_list = (struct sr_if*)calloc(1,sizeof(struct sr_if));
         assert(sr->if_list);
         sr->if_list->next = 0;
+        sr->if_list->mtu = SR_IF_DEFAULT_MTU;
         strncpy(sr->if_list->name,name,sr_IFACE_NAMELEN);
         return;
     }
@@ -85,9 +234,11 @@ void sr_add_interface(struct sr_instance* sr, const char* name)
     while(if_walker->next)
     {if_walker = if_walker->next; }
 
-    if_walker->next = (struct sr_if*)malloc(sizeof(struct sr_if));
+    if_walker->next = (struct sr_if*)calloc(1,sizeof(struct sr_if));
     assert(if_walker->next);
+    if_walker->next->ifindex = if_walker->ifindex + 1;
     if_walker = if_walker->next;
+    if_walker->mtu = SR_IF_DEFAULT_MTU;
     strncpy(if_walker->name,name,sr_IFACE_NAMELEN);
     if_walker->next = 0;
 } /* -- sr_add_interface -- */ 
@@ -140,6 +291,29 @@ void sr_set_ether_ip(struct sr_instance* sr, uint32_t ip_nbo)
 
 } /* -- sr_set_ether_ip -- */
 
+/*--------------------------------------------------------------------- 
+ * Method: sr_set_ether_speed(..)
+ * Scope: Global
+ *
+ * set the link speed (Mbit/s) of the LAST interface in the interface list
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_set_ether_speed(struct sr_instance* sr, uint32_t mbps)
+{
+    struct sr_if* if_walker = 0;
+
+    /* -- REQUIRES -- */
+    assert(sr->if_list);
+
+    if_walker = sr->if_list;
+    while(if_walker->next)
+    {if_walker = if_walker->next; }
+
+    if_walker->speed = mbps;
+
+} /* -- sr_set_ether_speed -- */
+
 /*--------------------------------------------------------------------- 
  * Method: sr_print_if_list(..)
  * Scope: Global
@@ -191,4 +365,5 @@ void sr_print_if(struct sr_if* iface)
     DebugMAC(iface->addr);
     Debug("\n");
     Debug("\tinet addr %s\n",inet_ntoa(ip_addr));
+    Debug("\tmtu %u\n",iface->mtu);
 } /* -- sr_print_if -- */
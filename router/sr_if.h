@@ -26,6 +26,10 @@
 
 #include "sr_protocol.h"
 
+#define SR_IF_DEFAULT_MTU 1500
+#define SR_IF_MIN_MTU     68      /* RFC 791: 60 byte header + 8 bytes */
+#define SR_LOCAL_SEEDS    16      /* hash seeds tried per table build */
+
 struct sr_instance;
 
 /* ----------------------------------------------------------------------------
@@ -41,13 +45,46 @@ struct sr_if
   unsigned char addr[ETHER_ADDR_LEN];
   uint32_t ip;
   uint32_t speed;
+  uint32_t mtu;          /* largest IP datagram we send out of here */
+  unsigned int ifindex;  /* position in the interface list */
   struct sr_if* next;
 };
 
+/* ----------------------------------------------------------------------------
+ * struct sr_local
+ *
+ * Open addressed set of the router's own addresses, owner interface per
+ * address, so telling whether a packet is ours takes one probe instead of
+ * a walk of the interface list.  The table is at most a quarter full and
+ * built with whichever of SR_LOCAL_SEEDS hash seeds displaces entries
+ * least; with a handful of addresses that's a perfect hash, and a miss
+ * (the common case, traffic passing through) usually finds an empty slot
+ * first.
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_local_slot
+{
+  uint32_t ip;
+  struct sr_if* iface;   /* 0: empty */
+};
+
+struct sr_local
+{
+  struct sr_local_slot* slots;
+  uint32_t mask;         /* slots - 1 */
+  uint32_t seed;
+  unsigned int count;
+  unsigned int max_probes;
+};
+
 struct sr_if* sr_get_interface(struct sr_instance* sr, const char* name);
+struct sr_if* sr_get_interface_by_ip(struct sr_instance* sr, uint32_t ip_nbo);
 void sr_add_interface(struct sr_instance*, const char*);
 void sr_set_ether_addr(struct sr_instance*, const unsigned char*);
 void sr_set_ether_ip(struct sr_instance*, uint32_t ip_nbo);
+void sr_set_ether_speed(struct sr_instance*, uint32_t mbps);
+void sr_local_build(struct sr_instance*);
 void sr_print_if_list(struct sr_instance*);
 void sr_print_if(struct sr_if*);
 
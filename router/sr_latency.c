@@ -0,0 +1,195 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_latency.c
+ *
+ * Description:
+ *
+ * Cycle-stamped latency histograms, see sr_latency.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "sr_stats.h"
+#include "sr_latency.h"
+
+struct sr_lat_hist {
+    uint64_t count[SR_LAT_MAX][SR_LAT_BUCKETS];
+    uint64_t sum[SR_LAT_MAX];
+    uint64_t max[SR_LAT_MAX];
+} __attribute__ ((aligned (SR_CACHELINE)));
+
+static const char* sr_lat_names[SR_LAT_MAX] = {
+    "forwarded", "arp_queued", "icmp", "arp"
+};
+
+static struct sr_lat_hist sr_lat_hists[SR_STATS_MAX_THREADS];
+static double sr_lat_cycles_per_ns = 1.0;
+
+static __thread uint64_t sr_lat_stamp = 0;
+static __thread int sr_lat_outcome = SR_LAT_NONE;
+
+/*---------------------------------------------------------------------
+ * Method: sr_lat_bucket(..)
+ * Scope:  Local
+ *
+ * Values below SR_LAT_SUB get a bucket each; above that every power of
+ * two is split into SR_LAT_SUB linear sub-buckets.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_lat_bucket(uint64_t v)
+{
+    int e;
+
+    if(v < SR_LAT_SUB)
+    { return (int)v; }
+
+    e = 63 - __builtin_clzll(v);
+    return (e - SR_LAT_SUB_BITS + 1) * SR_LAT_SUB +
+           (int)((v >> (e - SR_LAT_SUB_BITS)) & (SR_LAT_SUB - 1));
+} /* -- sr_lat_bucket -- */
+
+/* upper bound of bucket i */
+static uint64_t sr_lat_bucket_value(int i)
+{
+    int e;
+
+    if(i < SR_LAT_SUB)
+    { return (uint64_t)i; }
+
+    e = i / SR_LAT_SUB + SR_LAT_SUB_BITS - 1;
+    return (((uint64_t)(SR_LAT_SUB + i % SR_LAT_SUB + 1)) << (e - SR_LAT_SUB_BITS)) - 1;
+} /* -- sr_lat_bucket_value -- */
+
+static void sr_lat_record(int outcome, uint64_t cycles)
+{
+    struct sr_lat_hist* h = &sr_lat_hists[sr_stats_thread_id()];
+
+    h->count[outcome][sr_lat_bucket(cycles)]++;
+    h->sum[outcome] += cycles;
+    if(cycles > h->max[outcome])
+    { h->max[outcome] = cycles; }
+}
+
+void sr_latency_rx(void)
+{
+    sr_lat_stamp = sr_cycles();
+    sr_lat_outcome = SR_LAT_NONE;
+}
+
+void sr_latency_set_outcome(enum sr_lat_outcome outcome)
+{
+    sr_lat_outcome = outcome;
+}
+
+void sr_latency_tx(void)
+{
+    if(sr_lat_stamp && sr_lat_outcome != SR_LAT_NONE)
+    {
+        sr_lat_record(sr_lat_outcome, sr_cycles() - sr_lat_stamp);
+        sr_lat_stamp = 0;
+    }
+}
+
+void sr_latency_done(enum sr_lat_outcome outcome)
+{
+    sr_lat_outcome = outcome;
+    sr_latency_tx();
+}
+
+double sr_cycles_per_ns(void)
+{
+    return sr_lat_cycles_per_ns;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_latency_stats(..)
+ * Scope:  Local
+ *
+ * Merge the per-thread histograms and report percentiles in ns.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_latency_stats(struct sr_stats_writer* w, void* arg)
+{
+    static uint64_t merged[SR_LAT_BUCKETS];
+    static const double pct[] = { 0.50, 0.99, 0.999 };
+    static const char* pct_names[] = { "p50_ns", "p99_ns", "p999_ns" };
+    uint64_t total, sum, max, seen, rank, v;
+    int o, t, i, p;
+
+    for(o = 0; o < SR_LAT_MAX; o++)
+    {
+        memset(merged, 0, sizeof(merged));
+        total = sum = max = 0;
+
+        for(t = 0; t < SR_STATS_MAX_THREADS; t++)
+        {
+            for(i = 0; i < SR_LAT_BUCKETS; i++)
+            {
+                merged[i] += sr_lat_hists[t].count[o][i];
+                total += sr_lat_hists[t].count[o][i];
+            }
+            sum += sr_lat_hists[t].sum[o];
+            if(sr_lat_hists[t].max[o] > max)
+            { max = sr_lat_hists[t].max[o]; }
+        }
+
+        sr_stats_open(w, sr_lat_names[o]);
+        sr_stats_put_u64(w, "count", total);
+        if(total)
+        {
+            sr_stats_put_double(w, "mean_ns", sum / (double)total / sr_lat_cycles_per_ns);
+            for(p = 0; p < 3; p++)
+            {
+                rank = (uint64_t)(pct[p] * total);
+                for(seen = 0, i = 0; i < SR_LAT_BUCKETS; i++)
+                {
+                    seen += merged[i];
+                    if(seen > rank)
+                    { break; }
+                }
+                if(i == SR_LAT_BUCKETS)
+                { i--; }
+                v = sr_lat_bucket_value(i);
+                sr_stats_put_double(w, pct_names[p],
+                        (v < max ? v : max) / sr_lat_cycles_per_ns);
+            }
+            sr_stats_put_double(w, "max_ns", max / sr_lat_cycles_per_ns);
+        }
+        sr_stats_close(w);
+    }
+} /* -- sr_latency_stats -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_latency_init(..)
+ * Scope:  Global
+ *
+ * Calibrate the cycle counter against the monotonic clock and register
+ * the stats section.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_latency_init(void)
+{
+    struct timespec t0, t1, pause;
+    uint64_t c0, c1;
+    double ns;
+
+    pause.tv_sec = 0;
+    pause.tv_nsec = 20000000;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    c0 = sr_cycles();
+    nanosleep(&pause, 0);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    c1 = sr_cycles();
+
+    ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+    if(ns > 0 && c1 > c0)
+    { sr_lat_cycles_per_ns = (c1 - c0) / ns; }
+
+    sr_stats_register("latency", sr_latency_stats, 0);
+} /* -- sr_latency_init -- */
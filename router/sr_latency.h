@@ -0,0 +1,74 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_latency.h
+ *
+ * Description:
+ *
+ * Per-packet latency from the moment a frame is read off the VNS socket to
+ * the moment the router's answer is written back.  Timestamps come from the
+ * cycle counter and land in per-thread log-linear histograms (16 sub-buckets
+ * per power of two, so any reported percentile is within ~6% of the real
+ * value), one per outcome.  The "latency" stats section reports
+ * p50/p99/p999 in nanoseconds.
+ *
+ * Usage on the receive thread:
+ *
+ *   sr_latency_rx();                          -- frame arrived
+ *   sr_latency_set_outcome(SR_LAT_FORWARD);   -- router decided what to do
+ *   sr_send_packet(..)                        -- calls sr_latency_tx()
+ *
+ * Only the first transmission after sr_latency_rx() is recorded, and
+ * nothing is recorded unless an outcome was set.  With egress queueing
+ * (sr -q) the stamp is taken when the frame is queued, not when it is
+ * written; queueing delay is reported separately, per interface, in the
+ * "egress" section.  A frame the queue drops records nothing.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_LATENCY_H
+#define SR_LATENCY_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+#include <time.h>
+
+#define SR_LAT_SUB_BITS 4
+#define SR_LAT_SUB      (1 << SR_LAT_SUB_BITS)
+#define SR_LAT_BUCKETS  ((64 - SR_LAT_SUB_BITS + 1) * SR_LAT_SUB)
+
+enum sr_lat_outcome {
+    SR_LAT_NONE = -1,
+    SR_LAT_FORWARD,             /* forwarded with a cached next hop */
+    SR_LAT_ARP_QUEUED,          /* parked waiting for ARP */
+    SR_LAT_ICMP,                /* answered with ICMP */
+    SR_LAT_ARP,                 /* ARP reply */
+    SR_LAT_MAX
+};
+
+/* Cycle counter: TSC on x86, nanoseconds elsewhere */
+static __inline__ uint64_t sr_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t lo, hi;
+    __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t)hi << 32) | lo;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+void sr_latency_init(void);
+void sr_latency_rx(void);
+void sr_latency_set_outcome(enum sr_lat_outcome outcome);
+void sr_latency_tx(void);
+void sr_latency_done(enum sr_lat_outcome outcome);
+double sr_cycles_per_ns(void);
+
+#endif /* -- SR_LATENCY_H -- */
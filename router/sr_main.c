@@ -21,6 +21,7 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <pwd.h>
 #include <sys/types.h>
@@ -32,6 +33,19 @@
 #include "sr_dumper.h"
 #include "sr_router.h"
 #include "sr_rt.h"
+#include "sr_replay.h"
+#include "sr_stats.h"
+#include "sr_icmp.h"
+#include "sr_acl.h"
+#include "sr_nat.h"
+#include "sr_ct.h"
+#include "sr_sched.h"
+#include "sr_flow.h"
+#include "sr_top.h"
+#include "sr_fib.h"
+#include "sr_huge.h"
+#include "sr_cpu.h"
+#include "sr_poll.h"
 
 extern char* optarg;
 
@@ -43,6 +57,7 @@ extern char* optarg;
 #define DEFAULT_HOST "vrhost"
 #define DEFAULT_SERVER "localhost"
 #define DEFAULT_RTABLE "rtable"
+#define DEFAULT_ACL "acl"
 #define DEFAULT_TOPO 0
 
 static void usage(char* );
@@ -50,6 +65,13 @@ static void sr_init_instance(struct sr_instance* );
 static void sr_destroy_instance(struct sr_instance* );
 static void sr_set_user(struct sr_instance* );
 static void sr_load_rt_wrap(struct sr_instance* sr, char* rtable);
+static void sr_load_acl_wrap(struct sr_instance* sr, char* acl);
+static void sr_load_nat_wrap(struct sr_instance* sr, char* nat);
+static void sr_load_ct_wrap(struct sr_instance* sr, char* ct);
+static void sr_load_sched_wrap(struct sr_instance* sr, unsigned int limit,
+                               int pace);
+static void sr_load_flow_wrap(struct sr_instance* sr, char* flow);
+static void sr_load_top_wrap(struct sr_instance* sr, char* top);
 
 /*-----------------------------------------------------------------------------
  *---------------------------------------------------------------------------*/
@@ -61,15 +83,29 @@ int main(int argc, char **argv)
     char *user = 0;
     char *server = DEFAULT_SERVER;
     char *rtable = DEFAULT_RTABLE;
+    char *acl = 0;
+    char *nat = 0;
+    char *ct = 0;
+    char *flow = 0;
+    char *top = 0;
+    unsigned int queue_limit = 0;
+    int pace = 0;
+    int compile = 0;
     char *template = NULL;
     unsigned int port = DEFAULT_PORT;
     unsigned int topo = DEFAULT_TOPO;
     char *logfile = 0;
+    char *replay = 0;
+    char *replay_out = 0;
+    char *hwinfo = 0;
+    char *stats_path = 0;
+    unsigned int icmp_rate, icmp_prefix_rate;
+    double replay_speed = SR_REPLAY_AFAP;
     struct sr_instance sr;
 
     printf("Using %s\n", VERSION_INFO);
 
-    while ((c = getopt(argc, argv, "hs:v:p:u:t:r:l:T:")) != EOF)
+    while ((c = getopt(argc, argv, "hs:v:p:u:t:r:a:n:f:q:PECl:T:R:w:H:x:k:I:G:A:B:F:K:")) != EOF)
     {
         switch (c)
         {
@@ -98,12 +134,82 @@ int main(int argc, char **argv)
             case 'r':
                 rtable = optarg;
                 break;
+            case 'a':
+                acl = optarg;
+                break;
+            case 'n':
+                nat = optarg;
+                break;
+            case 'f':
+                ct = optarg;
+                break;
+            case 'q':
+                queue_limit = atoi((char *) optarg);
+                break;
+            case 'P':
+                pace = 1;
+                break;
+            case 'E':
+                sr_rt_set_ecmp(1);
+                break;
+            case 'C':
+                compile = 1;
+                break;
             case 'T':
                 template = optarg;
                 break;
+            case 'R':
+                replay = optarg;
+                break;
+            case 'w':
+                replay_out = optarg;
+                break;
+            case 'H':
+                hwinfo = optarg;
+                break;
+            case 'x':
+                replay_speed = atof((char *) optarg);
+                break;
+            case 'k':
+                stats_path = optarg;
+                break;
+            case 'I':
+                icmp_rate = atoi((char *) optarg);
+                icmp_prefix_rate = icmp_rate / 10;
+                if(strchr(optarg, ':'))
+                { icmp_prefix_rate = atoi(strchr(optarg, ':') + 1); }
+                sr_icmp_set_rate(icmp_rate, icmp_prefix_rate);
+                break;
+            case 'G':
+                if(sr_huge_set_mode(optarg) != 0)
+                {
+                    fprintf(stderr, "Unknown hugepage mode %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'A':
+                if(sr_cpu_parse(optarg) != 0)
+                { exit(1); }
+                break;
+            case 'B':
+                sr_poll_set(atoi((char *) optarg));
+                break;
+            case 'F':
+                flow = optarg;
+                break;
+            case 'K':
+                top = optarg;
+                break;
         } /* switch */
     } /* -- while -- */
 
+    /* -- compile the routing table for fast loading, and stop -- */
+    if(compile)
+    { return sr_rt_compile(rtable) == 0 ? 0 : 1; }
+
+    /* -- this thread forwards; place it before it loads any tables -- */
+    sr_cpu_bind(SR_CPU_RX);
+
     /* -- zero out sr instance -- */
     sr_init_instance(&sr);
 
@@ -135,6 +241,39 @@ int main(int argc, char **argv)
         }
     }
 
+    /* -- offline replay of a capture, no server involved -- */
+    if(replay)
+    {
+        if(!hwinfo || template)
+        {
+            fprintf(stderr,"Replay needs a hardware file (-H) and no template\n");
+            exit(1);
+        }
+        if(sr_replay_load_hwinfo(&sr, hwinfo) != 0)
+        { exit(1); }
+        if(sr_verify_routing_table(&sr) != 0)
+        {
+            fprintf(stderr,"Routing table not consistent with hardware\n");
+            exit(1);
+        }
+        sr_load_acl_wrap(&sr, acl);
+        sr_load_nat_wrap(&sr, nat);
+        sr_load_ct_wrap(&sr, ct);
+        sr_load_sched_wrap(&sr, queue_limit, pace);
+        sr_load_flow_wrap(&sr, flow);
+        sr_load_top_wrap(&sr, top);
+        if(sr_init_interfaces(&sr) != 0)
+        { exit(1); }
+
+        sr_init(&sr);
+        if(stats_path && sr_stats_serve(&sr, stats_path) != 0)
+        { exit(1); }
+
+        c = sr_replay_run(&sr, replay, replay_out, replay_speed);
+        sr_destroy_instance(&sr);
+        return c == 0 ? 0 : 1;
+    }
+
     Debug("Client %s connecting to Server %s:%d\n", sr.user, server, port);
     if(template)
         Debug("Requesting topology template %s\n", template);
@@ -156,9 +295,20 @@ int main(int argc, char **argv)
       sr_load_rt_wrap(&sr, rtable);
     }
 
+    sr_load_acl_wrap(&sr, acl);
+    sr_load_nat_wrap(&sr, nat);
+    sr_load_ct_wrap(&sr, ct);
+    sr_load_sched_wrap(&sr, queue_limit, pace);
+    sr_load_flow_wrap(&sr, flow);
+    sr_load_top_wrap(&sr, top);
+
     /* call router init (for arp subsystem etc.) */
     sr_init(&sr);
 
+    /* -- counters on a local socket -- */
+    if(stats_path && sr_stats_serve(&sr, stats_path) != 0)
+    { return 1; }
+
     /* -- whizbang main loop ;-) */
     while( sr_read_from_server(&sr) == 1);
 
@@ -177,8 +327,21 @@ static void usage(char* argv0)
     printf("Simple Router Client\n");
     printf("Format: %s [-h] [-v host] [-s server] [-p port] \n",argv0);
     printf("           [-T template_name] [-u username] \n");
-    printf("           [-t topo id] [-r routing table] \n");
-    printf("           [-l log file] \n");
+    printf("           [-t topo id] [-r routing table] [-a acl file] \n");
+    printf("           [-n NAT external iface[:max mappings]] \n");
+    printf("           [-f return traffic only iface[,iface..][:max connections]] \n");
+    printf("           [-q egress queue limit per class] [-P pace to link speed] \n");
+    printf("           [-E resilient ECMP hashing] [-C compile routing table] \n");
+    printf("           [-l log file] [-k stats socket] \n");
+    printf("           [-I icmp errors/s[:per /24], 0 = unlimited] \n");
+    printf("           [-G hugepages for large tables: off, thp or explicit] \n");
+    printf("           [-A thread placement, e.g. rx=2,tx=3,timer=0] \n");
+    printf("           [-B busy-poll the server socket for up to us] \n");
+    printf("           [-F IPFIX flow export to file or a.b.c.d:port\n");
+    printf("            [,active=s][,idle=s][,sample=N]] \n");
+    printf("           [-K top talkers to track[:prefix length]] \n");
+    printf("           [-R replay pcap -H hardware file [-w output pcap]\n");
+    printf("            [-x speed, 0 = as fast as possible, 1 = original]]\n");
     printf("   defaults server=%s port=%d host=%s  \n",
             DEFAULT_SERVER, DEFAULT_PORT, DEFAULT_HOST );
 } /* -- usage -- */
@@ -220,6 +383,9 @@ static void sr_destroy_instance(struct sr_instance* sr)
     /* REQUIRES */
     assert(sr);
 
+    if(sr->flow)
+    { sr_flow_drain(sr->flow); }
+
     if(sr->logfile)
     {
         sr_dump_close(sr->logfile);
@@ -247,71 +413,197 @@ static void sr_init_instance(struct sr_instance* sr)
     sr->host[0] = 0;
     sr->topo_id = 0;
     sr->if_list = 0;
-    sr->routing_table = 0;
+    sr->local = 0;
+    sr->fib = 0;
     sr->logfile = 0;
+    sr->replay = 0;
+    sr->acl = 0;
+    sr->nat = 0;
+    sr->ct = 0;
+    sr->sched = 0;
+    sr->flow = 0;
+    sr->top = 0;
 } /* -- sr_init_instance -- */
 
+static void sr_load_rt_wrap(struct sr_instance* sr, char* rtable) {
+    if(sr_load_rt(sr, rtable) != 0) {
+        fprintf(stderr,"Error setting up routing table from file %s\n",
+                rtable);
+        exit(1);
+    }
+
+
+    printf("Loading routing table\n");
+    printf("---------------------------------------------\n");
+    sr_print_routing_table(sr);
+    printf("---------------------------------------------\n");
+}
+
 /*-----------------------------------------------------------------------------
- * Method: sr_verify_routing_table()
- * Scope: Global
+ * Method: sr_load_acl_wrap(..)
+ * Scope: local
  *
- * make sure the routing table is consistent with the interface list by
- * verifying that all interfaces used in the routing table actually exist
- * in the hardware.
+ * Load the ACL given with -a, or DEFAULT_ACL if there is one.  Rules that
+ * name interfaces are resolved by sr_init_interfaces(..).
  *
- * RETURN VALUES:
+ *---------------------------------------------------------------------------*/
+
+static void sr_load_acl_wrap(struct sr_instance* sr, char* acl) {
+    if(acl == 0) {
+        if(access(DEFAULT_ACL, R_OK) != 0)
+        { return; }
+        acl = DEFAULT_ACL;
+    }
+    if((sr->acl = sr_acl_load(sr, acl)) == 0) {
+        fprintf(stderr,"Error setting up ACL from file %s\n", acl);
+        exit(1);
+    }
+}
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_parse_limit(..)
+ * Scope: local
  *
- *  0 on success
- *  something other than zero on error
+ * Read the decimal limit after the ':' of an option into n.  Returns 0,
+ * or -1 if s is empty, has anything after the digits or doesn't fit.
  *
  *---------------------------------------------------------------------------*/
 
-int sr_verify_routing_table(struct sr_instance* sr)
-{
-    struct sr_rt* rt_walker = 0;
-    struct sr_if* if_walker = 0;
-    int ret = 0;
+static int sr_parse_limit(const char* s, uint32_t* n) {
+    char* end;
+    unsigned long v;
+
+    if(*s < '0' || *s > '9')
+    { return -1; }
+    errno = 0;
+    v = strtoul(s, &end, 10);
+    if(errno || *end || v > 0xffffffffUL)
+    { return -1; }
+    *n = (uint32_t)v;
+    return 0;
+}
 
-    /* -- REQUIRES --*/
-    assert(sr);
+/*-----------------------------------------------------------------------------
+ * Method: sr_load_nat_wrap(..)
+ * Scope: local
+ *
+ * Turn on NAT for -n <iface>[:max mappings].  The interface is looked up
+ * by sr_init_interfaces(..).
+ *
+ *---------------------------------------------------------------------------*/
 
-    if( (sr->if_list == 0) || (sr->routing_table == 0))
-    {
-        return 999; /* doh! */
+static void sr_load_nat_wrap(struct sr_instance* sr, char* nat) {
+    char* max;
+    uint32_t n = SR_NAT_DEFAULT_MAX;
+
+    if(nat == 0)
+    { return; }
+    if((max = strchr(nat, ':'))) {
+        *max++ = 0;
+        if(sr_parse_limit(max, &n) != 0) {
+            fprintf(stderr,"Bad NAT mapping limit %s\n", max);
+            exit(1);
+        }
+    }
+    if((sr->nat = sr_nat_create(sr, nat, n)) == 0) {
+        fprintf(stderr,"Error setting up NAT on %s\n", nat);
+        exit(1);
     }
+}
 
-    rt_walker = sr->routing_table;
+/*-----------------------------------------------------------------------------
+ * Method: sr_load_ct_wrap(..)
+ * Scope: local
+ *
+ * Turn on connection tracking for -f <iface>[,<iface>..][:max], letting
+ * only return traffic in on the listed interfaces.  They're looked up by
+ * sr_init_interfaces(..).
+ *
+ *---------------------------------------------------------------------------*/
 
-    while(rt_walker)
-    {
-        /* -- check to see if interface exists -- */
-        if_walker = sr->if_list;
-        while(if_walker)
-        {
-            if( strncmp(if_walker->name,rt_walker->interface,sr_IFACE_NAMELEN)
-                    == 0)
-            { break; }
-            if_walker = if_walker->next;
+static void sr_load_ct_wrap(struct sr_instance* sr, char* ct) {
+    char* max;
+    char* name;
+    uint32_t n = SR_CT_DEFAULT_MAX;
+
+    if(ct == 0)
+    { return; }
+    if((max = strchr(ct, ':'))) {
+        *max++ = 0;
+        if(sr_parse_limit(max, &n) != 0) {
+            fprintf(stderr,"Bad connection tracking limit %s\n", max);
+            exit(1);
         }
-        if(if_walker == 0)
-        { ret++; } /* -- interface not found! -- */
+    }
+    if((sr->ct = sr_ct_create(n)) == 0) {
+        fprintf(stderr,"Error setting up connection tracking\n");
+        exit(1);
+    }
+    for(name = strtok(ct, ","); name; name = strtok(0, ",")) {
+        if(sr_ct_reply_only(sr->ct, name) != 0)
+        { exit(1); }
+    }
+}
 
-        rt_walker = rt_walker->next;
-    } /* -- while -- */
+/*-----------------------------------------------------------------------------
+ * Method: sr_load_sched_wrap(..)
+ * Scope: local
+ *
+ * Turn on egress queueing for -q <limit> and/or -P.  The queues are
+ * attached to the interfaces by sr_init_interfaces(..).
+ *
+ *---------------------------------------------------------------------------*/
 
-    return ret;
-} /* -- sr_verify_routing_table -- */
+static void sr_load_sched_wrap(struct sr_instance* sr, unsigned int limit,
+                               int pace) {
+    if(limit == 0 && pace == 0)
+    { return; }
+    if(limit == 0)
+    { limit = SR_SCHED_DEFAULT_LIMIT; }
+    if((sr->sched = sr_sched_create(sr, limit, pace)) == 0) {
+        fprintf(stderr,"Error setting up egress queues\n");
+        exit(1);
+    }
+}
 
-static void sr_load_rt_wrap(struct sr_instance* sr, char* rtable) {
-    if(sr_load_rt(sr, rtable) != 0) {
-        fprintf(stderr,"Error setting up routing table from file %s\n",
-                rtable);
+/*-----------------------------------------------------------------------------
+ * Method: sr_load_flow_wrap(..)
+ * Scope: local
+ *
+ * Turn on flow accounting and export for -F <target>[,options].
+ *
+ *---------------------------------------------------------------------------*/
+
+static void sr_load_flow_wrap(struct sr_instance* sr, char* flow) {
+    if(flow == 0)
+    { return; }
+    if((sr->flow = sr_flow_create(sr, flow)) == 0) {
+        fprintf(stderr,"Error setting up flow export\n");
         exit(1);
     }
+}
 
+/*-----------------------------------------------------------------------------
+ * Method: sr_load_top_wrap(..)
+ * Scope: local
+ *
+ * Track top talkers for -K <k>[:prefix length].
+ *
+ *---------------------------------------------------------------------------*/
 
-    printf("Loading routing table\n");
-    printf("---------------------------------------------\n");
-    sr_print_routing_table(sr);
-    printf("---------------------------------------------\n");
+static void sr_load_top_wrap(struct sr_instance* sr, char* top) {
+    char* len;
+    unsigned long prefix_len = SR_TOP_DEFAULT_PREFIX;
+
+    if(top == 0)
+    { return; }
+    if((len = strchr(top, ':'))) {
+        *len++ = 0;
+        prefix_len = strtoul(len, 0, 10);
+    }
+    if((sr->top = sr_top_create((unsigned int)strtoul(top, 0, 10),
+                                (unsigned int)prefix_len)) == 0) {
+        fprintf(stderr,"Error setting up top talkers\n");
+        exit(1);
+    }
 }
@@ -0,0 +1,606 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_nat.c
+ *
+ * Description:
+ *
+ * NAPT flow table, port pools and translation, see sr_nat.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include "sr_if.h"
+#include "sr_router.h"
+#include "sr_protocol.h"
+#include "sr_utils.h"
+#include "sr_stats.h"
+#include "sr_huge.h"
+#include "sr_pkt.h"
+#include "sr_nat.h"
+
+#define SR_NAT_INT  0           /* key directions */
+#define SR_NAT_EXT  1
+
+#define SR_NAT_SEEN_OUT  0x01   /* mapping flags */
+#define SR_NAT_SEEN_IN   0x02
+#define SR_NAT_CLOSING   0x04
+
+#define SR_NAT_NCHUNKS   ((65536 - SR_NAT_PORT_MIN) / SR_NAT_PORT_CHUNK)
+
+#define SR_TCP_FIN 0x01
+#define SR_TCP_RST 0x04
+
+struct sr_nat_pool {
+    uint32_t next;
+    uint32_t end;
+} __attribute__ ((aligned (SR_CACHELINE)));
+
+/* where the translated fields of a datagram live */
+struct sr_nat_pkt {
+    sr_ip_hdr_t* ip_hdr;
+    uint8_t*  l4;
+    uint16_t* sport;            /* the ICMP identifier for echo */
+    uint16_t* dport;            /* ... here too */
+    uint16_t* sum;
+    int       pseudo;           /* sum covers the addresses */
+    uint8_t   tcp_flags;
+};
+
+static struct sr_nat_pool sr_nat_pools[SR_STATS_MAX_THREADS];
+static uint32_t sr_nat_next_chunk = 0;
+
+static uint32_t sr_nat_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)ts.tv_sec;
+}
+
+static uint32_t sr_nat_hash(uint32_t a, uint32_t b, uint32_t ports,
+                            uint32_t proto_dir)
+{
+    uint32_t h;
+
+    h = a * 0x9e3779b1U;
+    h ^= h >> 16;
+    h += b * 0x85ebca77U;
+    h ^= h >> 13;
+    h += ports * 0xc2b2ae3dU;
+    h ^= h >> 16;
+    h += proto_dir * 0x27d4eb2fU;
+    return h ^ (h >> 15);
+}
+
+static uint32_t sr_nat_hash_int(uint8_t proto, uint32_t int_ip,
+        uint16_t int_port, uint32_t rem_ip, uint16_t rem_port)
+{
+    return sr_nat_hash(int_ip, rem_ip, (uint32_t)int_port << 16 | rem_port,
+                       (uint32_t)proto << 1 | SR_NAT_INT);
+}
+
+static uint32_t sr_nat_hash_ext(uint8_t proto, uint16_t ext_port,
+        uint32_t rem_ip, uint16_t rem_port)
+{
+    return sr_nat_hash(0, rem_ip, (uint32_t)ext_port << 16 | rem_port,
+                       (uint32_t)proto << 1 | SR_NAT_EXT);
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_find(..)
+ * Scope:  Local
+ *
+ * Look a key up in one direction.  For SR_NAT_EXT, ip is ignored and
+ * port is the external port.
+ *
+ *---------------------------------------------------------------------*/
+
+static struct sr_nat_map* sr_nat_find(struct sr_nat* nat, uint32_t h, int dir,
+        uint8_t proto, uint32_t ip, uint16_t port, uint32_t rem_ip,
+        uint16_t rem_port)
+{
+    struct sr_nat_slot* s;
+    struct sr_nat_map* m;
+    uint32_t i;
+
+    for(i = h & nat->mask; ; i = (i + 1) & nat->mask)
+    {
+        s = &nat->slots[i];
+        if(s->ref == 0)
+        { return 0; }
+        if(s->hash != h || (int)((s->ref - 1) & 1) != dir)
+        { continue; }
+
+        m = &nat->maps[(s->ref - 1) >> 1];
+        if(m->proto == proto && m->rem_ip == rem_ip && m->rem_port == rem_port &&
+           (dir == SR_NAT_EXT ? m->ext_port == port :
+                                (m->int_ip == ip && m->int_port == port)))
+        { return m; }
+    }
+} /* -- sr_nat_find -- */
+
+static void sr_nat_insert(struct sr_nat* nat, uint32_t h, uint32_t ref)
+{
+    uint32_t i;
+
+    for(i = h & nat->mask; nat->slots[i].ref; i = (i + 1) & nat->mask);
+    nat->slots[i].hash = h;
+    nat->slots[i].ref = ref;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_remove(..)
+ * Scope:  Local
+ *
+ * Delete one slot and shift later members of the probe run back into
+ * the hole, so lookups never have to skip tombstones.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_nat_remove(struct sr_nat* nat, uint32_t h, uint32_t ref)
+{
+    uint32_t i, j, home;
+
+    for(i = h & nat->mask; nat->slots[i].ref != ref; i = (i + 1) & nat->mask);
+
+    for(j = i; ; )
+    {
+        j = (j + 1) & nat->mask;
+        if(nat->slots[j].ref == 0)
+        { break; }
+
+        /* -- move j into the hole unless its home lies in (i, j] -- */
+        home = nat->slots[j].hash & nat->mask;
+        if(((j - home) & nat->mask) >= ((j - i) & nat->mask))
+        {
+            nat->slots[i] = nat->slots[j];
+            i = j;
+        }
+    }
+    nat->slots[i].ref = 0;
+} /* -- sr_nat_remove -- */
+
+static uint32_t sr_nat_timeout(struct sr_nat_map* m)
+{
+    switch(m->proto)
+    {
+        case ip_protocol_tcp:
+            if((m->flags & (SR_NAT_SEEN_OUT | SR_NAT_SEEN_IN | SR_NAT_CLOSING)) ==
+               (SR_NAT_SEEN_OUT | SR_NAT_SEEN_IN))
+            { return SR_NAT_TCP_ESTABLISHED; }
+            return SR_NAT_TCP_TRANSITORY;
+        case ip_protocol_udp:
+            return SR_NAT_UDP;
+        default:
+            return SR_NAT_ICMP;
+    }
+}
+
+/* Put mapping idx on the wheel at its expiry, or as far out as it goes */
+static void sr_nat_file(struct sr_nat* nat, uint32_t idx, uint32_t now)
+{
+    struct sr_nat_map* m = &nat->maps[idx];
+    uint32_t t = m->expires;
+
+    if((int32_t)(t - now) <= 0)
+    { t = now + 1; }
+    else if(t - now >= SR_NAT_WHEEL)
+    { t = now + SR_NAT_WHEEL - 1; }
+
+    m->link = nat->wheel[t % SR_NAT_WHEEL];
+    nat->wheel[t % SR_NAT_WHEEL] = idx + 1;
+}
+
+static void sr_nat_free(struct sr_nat* nat, uint32_t idx)
+{
+    struct sr_nat_map* m = &nat->maps[idx];
+
+    sr_nat_remove(nat, sr_nat_hash_int(m->proto, m->int_ip, m->int_port,
+                                       m->rem_ip, m->rem_port),
+                  (idx << 1 | SR_NAT_INT) + 1);
+    sr_nat_remove(nat, sr_nat_hash_ext(m->proto, m->ext_port, m->rem_ip,
+                                       m->rem_port),
+                  (idx << 1 | SR_NAT_EXT) + 1);
+
+    m->link = nat->free;
+    nat->free = idx + 1;
+    nat->active--;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_expire(..)
+ * Scope:  Local
+ *
+ * Advance the wheel to 'now'.  Each slot's list is detached before it's
+ * walked; mappings that were used since they were filed go back on the
+ * wheel at their new expiry, the rest are freed.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_nat_expire(struct sr_nat* nat, uint32_t now)
+{
+    uint32_t head, idx;
+
+    if(now - nat->tick > SR_NAT_WHEEL)
+    { nat->tick = now - SR_NAT_WHEEL; }
+
+    while(nat->tick != now)
+    {
+        nat->tick++;
+        head = nat->wheel[nat->tick % SR_NAT_WHEEL];
+        nat->wheel[nat->tick % SR_NAT_WHEEL] = 0;
+
+        while(head)
+        {
+            idx = head - 1;
+            head = nat->maps[idx].link;
+            if((int32_t)(nat->maps[idx].expires - now) > 0)
+            { sr_nat_file(nat, idx, now); }
+            else
+            {
+                sr_nat_free(nat, idx);
+                nat->expired++;
+            }
+        }
+    }
+} /* -- sr_nat_expire -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_port(..)
+ * Scope:  Local
+ *
+ * An external port (network byte order) not yet used towards the remote
+ * endpoint, from this thread's pool.  Pools claim SR_NAT_PORT_CHUNK ports
+ * at a time round robin from the whole range.  Returns -1 if
+ * SR_NAT_PORT_TRIES candidates were all taken.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_nat_port(struct sr_nat* nat, uint8_t proto, uint32_t rem_ip,
+                       uint16_t rem_port)
+{
+    struct sr_nat_pool* pool = &sr_nat_pools[sr_stats_thread_id()];
+    uint32_t chunk;
+    uint16_t port;
+    int i;
+
+    for(i = 0; i < SR_NAT_PORT_TRIES; i++)
+    {
+        if(pool->next == pool->end)
+        {
+            chunk = __sync_fetch_and_add(&sr_nat_next_chunk, 1) % SR_NAT_NCHUNKS;
+            pool->next = SR_NAT_PORT_MIN + chunk * SR_NAT_PORT_CHUNK;
+            pool->end = pool->next + SR_NAT_PORT_CHUNK;
+        }
+        port = htons((uint16_t)pool->next++);
+        if(!sr_nat_find(nat, sr_nat_hash_ext(proto, port, rem_ip, rem_port),
+                        SR_NAT_EXT, proto, 0, port, rem_ip, rem_port))
+        { return port; }
+    }
+    return -1;
+} /* -- sr_nat_port -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_parse(..)
+ * Scope:  Local
+ *
+ * Find the ports and checksum of a whole (unfragmented) TCP, UDP or ICMP
+ * echo datagram described by pkt.  'echo' is the ICMP type accepted in
+ * this direction.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_nat_parse(uint8_t* packet, const struct sr_pkt* pkt,
+                        struct sr_nat_pkt* p, uint8_t echo)
+{
+    unsigned int l4len = pkt->len - pkt->l4;
+
+    p->ip_hdr = (sr_ip_hdr_t*)(packet + pkt->l3);
+    p->l4 = packet + pkt->l4;
+    p->tcp_flags = 0;
+
+    if(pkt->flags & SR_PKT_FRAG)
+    { return -1; }
+
+    switch(pkt->proto)
+    {
+        case ip_protocol_tcp:
+            if(l4len < 20)
+            { return -1; }
+            p->sport = (uint16_t*)p->l4;
+            p->dport = (uint16_t*)(p->l4 + 2);
+            p->sum = (uint16_t*)(p->l4 + 16);
+            p->pseudo = 1;
+            p->tcp_flags = p->l4[13];
+            return 0;
+
+        case ip_protocol_udp:
+            if(l4len < 8)
+            { return -1; }
+            p->sport = (uint16_t*)p->l4;
+            p->dport = (uint16_t*)(p->l4 + 2);
+            p->sum = (uint16_t*)(p->l4 + 6);
+            p->pseudo = 1;
+            return 0;
+
+        case ip_protocol_icmp:
+            if(l4len < sizeof(sr_icmp_hdr_t) + 4 || p->l4[0] != echo)
+            { return -1; }
+            p->sport = p->dport = (uint16_t*)(p->l4 + 4);
+            p->sum = (uint16_t*)(p->l4 + 2);
+            p->pseudo = 0;
+            return 0;
+    }
+    return -1;
+} /* -- sr_nat_parse -- */
+
+/* Rewrite the source or destination address and one port and fix up both
+ * checksums */
+static void sr_nat_rewrite(struct sr_nat_pkt* p, int dst, uint32_t new_addr,
+                           uint16_t* port, uint16_t new_port)
+{
+    uint32_t addr = dst ? p->ip_hdr->ip_dst : p->ip_hdr->ip_src;
+    uint16_t sum = *p->sum;
+
+    p->ip_hdr->ip_sum = cksum_update32(p->ip_hdr->ip_sum, addr, new_addr);
+
+    /* -- a zero UDP checksum means there is none -- */
+    if(p->ip_hdr->ip_p != ip_protocol_udp || sum != 0)
+    {
+        if(p->pseudo)
+        { sum = cksum_update32(sum, addr, new_addr); }
+        sum = cksum_update16(sum, *port, new_port);
+        if(sum == 0 && p->ip_hdr->ip_p == ip_protocol_udp)
+        { sum = 0xffff; }
+        *p->sum = sum;
+    }
+
+    if(dst)
+    { p->ip_hdr->ip_dst = new_addr; }
+    else
+    { p->ip_hdr->ip_src = new_addr; }
+    *port = new_port;
+}
+
+static void sr_nat_touch(struct sr_nat_map* m, struct sr_nat_pkt* p,
+                         uint8_t seen, uint32_t now)
+{
+    m->flags |= seen;
+    if(p->tcp_flags & (SR_TCP_FIN | SR_TCP_RST))
+    { m->flags |= SR_NAT_CLOSING; }
+    m->expires = now + sr_nat_timeout(m);
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_outbound(..)
+ * Scope:  Global
+ *
+ * Translate a whole datagram about to leave through the external
+ * interface, creating its mapping if needed.  Returns 0 if translated,
+ * -1 if it can't be (not NATable, out of ports or mappings).
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_nat_outbound(struct sr_nat* nat,
+        uint8_t* packet /* lent */,
+        const struct sr_pkt* pkt)
+{
+    struct sr_nat_pkt p;
+    struct sr_nat_map* m;
+    uint32_t now, h, idx, rem_ip;
+    uint16_t int_port, rem_port;
+    int port;
+
+    if(sr_nat_parse(packet, pkt, &p, icmp_type_echo_request) != 0)
+    { return -1; }
+
+    now = sr_nat_now();
+    sr_nat_expire(nat, now);
+
+    int_port = *p.sport;
+    rem_ip = p.ip_hdr->ip_dst;
+    rem_port = p.pseudo ? *p.dport : 0;
+    h = sr_nat_hash_int(p.ip_hdr->ip_p, p.ip_hdr->ip_src, int_port,
+                        rem_ip, rem_port);
+
+    if((m = sr_nat_find(nat, h, SR_NAT_INT, p.ip_hdr->ip_p, p.ip_hdr->ip_src,
+                        int_port, rem_ip, rem_port)) == 0)
+    {
+        if(nat->free == 0 && nat->used == nat->max)
+        {
+            nat->table_full++;
+            return -1;
+        }
+        if((port = sr_nat_port(nat, p.ip_hdr->ip_p, rem_ip, rem_port)) < 0)
+        {
+            nat->no_port++;
+            return -1;
+        }
+
+        if(nat->free)
+        {
+            idx = nat->free - 1;
+            nat->free = nat->maps[idx].link;
+        }
+        else
+        { idx = nat->used++; }
+
+        m = &nat->maps[idx];
+        memset(m, 0, sizeof(*m));
+        m->int_ip = p.ip_hdr->ip_src;
+        m->int_port = int_port;
+        m->ext_port = (uint16_t)port;
+        m->rem_ip = rem_ip;
+        m->rem_port = rem_port;
+        m->proto = p.ip_hdr->ip_p;
+
+        sr_nat_insert(nat, h, (idx << 1 | SR_NAT_INT) + 1);
+        sr_nat_insert(nat, sr_nat_hash_ext(m->proto, m->ext_port, rem_ip, rem_port),
+                      (idx << 1 | SR_NAT_EXT) + 1);
+        sr_nat_touch(m, &p, SR_NAT_SEEN_OUT, now);
+        sr_nat_file(nat, idx, now);
+        nat->active++;
+        nat->created++;
+    }
+    else
+    { sr_nat_touch(m, &p, SR_NAT_SEEN_OUT, now); }
+
+    sr_nat_rewrite(&p, 0, nat->ext->ip, p.sport, m->ext_port);
+    nat->translated_out++;
+    return 0;
+} /* -- sr_nat_outbound -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_inbound_find(..)
+ * Scope:  Global
+ *
+ * The mapping a whole datagram addressed to the external interface
+ * belongs to, or 0 if none matches.  Nothing is translated or refreshed,
+ * so the caller can check the datagram as it arrived first; the mapping
+ * stays put until the next call into the NAT.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_nat_map* sr_nat_inbound_find(struct sr_nat* nat,
+        uint8_t* packet /* lent */,
+        const struct sr_pkt* pkt)
+{
+    struct sr_nat_pkt p;
+    struct sr_nat_map* m;
+    uint32_t rem_ip;
+    uint16_t rem_port;
+
+    if(sr_nat_parse(packet, pkt, &p, icmp_type_echo_reply) != 0)
+    { return 0; }
+
+    sr_nat_expire(nat, sr_nat_now());
+
+    rem_ip = p.ip_hdr->ip_src;
+    rem_port = p.pseudo ? *p.sport : 0;
+    m = sr_nat_find(nat, sr_nat_hash_ext(p.ip_hdr->ip_p, *p.dport, rem_ip, rem_port),
+                    SR_NAT_EXT, p.ip_hdr->ip_p, 0, *p.dport, rem_ip, rem_port);
+    if(m == 0)
+    { nat->no_mapping++; }
+    return m;
+} /* -- sr_nat_inbound_find -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_inbound(..)
+ * Scope:  Global
+ *
+ * Map the datagram sr_nat_inbound_find(..) found m for back to the
+ * inside host, refreshing m.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_nat_inbound(struct sr_nat* nat,
+        uint8_t* packet /* lent */,
+        const struct sr_pkt* pkt,
+        struct sr_nat_map* m)
+{
+    struct sr_nat_pkt p;
+
+    sr_nat_parse(packet, pkt, &p, icmp_type_echo_reply);
+    sr_nat_touch(m, &p, SR_NAT_SEEN_IN, sr_nat_now());
+    sr_nat_rewrite(&p, 1, m->int_ip, p.dport, m->int_port);
+    nat->translated_in++;
+} /* -- sr_nat_inbound -- */
+
+static void sr_nat_stats(struct sr_stats_writer* w, void* arg)
+{
+    struct sr_instance* sr = (struct sr_instance*)arg;
+    struct sr_nat* nat = sr->nat;
+
+    if(nat == 0)
+    { return; }
+
+    sr_stats_put_str(w, "external", nat->ext_name);
+    sr_stats_put_u64(w, "mappings", nat->active);
+    sr_stats_put_u64(w, "max_mappings", nat->max);
+    sr_stats_put_u64(w, "created", nat->created);
+    sr_stats_put_u64(w, "expired", nat->expired);
+    sr_stats_put_u64(w, "translated_out", nat->translated_out);
+    sr_stats_put_u64(w, "translated_in", nat->translated_in);
+    sr_stats_put_u64(w, "no_mapping", nat->no_mapping);
+    sr_stats_put_u64(w, "no_port", nat->no_port);
+    sr_stats_put_u64(w, "table_full", nat->table_full);
+} /* -- sr_nat_stats -- */
+
+void sr_nat_init(struct sr_instance* sr)
+{
+    sr_stats_register("nat", sr_nat_stats, sr);
+} /* -- sr_nat_init -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_create(..)
+ * Scope:  Global
+ *
+ * NAT behind interface ext_iface for up to max concurrent mappings; the
+ * interface is looked up later, by sr_nat_attach(..).  Returns 0 if the
+ * name or limit is bad or memory is short.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_nat* sr_nat_create(struct sr_instance* sr, const char* ext_iface,
+                             uint32_t max)
+{
+    struct sr_nat* nat;
+    uint32_t size;
+
+    /* -- REQUIRES -- */
+    assert(sr);
+    assert(ext_iface);
+
+    if(ext_iface[0] == 0 || strlen(ext_iface) >= sr_IFACE_NAMELEN)
+    {
+        fprintf(stderr, "NAT: bad interface name %s\n", ext_iface);
+        return 0;
+    }
+    if(max == 0 || max > SR_NAT_MAX)
+    {
+        fprintf(stderr, "NAT: mapping limit %u is not 1 to %u\n", max,
+                SR_NAT_MAX);
+        return 0;
+    }
+
+    /* -- two keys per mapping, at most half full -- */
+    for(size = 16; size < 4 * max; size <<= 1);
+
+    nat = (struct sr_nat*)calloc(1, sizeof(struct sr_nat));
+    if(nat == 0)
+    { return 0; }
+    nat->maps = (struct sr_nat_map*)sr_huge_alloc("nat_mappings",
+                                        max * sizeof(struct sr_nat_map));
+    nat->slots = (struct sr_nat_slot*)sr_huge_alloc("nat_slots",
+                                        size * sizeof(struct sr_nat_slot));
+    if(nat->maps == 0 || nat->slots == 0)
+    {
+        fprintf(stderr, "NAT: can't allocate %u mappings\n", max);
+        sr_huge_free(nat->maps);
+        sr_huge_free(nat->slots);
+        free(nat);
+        return 0;
+    }
+
+    strcpy(nat->ext_name, ext_iface);
+    nat->max = max;
+    nat->mask = size - 1;
+    nat->tick = sr_nat_now();
+    return nat;
+} /* -- sr_nat_create -- */
+
+/* Find the external interface, once the interface list is complete */
+int sr_nat_attach(struct sr_nat* nat, struct sr_instance* sr)
+{
+    if((nat->ext = sr_get_interface(sr, nat->ext_name)) == 0)
+    {
+        fprintf(stderr, "NAT: no interface %s\n", nat->ext_name);
+        return -1;
+    }
+    printf("NAT on %s, up to %u mappings\n", nat->ext->name, nat->max);
+    return 0;
+} /* -- sr_nat_attach -- */
@@ -0,0 +1,115 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_nat.h
+ *
+ * Description:
+ *
+ * NAPT between the external interface named with sr -n <iface>[:max] and
+ * every other interface.  TCP, UDP and ICMP echo (by identifier) leaving
+ * through the external interface get its address and a fresh port;
+ * traffic coming back to that address and port is mapped back.
+ *
+ * Mappings are endpoint dependent (keyed on the full 5-tuple), so an
+ * external port can be reused towards different remote endpoints and the
+ * number of concurrent mappings isn't bounded by the port space.  Every
+ * mapping is entered twice in one open-addressing table with linear
+ * probing, once per direction; a slot is just the key's hash and the
+ * mapping index, so a probe mostly stays in one cache line, and deletion
+ * shifts entries back instead of leaving tombstones.  All storage is
+ * sized for 'max' mappings up front; pages are only touched as the table
+ * fills.
+ *
+ * External ports are handed out from per-thread pools that claim chunks
+ * of the port range from a shared counter.  Idle mappings expire on a
+ * one-second timer wheel; refreshing a mapping only updates its expiry
+ * time and the wheel re-files it when its slot comes up, so a packet
+ * never touches the wheel.  Checksums are adjusted incrementally.
+ *
+ * The table itself is not locked: translation happens on the receive
+ * thread only.
+ *
+ * The external interface is looked up by sr_nat_attach(..) once the
+ * interface list is known, after VNSHWINFO on a live router.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_NAT_H
+#define SR_NAT_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+#include "sr_if.h"
+
+#define SR_NAT_DEFAULT_MAX  (1 << 20)   /* mappings */
+#define SR_NAT_MAX          (1 << 28)   /* so the 4 * max slots fit 32 bits */
+#define SR_NAT_PORT_MIN     1024
+#define SR_NAT_PORT_CHUNK   256         /* ports a thread claims at a time */
+#define SR_NAT_PORT_TRIES   512
+#define SR_NAT_WHEEL        1024        /* slots, one second each */
+
+/* idle timeouts, seconds */
+#define SR_NAT_TCP_ESTABLISHED  7440    /* RFC 5382 */
+#define SR_NAT_TCP_TRANSITORY   240
+#define SR_NAT_UDP              300     /* RFC 4787 */
+#define SR_NAT_ICMP             60      /* RFC 5508 */
+
+struct sr_instance;
+struct sr_if;
+struct sr_pkt;
+
+struct sr_nat_map {
+    uint32_t int_ip;            /* network byte order, all of these */
+    uint32_t rem_ip;
+    uint16_t int_port;
+    uint16_t ext_port;
+    uint16_t rem_port;
+    uint8_t  proto;
+    uint8_t  flags;
+    uint32_t expires;           /* seconds */
+    uint32_t link;              /* wheel or free list, index + 1 */
+};
+
+struct sr_nat_slot {
+    uint32_t hash;
+    uint32_t ref;               /* (mapping << 1 | direction) + 1, 0 = free */
+};
+
+struct sr_nat {
+    struct sr_if* ext;          /* 0 until sr_nat_attach(..) */
+    char ext_name[sr_IFACE_NAMELEN];
+    struct sr_nat_map* maps;
+    uint32_t max;
+    uint32_t used;              /* high water mark of maps[] */
+    uint32_t free;              /* free list, index + 1 */
+    uint32_t active;
+    struct sr_nat_slot* slots;
+    uint32_t mask;
+    uint32_t wheel[SR_NAT_WHEEL];
+    uint32_t tick;
+
+    uint64_t created;
+    uint64_t expired;
+    uint64_t translated_out;
+    uint64_t translated_in;
+    uint64_t no_mapping;
+    uint64_t no_port;
+    uint64_t table_full;
+};
+
+void sr_nat_init(struct sr_instance* sr);
+struct sr_nat* sr_nat_create(struct sr_instance* sr, const char* ext_iface,
+                             uint32_t max);
+int sr_nat_attach(struct sr_nat* nat, struct sr_instance* sr);
+int sr_nat_outbound(struct sr_nat* nat, uint8_t* packet,
+                    const struct sr_pkt* pkt);
+struct sr_nat_map* sr_nat_inbound_find(struct sr_nat* nat, uint8_t* packet,
+                                       const struct sr_pkt* pkt);
+void sr_nat_inbound(struct sr_nat* nat, uint8_t* packet,
+                    const struct sr_pkt* pkt, struct sr_nat_map* m);
+
+#endif /* -- SR_NAT_H -- */
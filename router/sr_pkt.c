@@ -0,0 +1,145 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_pkt.c
+ *
+ * Description:
+ *
+ * Single-pass receive parse, see sr_pkt.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <assert.h>
+
+#include "sr_if.h"
+#include "sr_router.h"
+#include "sr_protocol.h"
+#include "sr_utils.h"
+#include "sr_stats.h"
+#include "sr_pkt.h"
+
+static int sr_pkt_bad(struct sr_pkt* pkt, enum sr_drop reason)
+{
+    pkt->flags |= SR_PKT_BAD;
+    pkt->drop = (uint8_t)reason;
+    return -1;
+}
+
+/* The checks sr_handle_arp(..) relies on; requests for other hosts are
+ * refused before anything else looks at them.  Ours are the addresses
+ * of the interface it came in on. */
+static int sr_pkt_arp(struct sr_instance* sr, uint8_t* frame,
+                      struct sr_pkt* pkt)
+{
+    sr_arp_hdr_t* a_hdr = (sr_arp_hdr_t*)(frame + pkt->l3);
+
+    if(pkt->len < pkt->l3 + sizeof(sr_arp_hdr_t))
+    { return sr_pkt_bad(pkt, SR_DROP_SHORT); }
+
+    if(sr_get_interface_by_ip(sr, a_hdr->ar_tip) == pkt->iface)
+    { pkt->flags |= SR_PKT_LOCAL; }
+    else if(a_hdr->ar_op == htons(arp_op_request))
+    {
+        pkt->flags |= SR_PKT_QUIET;
+        return sr_pkt_bad(pkt, SR_DROP_NOT_FOR_US);
+    }
+
+    if(ntohs(a_hdr->ar_hrd) != arp_hrd_ethernet ||
+       ntohs(a_hdr->ar_pro) != ethertype_ip)
+    { return sr_pkt_bad(pkt, SR_DROP_BAD_HDR); }
+    if(!(pkt->flags & SR_PKT_LOCAL))
+    { return sr_pkt_bad(pkt, SR_DROP_NOT_FOR_US); }
+    return 0;
+}
+
+/* The checks sr_handle_ip(..) relies on; pkt->len loses any padding */
+static int sr_pkt_ip(struct sr_instance* sr, uint8_t* frame, struct sr_pkt* pkt)
+{
+    sr_ip_hdr_t* ip_hdr = (sr_ip_hdr_t*)(frame + pkt->l3);
+    unsigned int hl, ip_len, off;
+
+    if(pkt->len < pkt->l3 + sizeof(sr_ip_hdr_t))
+    { return sr_pkt_bad(pkt, SR_DROP_SHORT); }
+
+    hl = ip_hdr->ip_hl * 4;
+    ip_len = ntohs(ip_hdr->ip_len);
+    if(ip_hdr->ip_v != 4 || hl < sizeof(sr_ip_hdr_t) || ip_len < hl ||
+       pkt->len < pkt->l3 + ip_len)
+    { return sr_pkt_bad(pkt, SR_DROP_BAD_HDR); }
+
+    if(cksum(ip_hdr, hl) != 0xffff)
+    { return sr_pkt_bad(pkt, SR_DROP_BAD_CKSUM); }
+    pkt->flags |= SR_PKT_CKSUM_OK;
+
+    pkt->len = pkt->l3 + ip_len;
+    pkt->l4 = pkt->l3 + hl;
+    pkt->proto = ip_hdr->ip_p;
+
+    off = ntohs(ip_hdr->ip_off);
+    if(off & (IP_MF | IP_OFFMASK))
+    { pkt->flags |= SR_PKT_FRAG; }
+    if(off & IP_OFFMASK)
+    { pkt->flags |= SR_PKT_LATER; }
+
+    if(sr_get_interface_by_ip(sr, ip_hdr->ip_dst))
+    { pkt->flags |= SR_PKT_LOCAL; }
+    return 0;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_pkt_parse(..)
+ * Scope:  Global
+ *
+ * Validate the frame that arrived on interface and describe it in pkt.
+ * Returns 0, or -1 with SR_PKT_BAD set and the drop reason in pkt.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_pkt_parse(struct sr_instance* sr,
+        uint8_t* frame /* lent */,
+        unsigned int len,
+        const char* interface /* lent */,
+        struct sr_pkt* pkt)
+{
+    /* REQUIRES */
+    assert(sr);
+    assert(frame);
+    assert(pkt);
+
+    pkt->iface = sr_get_interface(sr, interface);
+    pkt->len = len;
+    pkt->ifindex = pkt->iface ? pkt->iface->ifindex : 0;
+    pkt->l3 = sizeof(sr_ethernet_hdr_t);
+    pkt->l4 = 0;
+    pkt->ethertype = 0;
+    pkt->proto = 0;
+    pkt->flags = 0;
+    pkt->drop = 0;
+
+    if(pkt->iface == 0)
+    { return sr_pkt_bad(pkt, SR_DROP_NO_IFACE); }
+    if(len < sizeof(sr_ethernet_hdr_t))
+    { return sr_pkt_bad(pkt, SR_DROP_SHORT); }
+
+    pkt->ethertype = ethertype(frame);
+    switch(pkt->ethertype)
+    {
+        case ethertype_arp:
+            return sr_pkt_arp(sr, frame, pkt);
+        case ethertype_ip:
+            return sr_pkt_ip(sr, frame, pkt);
+    }
+    return sr_pkt_bad(pkt, SR_DROP_UNSUPPORTED);
+} /* -- sr_pkt_parse -- */
+
+/* Describe the datagram reassembled from frag, len bytes at whole.  Its
+ * header came from the first fragment and was summed afresh. */
+void sr_pkt_whole(const struct sr_pkt* frag, uint8_t* whole,
+                  unsigned int len, struct sr_pkt* pkt)
+{
+    sr_ip_hdr_t* ip_hdr = (sr_ip_hdr_t*)(whole + frag->l3);
+
+    *pkt = *frag;
+    pkt->len = len;
+    pkt->l4 = pkt->l3 + ip_hdr->ip_hl * 4;
+    pkt->flags &= ~(SR_PKT_FRAG | SR_PKT_LATER);
+} /* -- sr_pkt_whole -- */
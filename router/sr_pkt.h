@@ -0,0 +1,61 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_pkt.h
+ *
+ * Description:
+ *
+ * The receive path parses each frame exactly once.  sr_pkt_parse(..)
+ * validates the Ethernet, ARP and IP headers in the order the handlers
+ * used to, and fills in a descriptor that travels with the frame from
+ * then on: where the IP and transport headers start (Ethernet is always
+ * at 0), the ethertype and IP protocol, the interface it came in on,
+ * whether it is addressed to us and whether its header checksum was
+ * verified.  The handlers, ACLs, connection tracking, NAT, reassembly and
+ * echo replies all read the descriptor instead of casting headers again;
+ * the packet log just copies the frame's bytes and parses nothing.
+ *
+ * A frame that fails validation still gets a descriptor, with SR_PKT_BAD
+ * set and the reason to count it under in drop.  ARP requests for other
+ * hosts on the segment are also marked SR_PKT_QUIET; they are dropped
+ * before they're logged.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_PKT_H
+#define SR_PKT_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+#define SR_PKT_LOCAL     0x01   /* ARP target or IP destination is ours */
+#define SR_PKT_CKSUM_OK  0x02   /* IP header checksum verified */
+#define SR_PKT_FRAG      0x04   /* one fragment of a larger datagram */
+#define SR_PKT_LATER     0x08   /* ... and not the first, no transport header */
+#define SR_PKT_BAD       0x10   /* drop it, counting it under drop */
+#define SR_PKT_QUIET     0x20   /* ... without logging it */
+
+struct sr_instance;
+struct sr_if;
+
+struct sr_pkt {
+    struct sr_if* iface;        /* ingress, 0 if unknown */
+    unsigned int  len;          /* frame, less ethernet padding */
+    unsigned int  ifindex;      /* of iface */
+    uint16_t      l3;           /* offsets into the frame */
+    uint16_t      l4;
+    uint16_t      ethertype;    /* host order */
+    uint8_t       proto;        /* IP protocol */
+    uint8_t       flags;
+    uint8_t       drop;         /* enum sr_drop, with SR_PKT_BAD */
+};
+
+int  sr_pkt_parse(struct sr_instance* sr, uint8_t* frame, unsigned int len,
+                  const char* interface, struct sr_pkt* pkt);
+void sr_pkt_whole(const struct sr_pkt* frag, uint8_t* whole,
+                  unsigned int len, struct sr_pkt* pkt);
+
+#endif /* -- SR_PKT_H -- */
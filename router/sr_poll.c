@@ -0,0 +1,152 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_poll.c
+ *
+ * Description:
+ *
+ * Busy-poll receive with adaptive backoff, see sr_poll.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "sr_stats.h"
+#include "sr_poll.h"
+
+static uint64_t sr_poll_max = 0;        /* ns, 0: off */
+static uint64_t sr_poll_budget = 0;     /* ns, current */
+static int sr_poll_kernel = 0;          /* SO_BUSY_POLL took */
+
+/* -- written by the forwarding thread only -- */
+static uint64_t sr_poll_start = 0;
+static uint64_t sr_poll_ready = 0;      /* a frame was already waiting */
+static uint64_t sr_poll_hits = 0;       /* one came while spinning */
+static uint64_t sr_poll_timeouts = 0;   /* none came, blocked */
+static uint64_t sr_poll_spin_ns = 0;
+static uint64_t sr_poll_blocked_ns = 0;
+
+static uint64_t sr_poll_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static __inline__ void sr_poll_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __asm__ __volatile__ ("pause");
+#endif
+}
+
+/* Spin for up to spin_us before blocking; 0 turns busy polling off */
+void sr_poll_set(unsigned int spin_us)
+{
+    sr_poll_max = (uint64_t)spin_us * 1000;
+    sr_poll_budget = sr_poll_max;
+} /* -- sr_poll_set -- */
+
+/* Ask the kernel to busy-poll the device for fd as well */
+void sr_poll_socket(int fd)
+{
+#ifdef SO_BUSY_POLL
+    int us = (int)(sr_poll_max / 1000);
+
+    if(sr_poll_max == 0)
+    { return; }
+    if(setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us)) == 0)
+    { sr_poll_kernel = 1; }
+    else
+    { perror("busy poll: setsockopt(SO_BUSY_POLL), spinning in user space"); }
+#endif
+} /* -- sr_poll_socket -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_poll_wait(..)
+ * Scope:  Global
+ *
+ * Return once fd has something to read (or an error or EOF for the
+ * caller's recv(..) to find), spinning first if busy polling is on.
+ * With it off this returns at once and the caller blocks as before.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_poll_wait(int fd)
+{
+    struct pollfd pfd;
+    uint64_t start, now;
+    ssize_t n;
+    char c;
+
+    if(sr_poll_max == 0)
+    { return; }
+
+    start = now = sr_poll_now();
+    if(sr_poll_start == 0)
+    { sr_poll_start = start; }
+    for(;;)
+    {
+        n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+        if(n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        {
+            if(now == start)
+            { sr_poll_ready++; }
+            else
+            {
+                sr_poll_hits++;
+                sr_poll_spin_ns += now - start;
+                sr_poll_budget *= 2;
+                if(sr_poll_budget > sr_poll_max)
+                { sr_poll_budget = sr_poll_max; }
+            }
+            return;
+        }
+        if(now - start >= sr_poll_budget)
+        { break; }
+        sr_poll_relax();
+        now = sr_poll_now();
+    }
+
+    /* -- nothing came, back off and sleep until something does -- */
+    sr_poll_timeouts++;
+    sr_poll_spin_ns += now - start;
+    sr_poll_budget /= 2;
+    if(sr_poll_budget < sr_poll_max / SR_POLL_SHRINK)
+    { sr_poll_budget = sr_poll_max / SR_POLL_SHRINK; }
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    while(poll(&pfd, 1, -1) < 0 && errno == EINTR);
+    sr_poll_blocked_ns += sr_poll_now() - now;
+} /* -- sr_poll_wait -- */
+
+static void sr_poll_stats(struct sr_stats_writer* w, void* arg)
+{
+    uint64_t elapsed = sr_poll_start ? sr_poll_now() - sr_poll_start : 0;
+
+    (void)arg;
+    sr_stats_put_u64(w, "spin_us", sr_poll_max / 1000);
+    if(sr_poll_max == 0)
+    { return; }
+    sr_stats_put_u64(w, "so_busy_poll", sr_poll_kernel);
+    sr_stats_put_double(w, "budget_us", sr_poll_budget / 1000.0);
+    sr_stats_put_u64(w, "ready", sr_poll_ready);
+    sr_stats_put_u64(w, "spin_hits", sr_poll_hits);
+    sr_stats_put_u64(w, "spin_timeouts", sr_poll_timeouts);
+    sr_stats_put_double(w, "spin_ratio",
+                        elapsed ? (double)sr_poll_spin_ns / elapsed : 0);
+    sr_stats_put_double(w, "idle_ratio",
+                        elapsed ? (double)sr_poll_blocked_ns / elapsed : 0);
+} /* -- sr_poll_stats -- */
+
+void sr_poll_init(struct sr_instance* sr)
+{
+    sr_stats_register("busy_poll", sr_poll_stats, sr);
+} /* -- sr_poll_init -- */
@@ -0,0 +1,36 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_poll.h
+ *
+ * Description:
+ *
+ * Busy-poll receive for the VNS socket (sr -B <us>).  Instead of going to
+ * sleep in recv(..) and paying a wakeup for every frame, the forwarding
+ * thread checks the socket without blocking for up to the spin budget
+ * before it gives up and waits in poll(..).  The socket also gets
+ * SO_BUSY_POLL where the kernel has it (raising it above
+ * net.core.busy_read needs CAP_NET_ADMIN), so those checks poll the
+ * device queue too.
+ *
+ * The budget adapts.  A spin that times out halves it, down to
+ * 1/SR_POLL_SHRINK of the configured value, so an idle router soon spends
+ * almost all its time blocked.  A spin that finds a frame doubles it,
+ * back up to the configured value, as soon as traffic returns.
+ *
+ * The "busy_poll" stats section counts how each wait ended and the share
+ * of time spent spinning and blocked; the rest went on packets.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_POLL_H
+#define SR_POLL_H
+
+#define SR_POLL_SHRINK  64
+
+struct sr_instance;
+
+void sr_poll_set(unsigned int spin_us);
+void sr_poll_socket(int fd);
+void sr_poll_wait(int fd);
+void sr_poll_init(struct sr_instance* sr);
+
+#endif /* -- SR_POLL_H -- */
@@ -0,0 +1,383 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_replay.c
+ *
+ * Description:
+ *
+ * Replay a pcap capture through the router offline and report throughput
+ * and per-packet latency.  See sr_replay.h for the hardware file format.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "sr_dumper.h"
+#include "sr_if.h"
+#include "sr_router.h"
+#include "sr_protocol.h"
+#include "sr_replay.h"
+#include "sr_stats.h"
+#include "sr_latency.h"
+#include "sr_sched.h"
+#include "sr_flow.h"
+
+#define SR_REPLAY_MAXFRAME 65536
+
+struct sr_replay
+{
+    pthread_mutex_t lock;          /* sr_send_packet may run on any thread */
+    FILE* out;                     /* capture of transmitted frames, or 0 */
+    unsigned long tx_packets;
+    unsigned long tx_bytes;
+};
+
+static struct sr_replay sr_replay_state;
+
+/*---------------------------------------------------------------------
+ * Method: sr_replay_now(..)
+ * Scope:  Local
+ *
+ * Monotonic time in nanoseconds
+ *
+ *---------------------------------------------------------------------*/
+
+static uint64_t sr_replay_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+} /* -- sr_replay_now -- */
+
+static int sr_replay_cmp_u64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_replay_load_hwinfo(..)
+ * Scope:  Global
+ *
+ * Build the interface list from a canned hardware description instead of
+ * the VNSHWINFO message.  Returns 0 on success.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_replay_load_hwinfo(struct sr_instance* sr, const char* filename)
+{
+    FILE* fp;
+    char  line[BUFSIZ];
+    char  name[sr_IFACE_NAMELEN];
+    char  hwaddr[32];
+    char  ip[32];
+    unsigned int mac[ETHER_ADDR_LEN];
+    unsigned char addr[ETHER_ADDR_LEN];
+    unsigned int speed, mtu;
+    struct in_addr ip_addr;
+    struct sr_if* iface;
+    int lineno = 0;
+    int i, n;
+
+    /* -- REQUIRES -- */
+    assert(sr);
+    assert(filename);
+
+    if((fp = fopen(filename,"r")) == 0)
+    {
+        perror("fopen(..):sr_replay_load_hwinfo");
+        return -1;
+    }
+
+    while( fgets(line,BUFSIZ,fp) != 0)
+    {
+        lineno++;
+        speed = 0;
+        mtu = SR_IF_DEFAULT_MTU;
+        n = sscanf(line,"%31s %31s %31s %u %u",name,hwaddr,ip,&speed,&mtu);
+        if(n <= 0 || name[0] == '#')
+        { continue; }
+
+        if(n < 3 ||
+           sscanf(hwaddr,"%x:%x:%x:%x:%x:%x",&mac[0],&mac[1],&mac[2],
+                  &mac[3],&mac[4],&mac[5]) != ETHER_ADDR_LEN ||
+           inet_aton(ip,&ip_addr) == 0 ||
+           mtu < SR_IF_MIN_MTU || mtu > IP_MAXPACKET)
+        {
+            fprintf(stderr,"%s:%d: expected 'name hwaddr ip [speed [mtu]]'\n",
+                    filename,lineno);
+            fclose(fp);
+            return -1;
+        }
+
+        for(i = 0; i < ETHER_ADDR_LEN; i++)
+        { addr[i] = (unsigned char)mac[i]; }
+
+        sr_add_interface(sr,name);
+        sr_set_ether_addr(sr,addr);
+        sr_set_ether_ip(sr,ip_addr.s_addr);
+        iface = sr_get_interface(sr,name);
+        iface->speed = speed;
+        iface->mtu = mtu;
+    } /* -- while -- */
+
+    fclose(fp);
+
+    if(sr->if_list == 0)
+    {
+        fprintf(stderr,"%s: no interfaces defined\n",filename);
+        return -1;
+    }
+    sr_local_build(sr);
+
+    printf("Router interfaces:\n");
+    sr_print_if_list(sr);
+
+    return 0;
+} /* -- sr_replay_load_hwinfo -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_replay_ingress(..)
+ * Scope:  Local
+ *
+ * A capture does not say which interface a frame arrived on, so guess:
+ * the interface owning the destination MAC, then for ARP the interface
+ * owning the target IP, and finally the first interface.
+ *
+ *---------------------------------------------------------------------*/
+
+static struct sr_if* sr_replay_ingress(struct sr_instance* sr,
+                                       uint8_t* packet, unsigned int len)
+{
+    sr_ethernet_hdr_t* e_hdr = (sr_ethernet_hdr_t*)packet;
+    sr_arp_hdr_t* a_hdr = 0;
+    struct sr_if* if_walker = 0;
+
+    for(if_walker = sr->if_list; if_walker; if_walker = if_walker->next)
+    {
+        if(memcmp(e_hdr->ether_dhost,if_walker->addr,ETHER_ADDR_LEN) == 0)
+        { return if_walker; }
+    }
+
+    if(e_hdr->ether_type == htons(ethertype_arp) &&
+       len >= sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t))
+    {
+        a_hdr = (sr_arp_hdr_t*)(packet + sizeof(sr_ethernet_hdr_t));
+        for(if_walker = sr->if_list; if_walker; if_walker = if_walker->next)
+        {
+            if(a_hdr->ar_tip == if_walker->ip)
+            { return if_walker; }
+        }
+    }
+
+    return sr->if_list;
+} /* -- sr_replay_ingress -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_replay_transmit(..)
+ * Scope:  Global
+ *
+ * Stand-in for the server socket while replaying, called from
+ * sr_send_packet(..).  Frames are appended to the output capture.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_replay_transmit(struct sr_instance* sr, uint8_t* buf,
+                       unsigned int len, const char* iface)
+{
+    struct sr_replay* rp = sr->replay;
+    struct pcap_pkthdr h;
+
+    /* REQUIRES */
+    assert(rp);
+    assert(buf);
+
+    pthread_mutex_lock(&rp->lock);
+
+    rp->tx_packets++;
+    rp->tx_bytes += len;
+
+    if(rp->out)
+    {
+        gettimeofday(&h.ts, 0);
+        h.caplen = len;
+        h.len = len;
+        sr_dump(rp->out, &h, buf);
+    }
+
+    pthread_mutex_unlock(&rp->lock);
+
+    return 0;
+} /* -- sr_replay_transmit -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_replay_run(..)
+ * Scope:  Global
+ *
+ * Feed every frame of 'infile' to the router.  A speed of 0 replays as
+ * fast as possible, otherwise the original inter-packet gaps are divided
+ * by 'speed'.  Returns 0 on success.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_replay_run(struct sr_instance* sr, const char* infile,
+                  const char* outfile, double speed)
+{
+    struct sr_replay* rp = &sr_replay_state;
+    struct sr_dump_reader reader;
+    struct pcap_pkthdr h;
+    struct sr_if* iface;
+    struct timespec gap;
+    struct sr_stats_writer w;
+    uint8_t* buf;
+    uint64_t* lat = 0;
+    unsigned long nlat = 0, maxlat = 0;
+    unsigned long rx_packets = 0, rx_bytes = 0, skipped = 0;
+    uint64_t first_ts = 0, start = 0, target, t0, t1, busy = 0, ts;
+    double elapsed, busy_s, avg;
+    int ret;
+
+    /* REQUIRES */
+    assert(sr);
+    assert(infile);
+
+    if(sr_dump_read_open(&reader, infile) != 0)
+    { return -1; }
+
+    memset(rp, 0, sizeof(*rp));
+    pthread_mutex_init(&rp->lock, 0);
+    if(outfile)
+    {
+        if((rp->out = sr_dump_open(outfile, 0, SR_REPLAY_MAXFRAME)) == 0)
+        {
+            sr_dump_read_close(&reader);
+            return -1;
+        }
+    }
+
+    if((buf = malloc(SR_REPLAY_MAXFRAME)) == 0)
+    {
+        fprintf(stderr,"Error: out of memory (sr_replay_run)\n");
+        sr_dump_read_close(&reader);
+        return -1;
+    }
+
+    sr->replay = rp;
+
+    printf("Replaying %s\n", infile);
+
+    while((ret = sr_dump_read(&reader, &h, buf, SR_REPLAY_MAXFRAME)) == 1)
+    {
+        if(h.caplen < sizeof(sr_ethernet_hdr_t))
+        {
+            skipped++;
+            continue;
+        }
+
+        ts = (uint64_t)h.ts.tv_sec * 1000000000ULL +
+             (uint64_t)h.ts.tv_usec * 1000ULL;
+
+        if(rx_packets == 0)
+        {
+            first_ts = ts;
+            start = sr_replay_now();
+        }
+        else if(speed > 0.0 && ts > first_ts)
+        {
+            /* -- honour the original pacing, scaled -- */
+            target = start + (uint64_t)((ts - first_ts) / speed);
+            t0 = sr_replay_now();
+            if(target > t0)
+            {
+                gap.tv_sec = (target - t0) / 1000000000ULL;
+                gap.tv_nsec = (target - t0) % 1000000000ULL;
+                while(nanosleep(&gap, &gap) == -1 && errno == EINTR);
+            }
+        }
+
+        if(nlat == maxlat)
+        {
+            maxlat = maxlat ? 2 * maxlat : 4096;
+            lat = (uint64_t*)realloc(lat, maxlat * sizeof(uint64_t));
+            assert(lat);
+        }
+
+        iface = sr_replay_ingress(sr, buf, h.caplen);
+
+        t0 = sr_replay_now();
+        sr_latency_rx();
+        sr_deliver_packet(sr, buf, h.caplen, iface->name);
+        t1 = sr_replay_now();
+
+        lat[nlat++] = t1 - t0;
+        busy += t1 - t0;
+        rx_packets++;
+        rx_bytes += h.caplen;
+    } /* -- while -- */
+
+    elapsed = rx_packets ? (sr_replay_now() - start) / 1e9 : 0.0;
+    busy_s = busy / 1e9;
+
+    sr_dump_read_close(&reader);
+    free(buf);
+
+    /* -- let queued frames out before the capture goes -- */
+    if(sr->sched)
+    { sr_sched_drain(sr->sched); }
+    if(sr->flow)
+    { sr_flow_drain(sr->flow); }
+
+    /* -- stop capturing, the ARP thread may still try to send -- */
+    pthread_mutex_lock(&rp->lock);
+    if(rp->out)
+    {
+        sr_dump_close(rp->out);
+        rp->out = 0;
+    }
+    pthread_mutex_unlock(&rp->lock);
+
+    if(ret < 0)
+    { fprintf(stderr,"Error: %s is truncated or corrupt\n", infile); }
+
+    printf("---------------------------------------------\n");
+    printf("Replayed %lu packets (%lu bytes) in %.3f s, %lu skipped\n",
+           rx_packets, rx_bytes, elapsed, skipped);
+    printf("Transmitted %lu packets (%lu bytes)\n",
+           rp->tx_packets, rp->tx_bytes);
+
+    if(nlat > 0)
+    {
+        qsort(lat, nlat, sizeof(uint64_t), sr_replay_cmp_u64);
+        avg = (double)busy / nlat;
+
+        if(busy_s > 0.0)
+        {
+            printf("Throughput: %.0f pkts/s, %.2f Mbit/s\n",
+                   rx_packets / busy_s, rx_bytes * 8 / busy_s / 1e6);
+        }
+        printf("Latency (us): min %.3f avg %.3f p50 %.3f p99 %.3f "
+               "p999 %.3f max %.3f\n",
+               lat[0] / 1e3, avg / 1e3,
+               lat[nlat / 2] / 1e3,
+               lat[(nlat * 99) / 100] / 1e3,
+               lat[(nlat * 999) / 1000] / 1e3,
+               lat[nlat - 1] / 1e3);
+    }
+    sr_stats_snapshot(&w, 0);
+    fwrite(w.buf, 1, w.len, stdout);
+    free(w.buf);
+    printf("---------------------------------------------\n");
+
+    free(lat);
+
+    return ret < 0 ? -1 : 0;
+} /* -- sr_replay_run -- */
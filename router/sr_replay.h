@@ -0,0 +1,42 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_replay.h
+ *
+ * Description:
+ *
+ * Offline driver that feeds frames from a pcap capture straight into
+ * sr_handlepacket(..) without a VNS server.  Interfaces come from a canned
+ * hardware description file, the routing table is loaded as usual, and
+ * everything the router transmits is written to another capture.
+ *
+ * The hardware file has one interface per line, in the order VNS would
+ * report them:
+ *
+ *   # name   hwaddr              ip              [speed [mtu]]
+ *   eth1     5e:c3:6a:dd:e5:c8   107.23.34.64    100     1500
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_REPLAY_H
+#define SR_REPLAY_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+struct sr_instance;
+
+/* speed argument to sr_replay_run(..) */
+#define SR_REPLAY_AFAP     0.0  /* as fast as possible */
+#define SR_REPLAY_ORIGINAL 1.0  /* pace like the original capture */
+
+int sr_replay_load_hwinfo(struct sr_instance* sr, const char* filename);
+int sr_replay_run(struct sr_instance* sr, const char* infile,
+                  const char* outfile, double speed);
+int sr_replay_transmit(struct sr_instance* sr, uint8_t* buf,
+                       unsigned int len, const char* iface);
+
+#endif /* -- SR_REPLAY_H -- */
@@ -12,6 +12,8 @@
  **********************************************************************/
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 
@@ -21,6 +23,23 @@
 #include "sr_protocol.h"
 #include "sr_arpcache.h"
 #include "sr_utils.h"
+#include "sr_stats.h"
+#include "sr_latency.h"
+#include "sr_icmp.h"
+#include "sr_cksum.h"
+#include "sr_frag.h"
+#include "sr_acl.h"
+#include "sr_nat.h"
+#include "sr_ct.h"
+#include "sr_epoch.h"
+#include "sr_sched.h"
+#include "sr_flow.h"
+#include "sr_top.h"
+#include "sr_rtcache.h"
+#include "sr_huge.h"
+#include "sr_cpu.h"
+#include "sr_poll.h"
+#include "sr_pkt.h"
 
 /*---------------------------------------------------------------------
  * Method: sr_init(void)
@@ -45,21 +64,450 @@ void sr_init(struct sr_instance* sr)
     pthread_t thread;
 
     pthread_create(&thread, &(sr->attr), sr_arpcache_timeout, sr);
+
+    sr_stats_init(sr);
+    sr_huge_init(sr);
+    sr_cpu_init(sr);
+    sr_poll_init(sr);
+    sr_latency_init();
+    sr_cksum_init();
+    sr_icmp_init();
+    sr_frag_init();
+    sr_acl_init(sr);
+    sr_nat_init(sr);
+    sr_ct_init(sr);
+    sr_sched_init(sr);
+    sr_flow_init(sr);
+    sr_top_init(sr);
+    sr_rt_init(sr);
+    sr_rtc_init(sr);
     
     /* Add initialization code here! */
 
 } /* -- sr_init -- */
 
 /*---------------------------------------------------------------------
- * Method: sr_handlepacket(uint8_t* p,char* interface)
+ * Method: sr_init_interfaces(..)
+ * Scope:  Global
+ *
+ * Finish setting up what names interfaces, once the interface list is
+ * complete: from VNSHWINFO on a live router, which comes after sr_init,
+ * or from the hardware file before a replay.  Returns 0, or -1 after
+ * saying what's wrong.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_init_interfaces(struct sr_instance* sr)
+{
+    /* REQUIRES */
+    assert(sr);
+
+    if(sr->acl && sr_acl_attach(sr->acl, sr) != 0)
+    { return -1; }
+    if(sr->nat && sr_nat_attach(sr->nat, sr) != 0)
+    { return -1; }
+    if(sr->ct && sr_ct_attach(sr->ct, sr) != 0)
+    { return -1; }
+    if(sr->sched && sr_sched_attach(sr->sched, sr) != 0)
+    { return -1; }
+    return 0;
+} /* -- sr_init_interfaces -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_send_arp_request(..)
+ * Scope:  Global
+ *
+ * Broadcast an ARP request for req->ip out of the interface the waiting
+ * packets are queued on.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_send_arp_request(struct sr_instance* sr, struct sr_arpreq* req)
+{
+    uint8_t frame[sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t)];
+    sr_ethernet_hdr_t* e_hdr = (sr_ethernet_hdr_t*)frame;
+    sr_arp_hdr_t* a_hdr = (sr_arp_hdr_t*)(frame + sizeof(sr_ethernet_hdr_t));
+    struct sr_if* iface;
+
+    /* REQUIRES */
+    assert(sr);
+    assert(req);
+
+    if(!req->packets || !(iface = sr_get_interface(sr, req->packets->iface)))
+    { return; }
+
+    memset(e_hdr->ether_dhost, 0xff, ETHER_ADDR_LEN);
+    memcpy(e_hdr->ether_shost, iface->addr, ETHER_ADDR_LEN);
+    e_hdr->ether_type = htons(ethertype_arp);
+
+    a_hdr->ar_hrd = htons(arp_hrd_ethernet);
+    a_hdr->ar_pro = htons(ethertype_ip);
+    a_hdr->ar_hln = ETHER_ADDR_LEN;
+    a_hdr->ar_pln = sizeof(uint32_t);
+    a_hdr->ar_op  = htons(arp_op_request);
+    memcpy(a_hdr->ar_sha, iface->addr, ETHER_ADDR_LEN);
+    a_hdr->ar_sip = iface->ip;
+    memset(a_hdr->ar_tha, 0, ETHER_ADDR_LEN);
+    a_hdr->ar_tip = req->ip;
+
+    SR_STATS_INC(SR_STAT_ARP_REQUESTS);
+    if(req->times_sent > 0)
+    { SR_STATS_INC(SR_STAT_ARP_RETRIES); }
+
+    sr_send_packet(sr, frame, sizeof(frame), iface->name);
+} /* -- sr_send_arp_request -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_send_ip_packet(..)
+ * Scope:  Global
+ *
+ * Send an IP datagram (frame includes room for the ethernet header) along
+ * route rt.  The next hop is resolved through the route cache or the ARP
+ * cache; on a miss the frame is copied onto the request queue and sent
+ * once the reply arrives.
+ * Datagrams larger than the outgoing MTU are fragmented (which clobbers
+ * frame) or, with DF set, refused with frag needed.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_send_ip_packet(struct sr_instance* sr,
+        uint8_t* frame /* lent */,
+        unsigned int len,
+        struct sr_rt* rt)
+{
+    sr_ethernet_hdr_t* e_hdr = (sr_ethernet_hdr_t*)frame;
+    sr_ip_hdr_t* ip_hdr = (sr_ip_hdr_t*)(frame + sizeof(sr_ethernet_hdr_t));
+    struct sr_if* out;
+    struct sr_arpentry* entry;
+    struct sr_arpreq* req;
+    uint32_t next_hop;
+    uint8_t mac[ETHER_ADDR_LEN];
+    int cached;
+
+    /* REQUIRES */
+    assert(sr);
+    assert(frame);
+    assert(rt);
+
+    if((out = sr_rtc_adjacency(ip_hdr->ip_dst, rt, mac)))
+    { cached = 1; }
+    else if((out = sr_get_interface(sr, rt->interface)))
+    { cached = 0; }
+    else
+    {
+        sr_stats_drop(0, SR_DROP_NO_IFACE);
+        return;
+    }
+
+    if(len - sizeof(sr_ethernet_hdr_t) > out->mtu)
+    {
+        if(ntohs(ip_hdr->ip_off) & IP_DF)
+        {
+            sr_stats_drop(out, SR_DROP_FRAG_DF);
+            sr_icmp_send_frag_needed(sr, frame, len, out->mtu);
+        }
+        else
+        { sr_frag_send(sr, frame, len, out->mtu, rt, 0); }
+        return;
+    }
+
+    next_hop = rt->gw.s_addr ? rt->gw.s_addr : ip_hdr->ip_dst;
+
+    memcpy(e_hdr->ether_shost, out->addr, ETHER_ADDR_LEN);
+    e_hdr->ether_type = htons(ethertype_ip);
+
+    if(cached)
+    {
+        SR_STATS_INC(SR_STAT_ARP_HITS);
+        memcpy(e_hdr->ether_dhost, mac, ETHER_ADDR_LEN);
+        sr_send_packet(sr, frame, len, out->name);
+        return;
+    }
+
+    if((entry = sr_arpcache_lookup(&(sr->cache), next_hop)) != 0)
+    {
+        SR_STATS_INC(SR_STAT_ARP_HITS);
+        memcpy(e_hdr->ether_dhost, entry->mac, ETHER_ADDR_LEN);
+        free(entry);
+        sr_send_packet(sr, frame, len, out->name);
+        return;
+    }
+
+    SR_STATS_INC(SR_STAT_ARP_MISSES);
+    sr_latency_done(SR_LAT_ARP_QUEUED);
+
+    pthread_mutex_lock(&(sr->cache.lock));
+    req = sr_arpcache_queuereq(&(sr->cache), next_hop, frame, len, out->name);
+    sr_arpcache_handle_arpreq(sr, req);
+    pthread_mutex_unlock(&(sr->cache.lock));
+} /* -- sr_send_ip_packet -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_handle_arp(..)
+ * Scope:  Local
+ *
+ * Answer ARP requests for our address and release packets waiting on
+ * an ARP reply.  sr_pkt_parse(..) has checked the header and that it's
+ * for us.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_handle_arp(struct sr_instance* sr,
+        uint8_t* packet /* lent */,
+        const struct sr_pkt* pkt)
+{
+    sr_ethernet_hdr_t* e_hdr = (sr_ethernet_hdr_t*)packet;
+    sr_arp_hdr_t* a_hdr = (sr_arp_hdr_t*)(packet + pkt->l3);
+    uint8_t frame[sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t)];
+    sr_ethernet_hdr_t* r_e_hdr = (sr_ethernet_hdr_t*)frame;
+    sr_arp_hdr_t* r_a_hdr = (sr_arp_hdr_t*)(frame + sizeof(sr_ethernet_hdr_t));
+    struct sr_arpreq* req;
+    struct sr_packet* waiting;
+    sr_ethernet_hdr_t* p_hdr;
+    struct sr_if* iface = pkt->iface;
+    struct sr_if* out;
+
+    switch(ntohs(a_hdr->ar_op))
+    {
+        case arp_op_request:
+            memcpy(r_e_hdr->ether_dhost, e_hdr->ether_shost, ETHER_ADDR_LEN);
+            memcpy(r_e_hdr->ether_shost, iface->addr, ETHER_ADDR_LEN);
+            r_e_hdr->ether_type = htons(ethertype_arp);
+
+            memcpy(r_a_hdr, a_hdr, sizeof(sr_arp_hdr_t));
+            r_a_hdr->ar_op = htons(arp_op_reply);
+            memcpy(r_a_hdr->ar_sha, iface->addr, ETHER_ADDR_LEN);
+            r_a_hdr->ar_sip = a_hdr->ar_tip;
+            memcpy(r_a_hdr->ar_tha, a_hdr->ar_sha, ETHER_ADDR_LEN);
+            r_a_hdr->ar_tip = a_hdr->ar_sip;
+
+            SR_STATS_INC(SR_STAT_ARP_REPLIES);
+            sr_latency_set_outcome(SR_LAT_ARP);
+            sr_send_packet(sr, frame, sizeof(frame), iface->name);
+            break;
+
+        case arp_op_reply:
+            req = sr_arpcache_insert(&(sr->cache), a_hdr->ar_sha, a_hdr->ar_sip);
+            if(req)
+            {
+                for(waiting = req->packets; waiting; waiting = waiting->next)
+                {
+                    if((out = sr_get_interface(sr, waiting->iface)) == 0)
+                    { continue; }
+                    p_hdr = (sr_ethernet_hdr_t*)waiting->buf;
+                    memcpy(p_hdr->ether_dhost, a_hdr->ar_sha, ETHER_ADDR_LEN);
+                    memcpy(p_hdr->ether_shost, out->addr, ETHER_ADDR_LEN);
+                    sr_send_packet(sr, waiting->buf, waiting->len, out->name);
+                }
+                sr_arpreq_destroy(&(sr->cache), req);
+            }
+            break;
+
+        default:
+            sr_stats_drop(iface, SR_DROP_UNSUPPORTED);
+            break;
+    }
+} /* -- sr_handle_arp -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_handle_ip_local(..)
+ * Scope:  Local
+ *
+ * Datagrams addressed to one of the router's interfaces.  We answer echo
+ * requests and refuse TCP/UDP with port unreachable.  packet may be
+ * modified.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_handle_ip_local(struct sr_instance* sr,
+        uint8_t* packet /* lent */,
+        const struct sr_pkt* pkt)
+{
+    sr_icmp_hdr_t* icmp_hdr = (sr_icmp_hdr_t*)(packet + pkt->l4);
+
+    switch(pkt->proto)
+    {
+        case ip_protocol_icmp:
+            if(pkt->len < pkt->l4 + sizeof(sr_icmp_hdr_t))
+            {
+                sr_stats_drop(pkt->iface, SR_DROP_SHORT);
+                return;
+            }
+            if(icmp_hdr->icmp_type != icmp_type_echo_request)
+            {
+                sr_stats_drop(pkt->iface, SR_DROP_UNSUPPORTED);
+                return;
+            }
+            sr_icmp_echo_reply(sr, packet, pkt);
+            break;
+
+        case ip_protocol_tcp:
+        case ip_protocol_udp:
+            sr_icmp_send_error(sr, packet, pkt->len, SR_ICMP_PORT_UNREACH);
+            break;
+
+        default:
+            sr_stats_drop(pkt->iface, SR_DROP_UNSUPPORTED);
+            break;
+    }
+} /* -- sr_handle_ip_local -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_ip_wants_whole(..)
+ * Scope:  Local
+ *
+ * Whether a fragment has to be reassembled before it's handled: it's for
+ * us, or connection tracking or NAT has to see its ports.  The whole
+ * datagram picks its equal-cost path by a hash of its ports, which most
+ * fragments don't have, so every fragment of a datagram that could leave
+ * through the NAT's outside interface is reassembled.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_ip_wants_whole(struct sr_instance* sr, sr_ip_hdr_t* ip_hdr,
+                             const struct sr_pkt* pkt)
+{
+    struct sr_rt* rt;
+
+    if(sr->ct || (pkt->flags & SR_PKT_LOCAL))
+    { return 1; }
+    if(sr->nat == 0 || pkt->iface == sr->nat->ext)
+    { return 0; }
+    if((rt = sr_rtc_lookup(sr, ip_hdr->ip_dst)) == 0)
+    { return 0; }
+    return sr_rt_any_path(rt, sr->nat->ext->name);
+} /* -- sr_ip_wants_whole -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_handle_ip_whole(..)
+ * Scope:  Local
+ *
+ * Deliver, translate or forward a validated datagram.  Fragments only
+ * get here reassembled when sr_ip_wants_whole() says so.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_handle_ip_whole(struct sr_instance* sr,
+        uint8_t* packet /* lent */,
+        const struct sr_pkt* pkt)
+{
+    sr_ip_hdr_t* ip_hdr = (sr_ip_hdr_t*)(packet + pkt->l3);
+    struct sr_if* iface = pkt->iface;
+    unsigned int len = pkt->len;
+    struct sr_nat_map* m = 0;
+    struct sr_rt* rt;
+    uint32_t dst = ip_hdr->ip_dst;
+    uint16_t old, new;
+
+    if(pkt->flags & SR_PKT_LOCAL)
+    {
+        /* -- replies to NATed flows are forwarded, the rest is ours -- */
+        if(sr->nat == 0 || iface != sr->nat->ext ||
+           (m = sr_nat_inbound_find(sr->nat, packet, pkt)) == 0)
+        {
+            sr_handle_ip_local(sr, packet, pkt);
+            return;
+        }
+        dst = m->int_ip;
+    }
+
+    /* -- errors quote the datagram as it arrived, so a reply is only
+     *    mapped to the inside once it's sure to be forwarded -- */
+    if(ip_hdr->ip_ttl <= 1)
+    {
+        sr_stats_drop(iface, SR_DROP_TTL);
+        sr_icmp_send_error(sr, packet, len, SR_ICMP_TIME_EXCEEDED);
+        return;
+    }
+
+    if((rt = sr_rtc_lookup(sr, dst)) == 0)
+    {
+        sr_stats_drop(iface, SR_DROP_NO_ROUTE);
+        sr_icmp_send_error(sr, packet, len, SR_ICMP_NET_UNREACH);
+        return;
+    }
+    if(m)
+    { sr_nat_inbound(sr->nat, packet, pkt, m); }
+    rt = sr_rt_select(rt, sr_rt_flow_hash((uint8_t*)ip_hdr, len - pkt->l3));
+
+    if(sr->ct && sr_ct_track(sr->ct, packet, pkt) != 0)
+    {
+        sr_stats_drop(iface, SR_DROP_CT);
+        return;
+    }
+
+    if(sr->nat && iface != sr->nat->ext &&
+       strncmp(rt->interface, sr->nat->ext->name, sr_IFACE_NAMELEN) == 0 &&
+       sr_nat_outbound(sr->nat, packet, pkt) != 0)
+    {
+        sr_stats_drop(iface, SR_DROP_NAT);
+        return;
+    }
+
+    /* -- TTL shares a word with the protocol -- */
+    memcpy(&old, &ip_hdr->ip_ttl, sizeof(old));
+    ip_hdr->ip_ttl--;
+    memcpy(&new, &ip_hdr->ip_ttl, sizeof(new));
+    ip_hdr->ip_sum = cksum_update16(ip_hdr->ip_sum, old, new);
+
+    SR_STATS_INC(SR_STAT_FORWARDED);
+    sr_latency_set_outcome(SR_LAT_FORWARD);
+    if(sr->flow)
+    { sr_flow_account(sr->flow, packet, pkt, rt); }
+    sr_send_ip_packet(sr, packet, len, rt);
+} /* -- sr_handle_ip_whole -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_handle_ip(..)
+ * Scope:  Local
+ *
+ * Filter a datagram sr_pkt_parse(..) found valid, reassemble it if
+ * need be, then deliver it locally or forward it.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_handle_ip(struct sr_instance* sr,
+        uint8_t* packet /* lent */,
+        const struct sr_pkt* pkt)
+{
+    sr_ip_hdr_t* ip_hdr = (sr_ip_hdr_t*)(packet + pkt->l3);
+    struct sr_pkt whole_pkt;
+    uint8_t* whole;
+    unsigned int whole_len;
+
+    if(sr->top)
+    { sr_top_account(sr->top, packet, pkt); }
+
+    if(sr->acl && sr_acl_check(sr->acl, packet, pkt) == SR_ACL_DENY)
+    {
+        sr_stats_drop(pkt->iface, SR_DROP_ACL);
+        return;
+    }
+
+    if((pkt->flags & SR_PKT_FRAG) && sr_ip_wants_whole(sr, ip_hdr, pkt))
+    {
+        if((whole = sr_reasm_input(sr, packet, pkt, &whole_len)))
+        {
+            sr_pkt_whole(pkt, whole, whole_len, &whole_pkt);
+            sr_handle_ip_whole(sr, whole, &whole_pkt);
+            sr_reasm_release(whole);
+        }
+        return;
+    }
+
+    sr_handle_ip_whole(sr, packet, pkt);
+} /* -- sr_handle_ip -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_handlepacket(uint8_t* p,struct sr_pkt* pkt)
  * Scope:  Global
  *
  * This method is called each time the router receives a packet on the
- * interface.  The packet buffer, the packet length and the receiving
- * interface are passed in as parameters. The packet is complete with
- * ethernet headers.
+ * interface.  The packet buffer and its descriptor from sr_pkt_parse(..),
+ * which holds the length and the receiving interface, are passed in as
+ * parameters. The packet is complete with ethernet headers.
  *
- * Note: Both the packet buffer and the character's memory are handled
+ * Note: Both the packet buffer and the descriptor are handled
  * by sr_vns_comm.c that means do NOT delete either.  Make a copy of the
  * packet instead if you intend to keep it around beyond the scope of
  * the method call.
@@ -68,17 +516,30 @@ void sr_init(struct sr_instance* sr)
 
 void sr_handlepacket(struct sr_instance* sr,
         uint8_t * packet/* lent */,
-        unsigned int len,
-        char* interface/* lent */)
+        const struct sr_pkt* pkt/* lent */)
 {
   /* REQUIRES */
   assert(sr);
   assert(packet);
-  assert(interface);
+  assert(pkt);
 
-  printf("*** -> Received packet of length %d \n",len);
+  if(pkt->flags & SR_PKT_BAD)
+  {
+    sr_stats_drop(pkt->iface, (enum sr_drop)pkt->drop);
+    return;
+  }
 
-  /* fill in code here */
+  /* -- routes looked up below stay valid until we're done -- */
+  sr_epoch_enter();
+  switch(pkt->ethertype)
+  {
+    case ethertype_arp:
+      sr_handle_arp(sr, packet, pkt);
+      break;
+    case ethertype_ip:
+      sr_handle_ip(sr, packet, pkt);
+      break;
+  }
+  sr_epoch_exit();
 
 }/* end sr_ForwardPacket */
-
@@ -32,7 +32,17 @@
 
 /* forward declare */
 struct sr_if;
+struct sr_local;
 struct sr_rt;
+struct sr_fib;
+struct sr_replay;
+struct sr_acl;
+struct sr_nat;
+struct sr_ct;
+struct sr_sched;
+struct sr_flow;
+struct sr_top;
+struct sr_pkt;
 
 /* ----------------------------------------------------------------------------
  * struct sr_instance
@@ -50,10 +60,18 @@ struct sr_instance
     unsigned short topo_id;
     struct sockaddr_in sr_addr; /* address to server */
     struct sr_if* if_list; /* list of interfaces */
-    struct sr_rt* routing_table; /* routing table */
+    struct sr_local* local; /* our addresses, see sr_local_build() */
+    struct sr_fib* fib; /* routing table */
     struct sr_arpcache cache;   /* ARP cache */
     pthread_attr_t attr;
     FILE* logfile;
+    struct sr_replay* replay; /* set while replaying a capture offline */
+    struct sr_acl* acl;       /* compiled ACL, 0 if none */
+    struct sr_nat* nat;       /* NAPT state, 0 if disabled */
+    struct sr_ct* ct;         /* connection tracking, 0 if disabled */
+    struct sr_sched* sched;   /* egress queues, 0 to send right away */
+    struct sr_flow* flow;     /* flow export, 0 if disabled */
+    struct sr_top* top;       /* top talkers, 0 if disabled */
 };
 
 /* -- sr_main.c -- */
@@ -61,12 +79,20 @@ int sr_verify_routing_table(struct sr_instance* sr);
 
 /* -- sr_vns_comm.c -- */
 int sr_send_packet(struct sr_instance* , uint8_t* , unsigned int , const char*);
+int sr_transmit_packet(struct sr_instance* , uint8_t* , unsigned int ,
+                       struct sr_if* );
 int sr_connect_to_server(struct sr_instance* ,unsigned short , char* );
 int sr_read_from_server(struct sr_instance* );
+void sr_deliver_packet(struct sr_instance* , uint8_t* , unsigned int , char* );
 
 /* -- sr_router.c -- */
 void sr_init(struct sr_instance* );
-void sr_handlepacket(struct sr_instance* , uint8_t * , unsigned int , char* );
+int  sr_init_interfaces(struct sr_instance* );
+void sr_handlepacket(struct sr_instance* , uint8_t * ,
+                     const struct sr_pkt* );
+void sr_send_arp_request(struct sr_instance* , struct sr_arpreq* );
+void sr_send_ip_packet(struct sr_instance* , uint8_t* , unsigned int ,
+                       struct sr_rt* );
 
 /* -- sr_if.c -- */
 void sr_add_interface(struct sr_instance* , const char* );
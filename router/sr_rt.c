@@ -12,79 +12,617 @@
 #include <assert.h>
 #include <string.h>
 #include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
 
 
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #define __USE_MISC 1 /* force linux to show inet_aton */
 #include <arpa/inet.h>
 
 #include "sr_rt.h"
 #include "sr_router.h"
+#include "sr_stats.h"
+#include "sr_protocol.h"
+#include "sr_epoch.h"
+#include "sr_fib.h"
+#include "sr_rtcache.h"
+#include "sr_cpu.h"
+
+static int sr_rt_resilient = 0;
+
+/* -- reloading, see sr_rt_init(..) -- */
+static char sr_rt_file[256];            /* what sr_load_rt(..) last loaded */
+static struct timespec sr_rt_mtime;     /* of sr_rt_file when loaded */
+static volatile sig_atomic_t sr_rt_hup = 0;
+static uint64_t sr_rt_loads = 0;
+static uint64_t sr_rt_load_failures = 0;
+static uint64_t sr_rt_load_ns = 0;      /* the last successful load */
+
+static int sr_rt_add_to(struct sr_fib* fib, struct in_addr dest,
+                        struct in_addr gw, struct in_addr mask,
+                        const char* if_name);
+static int sr_rt_attach(struct sr_fib* fib, struct sr_fib_node* node,
+                        struct sr_rt* rt);
+
+static uint64_t sr_rt_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* -- one parsed line of a routing table file -- */
+struct sr_rt_rec {
+    uint32_t prefix;            /* host byte order, masked */
+    uint32_t gw;                /* network byte order */
+    uint32_t line;              /* within the chunk */
+    uint8_t  len;
+    char     iface[sr_IFACE_NAMELEN];
+};
+
+#define SR_RT_PARSE_THREADS  8
+#define SR_RT_PARSE_CHUNK    (1 << 20)  /* least bytes worth a thread */
+#define SR_RT_PARSE_REPORT   10         /* malformed lines shown per chunk */
+
+/* -- a piece of the file, parsed by one thread -- */
+struct sr_rt_chunk {
+    const char* start;
+    const char* end;
+    struct sr_rt_rec* recs;
+    uint32_t* order;            /* recs by prefix, then line */
+    unsigned int nrecs;
+    unsigned int lines;
+    unsigned int nbad;
+    struct {
+        unsigned int line;
+        const char* why;
+        char text[64];
+    } bad[SR_RT_PARSE_REPORT];
+};
+
+/* Dotted quad at p, host byte order; returns the end or 0 */
+static const char* sr_rt_parse_ip(const char* p, const char* end, uint32_t* ip)
+{
+    unsigned int part, v, digits;
+
+    *ip = 0;
+    for(part = 0; part < 4; part++)
+    {
+        if(part && (p == end || *p++ != '.'))
+        { return 0; }
+        for(v = 0, digits = 0; p < end && *p >= '0' && *p <= '9'; p++, digits++)
+        { v = v * 10 + (*p - '0'); }
+        if(digits == 0 || digits > 3 || v > 255)
+        { return 0; }
+        *ip = (*ip << 8) | v;
+    }
+    return p;
+}
 
 /*---------------------------------------------------------------------
- * Method:
+ * Method: sr_rt_parse_line(..)
+ * Scope:  Local
+ *
+ * Parse "dest gw mask iface" or "dest/len gw iface" into rec.  Returns
+ * 1 for a route, 0 for a blank or comment line, or -1 with *why set.
  *
  *---------------------------------------------------------------------*/
 
-int sr_load_rt(struct sr_instance* sr,const char* filename)
+static int sr_rt_parse_line(const char* p, const char* end,
+                            struct sr_rt_rec* rec, const char** why)
+{
+    const char* tok[5];
+    const char* tend[5];
+    const char* q;
+    uint32_t dest, gw, mask;
+    unsigned int n = 0, len;
+
+    while(p < end && n < 5)
+    {
+        while(p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+        { p++; }
+        if(p == end || *p == '#')
+        { break; }
+        tok[n] = p;
+        while(p < end && *p != ' ' && *p != '\t' && *p != '\r')
+        { p++; }
+        tend[n++] = p;
+    }
+    if(n == 0)
+    { return 0; }
+
+    *why = "bad destination";
+    if((q = sr_rt_parse_ip(tok[0], tend[0], &dest)) == 0)
+    { return -1; }
+    if(q < tend[0])
+    {
+        /* -- a.b.c.d/len -- */
+        if(*q++ != '/' || q == tend[0] || tend[0] - q > 2)
+        { return -1; }
+        for(len = 0; q < tend[0] && *q >= '0' && *q <= '9'; q++)
+        { len = len * 10 + (*q - '0'); }
+        *why = "bad prefix length";
+        if(q != tend[0] || len > 32)
+        { return -1; }
+        *why = "expected dest/len gateway interface";
+        if(n != 3)
+        { return -1; }
+        tok[3] = tok[2];
+        tend[3] = tend[2];
+    }
+    else
+    {
+        *why = "expected dest gateway mask interface";
+        if(n != 4)
+        { return -1; }
+        *why = "bad mask";
+        if(sr_rt_parse_ip(tok[2], tend[2], &mask) != tend[2])
+        { return -1; }
+        for(len = 0; len < 32 && (mask & (0x80000000U >> len)); len++);
+        *why = "mask is not a prefix";
+        if(len < 32 && (mask << len) != 0)
+        { return -1; }
+    }
+    *why = "bad gateway";
+    if(sr_rt_parse_ip(tok[1], tend[1], &gw) != tend[1])
+    { return -1; }
+    *why = "interface name too long";
+    if(tend[3] - tok[3] >= sr_IFACE_NAMELEN)
+    { return -1; }
+
+    rec->prefix = len ? dest & (0xffffffffU << (32 - len)) : 0;
+    rec->len = len;
+    rec->gw = htonl(gw);
+    memset(rec->iface, 0, sizeof(rec->iface));
+    memcpy(rec->iface, tok[3], tend[3] - tok[3]);
+    return 1;
+} /* -- sr_rt_parse_line -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_sort(..)
+ * Scope:  Local
+ *
+ * Order a chunk's routes by prefix and length.  LSD radix sort on the
+ * 40 bits of prefix and length; it's stable, so routes to one prefix
+ * stay in line order.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_rt_sort(struct sr_rt_chunk* c)
 {
-    FILE* fp;
-    char  line[BUFSIZ];
-    char  dest[32];
-    char  gw[32];
-    char  mask[32];
-    char  iface[32];
-    struct in_addr dest_addr;
-    struct in_addr gw_addr;
-    struct in_addr mask_addr;
-    int clear_routing_table = 0;
+    uint64_t* key[2];
+    uint32_t* idx[2];
+    unsigned int count[256];
+    unsigned int i, b, sum, cur = 0, n = c->nrecs;
+    int shift;
+
+    key[0] = (uint64_t*)malloc((n + 1) * sizeof(uint64_t));
+    key[1] = (uint64_t*)malloc((n + 1) * sizeof(uint64_t));
+    idx[0] = (uint32_t*)malloc((n + 1) * sizeof(uint32_t));
+    idx[1] = (uint32_t*)malloc((n + 1) * sizeof(uint32_t));
+    assert(key[0] && key[1] && idx[0] && idx[1]);
+
+    for(i = 0; i < n; i++)
+    {
+        key[0][i] = (uint64_t)c->recs[i].prefix << 32 |
+                    (uint64_t)c->recs[i].len << 24;
+        idx[0][i] = i;
+    }
+    for(shift = 24; shift < 64; shift += 8)
+    {
+        memset(count, 0, sizeof(count));
+        for(i = 0; i < n; i++)
+        { count[(key[cur][i] >> shift) & 0xff]++; }
+        if(n == 0 || count[(key[cur][0] >> shift) & 0xff] == n)
+        { continue; }
+        for(b = 0, sum = 0; b < 256; b++)
+        {
+            sum += count[b];
+            count[b] = sum - count[b];
+        }
+        for(i = 0; i < n; i++)
+        {
+            b = count[(key[cur][i] >> shift) & 0xff]++;
+            key[!cur][b] = key[cur][i];
+            idx[!cur][b] = idx[cur][i];
+        }
+        cur = !cur;
+    }
+
+    c->order = idx[cur];
+    free(idx[!cur]);
+    free(key[0]);
+    free(key[1]);
+} /* -- sr_rt_sort -- */
+
+/* Parse one chunk and sort its routes (thread) */
+static void* sr_rt_parse_chunk(void* arg)
+{
+    struct sr_rt_chunk* c = (struct sr_rt_chunk*)arg;
+    const char* p = c->start;
+    const char* eol;
+    const char* why = 0;
+    unsigned int max = 64;
+    int r;
+
+    c->recs = (struct sr_rt_rec*)malloc(max * sizeof(struct sr_rt_rec));
+    assert(c->recs);
+    for(; p < c->end; p = eol + 1)
+    {
+        if((eol = memchr(p, '\n', c->end - p)) == 0)
+        { eol = c->end; }
+        c->lines++;
+        if(c->nrecs == max)
+        {
+            max *= 2;
+            c->recs = (struct sr_rt_rec*)realloc(c->recs,
+                                                 max * sizeof(struct sr_rt_rec));
+            assert(c->recs);
+        }
+        if((r = sr_rt_parse_line(p, eol, &c->recs[c->nrecs], &why)) > 0)
+        { c->recs[c->nrecs++].line = c->lines; }
+        else if(r < 0)
+        {
+            if(c->nbad < SR_RT_PARSE_REPORT)
+            {
+                c->bad[c->nbad].line = c->lines;
+                c->bad[c->nbad].why = why;
+                snprintf(c->bad[c->nbad].text, sizeof(c->bad[0].text), "%.*s",
+                         (int)(eol - p), p);
+            }
+            c->nbad++;
+        }
+    }
+    sr_rt_sort(c);
+    return 0;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_parse(..)
+ * Scope:  Local
+ *
+ * Parse a routing table text file into a new fib, or 0 if it can't be
+ * read or has nothing but malformed lines.  Malformed lines are reported,
+ * then skipped, or with strict set fail the whole file.
+ *
+ * The file is mapped and cut at line ends into chunks that are parsed
+ * and sorted on up to SR_RT_PARSE_THREADS threads.  The chunks are then
+ * merged in prefix order straight into the trie, so each node is made
+ * once and no route is looked up.  Routes to the same prefix keep their
+ * order in the file, the first carries the group.
+ *
+ *---------------------------------------------------------------------*/
+
+static struct sr_fib* sr_rt_parse(const char* filename, int strict)
+{
+    struct sr_rt_chunk chunks[SR_RT_PARSE_THREADS];
+    pthread_t threads[SR_RT_PARSE_THREADS];
+    pthread_attr_t attr;
+    int spawned[SR_RT_PARSE_THREADS];
+    unsigned int at[SR_RT_PARSE_THREADS];
+    struct sr_fib_cursor cursor;
+    struct sr_fib* fib;
+    struct sr_rt_rec* rec;
+    struct sr_rt* rt;
+    struct stat st;
+    const char* map = 0;
+    const char* p;
+    unsigned int i, k, nchunks, lines, nrecs = 0, nbad = 0, nfull = 0;
+    long ncpu;
+    int fd;
 
     /* -- REQUIRES -- */
     assert(filename);
-    if( access(filename,R_OK) != 0)
+    if((fd = open(filename, O_RDONLY)) < 0 || fstat(fd, &st) != 0)
     {
-        perror("access");
-        return -1;
+        perror(filename);
+        if(fd >= 0)
+        { close(fd); }
+        return 0;
     }
+    if(st.st_size > 0 &&
+       (map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+    {
+        perror(filename);
+        close(fd);
+        return 0;
+    }
+    close(fd);
+    if(map)
+    { madvise((void*)map, st.st_size, MADV_SEQUENTIAL); }
 
-    fp = fopen(filename,"r");
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    nchunks = st.st_size / SR_RT_PARSE_CHUNK + 1;
+    if(nchunks > SR_RT_PARSE_THREADS)
+    { nchunks = SR_RT_PARSE_THREADS; }
+    if(ncpu > 0 && nchunks > (unsigned int)ncpu)
+    { nchunks = ncpu; }
 
-    while( fgets(line,BUFSIZ,fp) != 0)
+    memset(chunks, 0, sizeof(chunks));
+    for(i = 0, p = map; i < nchunks; i++)
     {
-        sscanf(line,"%s %s %s %s",dest,gw,mask,iface);
-        if(inet_aton(dest,&dest_addr) == 0)
-        { 
-            fprintf(stderr,
-                    "Error loading routing table, cannot convert %s to valid IP\n",
-                    dest);
-            return -1; 
+        chunks[i].start = p;
+        if(i == nchunks - 1)
+        { p = map + st.st_size; }
+        else
+        {
+            p = map + st.st_size / nchunks * (i + 1);
+            if(p < chunks[i].start)
+            { p = chunks[i].start; }
+            while(p < map + st.st_size && p[-1] != '\n')
+            { p++; }
         }
-        if(inet_aton(gw,&gw_addr) == 0)
-        { 
-            fprintf(stderr,
-                    "Error loading routing table, cannot convert %s to valid IP\n",
-                    gw);
-            return -1; 
+        chunks[i].end = p;
+    }
+
+    /* -- helpers run with the control threads, not on the caller's CPU -- */
+    pthread_attr_init(&attr);
+    sr_cpu_attr(SR_CPU_CONTROL, &attr);
+    for(i = 1; i < nchunks; i++)
+    {
+        if(!(spawned[i] = pthread_create(&threads[i], &attr, sr_rt_parse_chunk,
+                                         &chunks[i]) == 0))
+        { sr_rt_parse_chunk(&chunks[i]); }
+    }
+    pthread_attr_destroy(&attr);
+    sr_rt_parse_chunk(&chunks[0]);
+    for(i = 1; i < nchunks; i++)
+    {
+        if(spawned[i])
+        { pthread_join(threads[i], 0); }
+    }
+    if(map)
+    { munmap((void*)map, st.st_size); }
+
+    for(i = 0, lines = 0; i < nchunks; i++)
+    {
+        for(k = 0; k < chunks[i].nbad && k < SR_RT_PARSE_REPORT; k++)
+        {
+            fprintf(stderr, "%s:%u: %s: %s\n", filename,
+                    lines + chunks[i].bad[k].line, chunks[i].bad[k].why,
+                    chunks[i].bad[k].text);
         }
-        if(inet_aton(mask,&mask_addr) == 0)
-        { 
-            fprintf(stderr,
-                    "Error loading routing table, cannot convert %s to valid IP\n",
-                    mask);
-            return -1; 
+        if(chunks[i].nbad > SR_RT_PARSE_REPORT)
+        {
+            fprintf(stderr, "%s: %u more malformed lines\n", filename,
+                    chunks[i].nbad - SR_RT_PARSE_REPORT);
         }
-        if( clear_routing_table == 0 ){
-            printf("Loading routing table from server, clear local routing table.\n");
-            sr->routing_table = 0;
-            clear_routing_table = 1;
+        lines += chunks[i].lines;
+        nrecs += chunks[i].nrecs;
+        nbad += chunks[i].nbad;
+    }
+
+    fib = 0;
+    if(strict && nbad)
+    {
+        fprintf(stderr, "Error loading routing table, %u malformed lines in %s\n",
+                nbad, filename);
+    }
+    else if(nrecs || nbad == 0)
+    {
+        printf("Loading routing table from server, clear local routing table.\n");
+        fib = sr_fib_create();
+        sr_fib_cursor_init(fib, &cursor);
+        memset(at, 0, sizeof(at));
+
+        /* -- merge the sorted chunks, earlier chunks first on a tie -- */
+        pthread_mutex_lock(&fib->lock);
+        for(;;)
+        {
+            rec = 0;
+            for(i = 0, k = 0; i < nchunks; i++)
+            {
+                struct sr_rt_rec* r;
+
+                if(at[i] == chunks[i].nrecs)
+                { continue; }
+                r = &chunks[i].recs[chunks[i].order[at[i]]];
+                if(rec == 0 || r->prefix < rec->prefix ||
+                   (r->prefix == rec->prefix && r->len < rec->len))
+                {
+                    rec = r;
+                    k = i;
+                }
+            }
+            if(rec == 0)
+            { break; }
+            at[k]++;
+
+            rt = (struct sr_rt*)calloc(1, sizeof(struct sr_rt));
+            assert(rt);
+            rt->dest.s_addr = htonl(rec->prefix);
+            rt->gw.s_addr = rec->gw;
+            rt->mask.s_addr = htonl(rec->len ? 0xffffffffU << (32 - rec->len) : 0);
+            memcpy(rt->interface, rec->iface, sr_IFACE_NAMELEN);
+            if(sr_rt_attach(fib, sr_fib_find_next(fib, &cursor, rec->prefix,
+                                                  rec->len), rt) == SR_RT_FULL)
+            { nfull++; }
         }
-        sr_add_rt_entry(sr,dest_addr,gw_addr,mask_addr,iface);
-    } /* -- while -- */
+        pthread_mutex_unlock(&fib->lock);
+        if(nfull)
+        {
+            fprintf(stderr, "%s: %u routes not used for ECMP, their group is full\n",
+                    filename, nfull);
+        }
+        if(nbad)
+        {
+            fprintf(stderr, "%s: loaded %u routes, skipped %u malformed lines\n",
+                    filename, nrecs, nbad);
+        }
+    }
+    else
+    { fprintf(stderr, "Error loading routing table, no valid routes in %s\n", filename); }
 
+    for(i = 0; i < nchunks; i++)
+    {
+        free(chunks[i].recs);
+        free(chunks[i].order);
+    }
+    return fib;
+} /* -- sr_rt_parse -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_read(..)
+ * Scope:  Local
+ *
+ * A new fib for a routing table file: its compiled image (sr -C) if
+ * there is one compiled from the file as it is now, else the parsed text,
+ * strictly or not as for sr_rt_parse(..).
+ *
+ *---------------------------------------------------------------------*/
+
+static struct sr_fib* sr_rt_read(const char* filename, int strict)
+{
+    struct sr_fib* fib;
+    struct stat st, ist;
+    char image[1024];
+
+    snprintf(image, sizeof(image), "%s%s", filename, SR_RT_IMAGE_SUFFIX);
+    if(stat(image, &ist) == 0 &&
+       (fib = sr_fib_map(image, stat(filename, &st) == 0 ? &st : 0)))
+    {
+        printf("Mapped routing table image %s, %u routes\n", image,
+               fib->nroutes);
+    }
+    else if((fib = sr_rt_parse(filename, strict)) == 0)
+    { return 0; }
+    return fib;
+} /* -- sr_rt_read -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_compile(..)
+ * Scope:  Global
+ *
+ * Parse a routing table text file and save it as an image next to it,
+ * for sr_load_rt(..) to map next time.  A file with malformed lines
+ * isn't compiled.  Returns 0 or -1.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_rt_compile(const char* filename)
+{
+    struct sr_fib* fib;
+    struct stat st;
+    char image[1024];
+    int ret;
+
+    /* -- stat first: if the file changes while it's read, the image is
+     *    stale from the start -- */
+    if(stat(filename, &st) != 0)
+    {
+        perror(filename);
+        return -1;
+    }
+    if((fib = sr_rt_parse(filename, 1)) == 0)
+    { return -1; }
+    snprintf(image, sizeof(image), "%s%s", filename, SR_RT_IMAGE_SUFFIX);
+    if((ret = sr_fib_save(fib, image, &st)) == 0)
+    {
+        printf("Compiled %u routes from %s into %s\n", fib->nroutes,
+               filename, image);
+    }
+    sr_fib_destroy(fib);
+    return ret;
+} /* -- sr_rt_compile -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_load_rt(..)
+ * Scope:  Global
+ *
+ * Load a routing table file at start.  The routes are read into a new
+ * table, which replaces the current one if the file loads; malformed
+ * lines are reported and skipped.  Routes added since the last load are
+ * dropped with the old table.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_load_rt(struct sr_instance* sr,const char* filename)
+{
+    struct sr_fib* fib;
+    struct stat st;
+    uint64_t start = sr_rt_now();
+
+    /* -- REQUIRES -- */
+    assert(sr);
+    assert(filename);
+
+    if(stat(filename, &st) == 0)
+    { sr_rt_mtime = st.st_mtim; }
+    if((fib = sr_rt_read(filename, 0)) == 0)
+    {
+        sr_rt_load_failures++;
+        return -1;
+    }
+    sr_fib_swap(sr, fib);
+
+    sr_rt_load_ns = sr_rt_now() - start;
+    sr_rt_loads++;
+    if(filename != sr_rt_file)
+    {
+        strncpy(sr_rt_file, filename, sizeof(sr_rt_file) - 1);
+        sr_rt_file[sizeof(sr_rt_file) - 1] = 0;
+    }
     return 0; /* -- success -- */
 } /* -- sr_load_rt -- */
 
+/*-----------------------------------------------------------------------------
+ * Method: sr_verify_routing_table()
+ * Scope: Global
+ *
+ * make sure the routing table is consistent with the interface list by
+ * verifying that all interfaces used in the routing table actually exist
+ * in the hardware.
+ *
+ * RETURN VALUES:
+ *
+ *  0 on success
+ *  something other than zero on error
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_verify_routing_table(struct sr_instance* sr)
+{
+    struct sr_rt* rt_walker = 0;
+    struct sr_if* if_walker = 0;
+    int ret = 0;
+
+    /* -- REQUIRES --*/
+    assert(sr);
+
+    if( (sr->if_list == 0) || (sr->fib == 0) || (sr->fib->routes == 0))
+    {
+        return 999; /* doh! */
+    }
+
+    rt_walker = sr->fib->routes;
+
+    while(rt_walker)
+    {
+        /* -- check to see if interface exists -- */
+        if_walker = sr->if_list;
+        while(if_walker)
+        {
+            if( strncmp(if_walker->name,rt_walker->interface,sr_IFACE_NAMELEN)
+                    == 0)
+            { break; }
+            if_walker = if_walker->next;
+        }
+        if(if_walker == 0)
+        { ret++; } /* -- interface not found! -- */
+
+        rt_walker = rt_walker->next;
+    } /* -- while -- */
+
+    return ret;
+} /* -- sr_verify_routing_table -- */
+
 /*---------------------------------------------------------------------
  * Method:
  *
@@ -93,43 +631,666 @@ int sr_load_rt(struct sr_instance* sr,const char* filename)
 void sr_add_rt_entry(struct sr_instance* sr, struct in_addr dest,
 struct in_addr gw, struct in_addr mask,char* if_name)
 {
-    struct sr_rt* rt_walker = 0;
+    /* -- REQUIRES -- */
+    assert(if_name);
+    assert(sr);
+
+    switch(sr_rt_add(sr, dest, gw, mask, if_name))
+    {
+        case SR_RT_BAD_MASK:
+            fprintf(stderr, "Not adding route to %s, ", inet_ntoa(dest));
+            fprintf(stderr, "%s is not a prefix mask\n", inet_ntoa(mask));
+            break;
+        case SR_RT_FULL:
+            fprintf(stderr, "Not using %s via %s for ECMP, the group is full\n",
+                    inet_ntoa(dest), if_name);
+            break;
+        default:
+            break;
+    }
+} /* -- sr_add_entry -- */
+
+/* Prefix length of a contiguous mask (network byte order), or -1 */
+static int sr_rt_mask_len(struct in_addr mask)
+{
+    uint32_t m = ntohl(mask.s_addr);
+    int len = 0;
+
+    while(len < 32 && (m & (0x80000000U >> len)))
+    { len++; }
+    if(len < 32 && (m << len) != 0)
+    { return -1; }
+    return len;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_group_add(..)
+ * Scope:  Local
+ *
+ * Publish a copy of the equal-cost group of head with member added,
+ * creating the group with head in it.  The new member takes buckets
+ * only from members above their fair share.  Returns -1 if the group
+ * is full.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_rt_group_add(struct sr_rt* head, struct sr_rt* member)
+{
+    struct sr_rt_group* old = head->group;
+    struct sr_rt_group* g;
+    unsigned int count[SR_RT_GROUP_MAX];
+    unsigned int share, got, b;
+
+    if(old && old->n == SR_RT_GROUP_MAX)
+    { return -1; }
+
+    g = (struct sr_rt_group*)calloc(1, sizeof(struct sr_rt_group));
+    assert(g);
+    if(old)
+    { memcpy(g, old, sizeof(struct sr_rt_group)); }
+    else
+    { g->members[g->n++] = head; }
+
+    memset(count, 0, sizeof(count));
+    for(b = 0; b < SR_RT_GROUP_BUCKETS; b++)
+    { count[g->buckets[b]]++; }
+
+    share = SR_RT_GROUP_BUCKETS / (g->n + 1);
+    for(b = 0, got = 0; b < SR_RT_GROUP_BUCKETS && got < share; b++)
+    {
+        if(count[g->buckets[b]] > share)
+        {
+            count[g->buckets[b]]--;
+            g->buckets[b] = g->n;
+            got++;
+        }
+    }
+    g->members[g->n++] = member;
+
+    __atomic_store_n(&head->group, g, __ATOMIC_RELEASE);
+    if(old)
+    { sr_epoch_retire(old, free); }
+    return 0;
+} /* -- sr_rt_group_add -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_group_del(..)
+ * Scope:  Local
+ *
+ * A copy of g without member m.  Its buckets go to whoever has fewest;
+ * every other bucket keeps its member.
+ *
+ *---------------------------------------------------------------------*/
+
+static struct sr_rt_group* sr_rt_group_del(const struct sr_rt_group* old,
+                                           unsigned int m)
+{
+    struct sr_rt_group* g;
+    unsigned int count[SR_RT_GROUP_MAX];
+    unsigned int i, least, b;
+
+    g = (struct sr_rt_group*)malloc(sizeof(struct sr_rt_group));
+    assert(g);
+    memcpy(g, old, sizeof(struct sr_rt_group));
+
+    memset(count, 0, sizeof(count));
+    for(b = 0; b < SR_RT_GROUP_BUCKETS; b++)
+    { count[g->buckets[b]]++; }
+    count[m] = ~0U;
+
+    for(b = 0; b < SR_RT_GROUP_BUCKETS && g->n > 1; b++)
+    {
+        if(g->buckets[b] != m)
+        { continue; }
+        for(i = 0, least = m; i < g->n; i++)
+        {
+            if(count[i] < count[least])
+            { least = i; }
+        }
+        g->buckets[b] = least;
+        count[least]++;
+    }
+
+    /* -- the last member moves into the hole -- */
+    g->n--;
+    g->members[m] = g->members[g->n];
+    for(b = 0; b < SR_RT_GROUP_BUCKETS; b++)
+    {
+        if(g->buckets[b] == g->n)
+        { g->buckets[b] = m; }
+    }
+    return g;
+} /* -- sr_rt_group_del -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_attach(..)
+ * Scope:  Local
+ *
+ * Put rt in fib at node, the node of its prefix, with the fib's lock
+ * held.  A second route to a prefix joins its equal-cost group.  On
+ * failure rt is freed.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_rt_attach(struct sr_fib* fib, struct sr_fib_node* node,
+                        struct sr_rt* rt)
+{
+    struct sr_rt* head;
+    struct sr_rt* m;
+    struct sr_rt_group* g;
+    unsigned int i;
+
+    if((head = node->rt))
+    {
+        g = head->group;
+        for(i = 0; i < (g ? g->n : 1); i++)
+        {
+            m = g ? g->members[i] : head;
+            if(m->gw.s_addr == rt->gw.s_addr &&
+               strncmp(m->interface, rt->interface, sr_IFACE_NAMELEN) == 0)
+            {
+                free(rt);
+                return SR_RT_EXISTS;
+            }
+        }
+        if(sr_rt_group_add(head, rt) != 0)
+        {
+            free(rt);
+            return SR_RT_FULL;
+        }
+    }
+    else
+    {
+        sr_fib_set_rt(fib, node, ntohl(rt->dest.s_addr),
+                      __builtin_popcount(rt->mask.s_addr), rt);
+        fib->nprefixes++;
+    }
+
+    /* -- the list is for writers and printing only -- */
+    rt->prev = fib->tail;
+    if(fib->tail)
+    { fib->tail->next = rt; }
+    else
+    { fib->routes = rt; }
+    fib->tail = rt;
+    fib->nroutes++;
+    return 0;
+} /* -- sr_rt_attach -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_add_to(..)
+ * Scope:  Local
+ *
+ * Add a route to fib.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_rt_add_to(struct sr_fib* fib, struct in_addr dest,
+                        struct in_addr gw, struct in_addr mask,
+                        const char* if_name)
+{
+    struct sr_rt* rt;
+    uint32_t prefix;
+    int len, ret;
+
+    if((len = sr_rt_mask_len(mask)) < 0)
+    { return SR_RT_BAD_MASK; }
+    prefix = ntohl(dest.s_addr) & ntohl(mask.s_addr);
+
+    rt = (struct sr_rt*)calloc(1, sizeof(struct sr_rt));
+    assert(rt);
+    rt->dest.s_addr = htonl(prefix);
+    rt->gw   = gw;
+    rt->mask = mask;
+    strncpy(rt->interface,if_name,sr_IFACE_NAMELEN);
+
+    pthread_mutex_lock(&fib->lock);
+    if((ret = sr_rt_attach(fib, sr_fib_find(fib, prefix, len, 1), rt)) == 0)
+    { sr_rtc_invalidate(); }
+    pthread_mutex_unlock(&fib->lock);
+    return ret;
+} /* -- sr_rt_add_to -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_writable(..)
+ * Scope:  Local
+ *
+ * The fib to change, from inside an epoch: a new one if there is none,
+ * and an ordinary copy in place of a mapped image.
+ *
+ *---------------------------------------------------------------------*/
+
+static struct sr_fib* sr_rt_writable(struct sr_instance* sr)
+{
+    struct sr_fib* fib;
+    struct sr_fib* copy;
+    struct sr_rt* rt;
+
+    for(;;)
+    {
+        fib = __atomic_load_n(&sr->fib, __ATOMIC_ACQUIRE);
+        if(fib && fib->image == 0)
+        { return fib; }
+
+        copy = sr_fib_create();
+        for(rt = fib ? fib->routes : 0; rt; rt = rt->next)
+        { sr_rt_add_to(copy, rt->dest, rt->gw, rt->mask, rt->interface); }
+        if(__atomic_compare_exchange_n(&sr->fib, &fib, copy, 0,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            sr_rtc_invalidate();
+            if(fib)
+            { sr_epoch_retire(fib, sr_fib_destroy); }
+            return copy;
+        }
+        sr_fib_destroy(copy);
+    }
+} /* -- sr_rt_writable -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_add(..)
+ * Scope:  Global
+ *
+ * Add a route while packets are being forwarded.  Returns 0, or
+ * SR_RT_BAD_MASK, SR_RT_EXISTS or SR_RT_FULL.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_rt_add(struct sr_instance* sr, struct in_addr dest, struct in_addr gw,
+              struct in_addr mask, const char* if_name)
+{
+    int ret;
 
     /* -- REQUIRES -- */
+    assert(sr);
     assert(if_name);
+
+    /* -- a reload can retire the fib while we're adding to it -- */
+    sr_epoch_enter();
+    ret = sr_rt_add_to(sr_rt_writable(sr), dest, gw, mask, if_name);
+    sr_epoch_exit();
+    return ret;
+} /* -- sr_rt_add -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_del_from(..)
+ * Scope:  Local
+ *
+ * Delete the route to dest/mask via gw on if_name from fib.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_rt_del_from(struct sr_fib* fib, struct in_addr dest,
+                          struct in_addr gw, struct in_addr mask,
+                          const char* if_name)
+{
+    struct sr_fib_node* node;
+    struct sr_rt* head;
+    struct sr_rt* victim = 0;
+    struct sr_rt* m;
+    struct sr_rt_group* g;
+    struct sr_rt_group* g2;
+    uint32_t prefix;
+    unsigned int i;
+    int len;
+
+    if((len = sr_rt_mask_len(mask)) < 0)
+    { return SR_RT_NOT_FOUND; }
+    prefix = ntohl(dest.s_addr) & ntohl(mask.s_addr);
+
+    pthread_mutex_lock(&fib->lock);
+    if((node = sr_fib_find(fib, prefix, len, 0)) == 0 || (head = node->rt) == 0)
+    {
+        pthread_mutex_unlock(&fib->lock);
+        return SR_RT_NOT_FOUND;
+    }
+
+    g = head->group;
+    for(i = 0; i < (g ? g->n : 1); i++)
+    {
+        m = g ? g->members[i] : head;
+        if(m->gw.s_addr == gw.s_addr &&
+           strncmp(m->interface, if_name, sr_IFACE_NAMELEN) == 0)
+        {
+            victim = m;
+            break;
+        }
+    }
+    if(victim == 0)
+    {
+        pthread_mutex_unlock(&fib->lock);
+        return SR_RT_NOT_FOUND;
+    }
+
+    if(g && g->n > 1)
+    {
+        g2 = sr_rt_group_del(g, i);
+        if(victim == head)
+        {
+            /* -- the group moves to the next entry, which takes the node -- */
+            head = g2->members[0];
+            __atomic_store_n(&head->group, g2, __ATOMIC_RELEASE);
+            sr_fib_set_rt(fib, node, prefix, len, head);
+        }
+        else
+        { __atomic_store_n(&head->group, g2, __ATOMIC_RELEASE); }
+        sr_epoch_retire(g, free);
+    }
+    else
+    {
+        sr_fib_set_rt(fib, node, prefix, len, 0);
+        if(g)
+        { sr_epoch_retire(g, free); }
+        fib->nprefixes--;
+        sr_fib_prune(fib, prefix, len);
+    }
+
+    sr_rtc_invalidate();
+    if(victim->prev)
+    { victim->prev->next = victim->next; }
+    else
+    { fib->routes = victim->next; }
+    if(victim->next)
+    { victim->next->prev = victim->prev; }
+    else
+    { fib->tail = victim->prev; }
+    fib->nroutes--;
+    sr_epoch_retire(victim, free);
+
+    pthread_mutex_unlock(&fib->lock);
+    return 0;
+} /* -- sr_rt_del_from -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_del(..)
+ * Scope:  Global
+ *
+ * Delete the route to dest/mask via gw on if_name while packets are
+ * being forwarded.  Flows on the other paths to the prefix keep them
+ * (with resilient hashing).  Returns 0, or SR_RT_NOT_FOUND.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_rt_del(struct sr_instance* sr, struct in_addr dest, struct in_addr gw,
+              struct in_addr mask, const char* if_name)
+{
+    int ret;
+
+    /* -- REQUIRES -- */
     assert(sr);
+    assert(if_name);
 
-    /* -- empty list special case -- */
-    if(sr->routing_table == 0)
+    sr_epoch_enter();
+    ret = sr_rt_del_from(sr_rt_writable(sr), dest, gw, mask, if_name);
+    sr_epoch_exit();
+    sr_epoch_reclaim();
+    return ret;
+} /* -- sr_rt_del -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_lookup(..)
+ *
+ * Longest prefix match for ip_nbo (network byte order).  Returns the
+ * matching entry or 0 if there is no route.  Call from inside an epoch
+ * and use the entry before leaving it.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_rt* sr_rt_lookup(struct sr_instance* sr, uint32_t ip_nbo)
+{
+    struct sr_fib* fib;
+
+    /* -- REQUIRES -- */
+    assert(sr);
+
+    SR_STATS_INC(SR_STAT_RT_LOOKUPS);
+
+    if((fib = __atomic_load_n(&sr->fib, __ATOMIC_ACQUIRE)) == 0)
+    { return 0; }
+    return sr_fib_lookup(fib, ip_nbo);
+} /* -- sr_rt_lookup -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_lookup_batch(..)
+ *
+ * sr_rt_lookup(..) for a burst of n destinations at once, see
+ * sr_fib_lookup_batch(..).  rt[i] is the match of ip_nbo[i] or 0.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_rt_lookup_batch(struct sr_instance* sr, const uint32_t* ip_nbo,
+                        struct sr_rt** rt, unsigned int n)
+{
+    struct sr_fib* fib;
+    unsigned int i;
+
+    /* -- REQUIRES -- */
+    assert(sr);
+
+    SR_STATS_ADD(SR_STAT_RT_LOOKUPS, n);
+
+    if((fib = __atomic_load_n(&sr->fib, __ATOMIC_ACQUIRE)) == 0)
+    {
+        for(i = 0; i < n; i++)
+        { rt[i] = 0; }
+        return;
+    }
+    sr_fib_lookup_batch(fib, ip_nbo, rt, n);
+} /* -- sr_rt_lookup_batch -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_flow_hash(..)
+ *
+ * Hash of the 5-tuple of an IP datagram (ip_packet starts at the IP
+ * header), the same on every run.  Fragments hash on addresses and
+ * protocol only, so all of a datagram takes one path.
+ *
+ *---------------------------------------------------------------------*/
+
+uint32_t sr_rt_flow_hash(const uint8_t* ip_packet, unsigned int len)
+{
+    const sr_ip_hdr_t* ip_hdr = (const sr_ip_hdr_t*)ip_packet;
+    unsigned int hl = ip_hdr->ip_hl * 4;
+    uint32_t ports = 0, h;
+
+    if((ip_hdr->ip_p == ip_protocol_tcp || ip_hdr->ip_p == ip_protocol_udp) &&
+       (ntohs(ip_hdr->ip_off) & (IP_MF | IP_OFFMASK)) == 0 && len >= hl + 4)
+    { memcpy(&ports, ip_packet + hl, 4); }
+
+    h = ntohl(ip_hdr->ip_src) * 0x9e3779b1U;
+    h ^= h >> 16;
+    h += ntohl(ip_hdr->ip_dst) * 0x85ebca77U;
+    h ^= h >> 13;
+    h += ntohl(ports) * 0xc2b2ae3dU;
+    h ^= h >> 16;
+    h += ip_hdr->ip_p * 0x27d4eb2fU;
+    return h ^ (h >> 15);
+} /* -- sr_rt_flow_hash -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_select(..)
+ *
+ * The path of a flow among the equal-cost paths of the prefix rt was
+ * looked up for.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_rt* sr_rt_select(struct sr_rt* rt, uint32_t flow_hash)
+{
+    struct sr_rt_group* g = __atomic_load_n(&rt->group, __ATOMIC_ACQUIRE);
+
+    if(g == 0 || g->n < 2)
+    { return rt; }
+    if(sr_rt_resilient)
+    { return g->members[g->buckets[flow_hash % SR_RT_GROUP_BUCKETS]]; }
+    return g->members[((flow_hash >> 16) * g->n) >> 16];
+} /* -- sr_rt_select -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_any_path(..)
+ *
+ * Whether any of the equal-cost paths of the prefix rt was looked up for
+ * goes out of if_name, for when the flow hash isn't known yet.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_rt_any_path(struct sr_rt* rt, const char* if_name)
+{
+    struct sr_rt_group* g = __atomic_load_n(&rt->group, __ATOMIC_ACQUIRE);
+    unsigned int i;
+
+    if(g == 0 || g->n < 2)
+    { return strncmp(rt->interface, if_name, sr_IFACE_NAMELEN) == 0; }
+    for(i = 0; i < g->n; i++)
     {
-        sr->routing_table = (struct sr_rt*)malloc(sizeof(struct sr_rt));
-        assert(sr->routing_table);
-        sr->routing_table->next = 0;
-        sr->routing_table->dest = dest;
-        sr->routing_table->gw   = gw;
-        sr->routing_table->mask = mask;
-        strncpy(sr->routing_table->interface,if_name,sr_IFACE_NAMELEN);
+        if(strncmp(g->members[i]->interface, if_name, sr_IFACE_NAMELEN) == 0)
+        { return 1; }
+    }
+    return 0;
+} /* -- sr_rt_any_path -- */
 
+void sr_rt_set_ecmp(int resilient)
+{
+    sr_rt_resilient = resilient;
+} /* -- sr_rt_set_ecmp -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_reload(..)
+ * Scope:  Local
+ *
+ * Load sr_rt_file again, keeping the current table if the new one
+ * doesn't load, has a malformed line or names an interface we don't
+ * have.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_rt_reload(struct sr_instance* sr)
+{
+    struct sr_fib* fib;
+    struct sr_rt* rt;
+    struct stat st;
+    uint64_t start = sr_rt_now();
+
+    if(stat(sr_rt_file, &st) == 0)
+    { sr_rt_mtime = st.st_mtim; }
+    if((fib = sr_rt_read(sr_rt_file, 1)) == 0)
+    {
+        fprintf(stderr, "Keeping the current routing table, %s didn't load\n",
+                sr_rt_file);
+        sr_rt_load_failures++;
         return;
     }
+    for(rt = fib->routes; rt; rt = rt->next)
+    {
+        if(sr_get_interface(sr, rt->interface) == 0)
+        {
+            fprintf(stderr, "Keeping the current routing table, %s names "
+                    "interface %s\n", sr_rt_file, rt->interface);
+            sr_fib_destroy(fib);
+            sr_rt_load_failures++;
+            return;
+        }
+    }
+    sr_fib_swap(sr, fib);
+
+    sr_rt_load_ns = sr_rt_now() - start;
+    sr_rt_loads++;
+    printf("Reloaded routing table from %s, %u routes\n", sr_rt_file,
+           fib->nroutes);
+} /* -- sr_rt_reload -- */
 
-    /* -- find the end of the list -- */
-    rt_walker = sr->routing_table;
-    while(rt_walker->next){
-      rt_walker = rt_walker->next; 
+static void sr_rt_sighup(int sig)
+{
+    (void)sig;
+    sr_rt_hup = 1;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_watch(..)
+ * Scope:  Local
+ *
+ * Reload thread: once a second, reload after a SIGHUP or when the file
+ * has a new mtime that held since the last look, so we don't read it
+ * halfway through being written.
+ *
+ *---------------------------------------------------------------------*/
+
+static void* sr_rt_watch(void* arg)
+{
+    struct sr_instance* sr = (struct sr_instance*)arg;
+    struct timespec seen;
+    struct stat st;
+
+    sr_cpu_bind(SR_CPU_CONTROL);
+    seen = sr_rt_mtime;
+    for(;;)
+    {
+        sleep(1);
+        if(stat(sr_rt_file, &st) != 0)
+        { continue; }
+        if(sr_rt_hup ||
+           ((st.st_mtim.tv_sec != sr_rt_mtime.tv_sec ||
+             st.st_mtim.tv_nsec != sr_rt_mtime.tv_nsec) &&
+            st.st_mtim.tv_sec == seen.tv_sec &&
+            st.st_mtim.tv_nsec == seen.tv_nsec))
+        {
+            sr_rt_hup = 0;
+            sr_rt_reload(sr);
+        }
+        seen = st.st_mtim;
+    }
+    return 0;
+} /* -- sr_rt_watch -- */
+
+static void sr_rt_stats(struct sr_stats_writer* w, void* arg)
+{
+    struct sr_instance* sr = (struct sr_instance*)arg;
+    struct sr_fib* fib;
+
+    sr_epoch_enter();
+    if((fib = __atomic_load_n(&sr->fib, __ATOMIC_ACQUIRE)))
+    {
+        sr_stats_put_u64(w, "routes", fib->nroutes);
+        sr_stats_put_u64(w, "prefixes", fib->nprefixes);
+        sr_stats_put_u64(w, "trie_nodes", fib->nnodes);
+        sr_stats_put_u64(w, "mapped", fib->image != 0);
     }
+    sr_epoch_exit();
+    sr_stats_put_str(w, "file", sr_rt_file);
+    sr_stats_put_u64(w, "loads", sr_rt_loads);
+    sr_stats_put_u64(w, "load_failures", sr_rt_load_failures);
+    sr_stats_put_double(w, "last_load_ms", sr_rt_load_ns / 1e6);
+} /* -- sr_rt_stats -- */
 
-    rt_walker->next = (struct sr_rt*)malloc(sizeof(struct sr_rt));
-    assert(rt_walker->next);
-    rt_walker = rt_walker->next;
+/*---------------------------------------------------------------------
+ * Method: sr_rt_init(..)
+ * Scope:  Global
+ *
+ * Report on the routing table as "routes", and if it came from a file,
+ * reload it on SIGHUP or when the file changes.  Forwarding carries on
+ * through the old table until the new one is swapped in.
+ *
+ *---------------------------------------------------------------------*/
 
-    rt_walker->next = 0;
-    rt_walker->dest = dest;
-    rt_walker->gw   = gw;
-    rt_walker->mask = mask;
-    strncpy(rt_walker->interface,if_name,sr_IFACE_NAMELEN);
+void sr_rt_init(struct sr_instance* sr)
+{
+    struct sigaction sa;
+    pthread_t thread;
 
-} /* -- sr_add_entry -- */
+    sr_stats_register("routes", sr_rt_stats, sr);
+
+    if(sr_rt_file[0] == 0)
+    { return; }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sr_rt_sighup;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGHUP, &sa, 0);
+
+    if(pthread_create(&thread, &(sr->attr), sr_rt_watch, sr) != 0)
+    { perror("pthread_create(..):sr_rt.c::sr_rt_init"); }
+} /* -- sr_rt_init -- */
 
 /*---------------------------------------------------------------------
  * Method:
@@ -140,7 +1301,7 @@ void sr_print_routing_table(struct sr_instance* sr)
 {
     struct sr_rt* rt_walker = 0;
 
-    if(sr->routing_table == 0)
+    if(sr->fib == 0 || sr->fib->routes == 0)
     {
         printf(" *warning* Routing table empty \n");
         return;
@@ -148,7 +1309,7 @@ void sr_print_routing_table(struct sr_instance* sr)
 
     printf("Destination\tGateway\t\tMask\tIface\n");
 
-    rt_walker = sr->routing_table;
+    rt_walker = sr->fib->routes;
     
     sr_print_routing_entry(rt_walker);
     while(rt_walker->next)
@@ -7,6 +7,29 @@
  *
  * Methods and datastructures for handeling the routing table
  *
+ * A routing table file has a route per line, "dest gateway mask iface"
+ * or "dest/len gateway iface"; # starts a comment.
+ *
+ * Entries with the same destination and mask are equal-cost paths: the
+ * first one carries a next-hop group of all of them, and
+ * sr_rt_select(..) spreads flows over the group by a hash of their
+ * 5-tuple, so a flow stays on one path.  By default the hash picks a
+ * member by hash-threshold (RFC 2992); with resilient hashing it picks
+ * one of SR_RT_GROUP_BUCKETS buckets instead, and adding or removing a
+ * member only moves the buckets it gains or loses, so other flows keep
+ * their path.
+ *
+ * The table itself is an sr_fib (sr_fib.h).  sr_rt_add(..) and
+ * sr_rt_del(..) change it in place while other threads forward through
+ * it; groups are copied, changed and swapped in, never edited where a
+ * reader could see them.
+ *
+ * sr_rt_init(..) reloads the file the table came from on SIGHUP or when
+ * it changes, on a thread of its own.
+ *
+ * sr -C compiles the table into an image (sr_fib.h) that later loads
+ * map instead of parsing the text, as long as it's not older.
+ *
  *---------------------------------------------------------------------------*/
 
 #ifndef sr_RT_H
@@ -20,6 +43,32 @@
 
 #include "sr_if.h"
 
+#define SR_RT_GROUP_BUCKETS  256
+#define SR_RT_GROUP_MAX      64        /* members */
+#define SR_RT_IMAGE_SUFFIX   ".fib"    /* compiled table, see sr_rt_compile */
+
+/* -- sr_rt_add(..) / sr_rt_del(..) -- */
+#define SR_RT_BAD_MASK   -1     /* not a prefix mask */
+#define SR_RT_EXISTS     -2     /* same prefix, gateway and interface */
+#define SR_RT_FULL       -3     /* equal-cost group full */
+#define SR_RT_NOT_FOUND  -4
+
+struct sr_rt;
+
+/* ----------------------------------------------------------------------------
+ * struct sr_rt_group
+ *
+ * Equal-cost next hops for one prefix
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_rt_group
+{
+    unsigned int n;
+    struct sr_rt* members[SR_RT_GROUP_MAX];
+    uint8_t buckets[SR_RT_GROUP_BUCKETS];   /* member index */
+};
+
 /* ----------------------------------------------------------------------------
  * struct sr_rt
  *
@@ -33,13 +82,28 @@ struct sr_rt
     struct in_addr gw;
     struct in_addr mask;
     char   interface[sr_IFACE_NAMELEN];
+    struct sr_rt_group* group;  /* on the first entry of a prefix, or 0 */
     struct sr_rt* next;
+    struct sr_rt* prev;
 };
 
 
+void sr_rt_init(struct sr_instance* sr);
 int sr_load_rt(struct sr_instance*,const char*);
+int sr_rt_compile(const char* filename);
 void sr_add_rt_entry(struct sr_instance*, struct in_addr,struct in_addr,
                   struct in_addr, char*);
+int sr_rt_add(struct sr_instance* sr, struct in_addr dest, struct in_addr gw,
+              struct in_addr mask, const char* if_name);
+int sr_rt_del(struct sr_instance* sr, struct in_addr dest, struct in_addr gw,
+              struct in_addr mask, const char* if_name);
+struct sr_rt* sr_rt_lookup(struct sr_instance* sr, uint32_t ip_nbo);
+void sr_rt_lookup_batch(struct sr_instance* sr, const uint32_t* ip_nbo,
+                        struct sr_rt** rt, unsigned int n);
+struct sr_rt* sr_rt_select(struct sr_rt* rt, uint32_t flow_hash);
+int sr_rt_any_path(struct sr_rt* rt, const char* if_name);
+uint32_t sr_rt_flow_hash(const uint8_t* ip_packet, unsigned int len);
+void sr_rt_set_ecmp(int resilient);
 void sr_print_routing_table(struct sr_instance* sr);
 void sr_print_routing_entry(struct sr_rt* entry);
 
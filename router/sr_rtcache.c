@@ -0,0 +1,147 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_rtcache.c
+ *
+ * Description:
+ *
+ * Per-thread route cache, see sr_rtcache.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "sr_if.h"
+#include "sr_rt.h"
+#include "sr_router.h"
+#include "sr_arpcache.h"
+#include "sr_stats.h"
+#include "sr_rtcache.h"
+
+static uint32_t sr_rtc_gen = 1;
+static __thread struct sr_rtc_set* sr_rtc_sets = 0;
+
+static struct sr_rtc_set* sr_rtc_table(void)
+{
+    void* p;
+
+    if(sr_rtc_sets == 0)
+    {
+        if(posix_memalign(&p, SR_CACHELINE,
+                          SR_RTC_SETS * sizeof(struct sr_rtc_set)) != 0)
+        { abort(); }
+        memset(p, 0, SR_RTC_SETS * sizeof(struct sr_rtc_set));
+        sr_rtc_sets = (struct sr_rtc_set*)p;
+    }
+    return sr_rtc_sets;
+}
+
+static __inline__ struct sr_rtc_set* sr_rtc_set_of(uint32_t dst)
+{
+    return &sr_rtc_table()[(dst * 0x9e3779b1U) >> 21 & (SR_RTC_SETS - 1)];
+}
+
+/* Every entry filled before this is stale from now on */
+void sr_rtc_invalidate(void)
+{
+    __sync_fetch_and_add(&sr_rtc_gen, 1);
+} /* -- sr_rtc_invalidate -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rtc_lookup(..)
+ * Scope:  Global
+ *
+ * sr_rt_lookup(..) through this thread's cache, from inside an epoch.
+ * A miss fills the entry, taking the generation before the lookup so a
+ * change that races with it leaves the entry stale rather than wrong.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_rt* sr_rtc_lookup(struct sr_instance* sr, uint32_t dst_nbo)
+{
+    struct sr_rtc_set* set = sr_rtc_set_of(dst_nbo);
+    struct sr_rtc_entry* e;
+    struct sr_arpentry* arp;
+    struct sr_rt_group* g;
+    uint32_t gen = __atomic_load_n(&sr_rtc_gen, __ATOMIC_ACQUIRE);
+    int w;
+
+    for(w = 0; w < SR_RTC_WAYS; w++)
+    {
+        e = &set->way[w];
+        if(e->gen == gen && e->dst == dst_nbo)
+        {
+            SR_STATS_INC(SR_STAT_RTC_HITS);
+            return e->rt;
+        }
+    }
+    SR_STATS_INC(SR_STAT_RTC_MISSES);
+
+    /* -- the newcomer goes first, the older entry moves over -- */
+    for(w = SR_RTC_WAYS - 1; w > 0; w--)
+    { set->way[w] = set->way[w - 1]; }
+    e = &set->way[0];
+    memset(e, 0, sizeof(*e));
+    e->dst = dst_nbo;
+    e->gen = gen;
+
+    if((e->rt = sr_rt_lookup(sr, dst_nbo)) == 0)
+    { return 0; }
+    g = __atomic_load_n(&e->rt->group, __ATOMIC_ACQUIRE);
+    if(g && g->n > 1)
+    { return e->rt; }   /* -- the adjacency depends on the flow -- */
+
+    if((e->out = sr_get_interface(sr, e->rt->interface)) &&
+       (arp = sr_arpcache_lookup(&(sr->cache),
+                                 e->rt->gw.s_addr ? e->rt->gw.s_addr : dst_nbo)))
+    {
+        memcpy(e->mac, arp->mac, sizeof(e->mac));
+        e->resolved = 1;
+        free(arp);
+    }
+    return e->rt;
+} /* -- sr_rtc_lookup -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rtc_adjacency(..)
+ * Scope:  Global
+ *
+ * The output interface of a datagram to dst_nbo going along rt, with the
+ * next hop's MAC copied to mac, if this thread's cache has it.  0 if the
+ * caller has to resolve it.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_if* sr_rtc_adjacency(uint32_t dst_nbo, struct sr_rt* rt,
+                               uint8_t* mac)
+{
+    struct sr_rtc_set* set = sr_rtc_set_of(dst_nbo);
+    struct sr_rtc_entry* e;
+    uint32_t gen = __atomic_load_n(&sr_rtc_gen, __ATOMIC_ACQUIRE);
+    int w;
+
+    for(w = 0; w < SR_RTC_WAYS; w++)
+    {
+        e = &set->way[w];
+        if(e->gen == gen && e->dst == dst_nbo && e->rt == rt && e->resolved)
+        {
+            memcpy(mac, e->mac, sizeof(e->mac));
+            return e->out;
+        }
+    }
+    return 0;
+} /* -- sr_rtc_adjacency -- */
+
+static void sr_rtc_stats(struct sr_stats_writer* w, void* arg)
+{
+    (void)arg;
+    sr_stats_put_u64(w, "generation", __atomic_load_n(&sr_rtc_gen,
+                                                      __ATOMIC_RELAXED));
+    sr_stats_put_u64(w, "entries_per_thread", SR_RTC_SETS * SR_RTC_WAYS);
+} /* -- sr_rtc_stats -- */
+
+void sr_rtc_init(struct sr_instance* sr)
+{
+    sr_stats_register("route_cache", sr_rtc_stats, sr);
+} /* -- sr_rtc_init -- */
@@ -0,0 +1,63 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_rtcache.h
+ *
+ * Description:
+ *
+ * Per-destination route cache in front of sr_rt_lookup(..).  Each thread
+ * has its own 2-way set associative table of SR_RTC_SETS sets, one cache
+ * line per set, so a hit reads one line and writes nothing shared.  An
+ * entry keeps the route looked up for a destination and, when the route
+ * has a single path, its adjacency: the output interface and the next
+ * hop's MAC address from the ARP cache.
+ *
+ * Entries carry the generation they were filled in.  Anything that
+ * changes the routing table or the ARP cache calls sr_rtc_invalidate(),
+ * which bumps the global generation and so retires every entry at once
+ * without touching them.  Routes in entries are only used inside the
+ * epoch they were looked up in, like any other route; the generation is
+ * bumped before a route is retired, so a current entry never holds one
+ * that has been.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_RTCACHE_H
+#define SR_RTCACHE_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+#include "sr_stats.h"
+
+#define SR_RTC_SETS  2048       /* power of two */
+#define SR_RTC_WAYS  2
+
+struct sr_instance;
+struct sr_rt;
+struct sr_if;
+
+struct sr_rtc_entry {
+    uint32_t dst;               /* network byte order */
+    uint32_t gen;               /* 0: empty */
+    struct sr_rt* rt;           /* 0: no route */
+    struct sr_if* out;          /* adjacency, if resolved */
+    uint8_t  mac[6];
+    uint8_t  resolved;
+    uint8_t  pad;
+};
+
+struct sr_rtc_set {
+    struct sr_rtc_entry way[SR_RTC_WAYS];
+} __attribute__ ((aligned (SR_CACHELINE)));
+
+void sr_rtc_init(struct sr_instance* sr);
+void sr_rtc_invalidate(void);
+struct sr_rt* sr_rtc_lookup(struct sr_instance* sr, uint32_t dst_nbo);
+struct sr_if* sr_rtc_adjacency(uint32_t dst_nbo, struct sr_rt* rt,
+                               uint8_t* mac);
+
+#endif /* -- SR_RTCACHE_H -- */
@@ -0,0 +1,438 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_sched.c
+ *
+ * Description:
+ *
+ * Egress queues, deficit round robin and pacing, see sr_sched.h.
+ *
+ * One lock covers every queue.  Senders hold it to append a frame, the
+ * transmit thread to pick the next one; the write itself happens with
+ * the lock dropped.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <errno.h>
+
+#include "sr_if.h"
+#include "sr_router.h"
+#include "sr_protocol.h"
+#include "sr_stats.h"
+#include "sr_cpu.h"
+#include "sr_sched.h"
+
+const unsigned int sr_sched_weights[SR_SCHED_CLASSES] = { 2, 4, 2, 1 };
+
+static const char* sr_sched_names[SR_SCHED_CLASSES] = {
+    "control", "expedited", "assured", "best_effort"
+};
+
+static uint64_t sr_sched_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static enum sr_sched_class sr_sched_classify(uint8_t* buf, unsigned int len)
+{
+    sr_ethernet_hdr_t* eth_hdr = (sr_ethernet_hdr_t*)buf;
+    sr_ip_hdr_t* ip_hdr = (sr_ip_hdr_t*)(buf + sizeof(sr_ethernet_hdr_t));
+    unsigned int dscp;
+
+    if(ntohs(eth_hdr->ether_type) != ethertype_ip ||
+       len < sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t))
+    { return SR_SCHED_CONTROL; }
+
+    dscp = ip_hdr->ip_tos >> 2;
+    if(dscp >= 48)
+    { return SR_SCHED_CONTROL; }
+    if(dscp >= 40)
+    { return SR_SCHED_EXPEDITED; }
+    if(dscp >= 10)
+    { return SR_SCHED_ASSURED; }
+    return SR_SCHED_BEST_EFFORT;
+} /* -- sr_sched_classify -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_sched_enqueue(..)
+ * Scope:  Global
+ *
+ * Copy a checked frame onto the right queue of out.  Returns -1 if the
+ * frame was dropped: the queue is full, out has no queues yet or the
+ * transmit thread has stopped.  Only that thread ever writes a frame.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_sched_enqueue(struct sr_sched* sched,
+        uint8_t* buf /* borrowed */,
+        unsigned int len,
+        struct sr_if* out)
+{
+    struct sr_sched_if* sif;
+    struct sr_sched_queue* q;
+    struct sr_sched_pkt* p;
+
+    p = (struct sr_sched_pkt*)malloc(sizeof(struct sr_sched_pkt) + len);
+    if(p)
+    {
+        memcpy(p->buf, buf, len);
+        p->len = len;
+        p->next = 0;
+        p->enqueued = sr_sched_now();
+    }
+
+    pthread_mutex_lock(&sched->lock);
+    if(out->ifindex >= sched->nifs || sched->done)
+    {
+        pthread_mutex_unlock(&sched->lock);
+        free(p);
+        sr_stats_drop(out, SR_DROP_QUEUE);
+        return -1;
+    }
+    sif = &sched->ifs[out->ifindex];
+    q = &sif->q[sr_sched_classify(buf, len)];
+    if(p == 0 || q->depth >= sched->limit)
+    {
+        q->dropped++;
+        pthread_mutex_unlock(&sched->lock);
+        free(p);
+        sr_stats_drop(out, SR_DROP_QUEUE);
+        return -1;
+    }
+
+    if(q->tail)
+    { q->tail->next = p; }
+    else
+    { q->head = p; }
+    q->tail = p;
+    if(++q->depth > q->max_depth)
+    { q->max_depth = q->depth; }
+    q->enqueued++;
+    sched->queued++;
+    if(sif->queued++ == 0)
+    { pthread_cond_signal(&sched->wake); }
+    pthread_mutex_unlock(&sched->lock);
+
+    return 0;
+} /* -- sr_sched_enqueue -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_sched_drr(..)
+ * Scope:  Local
+ *
+ * Take the next frame of an interface with frames queued.  Each class
+ * gets its quantum when its turn comes and sends while the head frame
+ * fits in its deficit; an emptied class forfeits what's left.
+ *
+ *---------------------------------------------------------------------*/
+
+static struct sr_sched_pkt* sr_sched_drr(struct sr_sched_if* sif)
+{
+    struct sr_sched_queue* q;
+    struct sr_sched_pkt* p;
+
+    for(;;)
+    {
+        q = &sif->q[sif->cur];
+        if(!sif->turn && q->depth)
+        {
+            q->deficit += sr_sched_weights[sif->cur] * SR_SCHED_QUANTUM;
+            sif->turn = 1;
+        }
+
+        if(q->depth && (int)q->head->len <= q->deficit)
+        {
+            p = q->head;
+            if((q->head = p->next) == 0)
+            { q->tail = 0; }
+            q->depth--;
+            q->deficit -= p->len;
+            q->sent++;
+            sif->queued--;
+            if(q->depth == 0)
+            {
+                q->deficit = 0;
+                sif->turn = 0;
+                sif->cur = (sif->cur + 1) % SR_SCHED_CLASSES;
+            }
+            return p;
+        }
+
+        if(q->depth == 0)
+        { q->deficit = 0; }
+        sif->turn = 0;
+        sif->cur = (sif->cur + 1) % SR_SCHED_CLASSES;
+    }
+} /* -- sr_sched_drr -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_sched_next(..)
+ * Scope:  Local
+ *
+ * With the lock held, pick an interface round robin among those with
+ * frames queued whose pacing allows a frame now, and take its next
+ * frame.  Otherwise returns 0 and sets *wait to when the earliest paced
+ * interface is due, or 0 if nothing is queued.
+ *
+ *---------------------------------------------------------------------*/
+
+static struct sr_sched_pkt* sr_sched_next(struct sr_sched* sched,
+        struct sr_sched_if** out, uint64_t now, uint64_t* wait)
+{
+    struct sr_sched_if* sif;
+    struct sr_sched_pkt* p;
+    unsigned int i, n;
+    uint32_t speed;
+
+    *wait = 0;
+    for(i = 0; i < sched->nifs; i++)
+    {
+        n = (sched->next_if + i) % sched->nifs;
+        sif = &sched->ifs[n];
+        if(sif->queued == 0)
+        { continue; }
+
+        speed = sif->iface->speed;
+        if(sched->pace && speed && sif->next_tx > now)
+        {
+            if(*wait == 0 || sif->next_tx < *wait)
+            { *wait = sif->next_tx; }
+            continue;
+        }
+
+        p = sr_sched_drr(sif);
+        sched->queued--;
+        sched->next_if = (n + 1) % sched->nifs;
+
+        /* -- the link is busy for len * 8 bits at speed Mbit/s -- */
+        if(sched->pace && speed)
+        {
+            if(sif->next_tx < now)
+            { sif->next_tx = now; }
+            sif->next_tx += (uint64_t)p->len * 8000 / speed;
+        }
+
+        *out = sif;
+        return p;
+    }
+    return 0;
+} /* -- sr_sched_next -- */
+
+static void* sr_sched_run(void* arg)
+{
+    struct sr_sched* sched = (struct sr_sched*)arg;
+    struct sr_sched_if* sif;
+    struct sr_sched_pkt* p;
+    struct timespec ts;
+    uint64_t now, wait, delay;
+
+    sr_cpu_bind(SR_CPU_TX);
+    pthread_mutex_lock(&sched->lock);
+    for(;;)
+    {
+        now = sr_sched_now();
+        if((p = sr_sched_next(sched, &sif, now, &wait)) == 0)
+        {
+            if(sched->queued == 0)
+            {
+                pthread_cond_broadcast(&sched->idle);
+                if(sched->stop)
+                {
+                    sched->done = 1;
+                    break;
+                }
+                pthread_cond_wait(&sched->wake, &sched->lock);
+            }
+            else
+            {
+                ts.tv_sec = wait / 1000000000ULL;
+                ts.tv_nsec = wait % 1000000000ULL;
+                pthread_cond_timedwait(&sched->wake, &sched->lock, &ts);
+            }
+            continue;
+        }
+
+        delay = now - p->enqueued;
+        sif->delay_total += delay;
+        if(delay > sif->delay_max)
+        { sif->delay_max = delay; }
+        pthread_mutex_unlock(&sched->lock);
+
+        sr_transmit_packet(sched->sr, p->buf, p->len, sif->iface);
+        free(p);
+
+        pthread_mutex_lock(&sched->lock);
+    }
+    pthread_mutex_unlock(&sched->lock);
+    return 0;
+} /* -- sr_sched_run -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_sched_drain(..)
+ * Scope:  Global
+ *
+ * Wait until every queued frame has been written, then stop the
+ * transmit thread; frames sent after that are dropped.  Used at the end
+ * of a replay, before the output capture is closed.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_sched_drain(struct sr_sched* sched)
+{
+    pthread_mutex_lock(&sched->lock);
+    sched->stop = 1;
+    pthread_cond_signal(&sched->wake);
+    while(sched->queued)
+    { pthread_cond_wait(&sched->idle, &sched->lock); }
+    pthread_mutex_unlock(&sched->lock);
+
+    pthread_join(sched->thread, 0);
+} /* -- sr_sched_drain -- */
+
+static void sr_sched_stats(struct sr_stats_writer* w, void* arg)
+{
+    struct sr_instance* sr = (struct sr_instance*)arg;
+    struct sr_sched* sched = sr->sched;
+    struct sr_sched_if* sif;
+    struct sr_sched_queue* q;
+    uint64_t sent;
+    unsigned int i, c;
+
+    if(sched == 0)
+    { return; }
+
+    pthread_mutex_lock(&sched->lock);
+    sr_stats_put_u64(w, "limit", sched->limit);
+    sr_stats_put_u64(w, "paced", sched->pace);
+    for(i = 0; i < sched->nifs; i++)
+    {
+        sif = &sched->ifs[i];
+        if(sif->iface == 0)
+        { continue; }
+        sr_stats_open(w, sif->iface->name);
+        sr_stats_put_u64(w, "speed_mbps", sif->iface->speed);
+        sr_stats_put_u64(w, "queued", sif->queued);
+
+        for(c = 0, sent = 0; c < SR_SCHED_CLASSES; c++)
+        { sent += sif->q[c].sent; }
+        sr_stats_put_double(w, "delay_mean_us",
+                            sent ? sif->delay_total / 1e3 / sent : 0.0);
+        sr_stats_put_double(w, "delay_max_us", sif->delay_max / 1e3);
+
+        for(c = 0; c < SR_SCHED_CLASSES; c++)
+        {
+            q = &sif->q[c];
+            sr_stats_open(w, sr_sched_names[c]);
+            sr_stats_put_u64(w, "depth", q->depth);
+            sr_stats_put_u64(w, "max_depth", q->max_depth);
+            sr_stats_put_u64(w, "enqueued", q->enqueued);
+            sr_stats_put_u64(w, "sent", q->sent);
+            sr_stats_put_u64(w, "dropped", q->dropped);
+            sr_stats_close(w);
+        }
+        sr_stats_close(w);
+    }
+    pthread_mutex_unlock(&sched->lock);
+} /* -- sr_sched_stats -- */
+
+/* Register the stats section and start the transmit thread if queueing */
+void sr_sched_init(struct sr_instance* sr)
+{
+    sr_stats_register("egress", sr_sched_stats, sr);
+
+    if(sr->sched &&
+       pthread_create(&sr->sched->thread, &(sr->attr), sr_sched_run, sr->sched) != 0)
+    {
+        perror("pthread_create(..):sr_sched.c::sr_sched_init");
+        exit(1);
+    }
+} /* -- sr_sched_init -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_sched_create(..)
+ * Scope:  Global
+ *
+ * Queues of limit frames per class, paced if pace is set.  There are
+ * none until sr_sched_attach(..) has the interface list.  Returns 0 if
+ * memory is short.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_sched* sr_sched_create(struct sr_instance* sr, unsigned int limit,
+                                 int pace)
+{
+    struct sr_sched* sched;
+    pthread_condattr_t attr;
+
+    /* -- REQUIRES -- */
+    assert(sr);
+
+    if(limit == 0)
+    {
+        fprintf(stderr, "egress: queue limit must be at least 1\n");
+        return 0;
+    }
+    if((sched = (struct sr_sched*)calloc(1, sizeof(struct sr_sched))) == 0)
+    { return 0; }
+
+    sched->sr = sr;
+    sched->limit = limit;
+    sched->pace = pace;
+    pthread_mutex_init(&sched->lock, 0);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&sched->wake, &attr);
+    pthread_cond_init(&sched->idle, 0);
+    pthread_condattr_destroy(&attr);
+
+    return sched;
+} /* -- sr_sched_create -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_sched_attach(..)
+ * Scope:  Global
+ *
+ * Give every interface of sr its queues, once the interface list is
+ * known (VNSHWINFO, or the hardware file when replaying).  The transmit
+ * thread may be running already.  Returns -1 if an interface is past
+ * SR_SCHED_MAX_IFACES.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_sched_attach(struct sr_sched* sched, struct sr_instance* sr)
+{
+    struct sr_if* iface;
+    unsigned int nifs = 0;
+
+    /* -- REQUIRES -- */
+    assert(sched);
+    assert(sr);
+
+    for(iface = sr->if_list; iface; iface = iface->next)
+    {
+        if(iface->ifindex >= SR_SCHED_MAX_IFACES)
+        {
+            fprintf(stderr, "egress: can't queue for %s, at most %d interfaces\n",
+                    iface->name, SR_SCHED_MAX_IFACES);
+            return -1;
+        }
+        if(iface->ifindex >= nifs)
+        { nifs = iface->ifindex + 1; }
+    }
+
+    pthread_mutex_lock(&sched->lock);
+    for(iface = sr->if_list; iface; iface = iface->next)
+    { sched->ifs[iface->ifindex].iface = iface; }
+    sched->nifs = nifs;
+    pthread_mutex_unlock(&sched->lock);
+
+    printf("Egress queues of %u frames per class on %u interfaces%s\n",
+           sched->limit, nifs, sched->pace ? ", paced to link speed" : "");
+    return 0;
+} /* -- sr_sched_attach -- */
@@ -0,0 +1,110 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_sched.h
+ *
+ * Description:
+ *
+ * Egress queueing, turned on with sr -q <limit>.  sr_send_packet(..)
+ * copies each frame onto one of SR_SCHED_CLASSES queues of its output
+ * interface, picked by DSCP, and returns; a transmit thread writes the
+ * queues out.  Within an interface the classes share the link by deficit
+ * round robin, with quanta in proportion to sr_sched_weights; interfaces
+ * take turns frame by frame, so a congested output never holds up the
+ * others.  With sr -P an interface with a known speed (VNS HWSPEED, or
+ * the hardware file when replaying) is also paced to it, so its queues
+ * build up here, where they're bounded and visible, instead of in the
+ * socket.
+ *
+ * A class queue holds at most <limit> frames; arrivals beyond that are
+ * dropped, as are frames sent before the interface list has arrived.
+ * The "egress" stats section has per class depth, high water mark,
+ * enqueued/sent/dropped counts and per interface queueing delay.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_SCHED_H
+#define SR_SCHED_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+#include <pthread.h>
+
+#include "sr_stats.h"
+
+#define SR_SCHED_DEFAULT_LIMIT  256    /* frames per class queue */
+#define SR_SCHED_MAX_IFACES     SR_STATS_MAX_IFACES
+#define SR_SCHED_QUANTUM        1514   /* bytes per unit of weight */
+
+/* traffic classes, from DSCP */
+enum sr_sched_class {
+    SR_SCHED_CONTROL,           /* CS6, CS7 and anything not IP */
+    SR_SCHED_EXPEDITED,         /* CS5, EF */
+    SR_SCHED_ASSURED,           /* AF1x-AF4x, CS2-CS4 */
+    SR_SCHED_BEST_EFFORT,       /* default, CS1 */
+    SR_SCHED_CLASSES
+};
+
+struct sr_instance;
+struct sr_if;
+
+struct sr_sched_pkt {
+    struct sr_sched_pkt* next;
+    uint64_t enqueued;          /* ns */
+    unsigned int len;
+    uint8_t buf[1];
+};
+
+struct sr_sched_queue {
+    struct sr_sched_pkt* head;
+    struct sr_sched_pkt* tail;
+    unsigned int depth;
+    unsigned int max_depth;
+    int deficit;                /* bytes */
+    uint64_t enqueued;
+    uint64_t sent;
+    uint64_t dropped;
+};
+
+struct sr_sched_if {
+    struct sr_if* iface;
+    struct sr_sched_queue q[SR_SCHED_CLASSES];
+    unsigned int queued;        /* frames, all classes */
+    int cur;                    /* class being served */
+    int turn;                   /* cur got its quantum this round */
+    uint64_t next_tx;           /* ns, when pacing */
+    uint64_t delay_total;       /* ns, enqueue to transmit */
+    uint64_t delay_max;
+};
+
+struct sr_sched {
+    struct sr_instance* sr;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;        /* work arrived, or stopping */
+    pthread_cond_t idle;        /* every queue is empty */
+    struct sr_sched_if ifs[SR_SCHED_MAX_IFACES];
+    unsigned int nifs;
+    unsigned int limit;
+    int pace;
+    unsigned int queued;
+    unsigned int next_if;       /* round robin over interfaces */
+    int stop;
+    int done;                   /* transmit thread has exited */
+    pthread_t thread;
+};
+
+extern const unsigned int sr_sched_weights[SR_SCHED_CLASSES];
+
+void sr_sched_init(struct sr_instance* sr);
+struct sr_sched* sr_sched_create(struct sr_instance* sr, unsigned int limit,
+                                 int pace);
+int sr_sched_attach(struct sr_sched* sched, struct sr_instance* sr);
+int sr_sched_enqueue(struct sr_sched* sched, uint8_t* buf, unsigned int len,
+                     struct sr_if* out);
+void sr_sched_drain(struct sr_sched* sched);
+
+#endif /* -- SR_SCHED_H -- */
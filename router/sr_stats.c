@@ -0,0 +1,471 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_stats.c
+ *
+ * Description:
+ *
+ * Per-thread counters, aggregation and the local stats socket.  See
+ * sr_stats.h for the client side of the protocol.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+
+#include "sr_if.h"
+#include "sr_router.h"
+#include "sr_arpcache.h"
+#include "sr_stats.h"
+#include "sr_cpu.h"
+
+static const char* sr_stat_names[SR_STAT_MAX] = {
+    "rx_packets", "rx_bytes", "tx_packets", "tx_bytes", "tx_errors",
+    "arp_hits", "arp_misses", "arp_requests", "arp_retries", "arp_replies",
+    "icmp_generated", "route_lookups", "route_cache_hits",
+    "route_cache_misses", "forwarded"
+};
+
+static const char* sr_drop_names[SR_DROP_MAX] = {
+    "short", "bad_header", "bad_checksum", "not_for_us", "unsupported",
+    "ttl_expired", "no_route", "arp_timeout", "no_interface", "needs_frag",
+    "reassembly", "acl_denied", "nat",
+    "conntrack", "queue_full"
+};
+
+static const char* sr_if_stat_names[SR_IF_STAT_MAX] = {
+    "rx_packets", "rx_bytes", "tx_packets", "tx_bytes", "drops"
+};
+
+static struct sr_stats_slot sr_stats_slots[SR_STATS_MAX_THREADS];
+static int sr_stats_nslots = 0;
+static int sr_stats_free[SR_STATS_MAX_THREADS];   /* ids of exited threads */
+static int sr_stats_nfree = 0;
+static pthread_mutex_t sr_stats_slot_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t sr_stats_thread_key;
+static pthread_once_t sr_stats_once = PTHREAD_ONCE_INIT;
+
+__thread struct sr_stats_slot* sr_stats_self = 0;
+static __thread int sr_stats_id = -1;
+
+struct sr_stats_section {
+    const char* name;
+    sr_stats_section_fn fn;
+    void* arg;
+};
+
+static struct sr_stats_section sr_stats_sections[SR_STATS_MAX_SECTIONS];
+static int sr_stats_nsections = 0;
+static pthread_mutex_t sr_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int sr_stats_listenfd = -1;
+
+/* Thread exit: hand the slot, counts and all, to the next thread */
+static void sr_stats_release(void* arg)
+{
+    int id = (int)((struct sr_stats_slot*)arg - sr_stats_slots);
+
+    pthread_mutex_lock(&sr_stats_slot_lock);
+    sr_stats_free[sr_stats_nfree++] = id;
+    pthread_mutex_unlock(&sr_stats_slot_lock);
+}
+
+static void sr_stats_thread_key_init(void)
+{
+    pthread_key_create(&sr_stats_thread_key, sr_stats_release);
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_stats_claim(..)
+ * Scope:  Global
+ *
+ * Give the calling thread a slot of its own, nobody else writes to it
+ * while the thread lives.  The slot goes back when the thread exits and
+ * keeps what it counted.  Other per-thread state (NAT port pools,
+ * latency histograms) is indexed by the same id, so running out of
+ * slots is fatal rather than shared.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_stats_slot* sr_stats_claim(void)
+{
+    int id;
+
+    pthread_once(&sr_stats_once, sr_stats_thread_key_init);
+
+    pthread_mutex_lock(&sr_stats_slot_lock);
+    if(sr_stats_nfree > 0)
+    { id = sr_stats_free[--sr_stats_nfree]; }
+    else if(sr_stats_nslots < SR_STATS_MAX_THREADS)
+    { id = sr_stats_nslots++; }
+    else
+    {
+        fprintf(stderr, "stats: more than %d threads\n", SR_STATS_MAX_THREADS);
+        abort();
+    }
+    pthread_mutex_unlock(&sr_stats_slot_lock);
+
+    sr_stats_id = id;
+    sr_stats_self = &sr_stats_slots[id];
+    pthread_setspecific(sr_stats_thread_key, sr_stats_self);
+    return sr_stats_self;
+} /* -- sr_stats_claim -- */
+
+int sr_stats_thread_id(void)
+{
+    if(!sr_stats_self)
+    { sr_stats_claim(); }
+    return sr_stats_id;
+} /* -- sr_stats_thread_id -- */
+
+static int sr_stats_nthreads(void)
+{
+    return sr_stats_nslots;
+}
+
+void sr_stats_drop(struct sr_if* iface, enum sr_drop reason)
+{
+    struct sr_stats_slot* s = sr_stats_slot();
+
+    s->drop[reason]++;
+    if(iface && iface->ifindex < SR_STATS_MAX_IFACES)
+    { s->iface[iface->ifindex][SR_IF_DROPS]++; }
+} /* -- sr_stats_drop -- */
+
+/*---------------------------------------------------------------------
+ * Writer
+ *---------------------------------------------------------------------*/
+
+static void sr_stats_printf(struct sr_stats_writer* w, const char* fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    for(;;)
+    {
+        va_start(ap, fmt);
+        n = vsnprintf(w->buf + w->len, w->cap - w->len, fmt, ap);
+        va_end(ap);
+
+        if(n < 0)
+        { return; }
+        if(w->len + n < w->cap)
+        {
+            w->len += n;
+            return;
+        }
+
+        w->cap = (w->cap * 2 > w->len + n + 1) ? w->cap * 2 : w->len + n + 1;
+        w->buf = (char*)realloc(w->buf, w->cap);
+        assert(w->buf);
+    }
+} /* -- sr_stats_printf -- */
+
+static void sr_stats_key(struct sr_stats_writer* w, const char* key)
+{
+    int i;
+
+    if(w->json)
+    {
+        sr_stats_printf(w, "%s\"%s\":", w->first[w->depth] ? "" : ",", key);
+        w->first[w->depth] = 0;
+        return;
+    }
+
+    for(i = 0; i < w->depth; i++)
+    { sr_stats_printf(w, "%s.", w->path[i]); }
+    sr_stats_printf(w, "%s ", key);
+} /* -- sr_stats_key -- */
+
+void sr_stats_open(struct sr_stats_writer* w, const char* name)
+{
+    assert(w->depth + 1 < SR_STATS_MAX_DEPTH);
+
+    if(w->json)
+    {
+        sr_stats_key(w, name);
+        sr_stats_printf(w, "{");
+    }
+    w->path[w->depth++] = name;
+    w->first[w->depth] = 1;
+} /* -- sr_stats_open -- */
+
+void sr_stats_close(struct sr_stats_writer* w)
+{
+    assert(w->depth > 0);
+
+    if(w->json)
+    { sr_stats_printf(w, "}"); }
+    w->depth--;
+} /* -- sr_stats_close -- */
+
+void sr_stats_put_u64(struct sr_stats_writer* w, const char* key,
+                      uint64_t value)
+{
+    sr_stats_key(w, key);
+    sr_stats_printf(w, w->json ? "%llu" : "%llu\n", (unsigned long long)value);
+}
+
+void sr_stats_put_double(struct sr_stats_writer* w, const char* key,
+                         double value)
+{
+    sr_stats_key(w, key);
+    sr_stats_printf(w, w->json ? "%.6g" : "%.6g\n", value);
+}
+
+void sr_stats_put_str(struct sr_stats_writer* w, const char* key,
+                      const char* value)
+{
+    sr_stats_key(w, key);
+    sr_stats_printf(w, w->json ? "\"%s\"" : "%s\n", value);
+}
+
+/*---------------------------------------------------------------------
+ * Built-in sections
+ *---------------------------------------------------------------------*/
+
+static void sr_stats_counters(struct sr_stats_writer* w, void* arg)
+{
+    uint64_t sum;
+    int i, t, n = sr_stats_nthreads();
+
+    for(i = 0; i < SR_STAT_MAX; i++)
+    {
+        for(sum = 0, t = 0; t < n; t++)
+        { sum += sr_stats_slots[t].stat[i]; }
+        sr_stats_put_u64(w, sr_stat_names[i], sum);
+    }
+
+    sr_stats_open(w, "drops");
+    for(i = 0; i < SR_DROP_MAX; i++)
+    {
+        for(sum = 0, t = 0; t < n; t++)
+        { sum += sr_stats_slots[t].drop[i]; }
+        sr_stats_put_u64(w, sr_drop_names[i], sum);
+    }
+    sr_stats_close(w);
+} /* -- sr_stats_counters -- */
+
+static void sr_stats_interfaces(struct sr_stats_writer* w, void* arg)
+{
+    struct sr_instance* sr = (struct sr_instance*)arg;
+    struct sr_if* if_walker;
+    uint64_t sum;
+    int i, t, n = sr_stats_nthreads();
+
+    for(if_walker = sr->if_list; if_walker; if_walker = if_walker->next)
+    {
+        if(if_walker->ifindex >= SR_STATS_MAX_IFACES)
+        { continue; }
+
+        sr_stats_open(w, if_walker->name);
+        for(i = 0; i < SR_IF_STAT_MAX; i++)
+        {
+            for(sum = 0, t = 0; t < n; t++)
+            { sum += sr_stats_slots[t].iface[if_walker->ifindex][i]; }
+            sr_stats_put_u64(w, sr_if_stat_names[i], sum);
+        }
+        sr_stats_close(w);
+    }
+} /* -- sr_stats_interfaces -- */
+
+static void sr_stats_arp(struct sr_stats_writer* w, void* arg)
+{
+    struct sr_instance* sr = (struct sr_instance*)arg;
+    struct sr_arpreq* req;
+    struct sr_packet* pkt;
+    uint64_t entries = 0, requests = 0, queued = 0;
+    int i;
+
+    pthread_mutex_lock(&(sr->cache.lock));
+    for(i = 0; i < SR_ARPCACHE_SZ; i++)
+    {
+        if(sr->cache.entries[i].valid)
+        { entries++; }
+    }
+    for(req = sr->cache.requests; req; req = req->next)
+    {
+        requests++;
+        for(pkt = req->packets; pkt; pkt = pkt->next)
+        { queued++; }
+    }
+    pthread_mutex_unlock(&(sr->cache.lock));
+
+    sr_stats_put_u64(w, "cache_entries", entries);
+    sr_stats_put_u64(w, "pending_requests", requests);
+    sr_stats_put_u64(w, "queued_packets", queued);
+} /* -- sr_stats_arp -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_stats_init(..)
+ * Scope:  Global
+ *
+ * Register the built-in sections.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_stats_init(struct sr_instance* sr)
+{
+    sr_stats_register("counters", sr_stats_counters, sr);
+    sr_stats_register("interfaces", sr_stats_interfaces, sr);
+    sr_stats_register("arp", sr_stats_arp, sr);
+} /* -- sr_stats_init -- */
+
+void sr_stats_register(const char* name, sr_stats_section_fn fn, void* arg)
+{
+    pthread_mutex_lock(&sr_stats_lock);
+    assert(sr_stats_nsections < SR_STATS_MAX_SECTIONS);
+    sr_stats_sections[sr_stats_nsections].name = name;
+    sr_stats_sections[sr_stats_nsections].fn = fn;
+    sr_stats_sections[sr_stats_nsections].arg = arg;
+    sr_stats_nsections++;
+    pthread_mutex_unlock(&sr_stats_lock);
+} /* -- sr_stats_register -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_stats_snapshot(..)
+ * Scope:  Global
+ *
+ * Aggregate every section into w.  The caller frees w->buf.  Returns the
+ * number of bytes written.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_stats_snapshot(struct sr_stats_writer* w, int json)
+{
+    int i;
+
+    memset(w, 0, sizeof(*w));
+    w->json = json;
+    w->cap = 4096;
+    w->buf = (char*)malloc(w->cap);
+    assert(w->buf);
+    w->first[0] = 1;
+
+    if(json)
+    { sr_stats_printf(w, "{"); }
+
+    pthread_mutex_lock(&sr_stats_lock);
+    for(i = 0; i < sr_stats_nsections; i++)
+    {
+        sr_stats_open(w, sr_stats_sections[i].name);
+        sr_stats_sections[i].fn(w, sr_stats_sections[i].arg);
+        sr_stats_close(w);
+    }
+    pthread_mutex_unlock(&sr_stats_lock);
+
+    if(json)
+    { sr_stats_printf(w, "}\n"); }
+
+    return (int)w->len;
+} /* -- sr_stats_snapshot -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_stats_server(..)
+ * Scope:  Local
+ *
+ * One client at a time: read an optional request, write a snapshot, close.
+ *
+ *---------------------------------------------------------------------*/
+
+static void* sr_stats_server(void* arg)
+{
+    struct sr_stats_writer w;
+    struct timeval tv;
+    char req[16];
+    size_t off;
+    ssize_t n;
+    int c;
+
+    sr_cpu_bind(SR_CPU_STATS);
+    for(;;)
+    {
+        if((c = accept(sr_stats_listenfd, 0, 0)) < 0)
+        {
+            if(errno != EINTR)
+            { perror("accept(..):sr_stats.c::sr_stats_server"); }
+            continue;
+        }
+
+        /* -- clients that only read get text after a short wait -- */
+        tv.tv_sec = 0;
+        tv.tv_usec = 100000;
+        setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        n = recv(c, req, sizeof(req) - 1, 0);
+        req[n > 0 ? n : 0] = 0;
+
+        sr_stats_snapshot(&w, strncmp(req, "json", 4) == 0);
+
+        for(off = 0; off < w.len; off += n)
+        {
+            if((n = send(c, w.buf + off, w.len - off, MSG_NOSIGNAL)) <= 0)
+            { break; }
+        }
+
+        free(w.buf);
+        close(c);
+    }
+
+    return 0;
+} /* -- sr_stats_server -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_stats_serve(..)
+ * Scope:  Global
+ *
+ * Listen on the UNIX socket 'path' and answer from a background thread.
+ * Returns 0 on success.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_stats_serve(struct sr_instance* sr, const char* path)
+{
+    struct sockaddr_un addr;
+    pthread_t thread;
+
+    /* REQUIRES */
+    assert(sr);
+    assert(path);
+
+    if(strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "stats socket path too long: %s\n", path);
+        return -1;
+    }
+
+    if((sr_stats_listenfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    {
+        perror("socket(..):sr_stats.c::sr_stats_serve");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    if(bind(sr_stats_listenfd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+       listen(sr_stats_listenfd, 8) < 0)
+    {
+        perror("bind(..):sr_stats.c::sr_stats_serve");
+        close(sr_stats_listenfd);
+        sr_stats_listenfd = -1;
+        return -1;
+    }
+
+    if(pthread_create(&thread, &(sr->attr), sr_stats_server, sr) != 0)
+    {
+        perror("pthread_create(..):sr_stats.c::sr_stats_serve");
+        return -1;
+    }
+
+    return 0;
+} /* -- sr_stats_serve -- */
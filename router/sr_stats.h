@@ -0,0 +1,141 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_stats.h
+ *
+ * Description:
+ *
+ * Packet and drop counters.  Every thread that touches a counter gets its
+ * own cache-line aligned slot so the hot path never shares a line with
+ * another writer; slots are only summed when somebody asks for them.
+ *
+ * Snapshots are served on a UNIX domain socket (sr -k <path>).  A client
+ * connects, optionally writes "json" or "text", and reads until EOF:
+ *
+ *   $ socat - UNIX-CONNECT:/tmp/sr.sock
+ *   $ echo json | socat - UNIX-CONNECT:/tmp/sr.sock
+ *
+ * Other subsystems add their own sections with sr_stats_register(..).
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_STATS_H
+#define SR_STATS_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+#include <stddef.h>
+
+#define SR_CACHELINE          64
+#define SR_STATS_MAX_THREADS  16
+#define SR_STATS_MAX_IFACES   16
+#define SR_STATS_MAX_SECTIONS 32
+#define SR_STATS_MAX_DEPTH    8
+
+struct sr_instance;
+struct sr_if;
+
+/* global per-stage counters */
+enum sr_stat {
+    SR_STAT_RX_PACKETS,
+    SR_STAT_RX_BYTES,
+    SR_STAT_TX_PACKETS,
+    SR_STAT_TX_BYTES,
+    SR_STAT_TX_ERRORS,
+    SR_STAT_ARP_HITS,
+    SR_STAT_ARP_MISSES,
+    SR_STAT_ARP_REQUESTS,       /* ARP requests we sent */
+    SR_STAT_ARP_RETRIES,        /* ... of which were retransmissions */
+    SR_STAT_ARP_REPLIES,        /* ARP replies we sent */
+    SR_STAT_ICMP_TX,
+    SR_STAT_RT_LOOKUPS,
+    SR_STAT_RTC_HITS,           /* route cache, see sr_rtcache.h */
+    SR_STAT_RTC_MISSES,
+    SR_STAT_FORWARDED,
+    SR_STAT_MAX
+};
+
+/* reasons a received or queued packet was dropped */
+enum sr_drop {
+    SR_DROP_SHORT,              /* truncated header */
+    SR_DROP_BAD_HDR,            /* malformed header */
+    SR_DROP_BAD_CKSUM,
+    SR_DROP_NOT_FOR_US,         /* ARP for another host */
+    SR_DROP_UNSUPPORTED,        /* ethertype/protocol we don't handle */
+    SR_DROP_TTL,
+    SR_DROP_NO_ROUTE,
+    SR_DROP_ARP_TIMEOUT,        /* next hop never answered ARP */
+    SR_DROP_NO_IFACE,
+    SR_DROP_FRAG_DF,            /* too big for the MTU and DF set */
+    SR_DROP_REASM,              /* fragment or datagram given up on */
+    SR_DROP_ACL,                /* denied by an ACL rule */
+    SR_DROP_NAT,                /* can't be translated */
+    SR_DROP_CT,                 /* refused by connection tracking */
+    SR_DROP_QUEUE,              /* egress queue full */
+    SR_DROP_MAX
+};
+
+/* per interface counters */
+enum sr_if_stat {
+    SR_IF_RX_PACKETS,
+    SR_IF_RX_BYTES,
+    SR_IF_TX_PACKETS,
+    SR_IF_TX_BYTES,
+    SR_IF_DROPS,
+    SR_IF_STAT_MAX
+};
+
+struct sr_stats_slot {
+    uint64_t stat[SR_STAT_MAX];
+    uint64_t drop[SR_DROP_MAX];
+    uint64_t iface[SR_STATS_MAX_IFACES][SR_IF_STAT_MAX];
+} __attribute__ ((aligned (SR_CACHELINE)));
+
+/* Output buffer for a snapshot, either "a.b.c value" lines or JSON. */
+struct sr_stats_writer {
+    char*  buf;
+    size_t len;
+    size_t cap;
+    int    json;
+    int    depth;
+    int    first[SR_STATS_MAX_DEPTH];
+    const char* path[SR_STATS_MAX_DEPTH];
+};
+
+typedef void (*sr_stats_section_fn)(struct sr_stats_writer*, void* arg);
+
+extern __thread struct sr_stats_slot* sr_stats_self;
+
+struct sr_stats_slot* sr_stats_claim(void);
+int  sr_stats_thread_id(void);
+
+#define sr_stats_slot() \
+    (sr_stats_self ? sr_stats_self : sr_stats_claim())
+#define SR_STATS_ADD(c, n)  (sr_stats_slot()->stat[(c)] += (n))
+#define SR_STATS_INC(c)     SR_STATS_ADD(c, 1)
+#define SR_STATS_IF_ADD(idx, c, n) \
+    do { if((unsigned)(idx) < SR_STATS_MAX_IFACES) \
+           sr_stats_slot()->iface[(idx)][(c)] += (n); } while(0)
+
+void sr_stats_drop(struct sr_if* iface, enum sr_drop reason);
+
+void sr_stats_init(struct sr_instance* sr);
+
+void sr_stats_register(const char* name, sr_stats_section_fn fn, void* arg);
+int  sr_stats_snapshot(struct sr_stats_writer* w, int json);
+int  sr_stats_serve(struct sr_instance* sr, const char* path);
+
+void sr_stats_open(struct sr_stats_writer* w, const char* name);
+void sr_stats_close(struct sr_stats_writer* w);
+void sr_stats_put_u64(struct sr_stats_writer* w, const char* key,
+                      uint64_t value);
+void sr_stats_put_double(struct sr_stats_writer* w, const char* key,
+                         double value);
+void sr_stats_put_str(struct sr_stats_writer* w, const char* key,
+                      const char* value);
+
+#endif /* -- SR_STATS_H -- */
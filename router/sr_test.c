@@ -0,0 +1,199 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_test.c
+ *
+ * Description:
+ *
+ * Differential tests for the fast paths, kept off the router's own load
+ * and start paths.  Built and run by
+ *
+ *   $ make check
+ *
+ * or by hand as sr_test [routing table ...] to also check tables of your
+ * own, text or compiled (sr -C).  Exits non-zero if anything disagrees.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "sr_router.h"
+#include "sr_rt.h"
+#include "sr_fib.h"
+#include "sr_epoch.h"
+#include "sr_cksum.h"
+
+#define SR_TEST_SAMPLES   (1 << 20)  /* addresses per table */
+#define SR_TEST_OPS       200000     /* random route adds and deletes */
+#define SR_TEST_CHECK_OPS 1000       /* ops between checks */
+#define SR_TEST_CHECK_SAMPLES 4096
+#define SR_TEST_BATCH_ROUTES  20000   /* routes behind the batch test */
+#define SR_TEST_BATCH_ROUNDS  20000   /* bursts looked up */
+#define SR_TEST_BATCH_MAX     (4 * SR_FIB_BATCH + 3)
+
+static uint32_t sr_test_x = 2463534242u;
+
+static uint32_t sr_test_rand(void)
+{
+    sr_test_x ^= sr_test_x << 13;
+    sr_test_x ^= sr_test_x >> 17;
+    sr_test_x ^= sr_test_x << 5;
+    return sr_test_x;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_test_fib_churn(..)
+ * Scope:  Local
+ *
+ * Add and delete random routes of every length, so the first level is
+ * rewritten under all sorts of tries, and check the lookups against the
+ * trie walk as it goes.  Returns the number of disagreements.
+ *
+ *---------------------------------------------------------------------*/
+
+static unsigned int sr_test_fib_churn(void)
+{
+    struct sr_instance sr;
+    struct in_addr dest, gw, mask;
+    unsigned int i, len, bad = 0;
+    char iface[sr_IFACE_NAMELEN];
+
+    memset(&sr, 0, sizeof(sr));
+    for(i = 0; i < SR_TEST_OPS; i++)
+    {
+        len = sr_test_rand() % 33;
+        mask.s_addr = htonl(len ? 0xffffffffU << (32 - len) : 0);
+        dest.s_addr = sr_test_rand() & mask.s_addr;
+        gw.s_addr = htonl(0x0a000001 + sr_test_rand() % 4);
+        snprintf(iface, sizeof(iface), "eth%u", sr_test_rand() % 4);
+
+        if(sr_test_rand() % 3)
+        { sr_rt_add(&sr, dest, gw, mask, iface); }
+        else
+        { sr_rt_del(&sr, dest, gw, mask, iface); }
+
+        if(i % SR_TEST_CHECK_OPS == 0)
+        {
+            sr_epoch_enter();
+            bad += sr_fib_check(sr.fib, SR_TEST_CHECK_SAMPLES);
+            sr_epoch_exit();
+        }
+    }
+    printf("fib: %u random adds and deletes, %u disagreements\n",
+           SR_TEST_OPS, bad);
+    return bad;
+} /* -- sr_test_fib_churn -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_test_rt_batch(..)
+ * Scope:  Local
+ *
+ * Look up bursts of every size up to a few batches, at every offset into
+ * the address array, with sr_rt_lookup_batch(..) and check each answer
+ * against sr_rt_lookup(..) one address at a time.  Half the addresses
+ * are the edges of routes, so the bursts cross prefix boundaries.
+ * Returns the number of disagreements.
+ *
+ *---------------------------------------------------------------------*/
+
+static unsigned int sr_test_rt_batch(void)
+{
+    struct sr_instance sr;
+    struct in_addr dest, gw, mask;
+    uint32_t ip[SR_TEST_BATCH_MAX + 8];
+    struct sr_rt* rt[SR_TEST_BATCH_MAX + 8];
+    struct sr_rt* r;
+    unsigned int i, k, n, off, len, bad = 0;
+    char iface[sr_IFACE_NAMELEN];
+
+    memset(&sr, 0, sizeof(sr));
+    for(i = 0; i < SR_TEST_BATCH_ROUTES; i++)
+    {
+        len = 8 + sr_test_rand() % 25;
+        mask.s_addr = htonl(0xffffffffU << (32 - len));
+        dest.s_addr = sr_test_rand() & mask.s_addr;
+        gw.s_addr = htonl(0x0a000001 + sr_test_rand() % 4);
+        snprintf(iface, sizeof(iface), "eth%u", sr_test_rand() % 4);
+        sr_rt_add(&sr, dest, gw, mask, iface);
+    }
+
+    sr_epoch_enter();
+    for(i = 0; i < SR_TEST_BATCH_ROUNDS; i++)
+    {
+        n = 1 + i % SR_TEST_BATCH_MAX;
+        off = i % 8;
+        for(k = 0; k < n; k++)
+        {
+            ip[off + k] = sr_test_rand();
+            if(k & 1)
+            {
+                /* -- first or last address of the route it falls in -- */
+                if((r = sr_rt_lookup(&sr, ip[off + k])) != 0)
+                {
+                    ip[off + k] &= r->mask.s_addr;
+                    if(sr_test_rand() & 1)
+                    { ip[off + k] |= ~r->mask.s_addr; }
+                }
+            }
+        }
+        sr_rt_lookup_batch(&sr, ip + off, rt + off, n);
+        for(k = 0; k < n; k++)
+        {
+            if(rt[off + k] == sr_rt_lookup(&sr, ip[off + k]))
+            { continue; }
+            if(bad++ < 10)
+            {
+                dest.s_addr = ip[off + k];
+                fprintf(stderr, "batch: %s, burst of %u, differs from "
+                        "sr_rt_lookup\n", inet_ntoa(dest), n);
+            }
+        }
+    }
+    sr_epoch_exit();
+    printf("batch: %u bursts of 1 to %u over %u routes, %u disagreements\n",
+           SR_TEST_BATCH_ROUNDS, SR_TEST_BATCH_MAX, sr.fib->nroutes, bad);
+    return bad;
+} /* -- sr_test_rt_batch -- */
+
+/* Load a routing table file and check every way of looking it up */
+static unsigned int sr_test_fib_file(const char* filename)
+{
+    struct sr_instance sr;
+    unsigned int bad;
+
+    memset(&sr, 0, sizeof(sr));
+    if(sr_load_rt(&sr, filename) != 0)
+    {
+        fprintf(stderr, "fib: %s didn't load\n", filename);
+        return 1;
+    }
+    sr_epoch_enter();
+    bad = sr_fib_check(sr.fib, SR_TEST_SAMPLES);
+    sr_epoch_exit();
+    printf("fib: %s, %u routes, %u disagreements\n", filename,
+           sr.fib->nroutes, bad);
+    return bad;
+} /* -- sr_test_fib_file -- */
+
+int main(int argc, char** argv)
+{
+    unsigned int bad = 0;
+    int i;
+
+    bad += sr_cksum_test();
+    bad += sr_test_fib_churn();
+    bad += sr_test_rt_batch();
+    for(i = 1; i < argc; i++)
+    { bad += sr_test_fib_file(argv[i]); }
+
+    if(bad)
+    {
+        fprintf(stderr, "FAILED\n");
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+} /* -- main -- */
@@ -0,0 +1,352 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_top.c
+ *
+ * Description:
+ *
+ * Top talkers by count-min sketch, see sr_top.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <arpa/inet.h>
+
+#include "sr_router.h"
+#include "sr_protocol.h"
+#include "sr_stats.h"
+#include "sr_huge.h"
+#include "sr_pkt.h"
+#include "sr_top.h"
+
+static const uint32_t sr_top_seeds[SR_TOP_DEPTH] = {
+    0x9e3779b9U, 0x3c6ef372U, 0xdaa66d2bU, 0x78dde6e4U
+};
+
+static __inline__ uint32_t sr_top_hash(uint32_t seed, uint32_t prefix)
+{
+    uint32_t h = prefix ^ seed;
+
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    return h ^ (h >> 16);
+}
+
+static time_t sr_top_now(void)
+{
+    struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC_COARSE
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return ts.tv_sec;
+}
+
+static void sr_top_swap(struct sr_top_entry* a, struct sr_top_entry* b)
+{
+    struct sr_top_entry t = *a;
+
+    *a = *b;
+    *b = t;
+}
+
+static void sr_top_sift_up(struct sr_top_dir* d, unsigned int i)
+{
+    while(i > 0 && d->heap[i].bytes < d->heap[(i - 1) / 2].bytes)
+    {
+        sr_top_swap(&d->heap[i], &d->heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+}
+
+static void sr_top_sift_down(struct sr_top_dir* d, unsigned int i)
+{
+    unsigned int c;
+
+    for(;;)
+    {
+        c = 2 * i + 1;
+        if(c >= d->n)
+        { break; }
+        if(c + 1 < d->n && d->heap[c + 1].bytes < d->heap[c].bytes)
+        { c++; }
+        if(d->heap[i].bytes <= d->heap[c].bytes)
+        { break; }
+        sr_top_swap(&d->heap[i], &d->heap[c]);
+        i = c;
+    }
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_top_add(..)
+ * Scope:  Local
+ *
+ * Count len bytes for prefix in one direction's sketch, then give the
+ * heap the new estimate if it belongs there.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_top_add(struct sr_top* top, struct sr_top_dir* d,
+                       uint32_t prefix, unsigned int len)
+{
+    struct sr_top_cell* cell[SR_TOP_DEPTH];
+    uint64_t bytes, packets;
+    unsigned int r, i;
+
+    for(r = 0; r < SR_TOP_DEPTH; r++)
+    {
+        cell[r] = &d->cells[r * SR_TOP_WIDTH +
+                            (sr_top_hash(sr_top_seeds[r], prefix) & (SR_TOP_WIDTH - 1))];
+    }
+
+    /* -- conservative update: raise only what's below the new minimum -- */
+    bytes = cell[0]->bytes;
+    packets = cell[0]->packets;
+    for(r = 1; r < SR_TOP_DEPTH; r++)
+    {
+        if(cell[r]->bytes < bytes)
+        { bytes = cell[r]->bytes; }
+        if(cell[r]->packets < packets)
+        { packets = cell[r]->packets; }
+    }
+    bytes += len;
+    packets++;
+    for(r = 0; r < SR_TOP_DEPTH; r++)
+    {
+        if(cell[r]->bytes < bytes)
+        { cell[r]->bytes = bytes; }
+        if(cell[r]->packets < packets)
+        { cell[r]->packets = packets; }
+    }
+
+    /* -- a prefix in the heap is at least its smallest, so one that
+     *    can't beat it isn't in there -- */
+    if(d->n == top->k && bytes <= d->heap[0].bytes)
+    { return; }
+
+    pthread_mutex_lock(&top->lock);
+    for(i = 0; i < d->n && d->heap[i].prefix != prefix; i++);
+    if(i < d->n)
+    {
+        d->heap[i].bytes = bytes;
+        d->heap[i].packets = packets;
+        sr_top_sift_down(d, i);
+    }
+    else if(d->n < top->k)
+    {
+        d->heap[d->n].prefix = prefix;
+        d->heap[d->n].bytes = bytes;
+        d->heap[d->n].packets = packets;
+        sr_top_sift_up(d, d->n++);
+    }
+    else
+    {
+        d->heap[0].prefix = prefix;
+        d->heap[0].bytes = bytes;
+        d->heap[0].packets = packets;
+        sr_top_sift_down(d, 0);
+    }
+    pthread_mutex_unlock(&top->lock);
+} /* -- sr_top_add -- */
+
+/* Halve every count shift times; the heaps keep their order.  Counters
+ * shifted by their width or more are just cleared. */
+static void sr_top_decay(struct sr_top* top, unsigned int shift)
+{
+    struct sr_top_dir* dirs[2];
+    unsigned int i, j;
+
+    dirs[0] = &top->src;
+    dirs[1] = &top->dst;
+
+    pthread_mutex_lock(&top->lock);
+    for(j = 0; j < 2; j++)
+    {
+        if(shift >= 64)
+        {
+            memset(dirs[j]->cells, 0,
+                   SR_TOP_DEPTH * SR_TOP_WIDTH * sizeof(struct sr_top_cell));
+            dirs[j]->n = 0;
+            continue;
+        }
+        for(i = 0; i < SR_TOP_DEPTH * SR_TOP_WIDTH; i++)
+        {
+            dirs[j]->cells[i].bytes >>= shift;
+            dirs[j]->cells[i].packets >>= shift;
+        }
+        for(i = 0; i < dirs[j]->n; i++)
+        {
+            dirs[j]->heap[i].bytes >>= shift;
+            dirs[j]->heap[i].packets >>= shift;
+        }
+    }
+    if(shift >= 64)
+    {
+        top->bytes = 0;
+        top->packets = 0;
+    }
+    else
+    {
+        top->bytes >>= shift;
+        top->packets >>= shift;
+    }
+    top->decays += shift;
+    pthread_mutex_unlock(&top->lock);
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_top_account(..)
+ * Scope:  Global
+ *
+ * Count the IP datagram described by pkt, which sr_pkt_parse(..) found
+ * valid, against its source and destination prefixes.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_top_account(struct sr_top* top,
+        const uint8_t* packet /* lent */,
+        const struct sr_pkt* pkt)
+{
+    const sr_ip_hdr_t* ip_hdr = (const sr_ip_hdr_t*)(packet + pkt->l3);
+    unsigned int len = pkt->len - pkt->l3;
+    time_t now = sr_top_now();
+    time_t n;
+
+    /* -- one halving per half-life gone by, however long traffic
+     *    stopped for -- */
+    if(top->last_decay == 0)
+    { top->last_decay = now; }
+    else if(now - top->last_decay >= SR_TOP_HALF_LIFE)
+    {
+        n = (now - top->last_decay) / SR_TOP_HALF_LIFE;
+        sr_top_decay(top, n > 64 ? 64 : (unsigned int)n);
+        top->last_decay += n * SR_TOP_HALF_LIFE;
+    }
+
+    top->bytes += len;
+    top->packets++;
+    sr_top_add(top, &top->src, ip_hdr->ip_src & top->mask, len);
+    sr_top_add(top, &top->dst, ip_hdr->ip_dst & top->mask, len);
+} /* -- sr_top_account -- */
+
+static int sr_top_cmp(const void* a, const void* b)
+{
+    const struct sr_top_entry* x = (const struct sr_top_entry*)a;
+    const struct sr_top_entry* y = (const struct sr_top_entry*)b;
+
+    return x->bytes < y->bytes ? 1 : x->bytes > y->bytes ? -1 : 0;
+}
+
+static void sr_top_put_dir(struct sr_stats_writer* w, const char* name,
+                           struct sr_top_entry* list, unsigned int n,
+                           uint64_t total, unsigned int prefix_len)
+{
+    char rank[16];
+    char addr[INET_ADDRSTRLEN];
+    char buf[32];
+    unsigned int i;
+
+    qsort(list, n, sizeof(struct sr_top_entry), sr_top_cmp);
+
+    sr_stats_open(w, name);
+    for(i = 0; i < n; i++)
+    {
+        inet_ntop(AF_INET, &list[i].prefix, addr, sizeof(addr));
+        snprintf(rank, sizeof(rank), "%u", i + 1);
+        snprintf(buf, sizeof(buf), "%s/%u", addr, prefix_len);
+        sr_stats_open(w, rank);
+        sr_stats_put_str(w, "prefix", buf);
+        sr_stats_put_u64(w, "bytes", list[i].bytes);
+        sr_stats_put_u64(w, "packets", list[i].packets);
+        sr_stats_put_double(w, "share", total ? (double)list[i].bytes / total : 0);
+        sr_stats_close(w);
+    }
+    sr_stats_close(w);
+}
+
+static void sr_top_stats(struct sr_stats_writer* w, void* arg)
+{
+    struct sr_instance* sr = (struct sr_instance*)arg;
+    struct sr_top* top = sr->top;
+    struct sr_top_entry src[SR_TOP_MAX];
+    struct sr_top_entry dst[SR_TOP_MAX];
+    unsigned int nsrc, ndst;
+    uint64_t bytes, packets, decays;
+
+    if(top == 0)
+    { return; }
+
+    pthread_mutex_lock(&top->lock);
+    nsrc = top->src.n;
+    ndst = top->dst.n;
+    memcpy(src, top->src.heap, nsrc * sizeof(struct sr_top_entry));
+    memcpy(dst, top->dst.heap, ndst * sizeof(struct sr_top_entry));
+    bytes = top->bytes;
+    packets = top->packets;
+    decays = top->decays;
+    pthread_mutex_unlock(&top->lock);
+
+    sr_stats_put_u64(w, "k", top->k);
+    sr_stats_put_u64(w, "prefix_len", top->prefix_len);
+    sr_stats_put_u64(w, "memory_bytes",
+                     2 * SR_TOP_DEPTH * SR_TOP_WIDTH * sizeof(struct sr_top_cell));
+    sr_stats_put_u64(w, "half_life_s", SR_TOP_HALF_LIFE);
+    sr_stats_put_u64(w, "decays", decays);
+    sr_stats_put_u64(w, "bytes", bytes);
+    sr_stats_put_u64(w, "packets", packets);
+    sr_top_put_dir(w, "src", src, nsrc, bytes, top->prefix_len);
+    sr_top_put_dir(w, "dst", dst, ndst, bytes, top->prefix_len);
+} /* -- sr_top_stats -- */
+
+void sr_top_init(struct sr_instance* sr)
+{
+    sr_stats_register("top", sr_top_stats, sr);
+} /* -- sr_top_init -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_top_create(..)
+ * Scope:  Global
+ *
+ * Track the k busiest prefixes of prefix_len bits each way.  Returns 0
+ * if k or prefix_len is out of range or there's no memory.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_top* sr_top_create(unsigned int k, unsigned int prefix_len)
+{
+    struct sr_top* top;
+    size_t size = SR_TOP_DEPTH * SR_TOP_WIDTH * sizeof(struct sr_top_cell);
+
+    if(k == 0 || k > SR_TOP_MAX || prefix_len == 0 || prefix_len > 32)
+    {
+        fprintf(stderr, "top talkers: k is 1 to %d, prefix length 1 to 32\n",
+                SR_TOP_MAX);
+        return 0;
+    }
+
+    if((top = (struct sr_top*)calloc(1, sizeof(struct sr_top))) == 0)
+    { return 0; }
+    top->src.cells = (struct sr_top_cell*)sr_huge_alloc("top_sketch", size);
+    top->dst.cells = (struct sr_top_cell*)sr_huge_alloc("top_sketch", size);
+    if(top->src.cells == 0 || top->dst.cells == 0)
+    {
+        if(top->src.cells)
+        { sr_huge_free(top->src.cells); }
+        if(top->dst.cells)
+        { sr_huge_free(top->dst.cells); }
+        free(top);
+        return 0;
+    }
+
+    pthread_mutex_init(&top->lock, 0);
+    top->k = k;
+    top->prefix_len = prefix_len;
+    top->mask = htonl(0xffffffffU << (32 - prefix_len));
+    return top;
+} /* -- sr_top_create -- */
@@ -0,0 +1,90 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_top.h
+ *
+ * Description:
+ *
+ * Top talkers: the source and destination prefixes sending the most
+ * bytes through the router, turned on with
+ *
+ *   sr -K <k>[:prefix length]
+ *
+ * e.g. -K 10:24 for the ten busiest /24s each way (the default length is
+ * /24, /32 tracks hosts).  Every IP datagram received is counted, before
+ * the ACL or anything else can drop it, so a flood shows up whatever
+ * becomes of it.
+ *
+ * Counts go into a count-min sketch per direction, SR_TOP_DEPTH rows of
+ * SR_TOP_WIDTH cells, with conservative update: only the cells holding
+ * the minimum grow.  A prefix's estimate never undercounts and is off by
+ * a small share of the total at most, whatever the number of prefixes.
+ * A min-heap of the k largest estimates sits beside each sketch; a
+ * datagram whose estimate can't beat the heap's smallest touches nothing
+ * else.  Memory is fixed at start, nothing grows with traffic.
+ *
+ * Counts are halved once for every SR_TOP_HALF_LIFE seconds gone by,
+ * caught up on the next datagram after a quiet spell, so the list follows
+ * what is happening now rather than since start.  The "top" stats section
+ * lists both heaps, largest first, with each prefix's share of the total.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_TOP_H
+#define SR_TOP_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+#include <time.h>
+#include <pthread.h>
+
+#define SR_TOP_MAX        64     /* largest k */
+#define SR_TOP_DEFAULT_PREFIX 24
+#define SR_TOP_DEPTH      4      /* rows, independent hashes */
+#define SR_TOP_WIDTH      4096   /* cells per row, power of two */
+#define SR_TOP_HALF_LIFE  10     /* seconds */
+
+struct sr_instance;
+struct sr_pkt;
+
+struct sr_top_cell {
+    uint64_t bytes;
+    uint64_t packets;
+};
+
+struct sr_top_entry {
+    uint32_t prefix;            /* network order, masked */
+    uint64_t bytes;             /* estimates */
+    uint64_t packets;
+};
+
+/* One direction: sketch and heap */
+struct sr_top_dir {
+    struct sr_top_cell* cells;  /* SR_TOP_DEPTH rows of SR_TOP_WIDTH */
+    struct sr_top_entry heap[SR_TOP_MAX];   /* min-heap on bytes */
+    unsigned int n;
+};
+
+struct sr_top {
+    pthread_mutex_t lock;       /* heaps, against the stats reader */
+    struct sr_top_dir src;
+    struct sr_top_dir dst;
+    unsigned int k;
+    unsigned int prefix_len;
+    uint32_t mask;              /* network order */
+    uint64_t bytes;             /* totals, halved with the rest */
+    uint64_t packets;
+    time_t last_decay;          /* when counts were last halved */
+    uint64_t decays;            /* halvings */
+};
+
+struct sr_top* sr_top_create(unsigned int k, unsigned int prefix_len);
+void sr_top_init(struct sr_instance* sr);
+void sr_top_account(struct sr_top* top, const uint8_t* packet,
+                    const struct sr_pkt* pkt);
+
+#endif /* -- SR_TOP_H -- */
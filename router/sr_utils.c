@@ -3,16 +3,26 @@
 #include <string.h>
 #include "sr_protocol.h"
 #include "sr_utils.h"
+#include "sr_cksum.h"
 
 
+/* The summing is done by whichever kernel sr_cksum_init() picked, see
+   sr_cksum.c. Its result is already in memory order, so is its complement. */
 uint16_t cksum (const void *_data, int len) {
-  const uint8_t *data = _data;
-  uint32_t sum;
+  uint16_t sum = ~sr_cksum_sum(_data, len);
+  return sum ? sum : 0xffff;
+}
+
 
-  for (sum = 0;len >= 2; data += 2, len -= 2)
-    sum += data[0] << 8 | data[1];
-  if (len > 0)
-    sum += data[0] << 8;
+/* Adds the 16 bit words of data to a running, unfolded sum. len must be even
+   unless this is the last piece. */
+uint32_t cksum_partial(const void *_data, int len, uint32_t sum) {
+  return sum + ntohs(sr_cksum_sum(_data, len));
+}
+
+/* Turns a running sum into a checksum, same result as cksum() over all the
+   data that went into it. */
+uint16_t cksum_fold(uint32_t sum) {
   while (sum > 0xffff)
     sum = (sum >> 16) + (sum & 0xffff);
   sum = htons (~sum);
@@ -20,6 +30,29 @@ uint16_t cksum (const void *_data, int len) {
 }
 
 
+/* RFC 1624 incremental update: the checksum 'sum' after one 16 bit word of
+   the data changed from 'old' to 'new'. All three are taken as they sit in
+   the packet, the one's complement sum doesn't care about byte order. */
+uint16_t cksum_update16(uint16_t sum, uint16_t old, uint16_t new) {
+  uint32_t s = (uint16_t)~sum + (uint16_t)~old + (uint32_t)new;
+
+  s = (s & 0xffff) + (s >> 16);
+  s = (s & 0xffff) + (s >> 16);
+  return (uint16_t)~s;
+}
+
+/* Same for a 32 bit field such as an address. */
+uint16_t cksum_update32(uint16_t sum, uint32_t old, uint32_t new) {
+  uint32_t s = (uint16_t)~sum;
+
+  s += (uint16_t)~old + (uint16_t)~(old >> 16);
+  s += (new & 0xffff) + (new >> 16);
+  s = (s & 0xffff) + (s >> 16);
+  s = (s & 0xffff) + (s >> 16);
+  return (uint16_t)~s;
+}
+
+
 uint16_t ethertype(uint8_t *buf) {
   sr_ethernet_hdr_t *ehdr = (sr_ethernet_hdr_t *)buf;
   return ntohs(ehdr->ether_type);
@@ -32,6 +32,7 @@
 #include <errno.h>
 
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
@@ -40,17 +41,27 @@
 #include "sr_router.h"
 #include "sr_if.h"
 #include "sr_protocol.h"
+#include "sr_replay.h"
+#include "sr_stats.h"
+#include "sr_latency.h"
+#include "sr_sched.h"
+#include "sr_poll.h"
+#include "sr_pkt.h"
 
 #include "sha1.h"
 #include "vnscommand.h"
 
 static void sr_log_packet(struct sr_instance* , uint8_t* , int );
-static int  sr_arp_req_not_for_us(struct sr_instance* sr,
-                                  uint8_t * packet /* lent */,
-                                  unsigned int len,
-                                  char* interface  /* lent */);
 int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expected_cmd);
 
+static void sr_stats_count_tx(struct sr_if* out, unsigned int len)
+{
+    SR_STATS_INC(SR_STAT_TX_PACKETS);
+    SR_STATS_ADD(SR_STAT_TX_BYTES, len);
+    SR_STATS_IF_ADD(out->ifindex, SR_IF_TX_PACKETS, 1);
+    SR_STATS_IF_ADD(out->ifindex, SR_IF_TX_BYTES, len);
+}
+
 /*-----------------------------------------------------------------------------
  * Method: sr_session_closed_help(..)
  *
@@ -120,6 +131,7 @@ int sr_connect_to_server(struct sr_instance* sr,unsigned short port,
         close(sr->sockfd);
         return -1;
     }
+    sr_poll_socket(sr->sockfd);
 
     /* wait for authentication to be completed (server sends the first message) */
     if(sr_read_from_server_expect(sr, VNS_AUTH_REQUEST)!= 1 ||
@@ -201,6 +213,8 @@ int sr_handle_hwinfo(struct sr_instance* sr, c_hwinfo* hwinfo)
             case HWSPEED:
                 /* Debug("Speed: %d\n",
                         ntohl(*((unsigned int*)hwinfo->mHWInfo[i].value))); */
+                sr_set_ether_speed(sr,
+                        ntohl(*((uint32_t*)hwinfo->mHWInfo[i].value)));
                 break;
             case HWSUBNET:
                 /* Debug("Subnet: %s\n",inet_ntoa(
@@ -226,9 +240,13 @@ int sr_handle_hwinfo(struct sr_instance* sr, c_hwinfo* hwinfo)
         } /* -- switch -- */
     } /* -- for -- */
 
+    sr_local_build(sr);
     printf("Router interfaces:\n");
     sr_print_if_list(sr);
 
+    if(sr_init_interfaces(sr) != 0)
+    { return -1; }
+
     return num_entries;
 } /* -- sr_handle_hwinfo -- */
 
@@ -335,7 +353,6 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
 {
     int command, len;
     unsigned char *buf = 0;
-    c_packet_ethernet_header* sr_pkt = 0;
     int ret = 0, bytes_read = 0;
 
     /* REQUIRES */
@@ -347,6 +364,9 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
 
     bytes_read = 0;
 
+    /* -- spin for it rather than sleep, if asked to -- */
+    sr_poll_wait(sr->sockfd);
+
     /* attempt to read the size of the incoming packet */
     while( bytes_read < 4)
     {
@@ -424,22 +444,9 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
         /* -------------        VNSPACKET     -------------------- */
 
         case VNSPACKET:
-            sr_pkt = (c_packet_ethernet_header *)buf;
-
-            /* -- check if it is an ARP to another router if so drop   -- */
-            if ( sr_arp_req_not_for_us(sr,
-                    (buf+sizeof(c_packet_header)),
-                    len - sizeof(c_packet_ethernet_header) +
-                    sizeof(struct sr_ethernet_hdr),
-                    (char*)(buf + sizeof(c_base))) )
-            { break; }
+            sr_latency_rx();
 
-            /* -- log packet -- */
-            sr_log_packet(sr, buf + sizeof(c_packet_header),
-                    ntohl(sr_pkt->mLen) - sizeof(c_packet_header));
-
-            /* -- pass to router, student's code should take over here -- */
-            sr_handlepacket(sr,
+            sr_deliver_packet(sr,
                     (buf+sizeof(c_packet_header)),
                     len - sizeof(c_packet_ethernet_header) +
                     sizeof(struct sr_ethernet_hdr),
@@ -468,7 +475,11 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
             /* -------------     VNSHWINFO     -------------------- */
 
         case VNSHWINFO:
-            sr_handle_hwinfo(sr,(c_hwinfo*)buf);
+            if(sr_handle_hwinfo(sr,(c_hwinfo*)buf) < 0)
+            {
+                fprintf(stderr,"Error setting up interfaces\n");
+                return -1;
+            }
             if(sr_verify_routing_table(sr) != 0)
             {
                 fprintf(stderr,"Routing table not consistent with hardware\n");
@@ -506,15 +517,56 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
     return ret;
 }/* -- sr_read_from_server -- */
 
+/*-----------------------------------------------------------------------------
+ * Method: sr_deliver_packet(..)
+ * Scope: Global
+ *
+ * Hand a received ethernet frame to the router.  Used for frames read from
+ * the server as well as frames replayed from a capture file.
+ *
+ *---------------------------------------------------------------------------*/
+
+void sr_deliver_packet(struct sr_instance* sr /* borrowed */,
+                       uint8_t* packet /* lent */,
+                       unsigned int len,
+                       char* interface /* lent */)
+{
+    struct sr_pkt pkt;
+
+    /* -- the one parse, everything after reads pkt -- */
+    sr_pkt_parse(sr, packet, len, interface, &pkt);
+
+    SR_STATS_INC(SR_STAT_RX_PACKETS);
+    SR_STATS_ADD(SR_STAT_RX_BYTES, len);
+    if ( pkt.iface ){
+        SR_STATS_IF_ADD(pkt.ifindex, SR_IF_RX_PACKETS, 1);
+        SR_STATS_IF_ADD(pkt.ifindex, SR_IF_RX_BYTES, len);
+    }
+
+    /* -- check if it is an ARP to another router if so drop   -- */
+    if ( pkt.flags & SR_PKT_QUIET )
+    {
+        sr_stats_drop(pkt.iface, (enum sr_drop)pkt.drop);
+        return;
+    }
+
+    /* -- log packet -- */
+    sr_log_packet(sr, packet, len);
+
+    /* -- pass to router, student's code should take over here -- */
+    sr_handlepacket(sr, packet, &pkt);
+} /* -- sr_deliver_packet -- */
+
 /*-----------------------------------------------------------------------------
  * Method: sr_ether_addrs_match_interface(..)
  * Scope: Local
  *
  * Make sure ethernet addresses are sane so we don't muck uo the system.
+ * Returns the outgoing interface, or 0 if the addresses don't match it.
  *
  *----------------------------------------------------------------------------*/
 
-static int
+static struct sr_if*
 sr_ether_addrs_match_interface( struct sr_instance* sr, /* borrowed */
                                 uint8_t* buf, /* borrowed */
                                 const char* name /* borrowed */ )
@@ -546,7 +598,7 @@ sr_ether_addrs_match_interface( struct sr_instance* sr, /* borrowed */
      * Note: This check should really be done server side ...
      */
 
-    return 1;
+    return iface;
 
 } /* -- sr_ether_addrs_match_interface -- */
 
@@ -555,7 +607,8 @@ sr_ether_addrs_match_interface( struct sr_instance* sr, /* borrowed */
  * Scope: Global
  *
  * Send a packet (ethernet header included!) of length 'len' to the server
- * to be injected onto the wire.
+ * to be injected onto the wire.  With egress queueing on (sr -q) the frame
+ * is copied onto a queue of 'iface' and written later by the scheduler.
  *
  *---------------------------------------------------------------------------*/
 
@@ -564,8 +617,7 @@ int sr_send_packet(struct sr_instance* sr /* borrowed */,
                          unsigned int len,
                          const char* iface /* borrowed */)
 {
-    c_packet_header *sr_pkt;
-    unsigned int total_len =  len + (sizeof(c_packet_header));
+    struct sr_if* out;
 
     /* REQUIRES */
     assert(sr);
@@ -578,35 +630,74 @@ int sr_send_packet(struct sr_instance* sr /* borrowed */,
         return -1;
     }
 
-    /* Create packet */
-    sr_pkt = (c_packet_header *)malloc(len +
-            sizeof(c_packet_header));
-    assert(sr_pkt);
-    sr_pkt->mLen  = htonl(total_len);
-    sr_pkt->mType = htonl(VNSPACKET);
-    strncpy(sr_pkt->mInterfaceName,iface,16);
-    memcpy(((uint8_t*)sr_pkt) + sizeof(c_packet_header),
-            buf,len);
-
     /* -- log packet -- */
     sr_log_packet(sr,buf,len);
 
-    if ( ! sr_ether_addrs_match_interface( sr, buf, iface) ){
+    if ( (out = sr_ether_addrs_match_interface( sr, buf, iface)) == 0 ){
         fprintf( stderr, "*** Error: problem with ethernet header, check log\n");
-        free ( sr_pkt );
+        SR_STATS_INC(SR_STAT_TX_ERRORS);
         return -1;
     }
 
-    if( write(sr->sockfd, sr_pkt, total_len) < total_len ){
+    if ( sr->sched )
+    {
+        if ( sr_sched_enqueue(sr->sched, buf, len, out) != 0 )
+        { return -1; }
+        sr_latency_tx();
+        return 0;
+    }
+
+    if ( sr_transmit_packet(sr, buf, len, out) != 0 )
+    { return -1; }
+    sr_latency_tx();
+    return 0;
+} /* -- sr_send_packet -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_transmit_packet(..)
+ * Scope: Global
+ *
+ * Write a checked frame out of 'out' now, to the server or the replay
+ * capture.  Called by sr_send_packet(..) or the egress scheduler.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_transmit_packet(struct sr_instance* sr /* borrowed */,
+                       uint8_t* buf /* borrowed */ ,
+                       unsigned int len,
+                       struct sr_if* out /* borrowed */)
+{
+    c_packet_header sr_pkt;
+    struct iovec iov[2];
+    unsigned int total_len =  len + (sizeof(c_packet_header));
+
+    /* -- offline replay, no server to talk to -- */
+    if ( sr->replay )
+    {
+        if ( sr_replay_transmit(sr, buf, len, out->name) != 0 )
+        { return -1; }
+        sr_stats_count_tx(out, len);
+        return 0;
+    }
+
+    /* Create packet, the header goes out in front of the caller's buffer */
+    sr_pkt.mLen  = htonl(total_len);
+    sr_pkt.mType = htonl(VNSPACKET);
+    strncpy(sr_pkt.mInterfaceName,out->name,16);
+    iov[0].iov_base = &sr_pkt;
+    iov[0].iov_len  = sizeof(c_packet_header);
+    iov[1].iov_base = buf;
+    iov[1].iov_len  = len;
+
+    if( writev(sr->sockfd, iov, 2) < total_len ){
         fprintf(stderr, "Error writing packet\n");
-        free(sr_pkt);
+        SR_STATS_INC(SR_STAT_TX_ERRORS);
         return -1;
     }
 
-    free(sr_pkt);
-
+    sr_stats_count_tx(out, len);
     return 0;
-} /* -- sr_send_packet -- */
+} /* -- sr_transmit_packet -- */
 
 /*-----------------------------------------------------------------------------
  * Method: sr_log_packet()
@@ -634,34 +725,3 @@ void sr_log_packet(struct sr_instance* sr, uint8_t* buf, int len )
     sr_dump(sr->logfile, &h, buf);
     fflush(sr->logfile);
 } /* -- sr_log_packet -- */
-
-/*-----------------------------------------------------------------------------
- * Method: sr_arp_req_not_for_us()
- * Scope: Local
- *
- *---------------------------------------------------------------------------*/
-
-int  sr_arp_req_not_for_us(struct sr_instance* sr,
-                           uint8_t * packet /* lent */,
-                           unsigned int len,
-                           char* interface  /* lent */)
-{
-    struct sr_if* iface = sr_get_interface(sr, interface);
-    struct sr_ethernet_hdr* e_hdr = 0;
-    struct sr_arp_hdr*       a_hdr = 0;
-
-    if (len < sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_arp_hdr) )
-    { return 0; }
-
-    assert(iface);
-
-    e_hdr = (struct sr_ethernet_hdr*)packet;
-    a_hdr = (struct sr_arp_hdr*)(packet + sizeof(struct sr_ethernet_hdr));
-
-    if ( (e_hdr->ether_type == htons(ethertype_arp)) &&
-            (a_hdr->ar_op      == htons(arp_op_request))   &&
-            (a_hdr->ar_tip     != iface->ip ) )
-    { return 1; }
-
-    return 0;
-} /* -- sr_arp_req_not_for_us -- */